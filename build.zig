@@ -31,8 +31,8 @@ pub fn build(b: *std.Build) void {
     };
 
     const executables = [_]Executable{
-        .{ .name = "kevs", .srcs = &[_][]const u8{ "src/c/cli.c", "src/c/util.c", "src/c/kevs.c" } },
-        .{ .name = "unittests", .srcs = &[_][]const u8{ "src/c/unittests.c", "src/c/kevs.c" } },
+        .{ .name = "kevs", .srcs = &[_][]const u8{ "src/c/cli.c", "src/c/export.c", "src/c/serve.c", "src/c/load.c", "src/c/util.c", "src/c/kevs.c" } },
+        .{ .name = "unittests", .srcs = &[_][]const u8{ "src/c/unittests.c", "src/c/export.c", "src/c/load.c", "src/c/util.c", "src/c/kevs.c" } },
         .{ .name = "example", .srcs = &[_][]const u8{ "src/c/example.c", "src/c/util.c", "src/c/kevs.c" } },
     };
 
@@ -73,4 +73,52 @@ pub fn build(b: *std.Build) void {
             b.getInstallStep().dependOn(&install.step);
         }
     }
+
+    for (targets) |query| {
+        const target = b.resolveTargetQuery(query);
+        const t = target.result;
+
+        const static = b.addStaticLibrary(.{
+            .name = "kevs",
+            .target = target,
+            .optimize = optimize,
+            .strip = strip,
+            .link_libc = true,
+        });
+        // kevs.h has no dllexport annotations, so windows gets the static library only
+        const libs = if (t.os.tag == .windows) &[_]*std.Build.Step.Compile{static} else &[_]*std.Build.Step.Compile{
+            static,
+            b.addSharedLibrary(.{
+                .name = "kevs",
+                .target = target,
+                .optimize = optimize,
+                .strip = strip,
+                .link_libc = true,
+            }),
+        };
+
+        for (libs) |lib| {
+            lib.addCSourceFiles(.{
+                .files = &.{"src/c/kevs.c"},
+                .flags = &.{ "-std=c99", "-g", "-Wall", "-Wextra", "-Werror" },
+            });
+
+            const install = b.addInstallArtifact(lib, .{});
+            install.dest_dir = .prefix;
+            install.dest_sub_path = b.fmt("{s}/{s}/{s}/{s}", .{
+                @tagName(optimize),
+                @tagName(t.os.tag),
+                @tagName(t.cpu.arch),
+                lib.out_filename,
+            });
+            b.getInstallStep().dependOn(&install.step);
+        }
+
+        const header = b.addInstallFile(b.path("src/c/kevs.h"), b.fmt("{s}/{s}/{s}/kevs.h", .{
+            @tagName(optimize),
+            @tagName(t.os.tag),
+            @tagName(t.cpu.arch),
+        }));
+        b.getInstallStep().dependOn(&header.step);
+    }
 }
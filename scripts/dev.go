@@ -15,6 +15,7 @@ import (
 	"strings"
 	"syscall"
 	"time"
+	"unicode/utf8"
 )
 
 const (
@@ -29,6 +30,8 @@ var (
 	disableIntegrationTests = flag.Bool("no-it", false, "Disable integration tests")
 	disableCodeCoverage     = flag.Bool("no-cc", false, "Disable code coverage")
 	enableFuzzer            = flag.Bool("fuzz", false, "Run fuzzer")
+	enablePerfFuzzer        = flag.Bool("perf-fuzz", false, "Run performance fuzzer, it reports inputs with super-linear parsing cost")
+	enableDiff              = flag.Bool("diff", false, "Compare output with the Python implementation for testdata and fuzzer corpora, and the Python backends for testdata/valid")
 	fuzzTime                = flag.Int("fuzz-time", 30, "Run fuzzer for that number of seconds")
 	fuzzMaxLen              = flag.Int("fuzz-max-len", 8192, "Run fuzzer that max input size")
 	osTag                   = flag.String("os", "linux", "Os tag: linux or windows")
@@ -65,7 +68,17 @@ func mainErr() error {
 	}()
 
 	if *enableFuzzer {
-		return runFuzzer()
+		return runFuzzer("fuzzer", "testdata/corpus")
+	}
+	if *enablePerfFuzzer {
+		return runFuzzer("perf_fuzzer", "testdata/perf_corpus")
+	}
+	if *enableDiff {
+		if err := runDiff(); err != nil {
+			return err
+		}
+		globalResult.summary()
+		return nil
 	}
 
 	if !*disableUnitTests {
@@ -117,12 +130,9 @@ func (g GlobalResult) summary() {
 
 var globalResult GlobalResult
 
-func runFuzzer() error {
-	const (
-		mainCorpusDir = "testdata/corpus"
-	)
+func runFuzzer(name string, mainCorpusDir string) error {
 	var (
-		fuzzOutDir    = filepath.Join(devOutDir, "fuzz")
+		fuzzOutDir    = filepath.Join(devOutDir, name)
 		tempCorpusDir = filepath.Join(fuzzOutDir, "corpus")
 		covProfile    = filepath.Join(fuzzOutDir, "coverage.profraw")
 	)
@@ -137,7 +147,7 @@ func runFuzzer() error {
 
 		dirs := []string{"testdata/not_valid/", "testdata/valid/"}
 		for _, dir := range dirs {
-			exe := filepath.Join(*buildDir, "fuzzer")
+			exe := filepath.Join(*buildDir, name)
 
 			cmd := exec.CommandContext(ctx, exe, "-create_missing_dirs=1", "-merge=1", mainCorpusDir, dir)
 			cmd.Stdout = outBuf
@@ -182,7 +192,7 @@ func runFuzzer() error {
 
 	// run fuzzer
 	{
-		exe := filepath.Join(*buildDir, "fuzzer")
+		exe := filepath.Join(*buildDir, name)
 
 		cmd := exec.CommandContext(ctx,
 			exe,
@@ -222,7 +232,7 @@ func runFuzzer() error {
 
 	// merge corpus
 	{
-		exe := filepath.Join(*buildDir, "fuzzer")
+		exe := filepath.Join(*buildDir, name)
 
 		cmd := exec.CommandContext(ctx, exe, "-create_missing_dirs=1", "-merge=1", mainCorpusDir, tempCorpusDir)
 		cmd.Stdout = outBuf
@@ -253,8 +263,8 @@ func runFuzzer() error {
 	// generate coverage
 	{
 		profiles := []string{covProfile}
-		bins := []string{filepath.Join(*buildDir, "fuzzer")}
-		coverageOut := filepath.Join(devOutDir, "fuzz", "coverage")
+		bins := []string{filepath.Join(*buildDir, name)}
+		coverageOut := filepath.Join(fuzzOutDir, "coverage")
 		if err := generateCoverage(coverageOut, profiles, bins); err != nil {
 			return err
 		}
@@ -263,6 +273,99 @@ func runFuzzer() error {
 	return nil
 }
 
+// runDiff runs the C and the Python implementation on the same inputs,
+// both have to fail, or succeed with the same dump.
+func runDiff() error {
+	dirs := []string{"testdata/valid", "testdata/not_valid", "testdata/corpus", "testdata/perf_corpus"}
+
+	var files []string
+	for _, dir := range dirs {
+		entries, err := os.ReadDir(dir)
+		if err != nil {
+			continue
+		}
+		for _, e := range entries {
+			if e.IsDir() || strings.HasSuffix(e.Name(), ".out") {
+				continue
+			}
+			files = append(files, filepath.Join(dir, e.Name()))
+		}
+	}
+
+	fmt.Printf("diff with python for %d files .. ", len(files))
+
+	start := time.Now()
+	skipped := 0
+	for _, file := range files {
+		data, err := os.ReadFile(file)
+		if err != nil {
+			return err
+		}
+		// the Python implementation reads text
+		if !utf8.Valid(data) {
+			skipped++
+			continue
+		}
+
+		cOut, _, err := runOutput(filepath.Join(*buildDir, "kevs"), "--dump", "--no-err", "--free", file)
+		if err != nil {
+			globalResult.add("diff "+file, fmt.Errorf("c: %w", err), 0)
+			continue
+		}
+		pyOut, pyErr, err := runOutput("python3", "src/py/kevs", "--dump", "--no-err", file)
+		if err != nil {
+			if strings.Contains(pyErr, "RecursionError") {
+				skipped++
+				continue
+			}
+			globalResult.add("diff "+file, fmt.Errorf("python: %w: %s", err, pyErr), 0)
+			continue
+		}
+
+		cFailed := strings.HasPrefix(cOut, "error: ")
+		pyFailed := strings.HasPrefix(pyOut, file+":")
+
+		err = nil
+		if cFailed != pyFailed {
+			err = fmt.Errorf("c failed: %t, python failed: %t\nc: %s\npython: %s", cFailed, pyFailed, firstLine(cOut), firstLine(pyOut))
+		} else if !cFailed && cOut != pyOut {
+			err = fmt.Errorf("dumps differ")
+		}
+		globalResult.add("diff "+file, err, 0)
+
+		// kevs.loads with the C extension and without it
+		if filepath.Dir(file) == "testdata/valid" {
+			_, pyErr, err := runOutput("python3", "src/py/kevs", "--backends", file)
+			if err != nil {
+				err = fmt.Errorf("python backends: %w: %s", err, pyErr)
+			}
+			globalResult.add("backends "+file, err, 0)
+		}
+	}
+	dur := time.Since(start)
+
+	fmt.Printf("done, %d skipped %s\n", skipped, dur)
+
+	return nil
+}
+
+func runOutput(name string, args ...string) (string, string, error) {
+	outBuf := new(bytes.Buffer)
+	errBuf := new(bytes.Buffer)
+	cmd := exec.CommandContext(ctx, name, args...)
+	cmd.Stdout = outBuf
+	cmd.Stderr = errBuf
+	err := cmd.Run()
+	return outBuf.String(), errBuf.String(), err
+}
+
+func firstLine(s string) string {
+	if i := strings.IndexByte(s, '\n'); i != -1 {
+		return s[:i]
+	}
+	return s
+}
+
 func runExample() error {
 	exe := filepath.Join(*buildDir, "example")
 	outBuf := new(bytes.Buffer)
@@ -0,0 +1,52 @@
+#!/bin/sh
+
+# Profile guided release build:
+# build instrumented, train on testdata, examples and a generated corpus,
+# then rebuild the same build directory with the collected profile.
+#
+# Usage: scripts/pgo.sh [build dir], extra cmake args can be set in CMAKE_ARGS
+
+set -ex
+
+build=${1:-b-pgo}
+mkdir -p "$build"
+pgo_dir="$(cd "$build" && pwd)/pgo"
+corpus="$build/pgo-corpus"
+
+cmake -S . -B "$build" -DRELEASE=ON -DPGO=generate -DPGO_DIR="$pgo_dir" $CMAKE_ARGS
+cmake --build "$build" -j
+rm -rf "$pgo_dir"
+
+# generated corpus: wide tables, nested values, long lists and strings
+mkdir -p "$corpus"
+awk 'BEGIN {
+  for (i = 0; i < 20000; i++) {
+    printf "k%d = {\n", i
+    printf "  name = \"item %d\\t\\u00e9\";\n", i
+    printf "  raw = `raw %d`;\n", i
+    printf "  id = %d; mask = 0x%x; on = %s;\n", i, i, (i % 2 ? "true" : "false")
+    printf "  tags = [1; 2; 3; {x = %d;}; [true; false;];];\n", i
+    printf "};\n# comment %d\n", i
+  }
+}' > "$corpus/tables.kevs"
+awk 'BEGIN {
+  printf "ints = ["
+  for (i = 0; i < 200000; i++) printf "%d;", i
+  printf "];\nbools = ["
+  for (i = 0; i < 200000; i++) printf "%s;", (i % 3 ? "true" : "false")
+  printf "];\n"
+}' > "$corpus/lists.kevs"
+
+for f in testdata/valid/*.kevs testdata/not_valid/*.kevs examples/*.kevs "$corpus"/*.kevs; do
+  for flags in "" "-intern" "-pack"; do
+    "$build/kevs" $flags --no-err --free "$f" > /dev/null
+  done
+done
+
+# clang writes raw profiles which have to be merged
+if ls "$pgo_dir"/*.profraw > /dev/null 2>&1; then
+  llvm-profdata merge -o "$pgo_dir/kevs.profdata" "$pgo_dir"/*.profraw
+fi
+
+cmake -S . -B "$build" -DPGO=use
+cmake --build "$build" -j
@@ -1,3 +1,4 @@
+#include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -5,14 +6,61 @@
 #include "kevs.h"
 #include "util.h"
 
+static KevsError include_read(void *ctx, const char *path, char **out,
+                              size_t *out_len) {
+  (void)ctx;
+  return read_file(kevs_str_from_cstr(path), out, out_len);
+}
+
+// Read, parse and compile the schema at path.
+static KevsError load_schema(const char *path, KevsSchema *out, char *err_buf,
+                             size_t err_buf_len) {
+  const KevsStr file = kevs_str_from_cstr(path);
+  char *data = NULL;
+  size_t data_len = 0;
+  KevsError err = read_file(file, &data, &data_len);
+  if (err != NULL) {
+    snprintf(err_buf, err_buf_len, "failed to read schema: %s", err);
+    return err_buf;
+  }
+
+  KevsTable table = {};
+  const KevsOpts opts = {.file = file, .errors_with_file_and_line = true};
+  err = kevs_parse(&table, (KevsStr){.ptr = data, .len = data_len}, err_buf,
+                   err_buf_len, opts);
+  if (err == NULL) {
+    err = kevs_schema_compile(out, table, err_buf, err_buf_len);
+  }
+  kevs_free(&table);
+  free(data);
+  return err;
+}
+
 static void usage() {
   fprintf(stderr,
 
           "usage: kevs [FLAGS] file\n"
+          "       kevs serve [-socket path] [-intern] [-pack]\n"
+          "       kevs get [-socket path] [-intern] [-pack] file path\n"
+          "       kevs load [-pack] [-utf8] [-threads N] [-window N] "
+          "[-no-uring] file...\n"
           "\n"
           "Parse the given KEVS file and perform actions based on the given "
           "flags.\n"
           "\n"
+          "serve keeps parsed files in memory and answers get over a Unix "
+          "socket,\n"
+          "$KEVS_SOCKET or /tmp/kevs-$UID.sock by default. get prints the "
+          "value at a\n"
+          "path like hosts[2].port, it parses the file itself without a "
+          "daemon.\n"
+          "\n"
+          "load reads and parses many files, overlapping parsing with the "
+          "reads, which\n"
+          "go through io_uring on Linux or else reader threads. A file "
+          "argument - reads\n"
+          "paths from stdin, one per line.\n"
+          "\n"
           "Flags:\n"
           "  -help       Print this message\n"
           "  -abort      Abort when encountering an error\n"
@@ -21,6 +69,17 @@ static void usage() {
           "  -no-err     Exit with code 0 even if an error was encountered\n"
           "  -free       Free memory before exit\n"
           "  -no-file    Don't print file:line for error\n"
+          "  -intern     Intern keys in a per-document symbol table\n"
+          "  -pack       Store integer and boolean lists as packed arrays\n"
+          "  -utf8       Check that strings are valid UTF-8\n"
+          "  -json       Print the document as JSON, while scanning with "
+          "-scan\n"
+          "  -ndjson     Like -json, a line {\"key\": value} per root key\n"
+          "  -hash       Print the structural hash of the document\n"
+          "  -include    Resolve include \"path\"; entries, relative to the "
+          "working directory\n"
+          "  -schema F   Validate against the schema in file F, while "
+          "scanning with -scan\n"
 
   );
 }
@@ -34,12 +93,30 @@ int main(int argc, char **argv) {
     return 1;
   }
 
+  if (strcmp(args[0], "serve") == 0) {
+    return serve_main(nargs - 1, args + 1);
+  }
+  if (strcmp(args[0], "get") == 0) {
+    return get_main(nargs - 1, args + 1);
+  }
+  if (strcmp(args[0], "load") == 0) {
+    return load_main(nargs - 1, args + 1);
+  }
+
   bool only_scan = false;
   bool dump = false;
   bool pass_on_error = false;
   bool free_heap = false;
   bool abort_on_error = false;
   bool errors_with_file_and_line = true;
+  bool intern_keys = false;
+  bool pack_lists = false;
+  bool validate_utf8 = false;
+  bool json = false;
+  bool ndjson = false;
+  bool hash = false;
+  bool includes = false;
+  const char *schema_file = NULL;
 
   int args_index = 0;
   while (args_index < nargs) {
@@ -71,6 +148,44 @@ int main(int argc, char **argv) {
                strcmp(args[args_index], "-no-file") == 0) {
       errors_with_file_and_line = false;
       args_index++;
+    } else if (strcmp(args[args_index], "--intern") == 0 ||
+               strcmp(args[args_index], "-intern") == 0) {
+      intern_keys = true;
+      args_index++;
+    } else if (strcmp(args[args_index], "--pack") == 0 ||
+               strcmp(args[args_index], "-pack") == 0) {
+      pack_lists = true;
+      args_index++;
+    } else if (strcmp(args[args_index], "--utf8") == 0 ||
+               strcmp(args[args_index], "-utf8") == 0) {
+      validate_utf8 = true;
+      args_index++;
+    } else if (strcmp(args[args_index], "--json") == 0 ||
+               strcmp(args[args_index], "-json") == 0) {
+      json = true;
+      args_index++;
+    } else if (strcmp(args[args_index], "--ndjson") == 0 ||
+               strcmp(args[args_index], "-ndjson") == 0) {
+      json = true;
+      ndjson = true;
+      args_index++;
+    } else if (strcmp(args[args_index], "--hash") == 0 ||
+               strcmp(args[args_index], "-hash") == 0) {
+      hash = true;
+      args_index++;
+    } else if (strcmp(args[args_index], "--include") == 0 ||
+               strcmp(args[args_index], "-include") == 0) {
+      includes = true;
+      args_index++;
+    } else if (strcmp(args[args_index], "--schema") == 0 ||
+               strcmp(args[args_index], "-schema") == 0) {
+      if (args_index + 1 >= nargs) {
+        fprintf(stderr, "error: -schema needs a file\n");
+        usage();
+        return 1;
+      }
+      schema_file = args[args_index + 1];
+      args_index += 2;
     } else if (strlen(args[args_index]) > 0 && args[args_index][0] == '-') {
       fprintf(stderr, "error: unknown option '%s'\n", args[args_index]);
       usage();
@@ -86,6 +201,10 @@ int main(int argc, char **argv) {
     return 1;
   }
 
+  // token dumps print a line per token
+  static char stdout_buf[1 << 16];
+  setvbuf(stdout, stdout_buf, _IOFBF, sizeof(stdout_buf));
+
   KevsStr file = kevs_str_from_cstr(args[args_index]);
 
   char *data = NULL;
@@ -102,17 +221,59 @@ int main(int argc, char **argv) {
   KevsTable table = {};
   char err_buf[8193] = {};
   const KevsStr content = {.ptr = data, .len = data_len};
-  const KevsOpts opts = {
+  KevsOpts opts = {
       .file = file,
       .abort_on_error = abort_on_error,
       .errors_with_file_and_line = errors_with_file_and_line,
+      .intern_keys = intern_keys,
+      .pack_lists = pack_lists,
+      .validate_utf8 = validate_utf8,
   };
 
-  err = scan(&tokens, content, err_buf, sizeof(err_buf) - 1, opts);
+  KevsIncluder includer = {.read = include_read, .opts = opts};
+  if (includes) {
+    opts.include = kevs_include;
+    opts.include_ctx = &includer;
+  }
+
+  KevsHashes hashes = {};
+  if (hash) {
+    opts.hashes = &hashes;
+  }
+
+  KevsSchema schema = {};
+  if (schema_file != NULL) {
+    err = load_schema(schema_file, &schema, err_buf, sizeof(err_buf) - 1);
+    if (err != NULL) {
+      fprintf(stderr, "error: %s\n", err);
+      free(data);
+      return 1;
+    }
+  }
+
+  if (json && only_scan) {
+    // straight from the scanner, without tokens
+    err = json_write_events(stdout, content, ndjson, err_buf,
+                            sizeof(err_buf) - 1, opts);
+  } else {
+    err = scan(&tokens, content, err_buf, sizeof(err_buf) - 1, opts);
+  }
   if (!only_scan) {
     if (err == NULL) {
       err = parse(&table, content, err_buf, sizeof(err_buf) - 1, opts, tokens);
     }
+    if (err == NULL && schema_file != NULL) {
+      err = kevs_schema_validate(&schema, table, err_buf, sizeof(err_buf) - 1);
+    }
+    if (err == NULL && json) {
+      err = json_write_table(stdout, table, ndjson);
+    }
+    if (err == NULL && hash) {
+      printf("%016" PRIx64 "\n", kevs_table_hash(table, &hashes));
+    }
+  } else if (err == NULL && schema_file != NULL) {
+    err = kevs_schema_validate_events(&schema, content, err_buf,
+                                      sizeof(err_buf) - 1, opts);
   }
 
   if (err != NULL) {
@@ -125,9 +286,10 @@ int main(int argc, char **argv) {
   if (dump) {
     if (only_scan) {
       for (size_t i = 0; i < tokens.len; i++) {
-        char *v = kevs_str_dup(tokens.ptr[i].value);
-        printf("%s %s\n", tokenkind_str(tokens.ptr[i].kind), v);
-        free(v);
+        const KevsStr v = tokens.ptr[i].value;
+        printf("%s ", tokenkind_str(tokens.ptr[i].kind));
+        fwrite(v.ptr, 1, v.len, stdout);
+        putchar('\n');
       }
     } else {
       table_dump(table);
@@ -136,6 +298,9 @@ int main(int argc, char **argv) {
 
   if (free_heap) {
     kevs_free(&table);
+    kevs_hashes_free(&hashes);
+    kevs_includer_free(&includer);
+    kevs_schema_free(&schema);
     free(tokens.ptr);
     free(data);
   }
@@ -0,0 +1,639 @@
+// Buffered export for the CLI: dumps, and JSON from parsed tables or straight
+// from the scanner.
+//
+// Output goes through a large buffer which is written with fwrite when it's
+// full, JSON strings are escaped 16 bytes at a time where SSE2 is available
+// and integers are formatted without printf.
+
+#include <assert.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__SSE2__) && !defined(KEVS_NO_SIMD)
+#define JSON_SSE2
+#include <emmintrin.h>
+#endif
+
+#include "kevs.h"
+#include "util.h"
+
+static const size_t kOutBufferSize = 1 << 20;
+
+typedef struct {
+  FILE *f;
+  char *ptr;
+  size_t cap;
+  size_t len;
+  bool failed;
+} Out;
+
+static void out_init(Out *self, FILE *f) {
+  *self = (Out){.f = f, .cap = kOutBufferSize};
+  self->ptr = malloc(self->cap);
+  assert(self->ptr != NULL);
+}
+
+static void out_flush(Out *self) {
+  if (self->len != 0 && fwrite(self->ptr, 1, self->len, self->f) != self->len) {
+    self->failed = true;
+  }
+  self->len = 0;
+}
+
+// Make room for n bytes, only huge keys grow the buffer.
+static char *out_reserve(Out *self, size_t n) {
+  if (self->cap - self->len < n) {
+    out_flush(self);
+  }
+  if (self->cap < n) {
+    self->cap = n;
+    self->ptr = realloc(self->ptr, self->cap);
+    assert(self->ptr != NULL);
+  }
+  return self->ptr + self->len;
+}
+
+static void out_put(Out *self, const char *s, size_t n) {
+  memcpy(out_reserve(self, n), s, n);
+  self->len += n;
+}
+
+static void out_putc(Out *self, char c) {
+  *out_reserve(self, 1) = c;
+  self->len++;
+}
+
+static void out_str(Out *self, KevsStr s) { out_put(self, s.ptr, s.len); }
+
+static void out_cstr(Out *self, const char *s) {
+  out_put(self, s, strlen(s));
+}
+
+static void out_int(Out *self, int64_t v) {
+  static const char digits[] = "00010203040506070809"
+                               "10111213141516171819"
+                               "20212223242526272829"
+                               "30313233343536373839"
+                               "40414243444546474849"
+                               "50515253545556575859"
+                               "60616263646566676869"
+                               "70717273747576777879"
+                               "80818283848586878889"
+                               "90919293949596979899";
+
+  // written backwards, 20 digits and a sign at most
+  char buf[24];
+  char *end = buf + sizeof(buf);
+  char *p = end;
+  uint64_t u = v < 0 ? (uint64_t)0 - (uint64_t)v : (uint64_t)v;
+  while (u >= 100) {
+    const size_t i = (size_t)(u % 100) * 2;
+    u /= 100;
+    *--p = digits[i + 1];
+    *--p = digits[i];
+  }
+  if (u >= 10) {
+    *--p = digits[u * 2 + 1];
+    *--p = digits[u * 2];
+  } else {
+    *--p = (char)('0' + u);
+  }
+  if (v < 0) {
+    *--p = '-';
+  }
+  out_put(self, p, (size_t)(end - p));
+}
+
+static KevsError out_finish(Out *self) {
+  out_flush(self);
+  free(self->ptr);
+  return self->failed ? "failed to write output" : NULL;
+}
+
+typedef struct {
+  KevsValue val;
+  size_t i;
+} ExportFrame;
+
+typedef struct {
+  ExportFrame *ptr;
+  size_t cap;
+  size_t len;
+} ExportStack;
+
+static void export_stack_push(ExportStack *self, KevsValue val) {
+  if (self->len == self->cap) {
+    self->cap = self->cap == 0 ? 64 : self->cap * 2;
+    self->ptr = realloc(self->ptr, self->cap * sizeof(ExportFrame));
+    assert(self->ptr != NULL);
+  }
+  self->ptr[self->len++] = (ExportFrame){.val = val};
+}
+
+// Next entry of the list or table on top, false at its end.
+static bool export_next(ExportStack *self, const KevsStr **key,
+                        KevsValue *v) {
+  ExportFrame *top = &self->ptr[self->len - 1];
+  if (top->val.kind == KevsValueKindTable) {
+    const KevsTable t = top->val.data.table;
+    if (top->i == t.len) {
+      return false;
+    }
+    *key = &t.ptr[top->i].key;
+    *v = t.ptr[top->i].val;
+  } else {
+    const KevsList l = top->val.data.list;
+    if (top->i == l.len) {
+      return false;
+    }
+    *key = NULL;
+    kevs_list_value(l, top->i, v);
+  }
+  top->i++;
+  return true;
+}
+
+// Dumps: a line per value, "key kind value" in tables, nested values follow
+// the line of their list or table.
+static KevsError dump(FILE *f, KevsValue root) {
+  Out out = {};
+  out_init(&out, f);
+
+  ExportStack stack = {};
+  export_stack_push(&stack, root);
+  while (stack.len != 0) {
+    const KevsStr *key = NULL;
+    KevsValue v = {};
+    if (!export_next(&stack, &key, &v)) {
+      stack.len--;
+      continue;
+    }
+
+    if (key != NULL) {
+      out_str(&out, *key);
+      out_putc(&out, ' ');
+    }
+    out_cstr(&out, kevs_valuekind_str(v.kind));
+    switch (v.kind) {
+    case KevsValueKindTable:
+    case KevsValueKindList:
+      export_stack_push(&stack, v);
+      break;
+    case KevsValueKindString:
+      out_put(&out, " '", 2);
+      out_cstr(&out, v.data.string);
+      out_putc(&out, '\'');
+      break;
+    case KevsValueKindBoolean:
+      out_cstr(&out, v.data.boolean ? " true" : " false");
+      break;
+    case KevsValueKindInteger:
+      out_putc(&out, ' ');
+      out_int(&out, v.data.integer);
+      break;
+    default:
+      break;
+    }
+    out_putc(&out, '\n');
+  }
+  free(stack.ptr);
+
+  return out_finish(&out);
+}
+
+KevsError table_fdump(FILE *f, KevsTable self) {
+  return dump(f, (KevsValue){.kind = KevsValueKindTable, .data.table = self});
+}
+
+KevsError list_fdump(FILE *f, KevsList self) {
+  return dump(f, (KevsValue){.kind = KevsValueKindList, .data.list = self});
+}
+
+void table_dump(KevsTable self) { table_fdump(stdout, self); }
+
+void list_dump(KevsList self) { list_fdump(stdout, self); }
+
+void value_fprint(FILE *f, KevsValue v) {
+  switch (v.kind) {
+  case KevsValueKindTable: {
+    table_fdump(f, v.data.table);
+  } break;
+
+  case KevsValueKindList: {
+    list_fdump(f, v.data.list);
+  } break;
+
+  case KevsValueKindString: {
+    fprintf(f, "%s\n", v.data.string);
+  } break;
+
+  case KevsValueKindBoolean: {
+    fprintf(f, "%s\n", (v.data.boolean ? "true" : "false"));
+  } break;
+
+  case KevsValueKindInteger: {
+    fprintf(f, "%" PRId64 "\n", v.data.integer);
+  } break;
+
+  default: {
+    fprintf(f, "%s\n", kevs_valuekind_str(v.kind));
+  } break;
+  }
+}
+
+// JSON
+
+typedef struct {
+  Out out;
+  // per open list or table, whether the next element needs a comma
+  uint8_t *comma;
+  size_t comma_cap;
+  size_t depth;
+  // a key was written, its value follows without a comma
+  bool after_key;
+  // each key of the root table is a line {"key": value}
+  bool ndjson;
+} JsonWriter;
+
+// Comma before a value or key, unless it's the first or follows a key.
+static void json_sep(JsonWriter *self) {
+  if (self->after_key) {
+    self->after_key = false;
+    return;
+  }
+  if (self->depth != 0) {
+    if (self->comma[self->depth - 1]) {
+      out_putc(&self->out, ',');
+    }
+    self->comma[self->depth - 1] = 1;
+  }
+}
+
+// A value is complete, with ndjson this may end a line.
+static void json_done(JsonWriter *self) {
+  if (self->ndjson && self->depth == 0) {
+    out_put(&self->out, "}\n", 2);
+  }
+}
+
+static void json_begin(JsonWriter *self, char c) {
+  json_sep(self);
+  out_putc(&self->out, c);
+  if (self->depth == self->comma_cap) {
+    self->comma_cap = self->comma_cap == 0 ? 64 : self->comma_cap * 2;
+    self->comma = realloc(self->comma, self->comma_cap);
+    assert(self->comma != NULL);
+  }
+  self->comma[self->depth++] = 0;
+}
+
+static void json_end(JsonWriter *self, char c) {
+  out_putc(&self->out, c);
+  self->depth--;
+  json_done(self);
+}
+
+// Keys are identifiers, they need no escaping.
+static void json_key(JsonWriter *self, KevsStr key) {
+  if (self->ndjson && self->depth == 0) {
+    out_putc(&self->out, '{');
+  } else {
+    json_sep(self);
+  }
+  char *p = out_reserve(&self->out, key.len + 3);
+  p[0] = '"';
+  memcpy(p + 1, key.ptr, key.len);
+  p[key.len + 1] = '"';
+  p[key.len + 2] = ':';
+  self->out.len += key.len + 3;
+  self->after_key = true;
+}
+
+static void json_int(JsonWriter *self, int64_t v) {
+  json_sep(self);
+  out_int(&self->out, v);
+  json_done(self);
+}
+
+static void json_bool(JsonWriter *self, bool v) {
+  json_sep(self);
+  if (v) {
+    out_put(&self->out, "true", 4);
+  } else {
+    out_put(&self->out, "false", 5);
+  }
+  json_done(self);
+}
+
+static bool json_needs_escape(uint8_t c) {
+  return c < 0x20 || c == '"' || c == '\\';
+}
+
+// Escape one byte, at most 6 bytes are written to p.
+static size_t json_escape(char *p, uint8_t c) {
+  static const char hex[] = "0123456789abcdef";
+  p[0] = '\\';
+  switch (c) {
+  case '"':
+  case '\\':
+    p[1] = (char)c;
+    return 2;
+  case '\b':
+    p[1] = 'b';
+    return 2;
+  case '\f':
+    p[1] = 'f';
+    return 2;
+  case '\n':
+    p[1] = 'n';
+    return 2;
+  case '\r':
+    p[1] = 'r';
+    return 2;
+  case '\t':
+    p[1] = 't';
+    return 2;
+  default:
+    memcpy(p + 1, "u00", 3);
+    p[4] = hex[c >> 4];
+    p[5] = hex[c & 0xf];
+    return 6;
+  }
+}
+
+// Bytes are copied as they are, JSON needs UTF-8, see KevsOpts.validate_utf8.
+static void json_string(JsonWriter *self, KevsStr s) {
+  json_sep(self);
+  out_putc(&self->out, '"');
+
+  const uint8_t *in = (const uint8_t *)s.ptr;
+  size_t i = 0;
+  // each round copies 16 bytes, or a run before a byte to escape and it
+  while (i < s.len) {
+    char *p = out_reserve(&self->out, 16 + 6);
+    size_t n = s.len - i < 16 ? s.len - i : 16;
+#ifdef JSON_SSE2
+    if (n == 16) {
+      const __m128i v = _mm_loadu_si128((const __m128i *)(in + i));
+      // below 0x20: the unsigned max with 0x1f is 0x1f
+      const __m128i ctrl =
+          _mm_cmpeq_epi8(_mm_max_epu8(v, _mm_set1_epi8(0x1f)),
+                         _mm_set1_epi8(0x1f));
+      const __m128i special =
+          _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('"')),
+                       _mm_cmpeq_epi8(v, _mm_set1_epi8('\\')));
+      const int mask = _mm_movemask_epi8(_mm_or_si128(ctrl, special));
+      _mm_storeu_si128((__m128i *)p, v);
+      if (mask == 0) {
+        self->out.len += 16;
+        i += 16;
+        continue;
+      }
+      n = (size_t)__builtin_ctz((unsigned)mask);
+      self->out.len += n;
+      i += n;
+      self->out.len += json_escape(p + n, in[i]);
+      i++;
+      continue;
+    }
+#endif
+    size_t k = 0;
+    while (k < n && !json_needs_escape(in[i + k])) {
+      p[k] = (char)in[i + k];
+      k++;
+    }
+    self->out.len += k;
+    i += k;
+    if (k < n) {
+      self->out.len += json_escape(p + k, in[i]);
+      i++;
+    }
+  }
+
+  out_putc(&self->out, '"');
+  json_done(self);
+}
+
+static void json_init(JsonWriter *self, FILE *f, bool ndjson) {
+  *self = (JsonWriter){.ndjson = ndjson};
+  out_init(&self->out, f);
+  if (!ndjson) {
+    json_begin(self, '{');
+  }
+}
+
+static KevsError json_finish(JsonWriter *self) {
+  if (!self->ndjson) {
+    json_end(self, '}');
+    out_putc(&self->out, '\n');
+  }
+  free(self->comma);
+  return out_finish(&self->out);
+}
+
+// Drops what is still buffered, an error leaves no closed document behind.
+static void json_discard(JsonWriter *self) {
+  free(self->comma);
+  free(self->out.ptr);
+}
+
+KevsError json_write_table(FILE *f, KevsTable table, bool ndjson) {
+  JsonWriter w = {};
+  json_init(&w, f, ndjson);
+
+  // the root frame has no begin and end of its own
+  ExportStack stack = {};
+  export_stack_push(&stack, (KevsValue){.kind = KevsValueKindTable,
+                                        .data.table = table});
+  while (stack.len != 0) {
+    const KevsStr *key = NULL;
+    KevsValue v = {};
+    if (!export_next(&stack, &key, &v)) {
+      if (stack.len > 1) {
+        const bool is_table =
+            stack.ptr[stack.len - 1].val.kind == KevsValueKindTable;
+        json_end(&w, is_table ? '}' : ']');
+      }
+      stack.len--;
+      continue;
+    }
+    if (key != NULL) {
+      json_key(&w, *key);
+    }
+
+    switch (v.kind) {
+    case KevsValueKindString:
+      json_string(&w, kevs_str_from_cstr(v.data.string));
+      break;
+    case KevsValueKindInteger:
+      json_int(&w, v.data.integer);
+      break;
+    case KevsValueKindBoolean:
+      json_bool(&w, v.data.boolean);
+      break;
+    case KevsValueKindList:
+    case KevsValueKindTable:
+      json_begin(&w, v.kind == KevsValueKindTable ? '{' : '[');
+      export_stack_push(&stack, v);
+      break;
+    default:
+      break;
+    }
+  }
+  free(stack.ptr);
+
+  return json_finish(&w);
+}
+
+// Events: the scanner drives the writer.
+
+typedef struct {
+  JsonWriter w;
+  // a scalar which didn't convert and why
+  KevsValueKind err_kind;
+  KevsStr err_raw;
+  KevsError err;
+} JsonEvents;
+
+static bool json_events_fail(JsonEvents *self, KevsValueKind kind,
+                             KevsStr raw, KevsError err) {
+  self->err_kind = kind;
+  self->err_raw = raw;
+  self->err = err;
+  return false;
+}
+
+// Worded like the parse error of the tree, it replaces the message about
+// stopping.
+static void json_events_error(const JsonEvents *self, KevsStr content,
+                              KevsOpts opts, char *err_buf,
+                              size_t err_buf_len) {
+  char *ptr = err_buf;
+  size_t len = err_buf_len;
+  int n = 0;
+
+  if (opts.errors_with_file_and_line) {
+    size_t line = 1;
+    for (const char *p = content.ptr; p < self->err_raw.ptr; p++) {
+      line += *p == '\n';
+    }
+    n = snprintf(ptr, len, "%s:%zu: ", opts.file.ptr, line);
+    assert(n >= 0);
+    assert((size_t)n < len);
+    ptr += n;
+    len -= n;
+  }
+
+  const KevsStr raw = self->err_raw;
+  switch (self->err_kind) {
+  case KevsValueKindString:
+    snprintf(ptr, len, "parse: could not normalize string: %s", self->err);
+    break;
+  case KevsValueKindInteger:
+    snprintf(ptr, len, "parse: value '%.*s' is not an integer: %s",
+             (int)raw.len, raw.ptr, self->err);
+    break;
+  default:
+    snprintf(ptr, len, "parse: value '%.*s' is not a boolean: %s",
+             (int)raw.len, raw.ptr, self->err);
+    break;
+  }
+}
+
+static bool json_on_key(void *ctx, KevsStr key) {
+  json_key(&((JsonEvents *)ctx)->w, key);
+  return true;
+}
+
+static bool json_on_scalar(void *ctx, KevsValueKind kind, KevsStr raw) {
+  JsonEvents *self = ctx;
+  switch (kind) {
+  case KevsValueKindString: {
+    const KevsStr inner = {.ptr = raw.ptr + 1, .len = raw.len - 2};
+    // raw strings and strings without escapes are copied as they are
+    if (raw.ptr[0] == '`' || memchr(inner.ptr, '\\', inner.len) == NULL) {
+      json_string(&self->w, inner);
+      return true;
+    }
+    char *s = NULL;
+    KevsError err = kevs_scalar_string(raw, &s);
+    if (err != NULL) {
+      return json_events_fail(self, kind, raw, err);
+    }
+    json_string(&self->w, kevs_str_from_cstr(s));
+    free(s);
+  } break;
+
+  case KevsValueKindInteger: {
+    int64_t v = 0;
+    KevsError err = kevs_scalar_int(raw, &v);
+    if (err != NULL) {
+      return json_events_fail(self, kind, raw, err);
+    }
+    json_int(&self->w, v);
+  } break;
+
+  case KevsValueKindBoolean: {
+    bool v = false;
+    KevsError err = kevs_scalar_bool(raw, &v);
+    if (err != NULL) {
+      return json_events_fail(self, kind, raw, err);
+    }
+    json_bool(&self->w, v);
+  } break;
+
+  default:
+    break;
+  }
+  return true;
+}
+
+static bool json_on_begin_table(void *ctx) {
+  json_begin(&((JsonEvents *)ctx)->w, '{');
+  return true;
+}
+
+static bool json_on_end_table(void *ctx) {
+  json_end(&((JsonEvents *)ctx)->w, '}');
+  return true;
+}
+
+static bool json_on_begin_list(void *ctx) {
+  json_begin(&((JsonEvents *)ctx)->w, '[');
+  return true;
+}
+
+static bool json_on_end_list(void *ctx) {
+  json_end(&((JsonEvents *)ctx)->w, ']');
+  return true;
+}
+
+KevsError json_write_events(FILE *f, KevsStr content, bool ndjson,
+                            char *err_buf, size_t err_buf_len,
+                            KevsOpts opts) {
+  JsonEvents ev = {};
+  json_init(&ev.w, f, ndjson);
+
+  const KevsEvents events = {
+      .key = json_on_key,
+      .scalar = json_on_scalar,
+      .begin_table = json_on_begin_table,
+      .end_table = json_on_end_table,
+      .begin_list = json_on_begin_list,
+      .end_list = json_on_end_list,
+  };
+  KevsError err =
+      kevs_parse_events(content, &events, &ev, err_buf, err_buf_len, opts);
+  if (ev.err != NULL) {
+    json_events_error(&ev, content, opts, err_buf, err_buf_len);
+    err = err_buf;
+  }
+  if (err != NULL) {
+    json_discard(&ev.w);
+    return err;
+  }
+  return json_finish(&ev.w);
+}
@@ -1,11 +1,32 @@
 #include "kevs.h"
 
 #include <assert.h>
+#include <inttypes.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+// kevs_parse_batch runs on the calling thread only without pthreads
+#if !defined(_WIN32) && !defined(KEVS_NO_THREADS)
+#define KEVS_THREADS
+#include <pthread.h>
+#endif
+
+// UTF-8 validation uses SSSE3 when the CPU has it
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__)) &&       \
+    !defined(KEVS_NO_SIMD)
+#define KEVS_SSSE3
+#include <tmmintrin.h>
+#endif
+
+#ifdef KEVS_STATS
+KevsStats kevs_stats = {};
+#define STATS_ADD(field, n) (kevs_stats.field += (n))
+#else
+#define STATS_ADD(field, n) ((void)0)
+#endif
+
 static inline bool is_digit(char c) { return c >= '0' && c <= '9'; }
 
 static inline char lower(char c) { return (char)(c | ('x' - 'X')); }
@@ -90,12 +111,12 @@ static bool str_starts_with_char(KevsStr self, char c) {
   return self.ptr[0] == c;
 }
 
-int str_index_char(KevsStr self, char c) {
+int64_t str_index_char(KevsStr self, char c) {
   const char *ptr = memchr(self.ptr, c, self.len);
   if (ptr == NULL) {
     return -1;
   }
-  return (int)(ptr - self.ptr);
+  return ptr - self.ptr;
 }
 
 static size_t str_count_char(KevsStr self, char c) {
@@ -108,12 +129,13 @@ static size_t str_count_char(KevsStr self, char c) {
   return count;
 }
 
-static int str_index_any(KevsStr self, KevsStr chars, char *c) {
+static int64_t str_index_any(KevsStr self, KevsStr chars, char *c) {
   for (size_t i = 0; i < self.len; i++) {
-    const int j = str_index_char(chars, self.ptr[i]);
+    STATS_ADD(index_steps, 1);
+    const int64_t j = str_index_char(chars, self.ptr[i]);
     if (j != -1) {
       *c = chars.ptr[j];
-      return (int)i;
+      return (int64_t)i;
     }
   }
   return -1;
@@ -165,10 +187,8 @@ KevsStr str_trim_left(KevsStr self, KevsStr cutset) {
 }
 
 KevsStr str_trim_right(KevsStr self, KevsStr cutset) {
-  for (int i = (int)self.len - 1; i >= 0; i--) {
-    if (str_index_char(cutset, self.ptr[i]) == -1) {
-      break;
-    }
+  while (self.len != 0 &&
+         str_index_char(cutset, self.ptr[self.len - 1]) != -1) {
     self.len--;
   }
   return self;
@@ -253,6 +273,35 @@ static KevsError str_to_uint(KevsStr self, uint64_t base, uint64_t *out) {
   return NULL;
 }
 
+// Fast path for plain decimal integers which can't overflow.
+static bool str_to_int_fast(KevsStr self, int64_t *out) {
+  size_t i = 0;
+  bool neg = false;
+  if (self.len != 0 && (self.ptr[0] == '+' || self.ptr[0] == '-')) {
+    neg = (self.ptr[0] == '-');
+    i++;
+  }
+
+  // 18 digits always fit, leading 0 is a base prefix or invalid
+  const size_t digits = self.len - i;
+  if (digits == 0 || digits > 18 || (digits > 1 && self.ptr[i] == '0')) {
+    return false;
+  }
+
+  int64_t n = 0;
+  for (; i < self.len; i++) {
+    const char c = self.ptr[i];
+    if (!is_digit(c)) {
+      return false;
+    }
+    n = n * 10 + (c - '0');
+  }
+
+  *out = (neg ? -n : n);
+
+  return true;
+}
+
 KevsError str_to_int(KevsStr self, uint64_t base, int64_t *out) {
   if (self.len == 0) {
     return "empty input";
@@ -335,9 +384,207 @@ uint8_t ucs_to_utf8(uint64_t code, char out[4]) {
   return 0;
 }
 
-static KevsError str_norm(KevsStr self, char **out) {
-  String dst = {};
-  string_reserve(&dst, self.len);
+// Offset of the first byte which doesn't start a valid UTF-8 sequence,
+// or s.len if all of s is valid.
+size_t utf8_check_scalar(KevsStr s) {
+  const uint8_t *p = (const uint8_t *)s.ptr;
+  size_t i = 0;
+  while (i < s.len) {
+    // skip ASCII a word at a time
+    if (s.len - i >= 8) {
+      uint64_t word = 0;
+      memcpy(&word, p + i, 8);
+      if ((word & 0x8080808080808080) == 0) {
+        i += 8;
+        continue;
+      }
+    }
+
+    const uint8_t c = p[i];
+    if (c < 0x80) {
+      i++;
+      continue;
+    }
+
+    // the second byte has the tightest range, it excludes overlong forms,
+    // surrogates and code points above 0x10ffff
+    size_t n = 0;
+    uint8_t lo = 0x80;
+    uint8_t hi = 0xbf;
+    if (c >= 0xc2 && c <= 0xdf) {
+      n = 2;
+    } else if (c >= 0xe0 && c <= 0xef) {
+      n = 3;
+      lo = (c == 0xe0 ? 0xa0 : lo);
+      hi = (c == 0xed ? 0x9f : hi);
+    } else if (c >= 0xf0 && c <= 0xf4) {
+      n = 4;
+      lo = (c == 0xf0 ? 0x90 : lo);
+      hi = (c == 0xf4 ? 0x8f : hi);
+    } else {
+      return i;
+    }
+    if (s.len - i < n || p[i + 1] < lo || p[i + 1] > hi) {
+      return i;
+    }
+    for (size_t k = 2; k < n; k++) {
+      if ((p[i + k] & 0xc0) != 0x80) {
+        return i;
+      }
+    }
+    i += n;
+  }
+  return s.len;
+}
+
+#ifdef KEVS_SSSE3
+
+// Lookup table validation (Keiser and Lemire): each byte and its
+// predecessor select error bits from three 16 entry tables, by the high
+// nibble of the previous byte, its low nibble and the high nibble of the
+// byte. A set bit in all three is an error, continuations of three and four
+// byte sequences are checked separately.
+enum {
+  kUtf8TooShort = 1 << 0,
+  kUtf8TooLong = 1 << 1,
+  kUtf8Overlong3 = 1 << 2,
+  kUtf8TooLarge = 1 << 3,
+  kUtf8Surrogate = 1 << 4,
+  kUtf8Overlong2 = 1 << 5,
+  // shared, told apart by the previous byte
+  kUtf8TooLarge1000 = 1 << 6,
+  kUtf8Overlong4 = 1 << 6,
+  kUtf8TwoConts = 1 << 7,
+  kUtf8Carry = kUtf8TooShort | kUtf8TooLong | kUtf8TwoConts,
+};
+
+__attribute__((target("ssse3"))) static __m128i utf8_block_errors(__m128i in,
+                                                                 __m128i prev) {
+  const __m128i nibble = _mm_set1_epi8(0x0f);
+  const __m128i byte_1_high_table = _mm_setr_epi8(
+      // 0_______ ________, ASCII
+      kUtf8TooLong, kUtf8TooLong, kUtf8TooLong, kUtf8TooLong, kUtf8TooLong,
+      kUtf8TooLong, kUtf8TooLong, kUtf8TooLong,
+      // 10______ ________, continuation
+      kUtf8TwoConts, kUtf8TwoConts, kUtf8TwoConts, kUtf8TwoConts,
+      // 1100____ ________, two byte lead
+      kUtf8TooShort | kUtf8Overlong2,
+      // 1101____ ________, two byte lead
+      kUtf8TooShort,
+      // 1110____ ________, three byte lead
+      kUtf8TooShort | kUtf8Overlong3 | kUtf8Surrogate,
+      // 1111____ ________, four byte lead
+      (char)(kUtf8TooShort | kUtf8TooLarge | kUtf8TooLarge1000 |
+             kUtf8Overlong4));
+  const __m128i byte_1_low_table = _mm_setr_epi8(
+      // ____0000 ________
+      (char)(kUtf8Carry | kUtf8Overlong3 | kUtf8Overlong2 | kUtf8Overlong4),
+      // ____0001 ________
+      (char)(kUtf8Carry | kUtf8Overlong2),
+      // ____001_ ________
+      (char)kUtf8Carry, (char)kUtf8Carry,
+      // ____0100 ________
+      (char)(kUtf8Carry | kUtf8TooLarge),
+      // ____0101 ________ and above
+      (char)(kUtf8Carry | kUtf8TooLarge | kUtf8TooLarge1000),
+      (char)(kUtf8Carry | kUtf8TooLarge | kUtf8TooLarge1000),
+      (char)(kUtf8Carry | kUtf8TooLarge | kUtf8TooLarge1000),
+      (char)(kUtf8Carry | kUtf8TooLarge | kUtf8TooLarge1000),
+      (char)(kUtf8Carry | kUtf8TooLarge | kUtf8TooLarge1000),
+      (char)(kUtf8Carry | kUtf8TooLarge | kUtf8TooLarge1000),
+      (char)(kUtf8Carry | kUtf8TooLarge | kUtf8TooLarge1000),
+      (char)(kUtf8Carry | kUtf8TooLarge | kUtf8TooLarge1000),
+      // ____1101 ________
+      (char)(kUtf8Carry | kUtf8TooLarge | kUtf8TooLarge1000 | kUtf8Surrogate),
+      (char)(kUtf8Carry | kUtf8TooLarge | kUtf8TooLarge1000),
+      (char)(kUtf8Carry | kUtf8TooLarge | kUtf8TooLarge1000));
+  const __m128i byte_2_high_table = _mm_setr_epi8(
+      // ________ 0_______, ASCII
+      kUtf8TooShort, kUtf8TooShort, kUtf8TooShort, kUtf8TooShort,
+      kUtf8TooShort, kUtf8TooShort, kUtf8TooShort, kUtf8TooShort,
+      // ________ 1000____
+      (char)(kUtf8TooLong | kUtf8Overlong2 | kUtf8TwoConts | kUtf8Overlong3 |
+             kUtf8TooLarge1000 | kUtf8Overlong4),
+      // ________ 1001____
+      (char)(kUtf8TooLong | kUtf8Overlong2 | kUtf8TwoConts | kUtf8Overlong3 |
+             kUtf8TooLarge),
+      // ________ 101_____
+      (char)(kUtf8TooLong | kUtf8Overlong2 | kUtf8TwoConts | kUtf8Surrogate |
+             kUtf8TooLarge),
+      (char)(kUtf8TooLong | kUtf8Overlong2 | kUtf8TwoConts | kUtf8Surrogate |
+             kUtf8TooLarge),
+      // ________ 11______, lead
+      kUtf8TooShort, kUtf8TooShort, kUtf8TooShort, kUtf8TooShort);
+
+  const __m128i prev1 = _mm_alignr_epi8(in, prev, 15);
+  const __m128i byte_1_high = _mm_shuffle_epi8(
+      byte_1_high_table, _mm_and_si128(_mm_srli_epi16(prev1, 4), nibble));
+  const __m128i byte_1_low =
+      _mm_shuffle_epi8(byte_1_low_table, _mm_and_si128(prev1, nibble));
+  const __m128i byte_2_high = _mm_shuffle_epi8(
+      byte_2_high_table, _mm_and_si128(_mm_srli_epi16(in, 4), nibble));
+  const __m128i special =
+      _mm_and_si128(_mm_and_si128(byte_1_high, byte_1_low), byte_2_high);
+
+  // bytes two or three after a three or four byte lead must be
+  // continuations, which the tables flag as two continuations in a row
+  const __m128i prev2 = _mm_alignr_epi8(in, prev, 14);
+  const __m128i prev3 = _mm_alignr_epi8(in, prev, 13);
+  const __m128i third = _mm_subs_epu8(prev2, _mm_set1_epi8(0xe0 - 0x80));
+  const __m128i fourth = _mm_subs_epu8(prev3, _mm_set1_epi8(0xf0 - 0x80));
+  const __m128i must23 = _mm_and_si128(_mm_or_si128(third, fourth),
+                                       _mm_set1_epi8((char)0x80));
+  return _mm_xor_si128(must23, special);
+}
+
+__attribute__((target("ssse3"))) static size_t utf8_check_ssse3(KevsStr s) {
+  const uint8_t *p = (const uint8_t *)s.ptr;
+  __m128i prev = _mm_setzero_si128();
+  __m128i error = _mm_setzero_si128();
+  size_t i = 0;
+  for (; i + 16 <= s.len; i += 16) {
+    const __m128i in = _mm_loadu_si128((const __m128i *)(p + i));
+    // ASCII after ASCII can't be wrong
+    if (_mm_movemask_epi8(_mm_or_si128(in, prev)) != 0) {
+      error = _mm_or_si128(error, utf8_block_errors(in, prev));
+    }
+    prev = in;
+  }
+
+  // the tables only look back, so the exact offset and sequences cut
+  // by the last block are left to the scalar check
+  if (_mm_movemask_epi8(_mm_cmpeq_epi8(error, _mm_setzero_si128())) !=
+      0xffff) {
+    return utf8_check_scalar(s);
+  }
+  // back up to the lead of a sequence which may be cut
+  size_t tail = i;
+  while (tail > 0 && i - tail < 3 && (p[tail - 1] & 0xc0) == 0x80) {
+    tail--;
+  }
+  if (tail > 0 && p[tail - 1] >= 0xc0) {
+    tail--;
+  }
+  const size_t off =
+      utf8_check_scalar((KevsStr){.ptr = s.ptr + tail, .len = s.len - tail});
+  return tail + off;
+}
+
+#endif
+
+// Like utf8_check_scalar, vectorized where the CPU allows.
+size_t utf8_check(KevsStr s) {
+#ifdef KEVS_SSSE3
+  if (s.len >= 16 && __builtin_cpu_supports("ssse3")) {
+    return utf8_check_ssse3(s);
+  }
+#endif
+  return utf8_check_scalar(s);
+}
+
+// Interpret escape sequences, dst must have room for at least self.len chars.
+static KevsError str_norm(KevsStr self, String *dst) {
+  assert(dst->cap >= self.len);
 
   // TODO: change this from char by char to memchr?
 
@@ -346,111 +593,105 @@ static KevsError str_norm(KevsStr self, char **out) {
       i++;
       switch (self.ptr[i]) {
       case 'a': {
-        string_append(&dst, '\a');
+        string_append(dst, '\a');
         i++;
       } break;
       case 'b': {
-        string_append(&dst, '\b');
+        string_append(dst, '\b');
         i++;
       } break;
       case 'f': {
-        string_append(&dst, '\f');
+        string_append(dst, '\f');
         i++;
       } break;
       case 'n': {
-        string_append(&dst, '\n');
+        string_append(dst, '\n');
         i++;
       } break;
       case 'r': {
-        string_append(&dst, '\r');
+        string_append(dst, '\r');
         i++;
       } break;
       case 't': {
-        string_append(&dst, '\t');
+        string_append(dst, '\t');
         i++;
       } break;
       case 'v': {
-        string_append(&dst, '\v');
+        string_append(dst, '\v');
         i++;
       } break;
       case '"': {
-        string_append(&dst, '"');
+        string_append(dst, '"');
         i++;
       } break;
       case '\\': {
-        string_append(&dst, '\\');
+        string_append(dst, '\\');
         i++;
       } break;
       case 'u': {
         i++;
 
         if ((i + 4) > self.len) {
-          free(dst.ptr);
           return "\\u must be followed by 4 hex digits: \\uXXXX";
         }
 
         uint64_t code = 0;
         const KevsError err = str_to_uint(str_slice(self, i, i + 4), 16, &code);
         if (err != NULL) {
-          free(dst.ptr);
           return err;
         }
         i += 4;
+        if (code == 0) {
+          return "NUL is not allowed in strings";
+        }
 
         char utf8[4] = {};
         const int n = ucs_to_utf8(code, utf8);
         if (n == 0) {
-          free(dst.ptr);
           return "could not encode Unicode code point to UTF-8";
         }
 
         for (int i = 0; i < n; i++) {
-          string_append(&dst, utf8[i]);
+          string_append(dst, utf8[i]);
         }
       } break;
       case 'U': {
         i++;
 
         if ((i + 8) > self.len) {
-          free(dst.ptr);
           return "\\U must be followed by 8 hex digits: \\UXXXXXXXX";
         }
 
         uint64_t code = 0;
         const KevsError err = str_to_uint(str_slice(self, i, i + 8), 16, &code);
         if (err != NULL) {
-          free(dst.ptr);
           return err;
         }
         i += 8;
+        if (code == 0) {
+          return "NUL is not allowed in strings";
+        }
 
         char utf8[4] = {};
         const int n = ucs_to_utf8(code, utf8);
         if (n == 0) {
-          free(dst.ptr);
           return "could not encode Unicode code point to UTF-8";
         }
 
         for (int i = 0; i < n; i++) {
-          string_append(&dst, utf8[i]);
+          string_append(dst, utf8[i]);
         }
       } break;
       default: {
-        free(dst.ptr);
         return "unknown escape sequence";
       }
       }
     } else {
-      string_append(&dst, self.ptr[i]);
+      string_append(dst, self.ptr[i]);
       i++;
     }
   }
 
-  // TODO: here we might be wasting memory
-  // so check if dst.len==dst.cap, if not resize memory chunk
-
-  *out = dst.ptr;
-
   return NULL;
 }
 
@@ -464,6 +705,8 @@ const char *tokenkind_str(KevsTokenKind v) {
     return "delim";
   case KevsTokenKindValue:
     return "value";
+  case KevsTokenKindInclude:
+    return "include";
   default:
     return "unknown";
   }
@@ -496,20 +739,375 @@ static void tokens_append(KevsTokens *self, KevsToken v) {
   self->len += 1;
 }
 
-static void list_free(KevsList *self);
+typedef struct KevsArenaBlock {
+  struct KevsArenaBlock *next;
+  size_t cap;
+  size_t len;
+  uint64_t data[];
+} ArenaBlock;
+
+static const size_t kArenaBlockMin = 4096;
+static const size_t kArenaBlockMax = 1 << 20;
+
+// keep every allocation aligned for int64_t and pointers
+static size_t arena_align(size_t size) { return (size + 7) & ~(size_t)7; }
+
+static void arena_push_block(ArenaBlock **self, size_t cap) {
+  ArenaBlock *block = malloc(sizeof(ArenaBlock) + cap);
+  assert(block != NULL);
+  block->next = *self;
+  block->cap = cap;
+  block->len = 0;
+  *self = block;
+}
+
+static void *arena_alloc(ArenaBlock **self, size_t size) {
+  size = arena_align(size);
 
-static void value_free(KevsValue *self) {
+  ArenaBlock *head = *self;
+  if (head == NULL || head->cap - head->len < size) {
+    size_t cap = kArenaBlockMin;
+    if (head != NULL && head->cap < kArenaBlockMax) {
+      cap = head->cap * 2;
+    } else if (head != NULL) {
+      cap = kArenaBlockMax;
+    }
+    if (cap < size) {
+      cap = size;
+    }
+    arena_push_block(self, cap);
+    head = *self;
+  }
+
+  void *ptr = (char *)head->data + head->len;
+  head->len += size;
+  return ptr;
+}
+
+// Give back the end of ptr if it's the last allocation.
+static void arena_trim(ArenaBlock **self, void *ptr, size_t size,
+                       size_t new_size) {
+  ArenaBlock *head = *self;
+  size = arena_align(size);
+  new_size = arena_align(new_size);
+  if (head != NULL && (char *)ptr + size == (char *)head->data + head->len) {
+    head->len -= size - new_size;
+  }
+}
+
+static char *arena_str_dup(ArenaBlock **self, KevsStr s) {
+  char *ptr = arena_alloc(self, s.len + 1);
+  memcpy(ptr, s.ptr, s.len);
+  ptr[s.len] = 0;
+  return ptr;
+}
+
+static void arena_free(ArenaBlock **self) {
+  ArenaBlock *block = *self;
+  while (block != NULL) {
+    ArenaBlock *next = block->next;
+    free(block);
+    block = next;
+  }
+  *self = NULL;
+}
+
+// Keep only the largest block for the next document, emptied.
+static void arena_reset(ArenaBlock **self) {
+  ArenaBlock *keep = *self;
+  for (ArenaBlock *b = *self; b != NULL; b = b->next) {
+    if (b->cap > keep->cap) {
+      keep = b;
+    }
+  }
+
+  ArenaBlock *block = *self;
+  while (block != NULL) {
+    ArenaBlock *next = block->next;
+    if (block != keep) {
+      free(block);
+    }
+    block = next;
+  }
+
+  if (keep != NULL) {
+    keep->next = NULL;
+    keep->len = 0;
+  }
+  *self = keep;
+}
+
+// Symbol: interned key, the id is stored right before the key chars.
+typedef struct {
+  uint32_t id;
+  char str[];
+} Symbol;
+
+// Symbols: distinct keys of a document, see KevsOpts.intern_keys.
+typedef struct KevsSymbols {
+  // id to key
+  KevsStr *ptr;
+  size_t cap;
+  size_t len;
+  // open addressing hash table of id + 1, 0 marks an empty slot
+  uint32_t *index;
+  size_t index_cap;
+} Symbols;
+
+static uint64_t str_hash(KevsStr self) {
+  // FNV-1a
+  uint64_t h = 0xcbf29ce484222325;
+  for (size_t i = 0; i < self.len; i++) {
+    h ^= (uint8_t)self.ptr[i];
+    h *= 0x100000001b3;
+  }
+  return h;
+}
+
+static uint32_t symbol_id(KevsStr key) {
+  const Symbol *sym = (const Symbol *)(key.ptr - offsetof(Symbol, str));
+  return sym->id;
+}
+
+static bool symbols_find(const Symbols *self, KevsStr key, uint32_t *id) {
+  if (self->index_cap == 0) {
+    return false;
+  }
+  const size_t mask = self->index_cap - 1;
+  for (size_t i = str_hash(key) & mask;; i = (i + 1) & mask) {
+    const uint32_t slot = self->index[i];
+    if (slot == 0) {
+      return false;
+    }
+    STATS_ADD(key_compares, 1);
+    if (str_equals(self->ptr[slot - 1], key)) {
+      *id = slot - 1;
+      return true;
+    }
+  }
+}
+
+static void symbols_index_insert(Symbols *self, uint32_t id) {
+  const size_t mask = self->index_cap - 1;
+  size_t i = str_hash(self->ptr[id]) & mask;
+  while (self->index[i] != 0) {
+    i = (i + 1) & mask;
+  }
+  self->index[i] = id + 1;
+}
+
+// Return the canonical copy of key, adding it to the symbols if needed.
+static KevsStr symbols_intern(Symbols *self, ArenaBlock **arena, KevsStr key) {
+  uint32_t id = 0;
+  if (symbols_find(self, key, &id)) {
+    return self->ptr[id];
+  }
+
+  assert(self->len < UINT32_MAX);
+  id = (uint32_t)self->len;
+
+  Symbol *sym = arena_alloc(arena, sizeof(Symbol) + key.len + 1);
+  sym->id = id;
+  memcpy(sym->str, key.ptr, key.len);
+  sym->str[key.len] = 0;
+  const KevsStr canonical = {.ptr = sym->str, .len = key.len};
+
+  if (self->len == self->cap) {
+    self->cap = (self->cap + 1) * 2;
+    KevsStr *ptr = realloc(self->ptr, self->cap * sizeof(KevsStr));
+    assert(ptr != NULL);
+    self->ptr = ptr;
+  }
+  self->ptr[self->len] = canonical;
+  self->len += 1;
+
+  // keep load factor at most 1/2
+  if (self->len * 2 > self->index_cap) {
+    free(self->index);
+    self->index_cap = (self->index_cap == 0 ? 16 : self->index_cap * 2);
+    self->index = calloc(self->index_cap, sizeof(uint32_t));
+    assert(self->index != NULL);
+    for (uint32_t i = 0; i < self->len; i++) {
+      symbols_index_insert(self, i);
+    }
+  } else {
+    symbols_index_insert(self, id);
+  }
+
+  return canonical;
+}
+
+// Copy symbols into the arena, keys already live there.
+static void symbols_copy(const Symbols *self, ArenaBlock **arena,
+                         Symbols *dst) {
+  *dst = (Symbols){};
+  dst->len = dst->cap = self->len;
+  dst->index_cap = self->index_cap;
+  if (self->len != 0) {
+    dst->ptr = arena_alloc(arena, self->len * sizeof(KevsStr));
+    memcpy(dst->ptr, self->ptr, self->len * sizeof(KevsStr));
+    dst->index = arena_alloc(arena, self->index_cap * sizeof(uint32_t));
+    memcpy(dst->index, self->index, self->index_cap * sizeof(uint32_t));
+  }
+}
+
+// Index capacity symbols_intern ends up with for len symbols.
+static size_t symbols_index_cap(size_t len) {
+  size_t cap = 0;
+  while (len * 2 > cap) {
+    cap = (cap == 0 ? 16 : cap * 2);
+  }
+  return cap;
+}
+
+// Arena bytes of interned keys and of their copy made by symbols_copy.
+static size_t symbols_size(const Symbols *self, size_t index_cap) {
+  if (self->len == 0) {
+    return 0;
+  }
+  size_t size = arena_align(self->len * sizeof(KevsStr)) +
+                arena_align(index_cap * sizeof(uint32_t));
+  for (size_t i = 0; i < self->len; i++) {
+    size += arena_align(sizeof(Symbol) + self->ptr[i].len + 1);
+  }
+  return size;
+}
+
+// Remove all symbols, keeping the capacity.
+static void symbols_clear(Symbols *self) {
+  self->len = 0;
+  if (self->index_cap != 0) {
+    memset(self->index, 0, self->index_cap * sizeof(uint32_t));
+  }
+}
+
+static void symbols_free(Symbols *self) {
+  free(self->ptr);
+  free(self->index);
+  *self = (Symbols){};
+}
+
+// DocHeader is placed right before the entries of an arena document root.
+typedef struct {
+  ArenaBlock *arena;
+  Symbols symbols;
+} DocHeader;
+
+static DocHeader *doc_header(KevsTable self) {
+  assert(self.flags & KevsFlagArenaRoot);
+  return (DocHeader *)self.ptr - 1;
+}
+
+// Turn root into the root of an arena document.
+// The symbols, if given, are copied into the arena and can be freed after.
+// If owned, the document takes the arena, otherwise it borrows the arena,
+// see KevsParser.
+static void doc_finish(ArenaBlock **arena, KevsTable root,
+                       const Symbols *symbols, bool owned, KevsTable *out) {
+  const size_t len = root.len;
+  assert(len <= UINT32_MAX);
+
+  DocHeader *header =
+      arena_alloc(arena, sizeof(DocHeader) + len * sizeof(KevsKeyValue));
+  KevsKeyValue *ptr = (KevsKeyValue *)(header + 1);
+  if (len != 0) {
+    memcpy(ptr, root.ptr, len * sizeof(KevsKeyValue));
+  }
+
+  uint32_t flags = KevsFlagArena | KevsFlagArenaRoot;
+
+  header->symbols = (Symbols){};
+  if (symbols != NULL) {
+    flags |= KevsFlagInterned;
+    symbols_copy(symbols, arena, &header->symbols);
+  }
+
+  // set last, the allocations above may have added blocks
+  header->arena = NULL;
+  if (owned) {
+    header->arena = *arena;
+    *arena = NULL;
+  }
+
+  *out = (KevsTable){
+      .ptr = ptr,
+      .cap = (uint32_t)len,
+      .flags = flags,
+      .len = len,
+  };
+}
+
+static bool list_is_packed(KevsList self) {
+  return (self.flags & (KevsFlagPackedInts | KevsFlagPackedBools)) != 0;
+}
+
+// Bytes of the first n elements of a list.
+static size_t list_storage_size(KevsList self, size_t n) {
+  if (self.flags & KevsFlagPackedInts) {
+    return n * sizeof(int64_t);
+  }
+  if (self.flags & KevsFlagPackedBools) {
+    return (n + 63) / 64 * sizeof(uint64_t);
+  }
+  return n * sizeof(KevsValue);
+}
+
+// Storage of a list or table whose values are being visited.
+typedef struct {
+  void *ptr;
+  size_t len;
+  size_t i;
+  bool is_table;
+} StorageFrame;
+
+typedef struct {
+  StorageFrame *ptr;
+  size_t cap;
+  size_t len;
+} StorageStack;
+
+static void storage_stack_push(StorageStack *self, void *ptr, size_t len,
+                            bool is_table) {
+  if (self->len == self->cap) {
+    self->cap = self->cap == 0 ? 16 : self->cap * 2;
+    self->ptr = realloc(self->ptr, self->cap * sizeof(StorageFrame));
+    assert(self->ptr != NULL);
+  }
+  self->ptr[self->len++] = (StorageFrame){
+      .ptr = ptr,
+      .len = len,
+      .is_table = is_table,
+  };
+}
+
+// Release a value, nested values of its storage are left to the caller.
+static void value_release(KevsValue *self, StorageStack *stack) {
   switch (self->kind) {
   case KevsValueKindString:
     free(self->data.string);
     break;
 
   case KevsValueKindList:
-    list_free(&self->data.list);
+    if (self->data.list.flags & KevsFlagArena) {
+      break;
+    }
+    if (list_is_packed(self->data.list)) {
+      free(self->data.list.ptr);
+      break;
+    }
+    storage_stack_push(stack, self->data.list.ptr, self->data.list.len, false);
     break;
 
   case KevsValueKindTable:
-    kevs_free(&self->data.table);
+    if (self->data.table.flags & KevsFlagArenaRoot) {
+      ArenaBlock *arena = doc_header(self->data.table)->arena;
+      arena_free(&arena);
+      break;
+    }
+    if (self->data.table.flags & KevsFlagArena) {
+      break;
+    }
+    storage_stack_push(stack, self->data.table.ptr, self->data.table.len, true);
     break;
 
   default:
@@ -519,35 +1117,82 @@ static void value_free(KevsValue *self) {
   *self = (KevsValue){};
 }
 
-static void list_free(KevsList *self) {
-  for (size_t i = 0; i < self->len; i++) {
-    value_free(&self->ptr[i]);
+// Iterative, so deeply nested documents don't overflow the C stack.
+static void value_free(KevsValue *self) {
+  StorageStack stack = {};
+  value_release(self, &stack);
+  while (stack.len != 0) {
+    StorageFrame *top = &stack.ptr[stack.len - 1];
+    if (top->i == top->len) {
+      free(top->ptr);
+      stack.len--;
+      continue;
+    }
+    KevsValue *v = (top->is_table ? &((KevsKeyValue *)top->ptr)[top->i].val
+                                  : &((KevsValue *)top->ptr)[top->i]);
+    top->i++;
+    value_release(v, &stack);
   }
+  free(stack.ptr);
+}
 
-  free(self->ptr);
-  *self = (KevsList){};
+typedef struct KevsScanFrame {
+  // index of the begin delim token, see scanner_append_end
+  size_t begin;
+  // kListEnd, kTableEnd, or 0 for the root table
+  char end;
+  size_t keys;
+} ScanFrame;
+
+typedef struct {
+  ScanFrame *ptr;
+  size_t cap;
+  size_t len;
+} ScanStack;
+
+static void scan_stack_push(ScanStack *self, ScanFrame v) {
+  if (self->len == self->cap) {
+    self->cap = self->cap == 0 ? 16 : self->cap * 2;
+    self->ptr = realloc(self->ptr, self->cap * sizeof(ScanFrame));
+    assert(self->ptr != NULL);
+  }
+  self->ptr[self->len++] = v;
 }
 
 typedef struct {
   KevsOpts opts;
   KevsTokens *tokens;
-  int line;
+  size_t line;
   char *err_buf;
   size_t err_buf_len;
   KevsStr content;
+  // start of content, for offsets
+  const char *input;
+  // if set, tokens are passed to these callbacks instead of being stored
+  const KevsEvents *events;
+  void *ctx;
+  bool stopped;
+  // open lists and tables, reused across runs
+  ScanStack stack;
+  // counted for the limits in opts
+  size_t token_count;
+  size_t string_bytes;
+  size_t node_count;
 } Scanner;
 
-static bool scan_key_value(Scanner *self);
-static bool scan_value(Scanner *self);
-
 static void scan_errorf(const Scanner *self, const char *fmt, ...) {
+  if (self->stopped) {
+    // not an error, a callback asked to stop
+    return;
+  }
+
   char *ptr = self->err_buf;
   size_t len = self->err_buf_len;
 
   int n = 0;
 
   if (self->opts.errors_with_file_and_line) {
-    n = snprintf(ptr, len, "%s:%d: ", self->opts.file.ptr, self->line);
+    n = snprintf(ptr, len, "%s:%zu: ", self->opts.file.ptr, self->line);
     assert(n >= 0);
     assert((size_t)n < len);
     ptr += n;
@@ -591,77 +1236,218 @@ static void scanner_trim_space(Scanner *self) {
   self->content = str_trim_left(self->content, kevs_str_from_cstr(spaces));
 }
 
-static void scanner_append(Scanner *self, KevsTokenKind kind, size_t end) {
-  KevsStr val = str_slice(self->content, 0, end);
-  val = str_trim_right(val, kevs_str_from_cstr(spaces));
+static KevsValueKind scalar_kind(KevsStr raw) {
+  if (str_starts_with_char(raw, kStringBegin) ||
+      str_starts_with_char(raw, kRawStringBegin)) {
+    return KevsValueKindString;
+  }
+  if (str_equals(raw, kevs_str_from_cstr("true")) ||
+      str_equals(raw, kevs_str_from_cstr("false"))) {
+    return KevsValueKindBoolean;
+  }
+  return KevsValueKindInteger;
+}
 
-  const KevsToken t = {
-      .kind = kind,
-      .value = val,
-      .line = self->line,
-  };
+static bool scanner_dispatch(Scanner *self, KevsToken t) {
+  const KevsEvents *e = self->events;
+  void *ctx = self->ctx;
 
-  tokens_append(self->tokens, t);
+  switch (t.kind) {
+  case KevsTokenKindKey:
+    return e->key == NULL || e->key(ctx, t.value);
 
-  scanner_advance(self, end);
-}
+  case KevsTokenKindValue:
+    return e->scalar == NULL || e->scalar(ctx, scalar_kind(t.value), t.value);
 
-static void scanner_append_delim(Scanner *self) {
-  const KevsToken t = {
-      .kind = KevsTokenKindDelim,
-      .value = str_slice(self->content, 0, 1),
-      .line = self->line,
-  };
-  tokens_append(self->tokens, t);
-  scanner_advance(self, 1);
-}
+  default:
+    break;
+  }
 
-static bool scan_newline(Scanner *self) {
-  self->line++;
-  scanner_advance(self, 1);
+  const char c = t.value.ptr[0];
+  if (c == kListBegin) {
+    return e->begin_list == NULL || e->begin_list(ctx);
+  }
+  if (c == kListEnd) {
+    return e->end_list == NULL || e->end_list(ctx);
+  }
+  if (c == kTableBegin) {
+    return e->begin_table == NULL || e->begin_table(ctx);
+  }
+  if (c == kTableEnd) {
+    return e->end_table == NULL || e->end_table(ctx);
+  }
   return true;
 }
 
-static bool scan_comment(Scanner *self) {
-  const int newline = str_index_char(self->content, '\n');
-  if (newline == -1) {
-    scan_errorf(self, "comment does not end with newline");
-    return false;
-  }
-  scanner_advance(self, newline);
-  return true;
+static size_t progress_interval(KevsOpts opts) {
+  return opts.progress_interval == 0 ? 4096 : opts.progress_interval;
 }
 
-static bool scan_key(Scanner *self) {
-  char c = 0;
-  const int i = str_index_any(self->content, kevs_str_from_cstr("=;\n"), &c);
-  if (c != kKeyValSep) {
-    scan_errorf(self, "key-value pair is missing separator");
+static bool scanner_check_limits(Scanner *self, KevsToken t) {
+  const KevsOpts opts = self->opts;
+
+  self->token_count++;
+  STATS_ADD(tokens, 1);
+  if (opts.max_tokens != 0 && self->token_count > opts.max_tokens) {
+    scan_errorf(self, "more than %zu tokens", opts.max_tokens);
     return false;
   }
-  scanner_append(self, KevsTokenKindKey, i);
-  if (self->tokens->ptr[self->tokens->len - 1].value.len == 0) {
-    scan_errorf(self, "empty key");
+
+  const bool is_value = t.kind == KevsTokenKindValue;
+  if (is_value || (t.kind == KevsTokenKindDelim &&
+                   (t.value.ptr[0] == kListBegin ||
+                    t.value.ptr[0] == kTableBegin))) {
+    self->node_count++;
+    if (opts.max_nodes != 0 && self->node_count > opts.max_nodes) {
+      scan_errorf(self, "more than %zu values", opts.max_nodes);
+      return false;
+    }
+  }
+
+  if (is_value && scalar_kind(t.value) == KevsValueKindString) {
+    // without quotes
+    self->string_bytes += t.value.len - 2;
+    if (opts.max_string_bytes != 0 &&
+        self->string_bytes > opts.max_string_bytes) {
+      scan_errorf(self, "strings longer than %zu bytes in total",
+                  opts.max_string_bytes);
+      return false;
+    }
+  }
+
+  if (opts.progress != NULL &&
+      self->token_count % progress_interval(opts) == 0 &&
+      !opts.progress(opts.progress_ctx, self->token_count)) {
+    scan_errorf(self, "canceled by progress callback");
     return false;
   }
+
   return true;
 }
 
-static bool scan_delim(Scanner *self, char c) {
-  if (!scanner_expect(self, c)) {
+static bool scanner_emit(Scanner *self, KevsToken t) {
+  if (!scanner_check_limits(self, t)) {
     return false;
   }
-  scanner_append_delim(self);
-  return true;
-}
 
-static bool scan_string_value(Scanner *self) {
-  // advance past leading quote
-  KevsStr s = str_slice_low(self->content, 1);
+  if (self->events == NULL) {
+    tokens_append(self->tokens, t);
+    return true;
+  }
+
+  if (t.kind == KevsTokenKindKey && !is_identifier(t.value)) {
+    char *s = kevs_str_dup(t.value);
+    scan_errorf(self, "key is not a valid identifier: '%s'", s);
+    free(s);
+    return false;
+  }
+
+  if (!scanner_dispatch(self, t)) {
+    self->stopped = true;
+    return false;
+  }
+
+  return true;
+}
+
+static KevsToken scanner_take(Scanner *self, KevsTokenKind kind, size_t end) {
+  KevsStr val = str_slice(self->content, 0, end);
+  val = str_trim_right(val, kevs_str_from_cstr(spaces));
+
+  const KevsToken t = {
+      .kind = kind,
+      .value = val,
+  };
+
+  scanner_advance(self, end);
+
+  return t;
+}
+
+static bool scanner_append(Scanner *self, KevsTokenKind kind, size_t end) {
+  return scanner_emit(self, scanner_take(self, kind, end));
+}
+
+static bool scanner_append_delim(Scanner *self) {
+  const KevsToken t = {
+      .kind = KevsTokenKindDelim,
+      .value = str_slice(self->content, 0, 1),
+  };
+  scanner_advance(self, 1);
+  return scanner_emit(self, t);
+}
+
+static size_t scanner_index(const Scanner *self) {
+  return self->tokens == NULL ? 0 : self->tokens->len;
+}
+
+// append list or table end, and link it with its begin
+static bool scanner_append_end(Scanner *self, size_t begin) {
+  if (!scanner_append_delim(self)) {
+    return false;
+  }
+  if (self->tokens != NULL) {
+    self->tokens->ptr[begin].match = self->tokens->len - 1;
+  }
+  return true;
+}
+
+static bool scan_newline(Scanner *self) {
+  self->line++;
+  scanner_advance(self, 1);
+  return true;
+}
+
+static bool scan_comment(Scanner *self) {
+  const int64_t newline = str_index_char(self->content, '\n');
+  if (newline == -1) {
+    scan_errorf(self, "comment does not end with newline");
+    return false;
+  }
+  scanner_advance(self, newline);
+  return true;
+}
+
+static bool scan_key(Scanner *self) {
+  char c = 0;
+  const int64_t i =
+      str_index_any(self->content, kevs_str_from_cstr("=;\n"), &c);
+  if (c != kKeyValSep) {
+    scan_errorf(self, "key-value pair is missing separator");
+    return false;
+  }
+  const KevsToken t = scanner_take(self, KevsTokenKindKey, i);
+  if (t.value.len == 0) {
+    scan_errorf(self, "empty key");
+    return false;
+  }
+  return scanner_emit(self, t);
+}
+
+// Check a string token, quotes included, see KevsOpts.validate_utf8.
+static bool scanner_check_utf8(Scanner *self, KevsToken t) {
+  if (!self->opts.validate_utf8) {
+    return true;
+  }
+  const KevsStr s = str_slice(t.value, 1, t.value.len - 1);
+  const size_t i = utf8_check(s);
+  if (i == s.len) {
+    return true;
+  }
+  // raw strings span lines, the scanner is still on the first one
+  self->line += str_count_char(str_slice(s, 0, i), '\n');
+  scan_errorf(self, "invalid UTF-8 at offset %zu",
+              (size_t)(s.ptr + i - self->input));
+  return false;
+}
+
+static bool scan_string(Scanner *self, KevsTokenKind kind) {
+  // advance past leading quote
+  KevsStr s = str_slice_low(self->content, 1);
 
   while (true) {
     // search for trailing quote
-    const int i = str_index_char(s, kStringBegin);
+    const int64_t i = str_index_char(s, kStringBegin);
 
     if (i == -1) {
       scan_errorf(self, "string value does not end with quote");
@@ -684,13 +1470,12 @@ static bool scan_string_value(Scanner *self) {
   const size_t end = s.ptr - self->content.ptr - 1;
 
   // +1 for leading quote
-  scanner_append(self, KevsTokenKindValue, end + 1);
-
-  return true;
+  const KevsToken t = scanner_take(self, kind, end + 1);
+  return scanner_check_utf8(self, t) && scanner_emit(self, t);
 }
 
 static bool scan_raw_string(Scanner *self) {
-  const int end =
+  const int64_t end =
       str_index_char(str_slice_low(self->content, 1), kRawStringBegin);
   if (end == -1) {
     scan_errorf(self, "raw string value does not end with backtick");
@@ -698,11 +1483,13 @@ static bool scan_raw_string(Scanner *self) {
   }
 
   // +2 for leading and trailing quotes
-  scanner_append(self, KevsTokenKindValue, end + 2);
+  const KevsToken t = scanner_take(self, KevsTokenKindValue, end + 2);
+  if (!scanner_check_utf8(self, t) || !scanner_emit(self, t)) {
+    return false;
+  }
 
   // count newlines in raw string to keep line count accurate
-  self->line +=
-      (int)str_count_char(self->tokens->ptr[self->tokens->len - 1].value, '\n');
+  self->line += str_count_char(t.value, '\n');
 
   return true;
 }
@@ -711,23 +1498,83 @@ static bool scan_int_or_bool_value(Scanner *self) {
   // search for all possible value endings
   // if semicolon(or none of them) is not found => error
   char c = 0;
-  const int i = str_index_any(self->content, kevs_str_from_cstr(";]}\n"), &c);
+  const int64_t i =
+      str_index_any(self->content, kevs_str_from_cstr(";]}\n"), &c);
   if (c != kKeyValEnd) {
     scan_errorf(self, "integer or boolean value does not end with semicolon");
     return false;
   }
-  scanner_append(self, KevsTokenKindValue, i);
-  return true;
+  return scanner_append(self, KevsTokenKindValue, i);
+}
+
+static bool scan_value_end(Scanner *self) {
+  if (!scanner_expect(self, kKeyValEnd)) {
+    scan_errorf(self, "value does not end with semicolon");
+    return false;
+  }
+  return scanner_append_delim(self);
+}
+
+static const char *kInclude = "include";
+
+// Check for `include "path";`, only recognized with KevsOpts.include.
+static bool scanner_is_include(const Scanner *self) {
+  const size_t n = strlen(kInclude);
+  if (self->opts.include == NULL || self->events != NULL ||
+      self->content.len <= n || memcmp(self->content.ptr, kInclude, n) != 0) {
+    return false;
+  }
+  const KevsStr rest = str_trim_left(str_slice_low(self->content, n),
+                                     kevs_str_from_cstr(spaces));
+  // a key named include is followed by the separator instead
+  return rest.len != self->content.len - n &&
+         str_starts_with_char(rest, kStringBegin);
 }
 
-static bool scan_list_value(Scanner *self) {
-  scanner_append_delim(self);
+// The path is emitted as an include token, followed by the value end.
+static bool scan_include(Scanner *self) {
+  scanner_advance(self, strlen(kInclude));
+  scanner_trim_space(self);
+  return scan_string(self, KevsTokenKindInclude) && scan_value_end(self);
+}
+
+// Scan entries of the root table, nested lists and tables are tracked on
+// an explicit stack instead of recursion.
+static bool scanner_run(Scanner *self) {
+  const KevsOpts opts = self->opts;
+  if (opts.max_input_bytes != 0 && self->content.len > opts.max_input_bytes) {
+    scan_errorf(self, "input is larger than %zu bytes", opts.max_input_bytes);
+    return false;
+  }
+  // values are C strings, a NUL would cut them short
+  const char *nul = memchr(self->content.ptr, '\0', self->content.len);
+  if (nul != NULL) {
+    self->line += str_count_char(
+        str_slice(self->content, 0, (size_t)(nul - self->content.ptr)), '\n');
+    scan_errorf(self, "input contains a NUL byte");
+    return false;
+  }
+
+  self->stack.len = 0;
+  scan_stack_push(&self->stack, (ScanFrame){});
+
   while (true) {
+    const ScanFrame top = self->stack.ptr[self->stack.len - 1];
+
+    // the root ends only after a line or an entry, trailing spaces are
+    // scanned as a key below and rejected
+    if (top.end == 0 && self->content.len == 0) {
+      return true;
+    }
     scanner_trim_space(self);
-    if (self->content.len == 0) {
+    if (self->content.len == 0 && top.end == kListEnd) {
       scan_errorf(self, "end of input without list end");
       return false;
     }
+    if (self->content.len == 0 && top.end == kTableEnd) {
+      scan_errorf(self, "end of input without table end");
+      return false;
+    }
     if (scanner_expect(self, '\n')) {
       if (!scan_newline(self)) {
         return false;
@@ -740,124 +1587,141 @@ static bool scan_list_value(Scanner *self) {
       }
       continue;
     }
-    if (scanner_expect(self, kListEnd)) {
-      scanner_append_delim(self);
-      return true;
-    }
-    if (!scan_value(self)) {
-      return false;
+    if (top.end != 0 && scanner_expect(self, top.end)) {
+      if (!scanner_append_end(self, top.begin)) {
+        return false;
+      }
+      self->stack.len--;
+      if (!scan_value_end(self)) {
+        return false;
+      }
+      continue;
     }
-    if (scanner_expect(self, kListEnd)) {
-      scanner_append_delim(self);
-      return true;
+
+    if (top.end != kListEnd) {
+      const size_t keys = ++self->stack.ptr[self->stack.len - 1].keys;
+      if (opts.max_table_keys != 0 && keys > opts.max_table_keys) {
+        scan_errorf(self, "table has more than %zu keys", opts.max_table_keys);
+        return false;
+      }
+      if (scanner_is_include(self)) {
+        if (!scan_include(self)) {
+          return false;
+        }
+        continue;
+      }
+      if (!scan_key(self)) {
+        return false;
+      }
+      // separator check done in scan_key, no need to check again
+      if (!scanner_append_delim(self)) {
+        return false;
+      }
     }
-  }
-  return true;
-}
 
-static bool scan_table_value(Scanner *self) {
-  scanner_append_delim(self);
-  while (true) {
     scanner_trim_space(self);
-    if (self->content.len == 0) {
-      scan_errorf(self, "end of input without table end");
-      return false;
-    }
-    if (scanner_expect(self, '\n')) {
-      if (!scan_newline(self)) {
+    if (scanner_expect(self, kListBegin) || scanner_expect(self, kTableBegin)) {
+      const ScanFrame frame = {
+          .begin = scanner_index(self),
+          .end = (scanner_expect(self, kListBegin) ? kListEnd : kTableEnd),
+      };
+      if (opts.max_depth != 0 && self->stack.len > opts.max_depth) {
+        scan_errorf(self, "nesting is deeper than %zu", opts.max_depth);
         return false;
       }
-      continue;
-    }
-    if (scanner_expect(self, kCommentBegin)) {
-      if (!scan_comment(self)) {
+      if (!scanner_append_delim(self)) {
         return false;
       }
+      scan_stack_push(&self->stack, frame);
       continue;
     }
-    if (scanner_expect(self, kTableEnd)) {
-      scanner_append_delim(self);
-      return true;
+
+    bool ok = false;
+    if (scanner_expect(self, kStringBegin)) {
+      ok = scan_string(self, KevsTokenKindValue);
+    } else if (scanner_expect(self, kRawStringBegin)) {
+      ok = scan_raw_string(self);
+    } else {
+      ok = scan_int_or_bool_value(self);
     }
-    if (!scan_key_value(self)) {
+    if (!ok || !scan_value_end(self)) {
       return false;
     }
-    if (scanner_expect(self, kTableEnd)) {
-      scanner_append_delim(self);
-      return true;
-    }
   }
-  return true;
 }
 
-static bool scan_value(Scanner *self) {
-  scanner_trim_space(self);
-  bool ok = false;
-  if (scanner_expect(self, kListBegin)) {
-    ok = scan_list_value(self);
-  } else if (scanner_expect(self, kTableBegin)) {
-    ok = scan_table_value(self);
-  } else if (scanner_expect(self, kStringBegin)) {
-    ok = scan_string_value(self);
-  } else if (scanner_expect(self, kRawStringBegin)) {
-    ok = scan_raw_string(self);
-  } else {
-    ok = scan_int_or_bool_value(self);
-  }
+// Scan with a stack which is kept by the caller for reuse.
+static KevsError scan_with_stack(KevsTokens *tokens, ScanStack *stack,
+                                 KevsStr content, char *err_buf,
+                                 size_t err_buf_len, KevsOpts opts) {
+  Scanner s = {
+      .opts = opts,
+      .tokens = tokens,
+      .line = 1,
+      .err_buf = err_buf,
+      .err_buf_len = err_buf_len,
+      .content = content,
+      .input = content.ptr,
+      .stack = *stack,
+  };
+  const bool ok = scanner_run(&s);
+  *stack = s.stack;
   if (!ok) {
-    return false;
-  }
-  if (!scan_delim(self, kKeyValEnd)) {
-    scan_errorf(self, "value does not end with semicolon");
-    return false;
-  }
-  return true;
-}
-
-static bool scan_key_value(Scanner *self) {
-  if (!scan_key(self)) {
-    return false;
-  }
-
-  // separator check done in scan_key, no need to check again
-  scanner_append_delim(self);
-
-  if (!scan_value(self)) {
-    return false;
+    return s.err_buf;
   }
-
-  return true;
+  return NULL;
 }
 
 KevsError scan(KevsTokens *tokens, KevsStr content, char *err_buf,
                size_t err_buf_len, KevsOpts opts) {
+  ScanStack stack = {};
+  KevsError err =
+      scan_with_stack(tokens, &stack, content, err_buf, err_buf_len, opts);
+  free(stack.ptr);
+  return err;
+}
+
+KevsError kevs_parse_events(KevsStr content, const KevsEvents *events,
+                            void *ctx, char *err_buf, size_t err_buf_len,
+                            KevsOpts opts) {
+  assert(err_buf_len != 0);
+  assert(err_buf != NULL);
+
   Scanner s = {
       .opts = opts,
-      .tokens = tokens,
       .line = 1,
       .err_buf = err_buf,
       .err_buf_len = err_buf_len,
       .content = content,
+      .input = content.ptr,
+      .events = events,
+      .ctx = ctx,
   };
-  while (s.content.len != 0) {
-    scanner_trim_space(&s);
-    bool ok = false;
-    if (scanner_expect(&s, '\n')) {
-      ok = scan_newline(&s);
-    } else if (scanner_expect(&s, kCommentBegin)) {
-      ok = scan_comment(&s);
-    } else {
-      ok = scan_key_value(&s);
-    }
-    if (!ok) {
-      return s.err_buf;
-    }
+  const bool ok = scanner_run(&s);
+  free(s.stack.ptr);
+  if (ok) {
+    return NULL;
   }
-  return NULL;
+
+  if (s.stopped) {
+    snprintf(err_buf, err_buf_len, "stopped by event callback");
+  } else if (events->error != NULL) {
+    events->error(ctx, err_buf);
+  }
+
+  return err_buf;
+}
+
+// Capacity after growing from cap, computed in size_t and limited to the
+// uint32_t cap of lists and tables. Callers check len < UINT32_MAX first.
+static size_t storage_grow(size_t cap) {
+  const size_t grown = (cap + 1) * 2;
+  return grown > UINT32_MAX ? UINT32_MAX : grown;
 }
 
 static void list_reserve(KevsList *self, size_t cap) {
-  self->cap = cap;
+  assert(cap <= UINT32_MAX);
+  self->cap = (uint32_t)cap;
   KevsValue *ptr = realloc(self->ptr, cap * sizeof(KevsValue));
   assert(ptr != NULL);
   self->ptr = ptr;
@@ -865,14 +1729,15 @@ static void list_reserve(KevsList *self, size_t cap) {
 
 static void list_append(KevsList *self, KevsValue v) {
   if (self->len == self->cap) {
-    list_reserve(self, (self->cap + 1) * 2);
+    list_reserve(self, storage_grow(self->cap));
   }
   memcpy(self->ptr + self->len, &v, sizeof(v));
   self->len += 1;
 }
 
 static void table_reserve(KevsTable *self, size_t cap) {
-  self->cap = cap;
+  assert(cap <= UINT32_MAX);
+  self->cap = (uint32_t)cap;
   KevsKeyValue *ptr = realloc(self->ptr, cap * sizeof(KevsKeyValue));
   assert(ptr != NULL);
   self->ptr = ptr;
@@ -880,75 +1745,546 @@ static void table_reserve(KevsTable *self, size_t cap) {
 
 static void table_append(KevsTable *self, KevsKeyValue v) {
   if (self->len == self->cap) {
-    table_reserve(self, (self->cap + 1) * 2);
+    table_reserve(self, storage_grow(self->cap));
   }
   memcpy(self->ptr + self->len, &v, sizeof(v));
   self->len += 1;
 }
 
-typedef struct {
-  KevsOpts opts;
-  KevsTokens tokens;
-  KevsTable *table;
-  size_t i;
-  char *err_buf;
-  size_t err_buf_len;
-  KevsStr content;
-} Parser;
-
-static bool parse_value(Parser *self, KevsValue *out);
-static bool parse_key_value(Parser *self, KevsTable parent, KevsKeyValue *out);
-
-static KevsToken parser_get(const Parser *self) {
-  return self->tokens.ptr[self->i];
+static void arena_list_reserve(ArenaBlock **arena, KevsList *self,
+                               size_t cap) {
+  assert(cap <= UINT32_MAX);
+  KevsValue *ptr = arena_alloc(arena, cap * sizeof(KevsValue));
+  if (self->len != 0) {
+    memcpy(ptr, self->ptr, self->len * sizeof(KevsValue));
+  }
+  self->cap = (uint32_t)cap;
+  self->ptr = ptr;
 }
 
-static void parser_pop(Parser *self) { self->i++; }
-
-static void parse_errorf(const Parser *self, const char *fmt, ...) {
-  char *ptr = self->err_buf;
-  size_t len = self->err_buf_len;
-
-  int n = 0;
+static void arena_list_append(ArenaBlock **arena, KevsList *self,
+                              KevsValue v) {
+  if (self->len == self->cap) {
+    arena_list_reserve(arena, self, storage_grow(self->cap));
+  }
+  memcpy(self->ptr + self->len, &v, sizeof(v));
+  self->len += 1;
+}
 
-  if (self->opts.errors_with_file_and_line) {
-    n = snprintf(ptr, len, "%s:%d: ", self->opts.file.ptr,
-                 parser_get(self).line);
-    assert(n >= 0);
-    assert((size_t)n < len);
-    ptr += n;
-    len -= n;
+static void arena_table_reserve(ArenaBlock **arena, KevsTable *self,
+                                size_t cap) {
+  assert(cap <= UINT32_MAX);
+  KevsKeyValue *ptr = arena_alloc(arena, cap * sizeof(KevsKeyValue));
+  if (self->len != 0) {
+    memcpy(ptr, self->ptr, self->len * sizeof(KevsKeyValue));
   }
+  self->cap = (uint32_t)cap;
+  self->ptr = ptr;
+}
 
-  n = snprintf(ptr, len, "parse: ");
-  assert(n >= 0);
-  assert((size_t)n < len);
-  ptr += n;
-  len -= n;
+static void arena_table_append(ArenaBlock **arena, KevsTable *self,
+                               KevsKeyValue v) {
+  if (self->len == self->cap) {
+    arena_table_reserve(arena, self, storage_grow(self->cap));
+  }
+  memcpy(self->ptr + self->len, &v, sizeof(v));
+  self->len += 1;
+}
 
-  va_list args;
-  va_start(args, fmt);
-  n = vsnprintf(ptr, len, fmt, args);
-  va_end(args);
+// Hash: structural hashes of values, see kevs_hash.
+//
+// The functions are fixed so hashes can be compared across builds and hosts:
+// words are read little endian and nothing depends on addresses or seeds.
+
+static const uint64_t kHashMul = 0x9e3779b97f4a7c15;
+
+// stirs in the kind, so equal payloads of different kinds differ
+static const uint64_t kHashString = 0x1f8a3c5e7b9d2460;
+static const uint64_t kHashInteger = 0x2e4b6d8f1a3c5e70;
+static const uint64_t kHashBoolean = 0x3d5f7b9e2c4a6e81;
+static const uint64_t kHashList = 0x4c6e8a1d3f5b7d92;
+static const uint64_t kHashTable = 0x5b7d9f2e4a6c8ea3;
+
+// splitmix64 finalizer
+static inline uint64_t hash_mix(uint64_t x) {
+  x ^= x >> 30;
+  x *= 0xbf58476d1ce4e5b9;
+  x ^= x >> 27;
+  x *= 0x94d049bb133111eb;
+  x ^= x >> 31;
+  return x;
+}
 
-  assert(n >= 0);
-  assert((size_t)n < len);
-  ptr += n;
-  len -= n;
+static inline uint64_t hash_rotl(uint64_t x, int n) {
+  return (x << n) | (x >> (64 - n));
+}
 
-  if (self->opts.abort_on_error) {
-    printf("%s\n", self->err_buf);
-    abort();
-  }
+static inline uint64_t hash_word(const char *p) {
+  uint64_t w = 0;
+  memcpy(&w, p, 8);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  w = __builtin_bswap64(w);
+#endif
+  return w;
 }
 
-static bool parser_expect(const Parser *self, KevsTokenKind kind) {
-  if (self->i >= self->tokens.len) {
-    parse_errorf(self, "expected token '%s', have nothing",
-                 tokenkind_str(kind));
-    return false;
+// Eight bytes per step, unlike the FNV-1a of str_hash.
+static uint64_t hash_bytes(KevsStr s) {
+  uint64_t h = (uint64_t)s.len * kHashMul;
+  size_t i = 0;
+  for (; i + 8 <= s.len; i += 8) {
+    h = hash_rotl(h ^ hash_mix(hash_word(s.ptr + i)), 27) * kHashMul;
   }
-  return parser_get(self).kind == kind;
+  if (i < s.len) {
+    uint64_t w = 0;
+    for (size_t j = 0; i + j < s.len; j++) {
+      w |= (uint64_t)(uint8_t)s.ptr[i + j] << (8 * j);
+    }
+    h = hash_rotl(h ^ hash_mix(w), 27) * kHashMul;
+  }
+  return hash_mix(h);
+}
+
+static uint64_t hash_scalar(KevsValue v) {
+  switch (v.kind) {
+  case KevsValueKindString:
+    return hash_mix(hash_bytes(kevs_str_from_cstr(v.data.string)) ^
+                    kHashString);
+  case KevsValueKindInteger:
+    return hash_mix((uint64_t)v.data.integer ^ kHashInteger);
+  case KevsValueKindBoolean:
+    return hash_mix((uint64_t)v.data.boolean ^ kHashBoolean);
+  default:
+    return 0;
+  }
+}
+
+// Lists hash their elements in order.
+static inline uint64_t hash_list_step(uint64_t h, uint64_t elem) {
+  return hash_rotl(h ^ elem, 31) * kHashMul;
+}
+
+static inline uint64_t hash_list_final(uint64_t h, size_t len) {
+  return hash_mix(h ^ kHashList ^ ((uint64_t)len * kHashMul));
+}
+
+// Tables add up the hashes of their entries, so key order doesn't matter.
+static inline uint64_t hash_entry(KevsStr key, uint64_t val) {
+  return hash_mix(hash_bytes(key) ^ hash_rotl(val, 32));
+}
+
+static inline uint64_t hash_table_final(uint64_t sum, size_t len) {
+  return hash_mix(sum ^ kHashTable ^ ((uint64_t)len * kHashMul));
+}
+
+// Lists and tables shorter than this are cheaper to walk than to look up,
+// their parents are cached if they're big enough.
+static const size_t kHashCacheMin = 8;
+
+typedef struct KevsHashEntry {
+  // storage of a list or table, NULL marks an empty slot
+  const void *ptr;
+  size_t len;
+  uint64_t hash;
+} HashEntry;
+
+static size_t hashes_slot(const void *ptr, size_t mask) {
+  return (size_t)hash_mix((uint64_t)(uintptr_t)ptr) & mask;
+}
+
+static bool hashes_get(const KevsHashes *self, const void *ptr, size_t len,
+                       uint64_t *out) {
+  if (self == NULL || self->len == 0 || len < kHashCacheMin) {
+    return false;
+  }
+  const size_t mask = self->cap - 1;
+  for (size_t i = hashes_slot(ptr, mask);; i = (i + 1) & mask) {
+    const HashEntry *e = &self->ptr[i];
+    if (e->ptr == NULL) {
+      return false;
+    }
+    if (e->ptr == ptr && e->len == len) {
+      *out = e->hash;
+      return true;
+    }
+  }
+}
+
+// Returns whether v took an empty slot.
+static bool hashes_insert(HashEntry *entries, size_t mask, HashEntry v) {
+  size_t i = hashes_slot(v.ptr, mask);
+  while (entries[i].ptr != NULL && entries[i].ptr != v.ptr) {
+    i = (i + 1) & mask;
+  }
+  const bool added = entries[i].ptr == NULL;
+  entries[i] = v;
+  return added;
+}
+
+static void hashes_put(KevsHashes *self, const void *ptr, size_t len,
+                       uint64_t hash) {
+  if (len < kHashCacheMin) {
+    return;
+  }
+  // at most half full
+  if ((self->len + 1) * 2 > self->cap) {
+    const size_t cap = self->cap == 0 ? 64 : self->cap * 2;
+    HashEntry *entries = calloc(cap, sizeof(HashEntry));
+    assert(entries != NULL);
+    for (size_t i = 0; i < self->cap; i++) {
+      if (self->ptr[i].ptr != NULL) {
+        hashes_insert(entries, cap - 1, self->ptr[i]);
+      }
+    }
+    free(self->ptr);
+    self->ptr = entries;
+    self->cap = cap;
+  }
+  if (hashes_insert(self->ptr, self->cap - 1, (HashEntry){ptr, len, hash})) {
+    self->len++;
+  }
+}
+
+static bool hashes_get_value(const KevsHashes *self, KevsValue v,
+                             uint64_t *out) {
+  if (v.kind == KevsValueKindList) {
+    return hashes_get(self, v.data.list.ptr, v.data.list.len, out);
+  }
+  if (v.kind == KevsValueKindTable) {
+    return hashes_get(self, v.data.table.ptr, v.data.table.len, out);
+  }
+  return false;
+}
+
+typedef struct {
+  KevsValue val;
+  size_t i;
+  uint64_t hash;
+} HashFrame;
+
+typedef struct {
+  HashFrame *ptr;
+  size_t cap;
+  size_t len;
+} HashStack;
+
+static void hash_stack_push(HashStack *self, KevsValue val) {
+  if (self->len == self->cap) {
+    self->cap = self->cap == 0 ? 16 : self->cap * 2;
+    self->ptr = realloc(self->ptr, self->cap * sizeof(HashFrame));
+    assert(self->ptr != NULL);
+  }
+  self->ptr[self->len++] = (HashFrame){.val = val};
+}
+
+// Hash of v, lists and tables found in lookup are not walked again,
+// the others are added to store if it's set.
+static uint64_t hash_value(KevsValue v, const KevsHashes *lookup,
+                           KevsHashes *store) {
+  uint64_t h = 0;
+  if (v.kind != KevsValueKindList && v.kind != KevsValueKindTable) {
+    return hash_scalar(v);
+  }
+  if (hashes_get_value(lookup, v, &h)) {
+    return h;
+  }
+
+  HashStack stack = {};
+  hash_stack_push(&stack, v);
+  while (true) {
+    HashFrame *top = &stack.ptr[stack.len - 1];
+    const bool is_table = top->val.kind == KevsValueKindTable;
+    const size_t len =
+        is_table ? top->val.data.table.len : top->val.data.list.len;
+
+    if (top->i == len) {
+      // finished, fold into the parent
+      if (is_table) {
+        h = hash_table_final(top->hash, len);
+        if (store != NULL) {
+          hashes_put(store, top->val.data.table.ptr, len, h);
+        }
+      } else {
+        h = hash_list_final(top->hash, len);
+        if (store != NULL) {
+          hashes_put(store, top->val.data.list.ptr, len, h);
+        }
+      }
+      if (--stack.len == 0) {
+        break;
+      }
+      top = &stack.ptr[stack.len - 1];
+    } else {
+      // next element, nested lists and tables get a frame of their own
+      KevsValue elem = {};
+      if (is_table) {
+        elem = top->val.data.table.ptr[top->i].val;
+      } else {
+        kevs_list_value(top->val.data.list, top->i, &elem);
+      }
+      if ((elem.kind == KevsValueKindList ||
+           elem.kind == KevsValueKindTable) &&
+          !hashes_get_value(lookup, elem, &h)) {
+        hash_stack_push(&stack, elem);
+        continue;
+      }
+      if (elem.kind != KevsValueKindList && elem.kind != KevsValueKindTable) {
+        h = hash_scalar(elem);
+      }
+    }
+
+    // h is the hash of element i of top
+    if (top->val.kind == KevsValueKindTable) {
+      top->hash += hash_entry(top->val.data.table.ptr[top->i].key, h);
+    } else {
+      top->hash = hash_list_step(top->hash, h);
+    }
+    top->i++;
+  }
+  free(stack.ptr);
+
+  return h;
+}
+
+typedef struct KevsParseFrame {
+  // list or table being built
+  KevsValue val;
+  // key of val in the parent table, empty in lists
+  KevsStr key;
+  // elements so far, see KevsOpts.hashes
+  uint64_t hash;
+} ParseFrame;
+
+typedef struct {
+  ParseFrame *ptr;
+  size_t cap;
+  size_t len;
+} ParseStack;
+
+typedef struct {
+  KevsOpts opts;
+  KevsTokens tokens;
+  KevsTable *table;
+  size_t i;
+  char *err_buf;
+  size_t err_buf_len;
+  KevsStr content;
+  // used only with opts.intern_keys
+  ArenaBlock *arena;
+  Symbols symbols;
+  // lists and tables being built, reused across runs
+  ParseStack stack;
+  // token index of the next progress callback
+  size_t progress_at;
+  // used only with opts.hashes, moved there once the document is done
+  KevsHashes hashes;
+  uint64_t root_hash;
+} Parser;
+
+static bool parser_use_arena(const Parser *self) {
+  return self->opts.intern_keys;
+}
+
+static void parser_value_free(const Parser *self, KevsValue *v) {
+  if (parser_use_arena(self)) {
+    // released with the arena
+    *v = (KevsValue){};
+  } else {
+    value_free(v);
+  }
+}
+
+// Fold the hash h of a value about to be added into its list or table.
+static void parser_hash_fold(Parser *self, KevsStr key, uint64_t h) {
+  if (self->stack.len == 0) {
+    self->root_hash += hash_entry(key, h);
+    return;
+  }
+  ParseFrame *top = &self->stack.ptr[self->stack.len - 1];
+  if (top->val.kind == KevsValueKindList) {
+    top->hash = hash_list_step(top->hash, h);
+  } else {
+    top->hash += hash_entry(key, h);
+  }
+}
+
+static void parser_hash_add(Parser *self, KevsKeyValue kv) {
+  if (self->opts.hashes != NULL) {
+    parser_hash_fold(self, kv.key,
+                     hash_value(kv.val, &self->hashes, &self->hashes));
+  }
+}
+
+// Cache the hash of a finished list or table and fold it into the parent,
+// f is already off the stack.
+static void parser_hash_frame(Parser *self, const ParseFrame *f) {
+  if (self->opts.hashes == NULL) {
+    return;
+  }
+  uint64_t h = 0;
+  if (f->val.kind == KevsValueKindList) {
+    const KevsList l = f->val.data.list;
+    h = hash_list_final(f->hash, l.len);
+    hashes_put(&self->hashes, l.ptr, l.len, h);
+  } else {
+    const KevsTable t = f->val.data.table;
+    h = hash_table_final(f->hash, t.len);
+    hashes_put(&self->hashes, t.ptr, t.len, h);
+  }
+  parser_hash_fold(self, f->key, h);
+}
+
+// Hand the hashes of a finished document to opts.hashes.
+static void parser_hash_finish(Parser *self, KevsTable table) {
+  KevsHashes *dst = self->opts.hashes;
+  if (dst == NULL) {
+    return;
+  }
+  hashes_put(&self->hashes, table.ptr, table.len,
+             hash_table_final(self->root_hash, table.len));
+  if (dst->len == 0) {
+    free(dst->ptr);
+    *dst = self->hashes;
+  } else {
+    for (size_t i = 0; i < self->hashes.cap; i++) {
+      const HashEntry e = self->hashes.ptr[i];
+      if (e.ptr != NULL) {
+        hashes_put(dst, e.ptr, e.len, e.hash);
+      }
+    }
+    free(self->hashes.ptr);
+  }
+  self->hashes = (KevsHashes){};
+}
+
+static KevsError parser_str_norm(Parser *self, KevsStr s, char **out) {
+  String dst = {};
+  if (parser_use_arena(self)) {
+    dst.ptr = arena_alloc(&self->arena, s.len + 1);
+    dst.cap = s.len;
+    dst.ptr[0] = 0;
+  } else {
+    string_reserve(&dst, s.len);
+  }
+
+  KevsError err = str_norm(s, &dst);
+  if (err != NULL) {
+    if (!parser_use_arena(self)) {
+      free(dst.ptr);
+    }
+    return err;
+  }
+
+  // escape sequences are longer than what they stand for
+  if (dst.len < dst.cap) {
+    if (parser_use_arena(self)) {
+      arena_trim(&self->arena, dst.ptr, dst.cap + 1, dst.len + 1);
+    } else {
+      char *ptr = realloc(dst.ptr, dst.len + 1);
+      assert(ptr != NULL);
+      dst.ptr = ptr;
+    }
+  }
+
+  *out = dst.ptr;
+
+  return NULL;
+}
+
+static char *parser_str_dup(Parser *self, KevsStr s) {
+  if (parser_use_arena(self)) {
+    return arena_str_dup(&self->arena, s);
+  }
+  return kevs_str_dup(s);
+}
+
+static KevsToken parser_get(const Parser *self) {
+  return self->tokens.ptr[self->i];
+}
+
+static void parser_pop(Parser *self) { self->i++; }
+
+static void parse_errorf(const Parser *self, const char *fmt, ...) {
+  char *ptr = self->err_buf;
+  size_t len = self->err_buf_len;
+
+  int n = 0;
+
+  if (self->opts.errors_with_file_and_line) {
+    // tokens don't keep their line, it's needed only here. Errors after the
+    // last value end point at that token.
+    size_t offset = 0;
+    if (self->tokens.len != 0) {
+      const size_t i =
+          (self->i < self->tokens.len ? self->i : self->tokens.len - 1);
+      offset = (size_t)(self->tokens.ptr[i].value.ptr - self->content.ptr);
+    }
+    const size_t line =
+        1 + str_count_char(str_slice(self->content, 0, offset), '\n');
+    n = snprintf(ptr, len, "%s:%zu: ", self->opts.file.ptr, line);
+    assert(n >= 0);
+    assert((size_t)n < len);
+    ptr += n;
+    len -= n;
+  }
+
+  n = snprintf(ptr, len, "parse: ");
+  assert(n >= 0);
+  assert((size_t)n < len);
+  ptr += n;
+  len -= n;
+
+  va_list args;
+  va_start(args, fmt);
+  n = vsnprintf(ptr, len, fmt, args);
+  va_end(args);
+
+  assert(n >= 0);
+  assert((size_t)n < len);
+  ptr += n;
+  len -= n;
+
+  if (self->opts.abort_on_error) {
+    printf("%s\n", self->err_buf);
+    abort();
+  }
+}
+
+// false if the list is full, lengths are stored as uint32_t
+static bool parser_list_append(Parser *self, KevsList *list, KevsValue v) {
+  if (list->len == UINT32_MAX) {
+    parse_errorf(self, "list has more than %zu elements", (size_t)UINT32_MAX);
+    return false;
+  }
+  if (parser_use_arena(self)) {
+    arena_list_append(&self->arena, list, v);
+  } else {
+    list_append(list, v);
+  }
+  return true;
+}
+
+static bool parser_table_append(Parser *self, KevsTable *table,
+                                KevsKeyValue kv) {
+  if (table->len == UINT32_MAX) {
+    parse_errorf(self, "table has more than %zu keys", (size_t)UINT32_MAX);
+    return false;
+  }
+  if (parser_use_arena(self)) {
+    arena_table_append(&self->arena, table, kv);
+  } else {
+    table_append(table, kv);
+  }
+  return true;
+}
+
+static bool parser_expect(const Parser *self, KevsTokenKind kind) {
+  if (self->i >= self->tokens.len) {
+    parse_errorf(self, "expected token '%s', have nothing",
+                 tokenkind_str(kind));
+    return false;
+  }
+  return parser_get(self).kind == kind;
 }
 
 static bool parser_expect_delim(const Parser *self, char delim) {
@@ -966,391 +2302,3711 @@ static bool parse_delim(Parser *self, char c) {
   return true;
 }
 
-static bool parse_list_value(Parser *self, KevsValue *out) {
-  out->kind = KevsValueKindList;
-
-  parser_pop(self);
+static void *parser_alloc(Parser *self, size_t size) {
+  if (parser_use_arena(self)) {
+    return arena_alloc(&self->arena, size);
+  }
+  void *ptr = malloc(size);
+  assert(ptr != NULL);
+  return ptr;
+}
 
-  while (true) {
-    if (parse_delim(self, kListEnd)) {
-      return true;
+// Store a list with only integers or only booleans as a packed array.
+// Returns false without consuming any token if the list doesn't qualify,
+// invalid values are then reported by the generic path.
+static bool parse_packed_list(Parser *self, KevsList *out) {
+  const KevsTokens tokens = self->tokens;
+
+  // lists which qualify are a sequence of: value ';', followed by ']'
+  bool ints = true;
+  bool bools = true;
+  size_t n = 0;
+  for (size_t i = self->i;; i += 2) {
+    if (i >= tokens.len) {
+      return false;
     }
-
-    KevsValue v = {};
-    if (!parse_value(self, &v)) {
+    const KevsToken tok = tokens.ptr[i];
+    if (tok.kind == KevsTokenKindDelim &&
+        str_equals_char(tok.value, kListEnd)) {
+      break;
+    }
+    if (tok.kind != KevsTokenKindValue || tok.value.len == 0 ||
+        i + 1 >= tokens.len ||
+        !str_equals_char(tokens.ptr[i + 1].value, kKeyValEnd)) {
       return false;
     }
-    list_append(&out->data.list, v);
+    const char c = tok.value.ptr[0];
+    if (c == kStringBegin || c == kRawStringBegin) {
+      return false;
+    }
+    const bool is_bool = str_equals(tok.value, kevs_str_from_cstr("true")) ||
+                         str_equals(tok.value, kevs_str_from_cstr("false"));
+    ints = ints && !is_bool;
+    bools = bools && is_bool;
+    if (!ints && !bools) {
+      return false;
+    }
+    n++;
+  }
+  if (n == 0 || n > UINT32_MAX) {
+    return false;
+  }
 
-    if (parse_delim(self, kListEnd)) {
-      return true;
+  void *ptr = NULL;
+  if (ints) {
+    int64_t *v = parser_alloc(self, n * sizeof(int64_t));
+    for (size_t j = 0; j < n; j++) {
+      const KevsStr val = tokens.ptr[self->i + 2 * j].value;
+      if (!str_to_int_fast(val, &v[j]) && str_to_int(val, 0, &v[j]) != NULL) {
+        if (!parser_use_arena(self)) {
+          free(v);
+        }
+        return false;
+      }
+    }
+    out->flags |= KevsFlagPackedInts;
+    ptr = v;
+  } else {
+    const size_t words = (n + 63) / 64;
+    uint64_t *v = parser_alloc(self, words * sizeof(uint64_t));
+    memset(v, 0, words * sizeof(uint64_t));
+    for (size_t j = 0; j < n; j++) {
+      // values are "true" or "false"
+      if (tokens.ptr[self->i + 2 * j].value.ptr[0] == 't') {
+        v[j / 64] |= (uint64_t)1 << (j % 64);
+      }
     }
+    out->flags |= KevsFlagPackedBools;
+    ptr = v;
   }
 
+  out->ptr = ptr;
+  out->cap = (uint32_t)n;
+  out->len = n;
+
+  // skip values and separators, stop at list end
+  self->i += 2 * n;
+
   return true;
 }
 
-static bool parse_table_value(Parser *self, KevsValue *out) {
-  out->kind = KevsValueKindTable;
+static bool parse_simple_value(Parser *self, KevsValue *out) {
+  if (!parser_expect(self, KevsTokenKindValue)) {
+    parse_errorf(self, "expected value token");
+    return false;
+  }
 
-  parser_pop(self);
+  const KevsStr val = parser_get(self).value;
 
-  while (true) {
-    if (parse_delim(self, kTableEnd)) {
-      return true;
-    }
+  bool ok = true;
 
-    KevsKeyValue kv = {};
-    if (!parse_key_value(self, out->data.table, &kv)) {
+  if (str_starts_with_char(val, kStringBegin)) {
+    char *data = NULL;
+    KevsError err =
+        parser_str_norm(self, str_slice(val, 1, val.len - 1), &data);
+    if (err != NULL) {
+      parse_errorf(self, "could not normalize string: %s", err);
       return false;
     }
-    table_append(&out->data.table, kv);
+    out->kind = KevsValueKindString;
+    out->data.string = data;
 
-    if (parse_delim(self, kTableEnd)) {
-      return true;
-    }
-  }
+  } else if (str_starts_with_char(val, kRawStringBegin)) {
+    out->kind = KevsValueKindString;
+    out->data.string = parser_str_dup(self, str_slice(val, 1, val.len - 1));
 
-  return true;
+  } else if (str_equals(val, kevs_str_from_cstr("true"))) {
+    out->kind = KevsValueKindBoolean;
+    out->data.boolean = true;
+
+  } else if (str_equals(val, kevs_str_from_cstr("false"))) {
+    out->kind = KevsValueKindBoolean;
+    out->data.boolean = false;
+
+  } else {
+    int64_t i = 0;
+    KevsError err = str_to_int(val, 0, &i);
+    if (err != NULL) {
+      char *s = kevs_str_dup(val);
+      parse_errorf(self, "value '%s' is not an integer: %s", s, err);
+      free(s);
+      ok = false;
+    } else {
+      out->kind = KevsValueKindInteger;
+      out->data.integer = i;
+    }
+  }
+
+  parser_pop(self);
+
+  return ok;
+}
+
+// Interned keys are compared by pointer.
+static bool parser_has_key(const Parser *self, KevsTable parent, KevsStr k) {
+  for (size_t i = 0; i < parent.len; i++) {
+    STATS_ADD(key_compares, 1);
+    const bool equals = (parser_use_arena(self)
+                             ? parent.ptr[i].key.ptr == k.ptr
+                             : str_equals(parent.ptr[i].key, k));
+    if (equals) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static bool parse_key(Parser *self, KevsTable parent, KevsStr *key) {
+  if (!parser_expect(self, KevsTokenKindKey)) {
+    parse_errorf(self, "expected key token");
+    return false;
+  }
+
+  const KevsToken tok = parser_get(self);
+
+  if (!is_identifier(tok.value)) {
+    char *s = kevs_str_dup(tok.value);
+    parse_errorf(self, "key is not a valid identifier: '%s'", s);
+    free(s);
+    return false;
+  }
+
+  KevsStr k = tok.value;
+  if (parser_use_arena(self)) {
+    k = symbols_intern(&self->symbols, &self->arena, k);
+  }
+
+  if (parser_has_key(self, parent, k)) {
+    char *s = kevs_str_dup(tok.value);
+    parse_errorf(self, "key '%s' is not unique for current table", s);
+    free(s);
+    return false;
+  }
+
+  *key = k;
+
+  parser_pop(self);
+
+  return true;
+}
+
+static void parser_push(Parser *self, ParseFrame v) {
+  ParseStack *stack = &self->stack;
+  if (stack->len == stack->cap) {
+    stack->cap = stack->cap == 0 ? 16 : stack->cap * 2;
+    stack->ptr = realloc(stack->ptr, stack->cap * sizeof(ParseFrame));
+    assert(stack->ptr != NULL);
+  }
+  stack->ptr[stack->len++] = v;
+}
+
+// Copy the storage of v, without its nested values, the way this parser
+// allocates. Lists and tables are pushed to have their entries copied.
+static void parser_copy_storage(Parser *self, KevsValue *v,
+                                StorageStack *stack) {
+  switch (v->kind) {
+  case KevsValueKindString:
+    v->data.string = parser_str_dup(self, kevs_str_from_cstr(v->data.string));
+    break;
+
+  case KevsValueKindList: {
+    KevsList *l = &v->data.list;
+    const size_t size = list_storage_size(*l, l->len);
+    void *ptr = (size == 0 ? NULL : parser_alloc(self, size));
+    if (size != 0) {
+      memcpy(ptr, l->ptr, size);
+    }
+    l->ptr = ptr;
+    l->cap = (uint32_t)l->len;
+    l->flags &= KevsFlagPackedInts | KevsFlagPackedBools;
+    if (parser_use_arena(self)) {
+      l->flags |= KevsFlagArena;
+    }
+    if (!list_is_packed(*l)) {
+      storage_stack_push(stack, l->ptr, l->len, false);
+    }
+  } break;
+
+  case KevsValueKindTable: {
+    KevsTable *t = &v->data.table;
+    const size_t size = t->len * sizeof(KevsKeyValue);
+    void *ptr = (size == 0 ? NULL : parser_alloc(self, size));
+    if (size != 0) {
+      memcpy(ptr, t->ptr, size);
+    }
+    t->ptr = ptr;
+    t->cap = (uint32_t)t->len;
+    t->flags = (parser_use_arena(self) ? KevsFlagArena | KevsFlagInterned : 0);
+    storage_stack_push(stack, t->ptr, t->len, true);
+  } break;
+
+  default:
+    break;
+  }
+}
+
+// Replace v, which belongs to another document, with a deep copy.
+// Keys are interned in arena documents, and shared otherwise.
+static void parser_copy_value(Parser *self, KevsValue *v) {
+  StorageStack stack = {};
+  parser_copy_storage(self, v, &stack);
+  while (stack.len != 0) {
+    StorageFrame *top = &stack.ptr[stack.len - 1];
+    if (top->i == top->len) {
+      stack.len--;
+      continue;
+    }
+    KevsValue *nested = NULL;
+    if (top->is_table) {
+      KevsKeyValue *kv = &((KevsKeyValue *)top->ptr)[top->i];
+      if (parser_use_arena(self)) {
+        kv->key = symbols_intern(&self->symbols, &self->arena, kv->key);
+      }
+      nested = &kv->val;
+    } else {
+      nested = &((KevsValue *)top->ptr)[top->i];
+    }
+    top->i++;
+    // may grow the stack, top is not used after this
+    parser_copy_storage(self, nested, &stack);
+  }
+  free(stack.ptr);
+}
+
+// Add the entries of the fragment returned by opts.include to parent.
+static bool parse_include(Parser *self, KevsTable *parent) {
+  const KevsStr raw = parser_get(self).value;
+
+  String path = {};
+  string_reserve(&path, raw.len);
+  KevsError err = str_norm(str_slice(raw, 1, raw.len - 1), &path);
+  if (err != NULL) {
+    parse_errorf(self, "could not normalize include path: %s", err);
+    free(path.ptr);
+    return false;
+  }
+
+  KevsTable fragment = {};
+  err = self->opts.include(self->opts.include_ctx, path.ptr, &fragment,
+                           self->err_buf, self->err_buf_len);
+  if (err != NULL) {
+    // the message may be in err_buf, which is written again below
+    char *msg = kevs_str_dup(kevs_str_from_cstr(err));
+    parse_errorf(self, "include '%s': %s", path.ptr, msg);
+    free(msg);
+    free(path.ptr);
+    return false;
+  }
+
+  for (size_t i = 0; i < fragment.len; i++) {
+    KevsKeyValue kv = fragment.ptr[i];
+    if (parser_use_arena(self)) {
+      kv.key = symbols_intern(&self->symbols, &self->arena, kv.key);
+    }
+    if (parser_has_key(self, *parent, kv.key)) {
+      char *s = kevs_str_dup(kv.key);
+      parse_errorf(self, "key '%s' from include '%s' is not unique", s,
+                   path.ptr);
+      free(s);
+      free(path.ptr);
+      return false;
+    }
+    parser_copy_value(self, &kv.val);
+    parser_hash_add(self, kv);
+    if (!parser_table_append(self, parent, kv)) {
+      parser_value_free(self, &kv.val);
+      free(path.ptr);
+      return false;
+    }
+  }
+  free(path.ptr);
+
+  parser_pop(self);
+  if (!parse_delim(self, kKeyValEnd)) {
+    parse_errorf(self, "missing include end");
+    return false;
+  }
+  return true;
+}
+
+// Check the value end and add the value to the innermost list or table.
+static bool parser_add(Parser *self, KevsTable *root, KevsKeyValue kv) {
+  if (!parse_delim(self, kKeyValEnd)) {
+    parse_errorf(self, "missing key value end");
+    parser_value_free(self, &kv.val);
+    return false;
+  }
+
+  bool ok = false;
+  KevsValue *top =
+      (self->stack.len == 0 ? NULL : &self->stack.ptr[self->stack.len - 1].val);
+  if (top == NULL) {
+    ok = parser_table_append(self, root, kv);
+  } else if (top->kind == KevsValueKindList) {
+    ok = parser_list_append(self, &top->data.list, kv.val);
+  } else {
+    ok = parser_table_append(self, &top->data.table, kv);
+  }
+  if (!ok) {
+    parser_value_free(self, &kv.val);
+  }
+  return ok;
+}
+
+// Parse entries of the root table, nested lists and tables are built on
+// an explicit stack instead of recursion.
+static bool parser_progress(Parser *self) {
+  const KevsOpts opts = self->opts;
+  if (opts.progress == NULL || self->i < self->progress_at ||
+      self->i >= self->tokens.len) {
+    return true;
+  }
+  self->progress_at = self->i + progress_interval(opts);
+  if (!opts.progress(opts.progress_ctx, self->i)) {
+    parse_errorf(self, "canceled by progress callback");
+    return false;
+  }
+  return true;
+}
+
+static bool parser_run(Parser *self, KevsTable *root) {
+  self->stack.len = 0;
+  self->progress_at = progress_interval(self->opts);
+  self->root_hash = 0;
+
+  while (true) {
+    if (!parser_progress(self)) {
+      return false;
+    }
+
+    const ParseFrame *top =
+        (self->stack.len == 0 ? NULL : &self->stack.ptr[self->stack.len - 1]);
+    const bool in_list = top != NULL && top->val.kind == KevsValueKindList;
+
+    if (top == NULL) {
+      if (self->i >= self->tokens.len) {
+        return true;
+      }
+    } else if (parse_delim(self, in_list ? kListEnd : kTableEnd)) {
+      const KevsKeyValue kv = {.key = top->key, .val = top->val};
+      self->stack.len--;
+      parser_hash_frame(self, top);
+      if (!parser_add(self, root, kv)) {
+        return false;
+      }
+      continue;
+    }
+
+    if (!in_list && self->i < self->tokens.len &&
+        parser_get(self).kind == KevsTokenKindInclude) {
+      KevsTable *parent = (top == NULL ? root
+                                       : &self->stack.ptr[self->stack.len - 1]
+                                              .val.data.table);
+      if (!parse_include(self, parent)) {
+        return false;
+      }
+      continue;
+    }
+
+    KevsKeyValue kv = {};
+    if (!in_list) {
+      const KevsTable parent = (top == NULL ? *root : top->val.data.table);
+      if (!parse_key(self, parent, &kv.key)) {
+        return false;
+      }
+      if (!parse_delim(self, kKeyValSep)) {
+        parse_errorf(self, "missing key value separator");
+        return false;
+      }
+    }
+
+    if (parser_expect_delim(self, kListBegin)) {
+      parser_pop(self);
+      kv.val.kind = KevsValueKindList;
+      if (parser_use_arena(self)) {
+        kv.val.data.list.flags = KevsFlagArena;
+      }
+      if (self->opts.pack_lists && parse_packed_list(self, &kv.val.data.list)) {
+        // skip list end
+        parser_pop(self);
+        parser_hash_add(self, kv);
+        if (!parser_add(self, root, kv)) {
+          return false;
+        }
+        continue;
+      }
+      parser_push(self, (ParseFrame){.val = kv.val, .key = kv.key});
+      continue;
+    }
+
+    if (parser_expect_delim(self, kTableBegin)) {
+      parser_pop(self);
+      kv.val.kind = KevsValueKindTable;
+      if (parser_use_arena(self)) {
+        kv.val.data.table.flags = KevsFlagArena | KevsFlagInterned;
+      }
+      parser_push(self, (ParseFrame){.val = kv.val, .key = kv.key});
+      continue;
+    }
+
+    if (!parse_simple_value(self, &kv.val)) {
+      parser_value_free(self, &kv.val);
+      return false;
+    }
+    parser_hash_add(self, kv);
+    if (!parser_add(self, root, kv)) {
+      return false;
+    }
+  }
+}
+
+// Run the parser, on error values of unfinished lists and tables are freed.
+static bool parse_root(Parser *self, KevsTable *root) {
+  const bool ok = parser_run(self, root);
+  for (size_t i = 0; i < self->stack.len; i++) {
+    parser_value_free(self, &self->stack.ptr[i].val);
+  }
+  if (!ok) {
+    // the cached storage is gone
+    free(self->hashes.ptr);
+    self->hashes = (KevsHashes){};
+  }
+  return ok;
+}
+
+KevsError parse(KevsTable *table, KevsStr content, char *err_buf,
+                size_t err_buf_len, KevsOpts opts, KevsTokens tokens) {
+  Parser p = {
+      .opts = opts,
+      .tokens = tokens,
+      .table = table,
+      .i = 0,
+      .err_buf = err_buf,
+      .err_buf_len = err_buf_len,
+      .content = content,
+  };
+
+  // arena documents get their root entries copied after the header at the end
+  KevsTable root = {};
+  KevsTable *dst = (parser_use_arena(&p) ? &root : table);
+
+  const bool ok = parse_root(&p, dst);
+  free(p.stack.ptr);
+
+  if (!ok) {
+    arena_free(&p.arena);
+    symbols_free(&p.symbols);
+    return err_buf;
+  }
+
+  if (parser_use_arena(&p)) {
+    doc_finish(&p.arena, root, &p.symbols, true, table);
+    symbols_free(&p.symbols);
+  } else {
+    table->flags |= KevsFlagHeapRoot;
+  }
+  parser_hash_finish(&p, *table);
+
+  return NULL;
+}
+
+KevsError kevs_parse(KevsTable *table, KevsStr content, char *err_buf,
+                     size_t err_buf_len, KevsOpts opts) {
+  assert(err_buf_len != 0);
+  assert(err_buf != NULL);
+
+  KevsTokens tokens = {};
+
+  KevsError err = scan(&tokens, content, err_buf, err_buf_len, opts);
+  if (err == NULL) {
+    err = parse(table, content, err_buf, err_buf_len, opts, tokens);
+  }
+
+  free(tokens.ptr);
+
+  return err;
+}
+
+// Parse with the scratch state of the parser into an arena which the
+// document borrows.
+static KevsError parser_parse_into(KevsParser *self, ArenaBlock **arena,
+                                   KevsTable *table, KevsStr content,
+                                   char *err_buf, size_t err_buf_len,
+                                   KevsOpts opts) {
+  self->tokens.len = 0;
+  if (self->symbols == NULL) {
+    self->symbols = calloc(1, sizeof(Symbols));
+    assert(self->symbols != NULL);
+  }
+  symbols_clear(self->symbols);
+
+  // documents always live in an arena
+  opts.intern_keys = true;
+
+  ScanStack scan_stack = {
+      .ptr = self->scan_stack,
+      .cap = self->scan_stack_cap,
+  };
+  KevsError err = scan_with_stack(&self->tokens, &scan_stack, content, err_buf,
+                                  err_buf_len, opts);
+  self->scan_stack = scan_stack.ptr;
+  self->scan_stack_cap = scan_stack.cap;
+  if (err != NULL) {
+    return err;
+  }
+
+  Parser p = {
+      .opts = opts,
+      .tokens = self->tokens,
+      .table = table,
+      .err_buf = err_buf,
+      .err_buf_len = err_buf_len,
+      .content = content,
+      .arena = *arena,
+      .symbols = *self->symbols,
+      .stack = {.ptr = self->parse_stack, .cap = self->parse_stack_cap},
+  };
+  KevsTable root = {};
+  const bool ok = parse_root(&p, &root);
+  *arena = p.arena;
+  *self->symbols = p.symbols;
+  self->parse_stack = p.stack.ptr;
+  self->parse_stack_cap = p.stack.cap;
+  if (!ok) {
+    return err_buf;
+  }
+
+  doc_finish(arena, root, self->symbols, false, table);
+  parser_hash_finish(&p, *table);
+  return NULL;
+}
+
+KevsError kevs_parser_parse(KevsParser *self, KevsTable *table,
+                            KevsStr content, char *err_buf,
+                            size_t err_buf_len, KevsOpts opts) {
+  assert(err_buf_len != 0);
+  assert(err_buf != NULL);
+
+  kevs_parser_reset(self);
+  return parser_parse_into(self, &self->arena, table, content, err_buf,
+                           err_buf_len, opts);
+}
+
+void kevs_parser_reset(KevsParser *self) {
+  self->tokens.len = 0;
+  arena_reset(&self->arena);
+  if (self->symbols != NULL) {
+    symbols_clear(self->symbols);
+  }
+}
+
+void kevs_parser_free(KevsParser *self) {
+  free(self->tokens.ptr);
+  arena_free(&self->arena);
+  if (self->symbols != NULL) {
+    symbols_free(self->symbols);
+    free(self->symbols);
+  }
+  free(self->scan_stack);
+  free(self->parse_stack);
+  *self = (KevsParser){};
+}
+
+typedef struct {
+  const KevsStr *inputs;
+  size_t n;
+  KevsTable *outputs;
+  KevsError *errors;
+  KevsOpts opts;
+#ifdef KEVS_THREADS
+  pthread_mutex_t mu;
+#endif
+  // next document to be claimed by a worker
+  size_t next;
+} Batch;
+
+// Worker: scratch state is shared by its documents, which get their memory
+// from its arena.
+typedef struct {
+  Batch *batch;
+  KevsParser parser;
+  ArenaBlock *arena;
+  size_t failed;
+} BatchWorker;
+
+// documents claimed at once, tiny records would contend on the lock
+static const size_t kBatchChunk = 64;
+
+static bool batch_claim(Batch *self, size_t *begin, size_t *end) {
+#ifdef KEVS_THREADS
+  pthread_mutex_lock(&self->mu);
+#endif
+  *begin = self->next;
+  *end = (self->n - *begin < kBatchChunk ? self->n : *begin + kBatchChunk);
+  self->next = *end;
+#ifdef KEVS_THREADS
+  pthread_mutex_unlock(&self->mu);
+#endif
+  return *begin < *end;
+}
+
+static void *batch_worker_run(void *arg) {
+  BatchWorker *self = arg;
+  Batch *batch = self->batch;
+  char err_buf[8193] = {};
+
+  size_t begin = 0;
+  size_t end = 0;
+  while (batch_claim(batch, &begin, &end)) {
+    for (size_t i = begin; i < end; i++) {
+      batch->outputs[i] = (KevsTable){};
+      batch->errors[i] = parser_parse_into(
+          &self->parser, &self->arena, &batch->outputs[i], batch->inputs[i],
+          err_buf, sizeof(err_buf) - 1, batch->opts);
+      if (batch->errors[i] != NULL) {
+        // keep the message, err_buf is reused by the next document
+        batch->errors[i] =
+            arena_str_dup(&self->arena, kevs_str_from_cstr(err_buf));
+        self->failed++;
+      }
+    }
+  }
+
+  return NULL;
+}
+
+KevsError kevs_parse_batch(KevsBatch *self, const KevsStr *inputs, size_t n,
+                           KevsTable *outputs, KevsError *errors,
+                           KevsOpts opts) {
+  Batch batch = {
+      .inputs = inputs,
+      .n = n,
+      .outputs = outputs,
+      .errors = errors,
+      .opts = opts,
+  };
+  // workers would share the cache
+  batch.opts.hashes = NULL;
+
+  size_t threads = opts.threads;
+  if (threads > (n + kBatchChunk - 1) / kBatchChunk) {
+    threads = (n + kBatchChunk - 1) / kBatchChunk;
+  }
+  if (threads == 0) {
+    threads = 1;
+  }
+#ifndef KEVS_THREADS
+  threads = 1;
+#endif
+
+  BatchWorker *workers = calloc(threads, sizeof(BatchWorker));
+  assert(workers != NULL);
+  for (size_t i = 0; i < threads; i++) {
+    workers[i].batch = &batch;
+  }
+
+#ifdef KEVS_THREADS
+  pthread_mutex_init(&batch.mu, NULL);
+  pthread_t *ids = calloc(threads, sizeof(pthread_t));
+  assert(ids != NULL);
+  // the calling thread is worker 0, if creating a thread fails the
+  // remaining workers just don't start
+  size_t started = 1;
+  while (started < threads &&
+         pthread_create(&ids[started], NULL, batch_worker_run,
+                        &workers[started]) == 0) {
+    started++;
+  }
+  batch_worker_run(&workers[0]);
+  for (size_t i = 1; i < started; i++) {
+    pthread_join(ids[i], NULL);
+  }
+  free(ids);
+  pthread_mutex_destroy(&batch.mu);
+#else
+  batch_worker_run(&workers[0]);
+#endif
+
+  size_t failed = 0;
+  for (size_t i = 0; i < threads; i++) {
+    failed += workers[i].failed;
+    kevs_parser_free(&workers[i].parser);
+
+    // hand the blocks over to the batch
+    ArenaBlock *arena = workers[i].arena;
+    if (arena != NULL) {
+      ArenaBlock *tail = arena;
+      while (tail->next != NULL) {
+        tail = tail->next;
+      }
+      tail->next = self->arena;
+      self->arena = arena;
+    }
+  }
+  free(workers);
+
+  if (failed != 0) {
+    return "batch has documents with errors";
+  }
+  return NULL;
+}
+
+void kevs_batch_free(KevsBatch *self) {
+  arena_free(&self->arena);
+  *self = (KevsBatch){};
+}
+
+typedef struct KevsIncludeEntry {
+  char *path;
+  uint64_t path_hash;
+  char *content;
+  size_t content_len;
+  uint64_t content_hash;
+  KevsTable fragment;
+  // false if the fragment is shared with an entry of equal content
+  bool owned;
+  // set while the fragment is being parsed, to detect cycles
+  bool loading;
+} IncludeEntry;
+
+static void include_entry_free(IncludeEntry *self) {
+  free(self->path);
+  free(self->content);
+  if (self->owned) {
+    kevs_free(&self->fragment);
+  }
+}
+
+static size_t includer_append(KevsIncluder *self, IncludeEntry v) {
+  if (self->entries_len == self->entries_cap) {
+    self->entries_cap = (self->entries_cap + 1) * 2;
+    self->entries =
+        realloc(self->entries, self->entries_cap * sizeof(IncludeEntry));
+    assert(self->entries != NULL);
+  }
+  self->entries[self->entries_len] = v;
+  return self->entries_len++;
+}
+
+KevsError kevs_include(void *ctx, const char *path, KevsTable *out,
+                       char *err_buf, size_t err_buf_len) {
+  KevsIncluder *self = ctx;
+  const KevsStr p = kevs_str_from_cstr(path);
+  const uint64_t path_hash = str_hash(p);
+
+  for (size_t i = 0; i < self->entries_len; i++) {
+    const IncludeEntry *e = &self->entries[i];
+    if (e->path_hash == path_hash && strcmp(e->path, path) == 0) {
+      if (e->loading) {
+        return "include cycle";
+      }
+      *out = e->fragment;
+      return NULL;
+    }
+  }
+
+  const size_t max_depth = (self->max_depth == 0 ? 16 : self->max_depth);
+  if (self->depth >= max_depth) {
+    snprintf(err_buf, err_buf_len, "includes nested deeper than %zu",
+             max_depth);
+    return err_buf;
+  }
+
+  IncludeEntry entry = {.path = kevs_str_dup(p), .path_hash = path_hash};
+  KevsError err = self->read(self->read_ctx, path, &entry.content,
+                             &entry.content_len);
+  if (err != NULL) {
+    free(entry.path);
+    return err;
+  }
+  const KevsStr content = {.ptr = entry.content, .len = entry.content_len};
+  entry.content_hash = str_hash(content);
+
+  for (size_t i = 0; i < self->entries_len; i++) {
+    const IncludeEntry *e = &self->entries[i];
+    if (!e->loading && e->content_hash == entry.content_hash &&
+        e->content_len == entry.content_len &&
+        memcmp(e->content, entry.content, entry.content_len) == 0) {
+      entry.fragment = e->fragment;
+      includer_append(self, entry);
+      *out = entry.fragment;
+      return NULL;
+    }
+  }
+
+  entry.owned = true;
+  entry.loading = true;
+  const size_t index = includer_append(self, entry);
+
+  // fragments own their keys, documents without intern_keys share them
+  KevsOpts opts = self->opts;
+  opts.file = kevs_str_from_cstr(entry.path);
+  opts.intern_keys = true;
+  opts.include = kevs_include;
+  opts.include_ctx = self;
+
+  KevsTable fragment = {};
+  self->depth++;
+  err = kevs_parse(&fragment, content, err_buf, err_buf_len, opts);
+  self->depth--;
+
+  // nested includes may have moved the entries
+  if (err != NULL) {
+    self->entries[index].owned = false;
+    include_entry_free(&self->entries[index]);
+    memmove(&self->entries[index], &self->entries[index + 1],
+            (self->entries_len - index - 1) * sizeof(IncludeEntry));
+    self->entries_len--;
+    return err;
+  }
+  self->entries[index].fragment = fragment;
+  self->entries[index].loading = false;
+  *out = fragment;
+  return NULL;
+}
+
+void kevs_includer_free(KevsIncluder *self) {
+  for (size_t i = 0; i < self->entries_len; i++) {
+    include_entry_free(&self->entries[i]);
+  }
+  free(self->entries);
+  self->entries = NULL;
+  self->entries_cap = 0;
+  self->entries_len = 0;
+  self->depth = 0;
+}
+
+KevsError kevs_scalar_int(KevsStr raw, int64_t *out) {
+  return str_to_int(raw, 0, out);
+}
+
+KevsError kevs_scalar_bool(KevsStr raw, bool *out) {
+  if (str_equals(raw, kevs_str_from_cstr("true"))) {
+    *out = true;
+    return NULL;
+  }
+  if (str_equals(raw, kevs_str_from_cstr("false"))) {
+    *out = false;
+    return NULL;
+  }
+  return "value is not boolean";
+}
+
+KevsError kevs_scalar_string(KevsStr raw, char **out) {
+  if (str_starts_with_char(raw, kRawStringBegin)) {
+    *out = kevs_str_dup(str_slice(raw, 1, raw.len - 1));
+    return NULL;
+  }
+  if (!str_starts_with_char(raw, kStringBegin)) {
+    return "value is not string";
+  }
+  const KevsStr s = str_slice(raw, 1, raw.len - 1);
+  String dst = {};
+  string_reserve(&dst, s.len);
+  KevsError err = str_norm(s, &dst);
+  if (err != NULL) {
+    free(dst.ptr);
+    return err;
+  }
+  *out = dst.ptr;
+  return NULL;
+}
+
+void kevs_free(KevsTable *self) {
+  KevsValue v = {.kind = KevsValueKindTable, .data.table = *self};
+  value_free(&v);
+  *self = (KevsTable){};
+}
+
+KevsMemoryUsage kevs_memory_usage(KevsTable self) {
+  KevsMemoryUsage usage = {};
+
+  // key strings are owned only by built documents, interned keys are
+  // counted with the symbols
+  const bool own_keys = (self.flags & KevsFlagArenaRoot) &&
+                        !(self.flags & KevsFlagInterned);
+
+  size_t arena = 0;
+  if (self.flags & KevsFlagArenaRoot) {
+    const DocHeader *header = doc_header(self);
+    for (const ArenaBlock *b = header->arena; b != NULL; b = b->next) {
+      arena += b->cap;
+    }
+    usage.keys += symbols_size(&header->symbols, header->symbols.index_cap);
+    usage.tables += sizeof(DocHeader);
+  }
+
+  size_t spare = (self.cap - self.len) * sizeof(KevsKeyValue);
+  usage.tables += self.len * sizeof(KevsKeyValue);
+
+  StorageStack stack = {};
+  storage_stack_push(&stack, self.ptr, self.len, true);
+  while (stack.len != 0) {
+    StorageFrame *top = &stack.ptr[stack.len - 1];
+    if (top->i == top->len) {
+      stack.len--;
+      continue;
+    }
+    KevsValue v = {};
+    if (top->is_table) {
+      const KevsKeyValue *kv = &((KevsKeyValue *)top->ptr)[top->i];
+      if (own_keys) {
+        usage.keys += kv->key.len + 1;
+      }
+      v = kv->val;
+    } else {
+      v = ((KevsValue *)top->ptr)[top->i];
+    }
+    top->i++;
+
+    switch (v.kind) {
+    case KevsValueKindString:
+      usage.strings += strlen(v.data.string) + 1;
+      break;
+    case KevsValueKindList: {
+      const KevsList l = v.data.list;
+      usage.lists += list_storage_size(l, l.len);
+      spare += list_storage_size(l, l.cap) - list_storage_size(l, l.len);
+      if (!list_is_packed(l)) {
+        storage_stack_push(&stack, l.ptr, l.len, false);
+      }
+    } break;
+    case KevsValueKindTable: {
+      const KevsTable t = v.data.table;
+      usage.tables += t.len * sizeof(KevsKeyValue);
+      spare += (t.cap - t.len) * sizeof(KevsKeyValue);
+      storage_stack_push(&stack, t.ptr, t.len, true);
+    } break;
+    default:
+      break;
+    }
+  }
+  free(stack.ptr);
+
+  const size_t used = usage.strings + usage.lists + usage.tables + usage.keys;
+  // arena slack also covers storage left behind by growth and unused blocks,
+  // merged documents can use more than their arena by sharing values
+  usage.slack = (arena != 0 && arena >= used ? arena - used : spare);
+  usage.total = used + usage.slack;
+  return usage;
+}
+
+// Resize storage to exactly size bytes.
+static void *storage_shrink(void *ptr, size_t size) {
+  if (size == 0) {
+    free(ptr);
+    return NULL;
+  }
+  void *out = realloc(ptr, size);
+  assert(out != NULL);
+  return out;
+}
+
+static void heap_compact(KevsTable *root) {
+  root->ptr = storage_shrink(root->ptr, root->len * sizeof(KevsKeyValue));
+  root->cap = (uint32_t)root->len;
+
+  StorageStack stack = {};
+  storage_stack_push(&stack, root->ptr, root->len, true);
+  while (stack.len != 0) {
+    StorageFrame *top = &stack.ptr[stack.len - 1];
+    if (top->i == top->len) {
+      stack.len--;
+      continue;
+    }
+    KevsValue *v = (top->is_table ? &((KevsKeyValue *)top->ptr)[top->i].val
+                                  : &((KevsValue *)top->ptr)[top->i]);
+    top->i++;
+
+    switch (v->kind) {
+    case KevsValueKindString:
+      v->data.string =
+          storage_shrink(v->data.string, strlen(v->data.string) + 1);
+      break;
+    case KevsValueKindList: {
+      KevsList *l = &v->data.list;
+      if (list_is_packed(*l)) {
+        // allocated with the exact size
+        break;
+      }
+      l->ptr = storage_shrink(l->ptr, l->len * sizeof(KevsValue));
+      l->cap = (uint32_t)l->len;
+      storage_stack_push(&stack, l->ptr, l->len, false);
+    } break;
+    case KevsValueKindTable: {
+      KevsTable *t = &v->data.table;
+      t->ptr = storage_shrink(t->ptr, t->len * sizeof(KevsKeyValue));
+      t->cap = (uint32_t)t->len;
+      storage_stack_push(&stack, t->ptr, t->len, true);
+    } break;
+    default:
+      break;
+    }
+  }
+  free(stack.ptr);
+}
+
+// Arena bytes needed by a compacted copy of an arena document.
+static size_t arena_compact_size(KevsTable self) {
+  const bool interned = (self.flags & KevsFlagInterned) != 0;
+  const Symbols *symbols = &doc_header(self)->symbols;
+
+  size_t size =
+      arena_align(sizeof(DocHeader) + self.len * sizeof(KevsKeyValue));
+  size += symbols_size(symbols, symbols_index_cap(symbols->len));
+
+  StorageStack stack = {};
+  storage_stack_push(&stack, self.ptr, self.len, true);
+  while (stack.len != 0) {
+    StorageFrame *top = &stack.ptr[stack.len - 1];
+    if (top->i == top->len) {
+      stack.len--;
+      continue;
+    }
+    KevsValue v = {};
+    if (top->is_table) {
+      const KevsKeyValue *kv = &((KevsKeyValue *)top->ptr)[top->i];
+      if (!interned) {
+        size += arena_align(kv->key.len + 1);
+      }
+      v = kv->val;
+    } else {
+      v = ((KevsValue *)top->ptr)[top->i];
+    }
+    top->i++;
+
+    switch (v.kind) {
+    case KevsValueKindString:
+      size += arena_align(strlen(v.data.string) + 1);
+      break;
+    case KevsValueKindList:
+      size += arena_align(list_storage_size(v.data.list, v.data.list.len));
+      if (!list_is_packed(v.data.list)) {
+        storage_stack_push(&stack, v.data.list.ptr, v.data.list.len, false);
+      }
+      break;
+    case KevsValueKindTable:
+      size += arena_align(v.data.table.len * sizeof(KevsKeyValue));
+      storage_stack_push(&stack, v.data.table.ptr, v.data.table.len, true);
+      break;
+    default:
+      break;
+    }
+  }
+  free(stack.ptr);
+
+  return size;
+}
+
+// Copy an arena document into a single block of exactly the size it needs.
+static void arena_compact(KevsTable *self) {
+  const bool interned = (self->flags & KevsFlagInterned) != 0;
+  const Symbols *old_symbols = &doc_header(*self)->symbols;
+
+  ArenaBlock *arena = NULL;
+  arena_push_block(&arena, arena_compact_size(*self));
+
+  // same order, so ids stay the same
+  Symbols symbols = {};
+  for (size_t i = 0; i < old_symbols->len; i++) {
+    symbols_intern(&symbols, &arena, old_symbols->ptr[i]);
+  }
+
+  // root entries are copied as they are, then every entry is moved over
+  KevsTable out = {};
+  doc_finish(&arena, *self, (interned ? &symbols : NULL), false, &out);
+
+  StorageStack stack = {};
+  storage_stack_push(&stack, out.ptr, out.len, true);
+  while (stack.len != 0) {
+    StorageFrame *top = &stack.ptr[stack.len - 1];
+    if (top->i == top->len) {
+      stack.len--;
+      continue;
+    }
+    KevsValue *v = NULL;
+    if (top->is_table) {
+      KevsKeyValue *kv = &((KevsKeyValue *)top->ptr)[top->i];
+      if (interned) {
+        kv->key = symbols.ptr[symbol_id(kv->key)];
+      } else {
+        kv->key.ptr = arena_str_dup(&arena, kv->key);
+      }
+      v = &kv->val;
+    } else {
+      v = &((KevsValue *)top->ptr)[top->i];
+    }
+    top->i++;
+
+    switch (v->kind) {
+    case KevsValueKindString:
+      v->data.string =
+          arena_str_dup(&arena, kevs_str_from_cstr(v->data.string));
+      break;
+    case KevsValueKindList: {
+      KevsList *l = &v->data.list;
+      const size_t size = list_storage_size(*l, l->len);
+      void *ptr = arena_alloc(&arena, size);
+      if (size != 0) {
+        memcpy(ptr, l->ptr, size);
+      }
+      l->ptr = ptr;
+      l->cap = (uint32_t)l->len;
+      l->flags |= KevsFlagArena;
+      if (!list_is_packed(*l)) {
+        storage_stack_push(&stack, l->ptr, l->len, false);
+      }
+    } break;
+    case KevsValueKindTable: {
+      KevsTable *t = &v->data.table;
+      const size_t size = t->len * sizeof(KevsKeyValue);
+      void *ptr = arena_alloc(&arena, size);
+      if (size != 0) {
+        memcpy(ptr, t->ptr, size);
+      }
+      t->ptr = ptr;
+      t->cap = (uint32_t)t->len;
+      // merged documents can hold tables of interned documents
+      t->flags = KevsFlagArena | (interned ? KevsFlagInterned : 0);
+      storage_stack_push(&stack, t->ptr, t->len, true);
+    } break;
+    default:
+      break;
+    }
+  }
+  free(stack.ptr);
+  symbols_free(&symbols);
+
+  // everything fit into the one block
+  assert(arena->next == NULL && arena->len == arena->cap);
+  doc_header(out)->arena = arena;
+
+  kevs_free(self);
+  *self = out;
+}
+
+KevsError kevs_compact(KevsTable *self) {
+  if (!(self->flags & KevsFlagArena)) {
+    // a nested table would be moved under its parent
+    if (!(self->flags & KevsFlagHeapRoot)) {
+      return "table is not the root of a heap document";
+    }
+    heap_compact(self);
+    return NULL;
+  }
+  if (!(self->flags & KevsFlagArenaRoot)) {
+    return "table is not the root of an arena document";
+  }
+  if (doc_header(*self)->arena == NULL) {
+    return "document borrows its arena";
+  }
+  arena_compact(self);
+  return NULL;
+}
+
+typedef struct {
+  KevsTable base;
+  KevsTable overlay;
+  // merged table, in the arena of the result
+  KevsTable *out;
+} MergeFrame;
+
+typedef struct {
+  MergeFrame *ptr;
+  size_t cap;
+  size_t len;
+} MergeStack;
+
+typedef struct {
+  ArenaBlock *arena;
+  KevsMergePolicy policy;
+  // tables present in both documents, waiting to be merged
+  MergeStack stack;
+  // open addressing hash table of base entry index + 1, 0 marks an empty
+  // slot, reused by every table
+  uint32_t *index;
+  size_t index_cap;
+} Merger;
+
+// tables up to this size are searched without an index
+static const size_t kMergeLinearMax = 8;
+
+static void merger_push(Merger *self, MergeFrame v) {
+  MergeStack *stack = &self->stack;
+  if (stack->len == stack->cap) {
+    stack->cap = stack->cap == 0 ? 16 : stack->cap * 2;
+    stack->ptr = realloc(stack->ptr, stack->cap * sizeof(MergeFrame));
+    assert(stack->ptr != NULL);
+  }
+  stack->ptr[stack->len++] = v;
+}
+
+// Index the keys of base, returns the mask of the used part of the index.
+static size_t merger_index(Merger *self, KevsTable base) {
+  size_t cap = 16;
+  while (cap < base.len * 2) {
+    cap *= 2;
+  }
+  if (cap > self->index_cap) {
+    free(self->index);
+    self->index = malloc(cap * sizeof(uint32_t));
+    assert(self->index != NULL);
+    self->index_cap = cap;
+  }
+  // only the part used by this table is cleared, so small tables stay cheap
+  memset(self->index, 0, cap * sizeof(uint32_t));
+
+  const size_t mask = cap - 1;
+  for (size_t i = 0; i < base.len; i++) {
+    size_t slot = str_hash(base.ptr[i].key) & mask;
+    while (self->index[slot] != 0) {
+      slot = (slot + 1) & mask;
+    }
+    self->index[slot] = (uint32_t)(i + 1);
+  }
+  return mask;
+}
+
+// Index of key in base, base.len if missing. mask is 0 without an index.
+static size_t merger_find(const Merger *self, KevsTable base, size_t mask,
+                          KevsStr key) {
+  if (mask == 0) {
+    for (size_t i = 0; i < base.len; i++) {
+      STATS_ADD(key_compares, 1);
+      if (str_equals(base.ptr[i].key, key)) {
+        return i;
+      }
+    }
+    return base.len;
+  }
+
+  for (size_t slot = str_hash(key) & mask;; slot = (slot + 1) & mask) {
+    const uint32_t i = self->index[slot];
+    if (i == 0) {
+      return base.len;
+    }
+    STATS_ADD(key_compares, 1);
+    if (str_equals(base.ptr[i - 1].key, key)) {
+      return i - 1;
+    }
+  }
+}
+
+static KevsError merger_append(Merger *self, KevsList a, KevsList b,
+                               KevsList *out) {
+  const size_t n = a.len + b.len;
+  if (n > UINT32_MAX) {
+    return "merged list is too long";
+  }
+
+  const uint32_t packed = a.flags & (KevsFlagPackedInts | KevsFlagPackedBools);
+  if (packed != 0 &&
+      packed == (b.flags & (KevsFlagPackedInts | KevsFlagPackedBools))) {
+    *out = (KevsList){
+        .cap = (uint32_t)n,
+        .flags = KevsFlagArena | packed,
+        .len = n,
+    };
+    if (packed == KevsFlagPackedInts) {
+      int64_t *ptr = arena_alloc(&self->arena, n * sizeof(int64_t));
+      memcpy(ptr, a.ptr, a.len * sizeof(int64_t));
+      memcpy(ptr + a.len, b.ptr, b.len * sizeof(int64_t));
+      out->ptr = (KevsValue *)ptr;
+      return NULL;
+    }
+    const size_t words = (n + 63) / 64;
+    uint64_t *ptr = arena_alloc(&self->arena, words * sizeof(uint64_t));
+    memset(ptr, 0, words * sizeof(uint64_t));
+    memcpy(ptr, a.ptr, (a.len + 63) / 64 * sizeof(uint64_t));
+    const uint64_t *bits = (const uint64_t *)b.ptr;
+    for (size_t j = 0; j < b.len; j++) {
+      if (bits[j / 64] >> (j % 64) & 1) {
+        const size_t k = a.len + j;
+        ptr[k / 64] |= (uint64_t)1 << (k % 64);
+      }
+    }
+    out->ptr = (KevsValue *)ptr;
+    return NULL;
+  }
+
+  // anything else is stored as values
+  KevsValue *ptr = arena_alloc(&self->arena, n * sizeof(KevsValue));
+  for (size_t i = 0; i < a.len; i++) {
+    kevs_list_value(a, i, &ptr[i]);
+  }
+  for (size_t j = 0; j < b.len; j++) {
+    kevs_list_value(b, j, &ptr[a.len + j]);
+  }
+  *out = (KevsList){
+      .ptr = ptr,
+      .cap = (uint32_t)n,
+      .flags = KevsFlagArena,
+      .len = n,
+  };
+  return NULL;
+}
+
+// Merge one pair of tables, nested pairs are pushed instead of recursing.
+static KevsError merger_table(Merger *self, MergeFrame f) {
+  const KevsTable base = f.base;
+  const KevsTable overlay = f.overlay;
+
+  const size_t cap = base.len + overlay.len;
+  if (cap > UINT32_MAX) {
+    return "merged table is too large";
+  }
+  KevsTable *out = f.out;
+  *out = (KevsTable){
+      .ptr = arena_alloc(&self->arena, cap * sizeof(KevsKeyValue)),
+      .cap = (uint32_t)cap,
+      .flags = KevsFlagArena,
+      .len = base.len,
+  };
+  if (base.len != 0) {
+    memcpy(out->ptr, base.ptr, base.len * sizeof(KevsKeyValue));
+  }
+
+  const size_t mask =
+      (base.len > kMergeLinearMax ? merger_index(self, base) : 0);
+
+  for (size_t j = 0; j < overlay.len; j++) {
+    const KevsKeyValue kv = overlay.ptr[j];
+    const size_t i = merger_find(self, base, mask, kv.key);
+    if (i == base.len) {
+      out->ptr[out->len++] = kv;
+      continue;
+    }
+
+    KevsValue *dst = &out->ptr[i].val;
+    const KevsValue b = base.ptr[i].val;
+    if (b.kind == KevsValueKindTable && kv.val.kind == KevsValueKindTable) {
+      // arena storage doesn't move, so dst stays valid
+      merger_push(self, (MergeFrame){
+                            .base = b.data.table,
+                            .overlay = kv.val.data.table,
+                            .out = &dst->data.table,
+                        });
+      continue;
+    }
+    if (b.kind == KevsValueKindList && kv.val.kind == KevsValueKindList &&
+        self->policy == KevsMergeAppendLists) {
+      KevsError err =
+          merger_append(self, b.data.list, kv.val.data.list, &dst->data.list);
+      if (err != NULL) {
+        return err;
+      }
+      continue;
+    }
+    dst->kind = kv.val.kind;
+    dst->data = kv.val.data;
+  }
+
+  return NULL;
+}
+
+KevsError kevs_merge(KevsTable base, KevsTable overlay, KevsMergePolicy policy,
+                     KevsTable *out) {
+  Merger m = {.policy = policy};
+  KevsTable root = {};
+  merger_push(&m, (MergeFrame){.base = base, .overlay = overlay, .out = &root});
+
+  KevsError err = NULL;
+  while (err == NULL && m.stack.len != 0) {
+    const MergeFrame f = m.stack.ptr[--m.stack.len];
+    err = merger_table(&m, f);
+  }
+  free(m.stack.ptr);
+  free(m.index);
+
+  if (err != NULL) {
+    arena_free(&m.arena);
+    return err;
+  }
+
+  doc_finish(&m.arena, root, NULL, true, out);
+  return NULL;
+}
+
+uint64_t kevs_hash(KevsValue v, const KevsHashes *hashes) {
+  return hash_value(v, hashes, NULL);
+}
+
+uint64_t kevs_table_hash(KevsTable self, const KevsHashes *hashes) {
+  return hash_value(
+      (KevsValue){.kind = KevsValueKindTable, .data.table = self}, hashes,
+      NULL);
+}
+
+void kevs_hashes_add(KevsHashes *self, KevsTable table) {
+  hash_value((KevsValue){.kind = KevsValueKindTable, .data.table = table},
+             self, self);
+}
+
+void kevs_hashes_reset(KevsHashes *self) {
+  if (self->len != 0) {
+    memset(self->ptr, 0, self->cap * sizeof(HashEntry));
+  }
+  self->len = 0;
+}
+
+void kevs_hashes_free(KevsHashes *self) {
+  free(self->ptr);
+  *self = (KevsHashes){};
+}
+
+// Equal: pairs of lists and tables are compared one level at a time,
+// nested pairs wait on a stack.
+
+typedef struct {
+  KevsValue a;
+  KevsValue b;
+} EqualPair;
+
+typedef struct {
+  EqualPair *ptr;
+  size_t cap;
+  size_t len;
+  // only the key index of the merger is used
+  Merger index;
+  const KevsHashes *hashes_a;
+  const KevsHashes *hashes_b;
+} Equal;
+
+// Compare scalars, lists and tables of the same kind are pushed.
+static bool equal_value(Equal *self, KevsValue a, KevsValue b) {
+  if (a.kind != b.kind) {
+    return false;
+  }
+  switch (a.kind) {
+  case KevsValueKindString:
+    return strcmp(a.data.string, b.data.string) == 0;
+  case KevsValueKindInteger:
+    return a.data.integer == b.data.integer;
+  case KevsValueKindBoolean:
+    return a.data.boolean == b.data.boolean;
+  case KevsValueKindList:
+  case KevsValueKindTable:
+    break;
+  default:
+    return true;
+  }
+
+  if (self->len == self->cap) {
+    self->cap = self->cap == 0 ? 16 : self->cap * 2;
+    self->ptr = realloc(self->ptr, self->cap * sizeof(EqualPair));
+    assert(self->ptr != NULL);
+  }
+  self->ptr[self->len++] = (EqualPair){.a = a, .b = b};
+  return true;
+}
+
+static bool equal_list(Equal *self, KevsList a, KevsList b) {
+  if ((a.flags & KevsFlagPackedInts) && (b.flags & KevsFlagPackedInts)) {
+    return memcmp(a.ptr, b.ptr, a.len * sizeof(int64_t)) == 0;
+  }
+  for (size_t i = 0; i < a.len; i++) {
+    KevsValue va = {};
+    KevsValue vb = {};
+    kevs_list_value(a, i, &va);
+    kevs_list_value(b, i, &vb);
+    if (!equal_value(self, va, vb)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static bool equal_table(Equal *self, KevsTable a, KevsTable b) {
+  // keys are unique, so with equal lengths finding every key of a in b
+  // matches all of b
+  size_t mask = 0;
+  bool indexed = false;
+  for (size_t i = 0; i < a.len; i++) {
+    const KevsKeyValue kv = a.ptr[i];
+    size_t j = i;
+    // documents written alike keep their keys in the same order
+    if (!str_equals(b.ptr[i].key, kv.key)) {
+      if (!indexed) {
+        mask = (b.len > kMergeLinearMax ? merger_index(&self->index, b) : 0);
+        indexed = true;
+      }
+      j = merger_find(&self->index, b, mask, kv.key);
+      if (j == b.len) {
+        return false;
+      }
+    }
+    if (!equal_value(self, kv.val, b.ptr[j].val)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static bool equal_run(Equal *self) {
+  while (self->len != 0) {
+    const EqualPair p = self->ptr[--self->len];
+    const bool is_table = p.a.kind == KevsValueKindTable;
+    const void *ptr_a = is_table ? (void *)p.a.data.table.ptr
+                                 : (void *)p.a.data.list.ptr;
+    const void *ptr_b = is_table ? (void *)p.b.data.table.ptr
+                                 : (void *)p.b.data.list.ptr;
+    const size_t len = is_table ? p.a.data.table.len : p.a.data.list.len;
+    if (len != (is_table ? p.b.data.table.len : p.b.data.list.len)) {
+      return false;
+    }
+    if (len == 0) {
+      continue;
+    }
+
+    uint64_t ha = 0;
+    uint64_t hb = 0;
+    if (hashes_get(self->hashes_a, ptr_a, len, &ha) &&
+        hashes_get(self->hashes_b, ptr_b, len, &hb) && ha != hb) {
+      return false;
+    }
+    // shared by both, like unchanged values of kevs_merge
+    if (ptr_a == ptr_b &&
+        (is_table || p.a.data.list.flags == p.b.data.list.flags)) {
+      continue;
+    }
+
+    const bool ok =
+        is_table ? equal_table(self, p.a.data.table, p.b.data.table)
+                 : equal_list(self, p.a.data.list, p.b.data.list);
+    if (!ok) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool kevs_equal(KevsValue a, const KevsHashes *hashes_a, KevsValue b,
+                const KevsHashes *hashes_b) {
+  Equal e = {.hashes_a = hashes_a, .hashes_b = hashes_b};
+  const bool ok = equal_value(&e, a, b) && equal_run(&e);
+  free(e.ptr);
+  free(e.index.index);
+  return ok;
+}
+
+bool kevs_table_equal(KevsTable a, const KevsHashes *hashes_a, KevsTable b,
+                      const KevsHashes *hashes_b) {
+  return kevs_equal((KevsValue){.kind = KevsValueKindTable, .data.table = a},
+                    hashes_a,
+                    (KevsValue){.kind = KevsValueKindTable, .data.table = b},
+                    hashes_b);
+}
+
+// Schema: compiled rules, see kevs_schema_compile.
+
+static const uint32_t kSchemaNone = UINT32_MAX;
+
+enum {
+  kSchemaOptional = 1 << 0,
+  kSchemaStrict = 1 << 1,
+  kSchemaMin = 1 << 2,
+  kSchemaMax = 1 << 3,
+  kSchemaMinLen = 1 << 4,
+  kSchemaMaxLen = 1 << 5,
+};
+
+typedef struct KevsSchemaRule {
+  // KevsValueKindUndefined accepts any value
+  KevsValueKind type;
+  uint32_t flags;
+  int64_t min;
+  int64_t max;
+  uint64_t min_len;
+  uint64_t max_len;
+  // offset of the pattern in strings, or kSchemaNone
+  uint32_t pattern;
+  // rule of list elements, or kSchemaNone
+  uint32_t items;
+  // keys of a table, sorted by name
+  uint32_t keys;
+  uint32_t keys_len;
+  // keys without the optional flag
+  uint32_t required;
+} SchemaRule;
+
+typedef struct KevsSchemaKey {
+  // offset of the null terminated name in strings
+  uint32_t name;
+  uint32_t name_len;
+  uint32_t rule;
+} SchemaKey;
+
+// Match one byte against the pattern element at *p, advancing past it.
+static bool glob_one(const char **p, char c) {
+  const char *q = *p;
+  bool match = false;
+  if (*q == '?') {
+    match = true;
+    q++;
+  } else if (*q == '[') {
+    q++;
+    const bool negate = *q == '!';
+    if (negate) {
+      q++;
+    }
+    // ']' right after the opening bracket is a member
+    for (bool first = true; *q != ']' || first; first = false) {
+      char lo = *q++;
+      if (lo == '\\') {
+        lo = *q++;
+      }
+      char hi = lo;
+      if (q[0] == '-' && q[1] != ']' && q[1] != 0) {
+        q++;
+        hi = *q++;
+        if (hi == '\\') {
+          hi = *q++;
+        }
+      }
+      match = match || ((uint8_t)c >= (uint8_t)lo && (uint8_t)c <= (uint8_t)hi);
+    }
+    q++;
+    match = match != negate;
+  } else {
+    if (*q == '\\') {
+      q++;
+    }
+    match = *q == c;
+    q++;
+  }
+  *p = q;
+  return match;
+}
+
+// Match s against a glob pattern: * any run of bytes, ? any byte, [abc],
+// [a-z] and [!a-z] byte classes, \ escapes the next byte.
+// The last star is retried on mismatch, so there is no recursion.
+static bool glob_match(const char *p, KevsStr s) {
+  const char *star = NULL;
+  size_t star_i = 0;
+  size_t i = 0;
+  while (i < s.len) {
+    if (*p == '*') {
+      star = ++p;
+      star_i = i;
+      continue;
+    }
+    const char *next = p;
+    if (*p != 0 && glob_one(&next, s.ptr[i])) {
+      p = next;
+      i++;
+      continue;
+    }
+    if (star == NULL) {
+      return false;
+    }
+    p = star;
+    i = ++star_i;
+  }
+  while (*p == '*') {
+    p++;
+  }
+  return *p == 0;
+}
+
+static bool glob_valid(const char *p) {
+  while (*p != 0) {
+    if (*p == '\\') {
+      if (p[1] == 0) {
+        return false;
+      }
+      p += 2;
+      continue;
+    }
+    if (*p == '[') {
+      p++;
+      if (*p == '!') {
+        p++;
+      }
+      for (bool first = true; *p != ']' || first; first = false) {
+        if (*p == 0 || (*p == '\\' && p[1] == 0)) {
+          return false;
+        }
+        p += (*p == '\\' ? 2 : 1);
+      }
+    }
+    p++;
+  }
+  return true;
+}
+
+static int schema_name_cmp(KevsStr a, KevsStr b) {
+  const int c = memcmp(a.ptr, b.ptr, a.len < b.len ? a.len : b.len);
+  if (c != 0) {
+    return c;
+  }
+  return (a.len > b.len) - (a.len < b.len);
+}
+
+typedef struct {
+  KevsStr name;
+  uint32_t rule;
+} SchemaKeySort;
+
+static int schema_key_sort_cmp(const void *a, const void *b) {
+  return schema_name_cmp(((const SchemaKeySort *)a)->name,
+                         ((const SchemaKeySort *)b)->name);
+}
+
+static KevsStr schema_key_name(const KevsSchema *self, const SchemaKey *k) {
+  return (KevsStr){.ptr = self->strings + k->name, .len = k->name_len};
+}
+
+// Index of key in the keys of rule, or kSchemaNone.
+static uint32_t schema_find_key(const KevsSchema *self, const SchemaRule *rule,
+                                KevsStr key) {
+  size_t lo = 0;
+  size_t hi = rule->keys_len;
+  while (lo < hi) {
+    const size_t mid = lo + (hi - lo) / 2;
+    const int c =
+        schema_name_cmp(schema_key_name(self, &self->keys[rule->keys + mid]),
+                        key);
+    if (c == 0) {
+      return (uint32_t)(rule->keys + mid);
+    }
+    if (c < 0) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return kSchemaNone;
+}
+
+typedef struct {
+  // schema table of the rule
+  KevsTable table;
+  uint32_t rule;
+  // for errors, the key the rule is for
+  KevsStr name;
+} SchemaTodo;
+
+typedef struct {
+  KevsSchema *out;
+  size_t rules_cap;
+  size_t keys_cap;
+  size_t strings_cap;
+  SchemaTodo *todo;
+  size_t todo_cap;
+  size_t todo_len;
+  char *err_buf;
+  size_t err_buf_len;
+} SchemaCompiler;
+
+static void schema_compile_errorf(SchemaCompiler *self, KevsStr name,
+                                  const char *fmt, ...) {
+  int n = snprintf(self->err_buf, self->err_buf_len, "schema: rule '%.*s': ",
+                   (int)name.len, name.ptr);
+  if (n < 0 || (size_t)n >= self->err_buf_len) {
+    return;
+  }
+  va_list args;
+  va_start(args, fmt);
+  vsnprintf(self->err_buf + n, self->err_buf_len - n, fmt, args);
+  va_end(args);
+}
+
+// Append a placeholder rule, compiled when its todo is taken.
+static uint32_t schema_add_rule(SchemaCompiler *self, KevsTable table,
+                                KevsStr name) {
+  KevsSchema *out = self->out;
+  if (out->rules_len == self->rules_cap) {
+    self->rules_cap = (self->rules_cap + 1) * 2;
+    out->rules = realloc(out->rules, self->rules_cap * sizeof(SchemaRule));
+    assert(out->rules != NULL);
+  }
+  const uint32_t rule = (uint32_t)out->rules_len++;
+  out->rules[rule] = (SchemaRule){};
+
+  if (self->todo_len == self->todo_cap) {
+    self->todo_cap = (self->todo_cap + 1) * 2;
+    self->todo = realloc(self->todo, self->todo_cap * sizeof(SchemaTodo));
+    assert(self->todo != NULL);
+  }
+  self->todo[self->todo_len++] = (SchemaTodo){
+      .table = table,
+      .rule = rule,
+      .name = name,
+  };
+  return rule;
+}
+
+static uint32_t schema_add_string(SchemaCompiler *self, KevsStr s) {
+  KevsSchema *out = self->out;
+  while (out->strings_len + s.len + 1 > self->strings_cap) {
+    self->strings_cap = (self->strings_cap + 1) * 2;
+  }
+  out->strings = realloc(out->strings, self->strings_cap);
+  assert(out->strings != NULL);
+  const uint32_t offset = (uint32_t)out->strings_len;
+  memcpy(out->strings + offset, s.ptr, s.len);
+  out->strings[offset + s.len] = 0;
+  out->strings_len += s.len + 1;
+  return offset;
+}
+
+static bool schema_type(KevsStr s, KevsValueKind *out) {
+  const KevsValueKind kinds[] = {
+      KevsValueKindString, KevsValueKindInteger, KevsValueKindBoolean,
+      KevsValueKindList,   KevsValueKindTable,
+  };
+  for (size_t i = 0; i < sizeof(kinds) / sizeof(kinds[0]); i++) {
+    if (str_equals(s, kevs_str_from_cstr(kevs_valuekind_str(kinds[i])))) {
+      *out = kinds[i];
+      return true;
+    }
+  }
+  if (str_equals(s, kevs_str_from_cstr("any"))) {
+    *out = KevsValueKindUndefined;
+    return true;
+  }
+  return false;
+}
+
+static bool schema_compile_keys(SchemaCompiler *self, KevsTable keys,
+                                SchemaRule *r) {
+  SchemaKeySort *sorted = malloc((keys.len + 1) * sizeof(SchemaKeySort));
+  assert(sorted != NULL);
+  for (size_t i = 0; i < keys.len; i++) {
+    const KevsKeyValue kv = keys.ptr[i];
+    if (kv.val.kind != KevsValueKindTable) {
+      schema_compile_errorf(self, kv.key, "rule is not a table");
+      free(sorted);
+      return false;
+    }
+    sorted[i] = (SchemaKeySort){
+        .name = kv.key,
+        .rule = schema_add_rule(self, kv.val.data.table, kv.key),
+    };
+  }
+  qsort(sorted, keys.len, sizeof(SchemaKeySort), schema_key_sort_cmp);
+
+  KevsSchema *out = self->out;
+  while (out->keys_len + keys.len > self->keys_cap) {
+    self->keys_cap = (self->keys_cap + 1) * 2;
+  }
+  out->keys = realloc(out->keys, (self->keys_cap + 1) * sizeof(SchemaKey));
+  assert(out->keys != NULL);
+  r->keys = (uint32_t)out->keys_len;
+  r->keys_len = (uint32_t)keys.len;
+  for (size_t i = 0; i < keys.len; i++) {
+    const uint32_t name = schema_add_string(self, sorted[i].name);
+    out->keys[out->keys_len++] = (SchemaKey){
+        .name = name,
+        .name_len = (uint32_t)sorted[i].name.len,
+        .rule = sorted[i].rule,
+    };
+  }
+  free(sorted);
+  return true;
+}
+
+static bool schema_compile_rule(SchemaCompiler *self, SchemaTodo todo) {
+  SchemaRule r = {.pattern = kSchemaNone, .items = kSchemaNone};
+  bool has_type = false;
+  const KevsTable *keys = NULL;
+  const KevsTable *items = NULL;
+
+  for (size_t i = 0; i < todo.table.len; i++) {
+    const KevsKeyValue *kv = &todo.table.ptr[i];
+    const KevsStr field = kv->key;
+    const KevsValue v = kv->val;
+
+    // fields and the kind of their value
+    const struct {
+      const char *name;
+      KevsValueKind kind;
+    } fields[] = {
+        {"type", KevsValueKindString},     {"optional", KevsValueKindBoolean},
+        {"strict", KevsValueKindBoolean},  {"min", KevsValueKindInteger},
+        {"max", KevsValueKindInteger},     {"min_len", KevsValueKindInteger},
+        {"max_len", KevsValueKindInteger}, {"pattern", KevsValueKindString},
+        {"items", KevsValueKindTable},     {"keys", KevsValueKindTable},
+    };
+    size_t f = 0;
+    while (f < sizeof(fields) / sizeof(fields[0]) &&
+           !str_equals(field, kevs_str_from_cstr(fields[f].name))) {
+      f++;
+    }
+    if (f == sizeof(fields) / sizeof(fields[0])) {
+      schema_compile_errorf(self, todo.name, "unknown field '%.*s'",
+                            (int)field.len, field.ptr);
+      return false;
+    }
+    if (v.kind != fields[f].kind) {
+      schema_compile_errorf(self, todo.name, "field '%s' is not %s",
+                            fields[f].name, kevs_valuekind_str(fields[f].kind));
+      return false;
+    }
+    const char *name = fields[f].name;
+
+    if (strcmp(name, "type") == 0) {
+      if (!schema_type(kevs_str_from_cstr(v.data.string), &r.type)) {
+        schema_compile_errorf(self, todo.name, "unknown type '%s'",
+                              v.data.string);
+        return false;
+      }
+      has_type = true;
+    } else if (strcmp(name, "optional") == 0) {
+      r.flags |= (v.data.boolean ? kSchemaOptional : 0);
+    } else if (strcmp(name, "strict") == 0) {
+      r.flags |= (v.data.boolean ? kSchemaStrict : 0);
+    } else if (strcmp(name, "min") == 0) {
+      r.flags |= kSchemaMin;
+      r.min = v.data.integer;
+    } else if (strcmp(name, "max") == 0) {
+      r.flags |= kSchemaMax;
+      r.max = v.data.integer;
+    } else if (strcmp(name, "min_len") == 0 || strcmp(name, "max_len") == 0) {
+      if (v.data.integer < 0) {
+        schema_compile_errorf(self, todo.name, "field '%s' is negative", name);
+        return false;
+      }
+      if (strcmp(name, "min_len") == 0) {
+        r.flags |= kSchemaMinLen;
+        r.min_len = (uint64_t)v.data.integer;
+      } else {
+        r.flags |= kSchemaMaxLen;
+        r.max_len = (uint64_t)v.data.integer;
+      }
+    } else if (strcmp(name, "pattern") == 0) {
+      if (!glob_valid(v.data.string)) {
+        schema_compile_errorf(self, todo.name, "invalid pattern '%s'",
+                              v.data.string);
+        return false;
+      }
+      r.pattern = schema_add_string(self, kevs_str_from_cstr(v.data.string));
+    } else if (strcmp(name, "items") == 0) {
+      items = &kv->val.data.table;
+    } else {
+      keys = &kv->val.data.table;
+    }
+  }
+
+  // the root is a table, other rules need a type
+  if (todo.rule == 0 && !has_type) {
+    r.type = KevsValueKindTable;
+    has_type = true;
+  }
+  if (!has_type) {
+    schema_compile_errorf(self, todo.name, "missing field 'type'");
+    return false;
+  }
+  if (todo.rule == 0 && r.type != KevsValueKindTable) {
+    schema_compile_errorf(self, todo.name, "root is not a table");
+    return false;
+  }
+
+  const bool is_int = r.type == KevsValueKindInteger;
+  const bool is_str = r.type == KevsValueKindString;
+  const bool is_list = r.type == KevsValueKindList;
+  const bool is_table = r.type == KevsValueKindTable;
+  const char *misplaced = NULL;
+  if ((r.flags & (kSchemaMin | kSchemaMax)) && !is_int) {
+    misplaced = "min and max are for integers";
+  } else if ((r.flags & (kSchemaMinLen | kSchemaMaxLen)) && !is_str &&
+             !is_list) {
+    misplaced = "min_len and max_len are for strings and lists";
+  } else if (r.pattern != kSchemaNone && !is_str) {
+    misplaced = "pattern is for strings";
+  } else if (items != NULL && !is_list) {
+    misplaced = "items is for lists";
+  } else if ((keys != NULL || (r.flags & kSchemaStrict)) && !is_table) {
+    misplaced = "keys and strict are for tables";
+  }
+  if (misplaced != NULL) {
+    schema_compile_errorf(self, todo.name, "%s", misplaced);
+    return false;
+  }
+
+  if (items != NULL) {
+    r.items = schema_add_rule(self, *items, kevs_str_from_cstr("items"));
+  }
+  if (keys != NULL && !schema_compile_keys(self, *keys, &r)) {
+    return false;
+  }
+
+  self->out->rules[todo.rule] = r;
+  return true;
+}
+
+KevsError kevs_schema_compile(KevsSchema *self, KevsTable schema,
+                              char *err_buf, size_t err_buf_len) {
+  assert(err_buf_len != 0);
+  assert(err_buf != NULL);
+
+  *self = (KevsSchema){};
+  SchemaCompiler c = {
+      .out = self,
+      .err_buf = err_buf,
+      .err_buf_len = err_buf_len,
+  };
+  schema_add_rule(&c, schema, kevs_str_from_cstr("(root)"));
+
+  bool ok = true;
+  while (ok && c.todo_len != 0) {
+    const SchemaTodo todo = c.todo[--c.todo_len];
+    ok = schema_compile_rule(&c, todo);
+  }
+  free(c.todo);
+  if (!ok) {
+    kevs_schema_free(self);
+    return err_buf;
+  }
+
+  // optional is known once all rules are compiled
+  for (size_t i = 0; i < self->rules_len; i++) {
+    SchemaRule *r = &self->rules[i];
+    for (uint32_t k = 0; k < r->keys_len; k++) {
+      const SchemaRule *kr = &self->rules[self->keys[r->keys + k].rule];
+      r->required += (kr->flags & kSchemaOptional ? 0 : 1);
+    }
+  }
+
+  return NULL;
+}
+
+void kevs_schema_free(KevsSchema *self) {
+  free(self->rules);
+  free(self->keys);
+  free(self->strings);
+  *self = (KevsSchema){};
+}
+
+typedef struct {
+  // list or table being visited, only the kind for events
+  KevsValue val;
+  // kSchemaNone if its entries are not checked
+  uint32_t rule;
+  // entries visited
+  size_t i;
+  // required keys seen in tables, for events the offset of the seen bits
+  size_t seen;
+  // how it was reached from the parent: by key, or by index in a list
+  KevsStr key;
+  size_t index;
+} SchemaFrame;
+
+typedef struct {
+  const KevsSchema *schema;
+  SchemaFrame *ptr;
+  size_t cap;
+  size_t len;
+  // key rules seen in open tables, used for events
+  uint64_t *seen;
+  size_t seen_cap;
+  size_t seen_len;
+  // the value being checked, in the innermost list or table
+  bool has_child;
+  KevsStr key;
+  size_t index;
+  // rule of the next value, for events
+  uint32_t next;
+  char *err_buf;
+  size_t err_buf_len;
+  bool failed;
+} SchemaRun;
+
+static void buf_vprintf(char **ptr, size_t *len, const char *fmt,
+                        va_list args) {
+  const int n = vsnprintf(*ptr, *len, fmt, args);
+  if (n < 0 || *len == 0) {
+    return;
+  }
+  // long paths are cut
+  const size_t used = ((size_t)n < *len ? (size_t)n : *len - 1);
+  *ptr += used;
+  *len -= used;
+}
+
+static void buf_printf(char **ptr, size_t *len, const char *fmt, ...) {
+  va_list args;
+  va_start(args, fmt);
+  buf_vprintf(ptr, len, fmt, args);
+  va_end(args);
+}
+
+// Report an error at the path of the innermost frame and child, if any.
+static bool schema_errorf(SchemaRun *self, const char *fmt, ...) {
+  char *ptr = self->err_buf;
+  size_t len = self->err_buf_len;
+  buf_printf(&ptr, &len, "schema: ");
+
+  bool any = false;
+  for (size_t k = 1; k <= self->len; k++) {
+    KevsStr key = self->key;
+    size_t index = self->index;
+    if (k < self->len) {
+      key = self->ptr[k].key;
+      index = self->ptr[k].index;
+    } else if (!self->has_child) {
+      break;
+    }
+    if (self->ptr[k - 1].val.kind == KevsValueKindList) {
+      buf_printf(&ptr, &len, "[%zu]", index);
+    } else {
+      buf_printf(&ptr, &len, "%s%.*s", (any ? "." : ""), (int)key.len,
+                 key.ptr);
+    }
+    any = true;
+  }
+  if (any) {
+    buf_printf(&ptr, &len, ": ");
+  }
+
+  va_list args;
+  va_start(args, fmt);
+  buf_vprintf(&ptr, &len, fmt, args);
+  va_end(args);
+
+  self->failed = true;
+  return false;
+}
+
+static void schema_push(SchemaRun *self, KevsValue val, uint32_t rule) {
+  if (self->len == self->cap) {
+    self->cap = self->cap == 0 ? 16 : self->cap * 2;
+    self->ptr = realloc(self->ptr, self->cap * sizeof(SchemaFrame));
+    assert(self->ptr != NULL);
+  }
+  self->ptr[self->len++] = (SchemaFrame){
+      .val = val,
+      .rule = rule,
+      .key = self->key,
+      .index = self->index,
+  };
+}
+
+static bool schema_check_kind(SchemaRun *self, const SchemaRule *r,
+                              KevsValueKind kind) {
+  if (r->type != KevsValueKindUndefined && r->type != kind) {
+    return schema_errorf(self, "is %s, want %s", kevs_valuekind_str(kind),
+                         kevs_valuekind_str(r->type));
+  }
+  return true;
+}
+
+static bool schema_check_int(SchemaRun *self, const SchemaRule *r,
+                             int64_t v) {
+  if ((r->flags & kSchemaMin) && v < r->min) {
+    return schema_errorf(self, "%" PRId64 " is less than %" PRId64, v,
+                         r->min);
+  }
+  if ((r->flags & kSchemaMax) && v > r->max) {
+    return schema_errorf(self, "%" PRId64 " is more than %" PRId64, v,
+                         r->max);
+  }
+  return true;
+}
+
+static bool schema_check_len(SchemaRun *self, const SchemaRule *r, size_t n) {
+  if ((r->flags & kSchemaMinLen) && n < r->min_len) {
+    return schema_errorf(self, "length %zu is less than %" PRIu64, n,
+                         r->min_len);
+  }
+  if ((r->flags & kSchemaMaxLen) && n > r->max_len) {
+    return schema_errorf(self, "length %zu is more than %" PRIu64, n,
+                         r->max_len);
+  }
+  return true;
+}
+
+static bool schema_check_string(SchemaRun *self, const SchemaRule *r,
+                                KevsStr s) {
+  if (!schema_check_len(self, r, s.len)) {
+    return false;
+  }
+  if (r->pattern != kSchemaNone &&
+      !glob_match(self->schema->strings + r->pattern, s)) {
+    return schema_errorf(self, "does not match '%s'",
+                         self->schema->strings + r->pattern);
+  }
+  return true;
+}
+
+// Check a value, lists and tables only by kind and length.
+static bool schema_check_value(SchemaRun *self, const SchemaRule *r,
+                               KevsValue v) {
+  if (!schema_check_kind(self, r, v.kind)) {
+    return false;
+  }
+  switch (v.kind) {
+  case KevsValueKindInteger:
+    return schema_check_int(self, r, v.data.integer);
+  case KevsValueKindString:
+    return schema_check_string(self, r, kevs_str_from_cstr(v.data.string));
+  case KevsValueKindList:
+    return schema_check_len(self, r, v.data.list.len);
+  default:
+    return true;
+  }
+}
+
+static bool schema_missing_key(SchemaRun *self, const SchemaRule *r,
+                               uint32_t k) {
+  const SchemaKey *key = &self->schema->keys[r->keys + k];
+  return schema_errorf(self, "missing key '%s'",
+                       self->schema->strings + key->name);
+}
+
+// Rule for a key of the table rule r, kSchemaNone if it's not checked.
+static bool schema_key_rule(SchemaRun *self, const SchemaRule *r, KevsStr key,
+                            uint32_t *out) {
+  *out = kSchemaNone;
+  const uint32_t k = schema_find_key(self->schema, r, key);
+  if (k == kSchemaNone) {
+    if (r->flags & kSchemaStrict) {
+      return schema_errorf(self, "unknown key");
+    }
+    return true;
+  }
+  *out = k;
+  return true;
+}
+
+KevsError kevs_schema_validate(const KevsSchema *self, KevsTable table,
+                               char *err_buf, size_t err_buf_len) {
+  assert(err_buf_len != 0);
+  assert(err_buf != NULL);
+
+  SchemaRun run = {
+      .schema = self,
+      .err_buf = err_buf,
+      .err_buf_len = err_buf_len,
+  };
+  const KevsValue root = {.kind = KevsValueKindTable, .data.table = table};
+  schema_push(&run, root, 0);
+
+  bool ok = true;
+  while (ok && run.len != 0) {
+    SchemaFrame *top = &run.ptr[run.len - 1];
+    const SchemaRule *r = &self->rules[top->rule];
+    run.has_child = false;
+
+    KevsValue v = {};
+    uint32_t rule = kSchemaNone;
+    if (top->val.kind == KevsValueKindTable) {
+      const KevsTable t = top->val.data.table;
+      if (top->i == t.len) {
+        if (top->seen < r->required) {
+          // keys are unique, so some required key is missing
+          for (uint32_t k = 0; k < r->keys_len; k++) {
+            const SchemaKey *key = &self->keys[r->keys + k];
+            if (!(self->rules[key->rule].flags & kSchemaOptional) &&
+                !kevs_table_has(t, self->strings + key->name)) {
+              ok = schema_missing_key(&run, r, k);
+              break;
+            }
+          }
+        }
+        run.len--;
+        continue;
+      }
+      const KevsKeyValue kv = t.ptr[top->i++];
+      run.has_child = true;
+      run.key = kv.key;
+      uint32_t k = kSchemaNone;
+      ok = schema_key_rule(&run, r, kv.key, &k);
+      if (!ok || k == kSchemaNone) {
+        continue;
+      }
+      rule = self->keys[k].rule;
+      top->seen += (self->rules[rule].flags & kSchemaOptional ? 0 : 1);
+      v = kv.val;
+    } else {
+      const KevsList l = top->val.data.list;
+      if (top->i == l.len) {
+        run.len--;
+        continue;
+      }
+      run.has_child = true;
+      run.index = top->i++;
+      rule = r->items;
+      kevs_list_value(l, run.index, &v);
+    }
+
+    const SchemaRule *vr = &self->rules[rule];
+    ok = schema_check_value(&run, vr, v);
+    // any doesn't check what's inside
+    const bool nested =
+        (v.kind == KevsValueKindTable ||
+         (v.kind == KevsValueKindList && vr->items != kSchemaNone));
+    if (ok && nested && vr->type != KevsValueKindUndefined) {
+      schema_push(&run, v, rule);
+    }
+  }
+  free(run.ptr);
+
+  return ok ? NULL : err_buf;
+}
+
+// Events: the frames follow the scanner, also through unchecked values.
+
+static uint32_t schema_next_rule(SchemaRun *self) {
+  SchemaFrame *top = &self->ptr[self->len - 1];
+  self->has_child = true;
+  if (top->val.kind == KevsValueKindList) {
+    self->index = top->i++;
+    return (top->rule == kSchemaNone ? kSchemaNone
+                                     : self->schema->rules[top->rule].items);
+  }
+  return self->next;
+}
+
+static bool schema_on_key(void *ctx, KevsStr key) {
+  SchemaRun *self = ctx;
+  SchemaFrame *top = &self->ptr[self->len - 1];
+  self->has_child = true;
+  self->key = key;
+  self->next = kSchemaNone;
+  if (top->rule == kSchemaNone) {
+    return true;
+  }
+
+  const SchemaRule *r = &self->schema->rules[top->rule];
+  uint32_t k = kSchemaNone;
+  if (!schema_key_rule(self, r, key, &k)) {
+    return false;
+  }
+  if (k != kSchemaNone) {
+    const size_t bit = k - r->keys;
+    self->seen[top->seen + bit / 64] |= (uint64_t)1 << (bit % 64);
+    self->next = self->schema->keys[k].rule;
+  }
+  return true;
+}
+
+static bool schema_on_scalar(void *ctx, KevsValueKind kind, KevsStr raw) {
+  SchemaRun *self = ctx;
+  const uint32_t rule = schema_next_rule(self);
+  if (rule == kSchemaNone) {
+    return true;
+  }
+
+  const SchemaRule *r = &self->schema->rules[rule];
+  if (!schema_check_kind(self, r, kind)) {
+    return false;
+  }
+  if (kind == KevsValueKindInteger && (r->flags & (kSchemaMin | kSchemaMax))) {
+    int64_t v = 0;
+    KevsError err = kevs_scalar_int(raw, &v);
+    if (err != NULL) {
+      return schema_errorf(self, "%s", err);
+    }
+    return schema_check_int(self, r, v);
+  }
+  if (kind == KevsValueKindString &&
+      ((r->flags & (kSchemaMinLen | kSchemaMaxLen)) ||
+       r->pattern != kSchemaNone)) {
+    char *s = NULL;
+    KevsError err = kevs_scalar_string(raw, &s);
+    if (err != NULL) {
+      return schema_errorf(self, "%s", err);
+    }
+    const bool ok = schema_check_string(self, r, kevs_str_from_cstr(s));
+    free(s);
+    return ok;
+  }
+  return true;
+}
+
+static void schema_open(SchemaRun *self, KevsValueKind kind, uint32_t rule) {
+  schema_push(self, (KevsValue){.kind = kind}, rule);
+  SchemaFrame *top = &self->ptr[self->len - 1];
+  top->seen = self->seen_len;
+  if (kind == KevsValueKindTable && rule != kSchemaNone) {
+    const size_t words = (self->schema->rules[rule].keys_len + 63) / 64;
+    if (self->seen_len + words > self->seen_cap) {
+      self->seen_cap = (self->seen_len + words) * 2;
+      self->seen = realloc(self->seen, self->seen_cap * sizeof(uint64_t));
+      assert(self->seen != NULL);
+    }
+    memset(self->seen + self->seen_len, 0, words * sizeof(uint64_t));
+    self->seen_len += words;
+  }
+  self->has_child = false;
+}
+
+static bool schema_on_begin(SchemaRun *self, KevsValueKind kind) {
+  uint32_t rule = schema_next_rule(self);
+  if (rule != kSchemaNone) {
+    const SchemaRule *r = &self->schema->rules[rule];
+    if (!schema_check_kind(self, r, kind)) {
+      return false;
+    }
+    // any doesn't check what's inside
+    if (r->type == KevsValueKindUndefined) {
+      rule = kSchemaNone;
+    }
+  }
+  schema_open(self, kind, rule);
+  return true;
+}
+
+static bool schema_on_end(void *ctx) {
+  SchemaRun *self = ctx;
+  SchemaFrame *top = &self->ptr[self->len - 1];
+  self->has_child = false;
+
+  if (top->rule != kSchemaNone) {
+    const SchemaRule *r = &self->schema->rules[top->rule];
+    if (top->val.kind == KevsValueKindList) {
+      if (!schema_check_len(self, r, top->i)) {
+        return false;
+      }
+    } else {
+      for (uint32_t k = 0; k < r->keys_len; k++) {
+        const bool seen = self->seen[top->seen + k / 64] >> (k % 64) & 1;
+        const SchemaKey *key = &self->schema->keys[r->keys + k];
+        const SchemaRule *kr = &self->schema->rules[key->rule];
+        if (!seen && !(kr->flags & kSchemaOptional)) {
+          return schema_missing_key(self, r, k);
+        }
+      }
+    }
+  }
+
+  self->seen_len = top->seen;
+  self->len--;
+  return true;
+}
+
+static bool schema_on_begin_table(void *ctx) {
+  return schema_on_begin(ctx, KevsValueKindTable);
+}
+
+static bool schema_on_begin_list(void *ctx) {
+  return schema_on_begin(ctx, KevsValueKindList);
+}
+
+KevsError kevs_schema_validate_events(const KevsSchema *self, KevsStr content,
+                                      char *err_buf, size_t err_buf_len,
+                                      KevsOpts opts) {
+  assert(err_buf_len != 0);
+  assert(err_buf != NULL);
+
+  SchemaRun run = {
+      .schema = self,
+      .err_buf = err_buf,
+      .err_buf_len = err_buf_len,
+  };
+  // the root has no begin event
+  schema_open(&run, KevsValueKindTable, 0);
+
+  const KevsEvents events = {
+      .key = schema_on_key,
+      .scalar = schema_on_scalar,
+      .begin_table = schema_on_begin_table,
+      .end_table = schema_on_end,
+      .begin_list = schema_on_begin_list,
+      .end_list = schema_on_end,
+  };
+  // scan errors go to their own buffer, stopping would overwrite ours,
+  // sized like ours as they may hold a long file name
+  char *scan_err = malloc(err_buf_len + 1);
+  assert(scan_err != NULL);
+  scan_err[0] = 0;
+  KevsError err = kevs_parse_events(content, &events, &run, scan_err,
+                                    err_buf_len, opts);
+  if (err == NULL) {
+    schema_on_end(&run);
+  } else if (!run.failed) {
+    snprintf(err_buf, err_buf_len, "%s", scan_err);
+  }
+
+  free(scan_err);
+  free(run.ptr);
+  free(run.seen);
+
+  return run.failed || err != NULL ? err_buf : NULL;
+}
+
+static bool value_is(KevsValue self, KevsValueKind kind) {
+  return self.kind == kind;
+}
+
+static KevsError table_get(KevsTable self, const char *key, KevsValue *val) {
+  KevsStr key_str = kevs_str_from_cstr(key);
+  for (size_t i = 0; i < self.len; i++) {
+    if (str_equals(self.ptr[i].key, key_str)) {
+      *val = self.ptr[i].val;
+      return NULL;
+    }
+  }
+  return "key not found";
+}
+
+KevsError kevs_table_string(KevsTable self, const char *key, char **out) {
+  KevsValue val = {};
+  KevsError err = table_get(self, key, &val);
+  if (err != NULL) {
+    return err;
+  }
+  if (!value_is(val, KevsValueKindString)) {
+    return "value is not string";
+  }
+  *out = val.data.string;
+  return NULL;
+}
+
+KevsError kevs_table_int(KevsTable self, const char *key, int64_t *out) {
+  KevsValue val = {};
+  KevsError err = table_get(self, key, &val);
+  if (err != NULL) {
+    return err;
+  }
+  if (!value_is(val, KevsValueKindInteger)) {
+    return "value is not integer";
+  }
+  *out = val.data.integer;
+  return NULL;
+}
+
+KevsError kevs_table_bool(KevsTable self, const char *key, bool *out) {
+  KevsValue val = {};
+  KevsError err = table_get(self, key, &val);
+  if (err != NULL) {
+    return err;
+  }
+  if (!value_is(val, KevsValueKindBoolean)) {
+    return "value is not boolean";
+  }
+  *out = val.data.boolean;
+  return NULL;
+}
+
+KevsError kevs_table_list(KevsTable self, const char *key, KevsList *out) {
+  KevsValue val = {};
+  KevsError err = table_get(self, key, &val);
+  if (err != NULL) {
+    return err;
+  }
+  if (!value_is(val, KevsValueKindList)) {
+    return "value is not list";
+  }
+  *out = val.data.list;
+  return NULL;
+}
+
+KevsError kevs_table_table(KevsTable self, const char *key, KevsTable *out) {
+  KevsValue val = {};
+  KevsError err = table_get(self, key, &val);
+  if (err != NULL) {
+    return err;
+  }
+  if (!value_is(val, KevsValueKindTable)) {
+    return "value is not table";
+  }
+  *out = val.data.table;
+  return NULL;
+}
+
+bool kevs_table_has(KevsTable self, const char *key) {
+  KevsStr key_str = kevs_str_from_cstr(key);
+  for (size_t i = 0; i < self.len; i++) {
+    if (str_equals(self.ptr[i].key, key_str)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static KevsError doc_symbols(KevsTable doc, const Symbols **out) {
+  if (!(doc.flags & KevsFlagArenaRoot) || !(doc.flags & KevsFlagInterned)) {
+    return "document keys are not interned";
+  }
+  *out = &doc_header(doc)->symbols;
+  return NULL;
+}
+
+size_t kevs_symbol_count(KevsTable doc) {
+  const Symbols *symbols = NULL;
+  if (doc_symbols(doc, &symbols) != NULL) {
+    return 0;
+  }
+  return symbols->len;
+}
+
+KevsError kevs_symbol_id(KevsTable doc, const char *key, uint32_t *out) {
+  const Symbols *symbols = NULL;
+  KevsError err = doc_symbols(doc, &symbols);
+  if (err != NULL) {
+    return err;
+  }
+  if (!symbols_find(symbols, kevs_str_from_cstr(key), out)) {
+    return "key not found";
+  }
+  return NULL;
+}
+
+KevsError kevs_symbol_key(KevsTable doc, uint32_t id, KevsStr *out) {
+  const Symbols *symbols = NULL;
+  KevsError err = doc_symbols(doc, &symbols);
+  if (err != NULL) {
+    return err;
+  }
+  if (id >= symbols->len) {
+    return "id out of bounds";
+  }
+  *out = symbols->ptr[id];
+  return NULL;
+}
+
+KevsError kevs_table_key_id(KevsTable self, size_t i, uint32_t *out) {
+  if (!(self.flags & KevsFlagInterned)) {
+    return "table keys are not interned";
+  }
+  if (i >= self.len) {
+    return "index out of bounds";
+  }
+  *out = symbol_id(self.ptr[i].key);
+  return NULL;
+}
+
+KevsError kevs_table_get_id(KevsTable self, uint32_t id, KevsValue *out) {
+  if (!(self.flags & KevsFlagInterned)) {
+    return "table keys are not interned";
+  }
+  for (size_t i = 0; i < self.len; i++) {
+    if (symbol_id(self.ptr[i].key) == id) {
+      *out = self.ptr[i].val;
+      return NULL;
+    }
+  }
+  return "key not found";
+}
+
+static KevsError list_get(KevsList self, size_t i, KevsValue *val) {
+  if (i >= self.len) {
+    return "index out of bounds";
+  }
+  if (self.flags & KevsFlagPackedInts) {
+    const int64_t *ints = (const int64_t *)self.ptr;
+    *val = (KevsValue){
+        .kind = KevsValueKindInteger,
+        .data.integer = ints[i],
+    };
+    return NULL;
+  }
+  if (self.flags & KevsFlagPackedBools) {
+    const uint64_t *bools = (const uint64_t *)self.ptr;
+    *val = (KevsValue){
+        .kind = KevsValueKindBoolean,
+        .data.boolean = (bools[i / 64] >> (i % 64)) & 1,
+    };
+    return NULL;
+  }
+  *val = self.ptr[i];
+  return NULL;
+}
+
+KevsError kevs_list_value(KevsList self, size_t i, KevsValue *out) {
+  return list_get(self, i, out);
+}
+
+KevsError kevs_list_ints(KevsList self, const int64_t **out) {
+  if (!(self.flags & KevsFlagPackedInts)) {
+    return "list is not packed integers";
+  }
+  *out = (const int64_t *)self.ptr;
+  return NULL;
+}
+
+KevsError kevs_list_bools(KevsList self, const uint64_t **out) {
+  if (!(self.flags & KevsFlagPackedBools)) {
+    return "list is not packed booleans";
+  }
+  *out = (const uint64_t *)self.ptr;
+  return NULL;
+}
+
+KevsError kevs_list_string(KevsList self, size_t i, char **out) {
+  KevsValue val = {};
+  KevsError err = list_get(self, i, &val);
+  if (err != NULL) {
+    return err;
+  }
+  if (!value_is(val, KevsValueKindString)) {
+    return "value is not string";
+  }
+  *out = val.data.string;
+  return NULL;
+}
+
+KevsError kevs_list_int(KevsList self, size_t i, int64_t *out) {
+  KevsValue val = {};
+  KevsError err = list_get(self, i, &val);
+  if (err != NULL) {
+    return err;
+  }
+  if (!value_is(val, KevsValueKindInteger)) {
+    return "value is not integer";
+  }
+  *out = val.data.integer;
+  return NULL;
+}
+
+KevsError kevs_list_bool(KevsList self, size_t i, bool *out) {
+  KevsValue val = {};
+  KevsError err = list_get(self, i, &val);
+  if (err != NULL) {
+    return err;
+  }
+  if (!value_is(val, KevsValueKindBoolean)) {
+    return "value is not boolean";
+  }
+  *out = val.data.boolean;
+  return NULL;
+}
+
+KevsError kevs_list_list(KevsList self, size_t i, KevsList *out) {
+  KevsValue val = {};
+  KevsError err = list_get(self, i, &val);
+  if (err != NULL) {
+    return err;
+  }
+  if (!value_is(val, KevsValueKindList)) {
+    return "value is not list";
+  }
+  *out = val.data.list;
+  return NULL;
+}
+
+KevsError kevs_list_table(KevsList self, size_t i, KevsTable *out) {
+  KevsValue val = {};
+  KevsError err = list_get(self, i, &val);
+  if (err != NULL) {
+    return err;
+  }
+  if (!value_is(val, KevsValueKindTable)) {
+    return "value is not table";
+  }
+  *out = val.data.table;
+  return NULL;
+}
+
+static KevsValue *builder_top(const KevsBuilder *self) {
+  if (self->stack_len == 0) {
+    return NULL;
+  }
+  return self->stack[self->stack_len - 1];
+}
+
+static void builder_push(KevsBuilder *self, KevsValue *v) {
+  if (self->stack_len == self->stack_cap) {
+    const size_t cap = (self->stack_cap + 1) * 2;
+    KevsValue **ptr = realloc(self->stack, cap * sizeof(KevsValue *));
+    assert(ptr != NULL);
+    self->stack_cap = cap;
+    self->stack = ptr;
+  }
+  self->stack[self->stack_len] = v;
+  self->stack_len += 1;
+}
+
+// Append an empty value to the current list or table and return it.
+static KevsError builder_slot(KevsBuilder *self, const char *key,
+                              KevsValue **out) {
+  KevsValue *top = builder_top(self);
+
+  if (top != NULL && top->kind == KevsValueKindList) {
+    if (key != NULL) {
+      return "key must be NULL when adding to a list";
+    }
+    KevsList *list = &top->data.list;
+    if (list->len == UINT32_MAX) {
+      return "list has more than 4294967295 elements";
+    }
+    arena_list_append(&self->arena, list, (KevsValue){});
+    *out = &list->ptr[list->len - 1];
+    return NULL;
+  }
+
+  KevsTable *table = (top == NULL ? &self->root : &top->data.table);
+
+  if (key == NULL) {
+    return "key is required when adding to a table";
+  }
+  const KevsStr key_str = kevs_str_from_cstr(key);
+  if (key_str.len == 0 || !is_identifier(key_str)) {
+    return "key is not a valid identifier";
+  }
+  for (size_t i = 0; i < table->len; i++) {
+    if (str_equals(table->ptr[i].key, key_str)) {
+      return "key is not unique for current table";
+    }
+  }
+
+  if (table->len == UINT32_MAX) {
+    return "table has more than 4294967295 keys";
+  }
+
+  const KevsKeyValue kv = {
+      .key = {.ptr = arena_str_dup(&self->arena, key_str), .len = key_str.len},
+  };
+  arena_table_append(&self->arena, table, kv);
+  *out = &table->ptr[table->len - 1].val;
+
+  return NULL;
+}
+
+KevsError kevs_builder_reserve(KevsBuilder *self, size_t cap) {
+  if (cap > UINT32_MAX) {
+    return "capacity is more than 4294967295";
+  }
+  KevsValue *top = builder_top(self);
+  if (top != NULL && top->kind == KevsValueKindList) {
+    if (cap > top->data.list.cap) {
+      arena_list_reserve(&self->arena, &top->data.list, cap);
+    }
+    return NULL;
+  }
+  KevsTable *table = (top == NULL ? &self->root : &top->data.table);
+  if (cap > table->cap) {
+    arena_table_reserve(&self->arena, table, cap);
+  }
+  return NULL;
+}
+
+KevsError kevs_builder_table_begin(KevsBuilder *self, const char *key,
+                                   size_t cap) {
+  if (cap > UINT32_MAX) {
+    return "capacity is more than 4294967295";
+  }
+  KevsValue *v = NULL;
+  KevsError err = builder_slot(self, key, &v);
+  if (err != NULL) {
+    return err;
+  }
+  v->kind = KevsValueKindTable;
+  v->data.table.flags = KevsFlagArena;
+  if (cap != 0) {
+    arena_table_reserve(&self->arena, &v->data.table, cap);
+  }
+  builder_push(self, v);
+  return NULL;
+}
+
+KevsError kevs_builder_table_end(KevsBuilder *self) {
+  const KevsValue *top = builder_top(self);
+  if (top == NULL || top->kind != KevsValueKindTable) {
+    return "no table to end";
+  }
+  self->stack_len -= 1;
+  return NULL;
+}
+
+KevsError kevs_builder_list_begin(KevsBuilder *self, const char *key,
+                                  size_t cap) {
+  if (cap > UINT32_MAX) {
+    return "capacity is more than 4294967295";
+  }
+  KevsValue *v = NULL;
+  KevsError err = builder_slot(self, key, &v);
+  if (err != NULL) {
+    return err;
+  }
+  v->kind = KevsValueKindList;
+  v->data.list.flags = KevsFlagArena;
+  if (cap != 0) {
+    arena_list_reserve(&self->arena, &v->data.list, cap);
+  }
+  builder_push(self, v);
+  return NULL;
+}
+
+KevsError kevs_builder_list_end(KevsBuilder *self) {
+  const KevsValue *top = builder_top(self);
+  if (top == NULL || top->kind != KevsValueKindList) {
+    return "no list to end";
+  }
+  self->stack_len -= 1;
+  return NULL;
+}
+
+KevsError kevs_builder_add_string(KevsBuilder *self, const char *key,
+                                  const char *val) {
+  KevsValue *v = NULL;
+  KevsError err = builder_slot(self, key, &v);
+  if (err != NULL) {
+    return err;
+  }
+  v->kind = KevsValueKindString;
+  v->data.string = arena_str_dup(&self->arena, kevs_str_from_cstr(val));
+  return NULL;
+}
+
+KevsError kevs_builder_add_int(KevsBuilder *self, const char *key,
+                               int64_t val) {
+  KevsValue *v = NULL;
+  KevsError err = builder_slot(self, key, &v);
+  if (err != NULL) {
+    return err;
+  }
+  v->kind = KevsValueKindInteger;
+  v->data.integer = val;
+  return NULL;
+}
+
+KevsError kevs_builder_add_bool(KevsBuilder *self, const char *key, bool val) {
+  KevsValue *v = NULL;
+  KevsError err = builder_slot(self, key, &v);
+  if (err != NULL) {
+    return err;
+  }
+  v->kind = KevsValueKindBoolean;
+  v->data.boolean = val;
+  return NULL;
+}
+
+KevsError kevs_builder_finish(KevsBuilder *self, KevsTable *out) {
+  if (self->stack_len != 0) {
+    return "list or table is not ended";
+  }
+  doc_finish(&self->arena, self->root, NULL, true, out);
+  self->root = (KevsTable){};
+  return NULL;
+}
+
+void kevs_builder_free(KevsBuilder *self) {
+  arena_free(&self->arena);
+  free(self->stack);
+  *self = (KevsBuilder){};
+}
+
+// Cell layout:
+//   bytes[0]       kind in the low 3 bits, kCellInline for inline strings
+//   integer        words[1]
+//   boolean        bytes[1]
+//   inline string  bytes[1] is the length, bytes[2..15] the chars
+//   string         bytes[1..7] is the length, words[1] points to the chars
+//   list, table    words[1] points to CellList or CellTable
+static const uint8_t kCellKindMask = 0x7;
+static const uint8_t kCellInline = 0x8;
+static const size_t kCellInlineMax = 14;
+
+typedef struct {
+  size_t len;
+  KevsCell ptr[];
+} CellList;
+
+// CellTable is followed by the key ids, one uint32_t for each value.
+typedef struct {
+  size_t len;
+  KevsCell vals[];
+} CellTable;
+
+static const uint32_t *cell_table_keys(const CellTable *self) {
+  return (const uint32_t *)(self->vals + self->len);
+}
+
+static void cell_set_ptr(KevsCell *self, KevsValueKind kind, const void *ptr) {
+  self->bytes[0] = (uint8_t)kind;
+  self->words[1] = (uint64_t)(uintptr_t)ptr;
+}
+
+static const void *cell_ptr(KevsCell self) {
+  return (const void *)(uintptr_t)self.words[1];
+}
+
+typedef struct {
+  ArenaBlock *arena;
+  Symbols symbols;
+} CellBuilder;
+
+// List or table whose values are being converted, out holds its cells.
+typedef struct {
+  KevsValue v;
+  KevsCell *out;
+  uint32_t *keys;
+  size_t i;
+} CellFrame;
+
+typedef struct {
+  CellFrame *ptr;
+  size_t cap;
+  size_t len;
+} CellStack;
+
+static void cell_stack_push(CellStack *self, CellFrame frame) {
+  if (self->len == self->cap) {
+    self->cap = self->cap == 0 ? 16 : self->cap * 2;
+    self->ptr = realloc(self->ptr, self->cap * sizeof(CellFrame));
+    assert(self->ptr != NULL);
+  }
+  self->ptr[self->len++] = frame;
+}
+
+// Convert a value, the cells of a list or table are left to the caller.
+static void cell_from_value(CellBuilder *self, KevsValue v, KevsCell *out,
+                            CellStack *stack) {
+  *out = (KevsCell){};
+
+  switch (v.kind) {
+  case KevsValueKindInteger: {
+    out->bytes[0] = KevsValueKindInteger;
+    out->words[1] = (uint64_t)v.data.integer;
+  } break;
+
+  case KevsValueKindBoolean: {
+    out->bytes[0] = KevsValueKindBoolean;
+    out->bytes[1] = v.data.boolean;
+  } break;
+
+  case KevsValueKindString: {
+    const size_t len = strlen(v.data.string);
+    if (len <= kCellInlineMax) {
+      out->bytes[0] = KevsValueKindString | kCellInline;
+      out->bytes[1] = (uint8_t)len;
+      memcpy(&out->bytes[2], v.data.string, len);
+    } else {
+      const KevsStr s = {.ptr = v.data.string, .len = len};
+      cell_set_ptr(out, KevsValueKindString, arena_str_dup(&self->arena, s));
+      for (size_t i = 0; i < 7; i++) {
+        out->bytes[1 + i] = (uint8_t)(len >> (8 * i));
+      }
+    }
+  } break;
+
+  case KevsValueKindList: {
+    const KevsList list = v.data.list;
+    CellList *cl = arena_alloc(&self->arena,
+                               sizeof(CellList) + list.len * sizeof(KevsCell));
+    cl->len = list.len;
+    cell_set_ptr(out, KevsValueKindList, cl);
+    cell_stack_push(stack, (CellFrame){.v = v, .out = cl->ptr});
+  } break;
+
+  case KevsValueKindTable: {
+    const KevsTable table = v.data.table;
+    const size_t size =
+        sizeof(CellTable) + table.len * (sizeof(KevsCell) + sizeof(uint32_t));
+    CellTable *ct = arena_alloc(&self->arena, size);
+    ct->len = table.len;
+    cell_set_ptr(out, KevsValueKindTable, ct);
+    cell_stack_push(stack,
+                    (CellFrame){.v = v,
+                                .out = ct->vals,
+                                .keys = (uint32_t *)cell_table_keys(ct)});
+  } break;
+
+  default:
+    break;
+  }
+}
+
+// Iterative, so deeply nested documents don't overflow the C stack.
+static void cell_from_table(CellBuilder *self, KevsTable table,
+                            KevsCell *out) {
+  CellStack stack = {};
+  const KevsValue root = {.kind = KevsValueKindTable, .data.table = table};
+  cell_from_value(self, root, out, &stack);
+  while (stack.len != 0) {
+    CellFrame *top = &stack.ptr[stack.len - 1];
+    const bool is_table = top->v.kind == KevsValueKindTable;
+    const size_t len =
+        is_table ? top->v.data.table.len : top->v.data.list.len;
+    if (top->i == len) {
+      stack.len--;
+      continue;
+    }
+    const size_t i = top->i++;
+    KevsCell *cell = &top->out[i];
+
+    KevsValue elem = {};
+    if (is_table) {
+      const KevsKeyValue *kv = &top->v.data.table.ptr[i];
+      const KevsStr key = symbols_intern(&self->symbols, &self->arena, kv->key);
+      top->keys[i] = symbol_id(key);
+      elem = kv->val;
+    } else {
+      list_get(top->v.data.list, i, &elem);
+    }
+    // may grow the stack, top is not used after
+    cell_from_value(self, elem, cell, &stack);
+  }
+  free(stack.ptr);
+}
+
+KevsError kevs_cell_from_table(KevsCellDoc *doc, KevsTable table) {
+  CellBuilder b = {};
+
+  cell_from_table(&b, table, &doc->root);
+
+  Symbols *symbols = arena_alloc(&b.arena, sizeof(Symbols));
+  symbols_copy(&b.symbols, &b.arena, symbols);
+  symbols_free(&b.symbols);
+
+  doc->arena = b.arena;
+  doc->symbols = symbols;
+
+  return NULL;
+}
+
+KevsError kevs_cell_parse(KevsCellDoc *doc, KevsStr content, char *err_buf,
+                          size_t err_buf_len, KevsOpts opts) {
+  // the intermediate document comes from one arena, cheap to drop after
+  opts.intern_keys = true;
+
+  KevsTable table = {};
+  KevsError err = kevs_parse(&table, content, err_buf, err_buf_len, opts);
+  if (err == NULL) {
+    err = kevs_cell_from_table(doc, table);
+  }
+  kevs_free(&table);
+
+  return err;
+}
+
+void kevs_cell_free(KevsCellDoc *self) {
+  arena_free(&self->arena);
+  *self = (KevsCellDoc){};
+}
+
+KevsValueKind kevs_cell_kind(KevsCell self) {
+  return (KevsValueKind)(self.bytes[0] & kCellKindMask);
+}
+
+KevsError kevs_cell_int(KevsCell self, int64_t *out) {
+  if (kevs_cell_kind(self) != KevsValueKindInteger) {
+    return "value is not integer";
+  }
+  *out = (int64_t)self.words[1];
+  return NULL;
+}
+
+KevsError kevs_cell_bool(KevsCell self, bool *out) {
+  if (kevs_cell_kind(self) != KevsValueKindBoolean) {
+    return "value is not boolean";
+  }
+  *out = self.bytes[1] != 0;
+  return NULL;
+}
+
+KevsError kevs_cell_string(const KevsCell *self, KevsStr *out) {
+  if (kevs_cell_kind(*self) != KevsValueKindString) {
+    return "value is not string";
+  }
+  if (self->bytes[0] & kCellInline) {
+    out->ptr = (const char *)&self->bytes[2];
+    out->len = self->bytes[1];
+    return NULL;
+  }
+  size_t len = 0;
+  for (size_t i = 0; i < 7; i++) {
+    len |= (size_t)self->bytes[1 + i] << (8 * i);
+  }
+  out->ptr = cell_ptr(*self);
+  out->len = len;
+  return NULL;
+}
+
+size_t kevs_cell_len(KevsCell self) {
+  switch (kevs_cell_kind(self)) {
+  case KevsValueKindList:
+    return ((const CellList *)cell_ptr(self))->len;
+  case KevsValueKindTable:
+    return ((const CellTable *)cell_ptr(self))->len;
+  default:
+    return 0;
+  }
+}
+
+KevsError kevs_cell_list_get(KevsCell self, size_t i, const KevsCell **out) {
+  if (kevs_cell_kind(self) != KevsValueKindList) {
+    return "value is not list";
+  }
+  const CellList *cl = cell_ptr(self);
+  if (i >= cl->len) {
+    return "index out of bounds";
+  }
+  *out = &cl->ptr[i];
+  return NULL;
+}
+
+KevsError kevs_cell_table_entry(KevsCell self, size_t i, uint32_t *key_id,
+                                const KevsCell **out) {
+  if (kevs_cell_kind(self) != KevsValueKindTable) {
+    return "value is not table";
+  }
+  const CellTable *ct = cell_ptr(self);
+  if (i >= ct->len) {
+    return "index out of bounds";
+  }
+  *key_id = cell_table_keys(ct)[i];
+  *out = &ct->vals[i];
+  return NULL;
+}
+
+KevsError kevs_cell_table_get(const KevsCellDoc *doc, KevsCell self,
+                              const char *key, const KevsCell **out) {
+  if (kevs_cell_kind(self) != KevsValueKindTable) {
+    return "value is not table";
+  }
+  uint32_t id = 0;
+  if (!symbols_find(doc->symbols, kevs_str_from_cstr(key), &id)) {
+    return "key not found";
+  }
+  const CellTable *ct = cell_ptr(self);
+  const uint32_t *keys = cell_table_keys(ct);
+  for (size_t i = 0; i < ct->len; i++) {
+    if (keys[i] == id) {
+      *out = &ct->vals[i];
+      return NULL;
+    }
+  }
+  return "key not found";
+}
+
+KevsError kevs_cell_key(const KevsCellDoc *doc, uint32_t id, KevsStr *out) {
+  if (id >= doc->symbols->len) {
+    return "id out of bounds";
+  }
+  *out = doc->symbols->ptr[id];
+  return NULL;
+}
+
+static const uint64_t kTapePayloadMask = ((uint64_t)1 << 56) - 1;
+
+static uint64_t tape_entry(char type, uint64_t payload) {
+  assert(payload <= kTapePayloadMask);
+  return ((uint64_t)(uint8_t)type << 56) | payload;
+}
+
+static char tape_type(uint64_t entry) { return (char)(entry >> 56); }
+
+static uint64_t tape_payload(uint64_t entry) {
+  return entry & kTapePayloadMask;
+}
+
+static KevsStr tape_str(KevsTape self, uint64_t offset) {
+  uint64_t len = 0;
+  memcpy(&len, self.strings + offset, sizeof(len));
+  const KevsStr s = {.ptr = self.strings + offset + sizeof(len), .len = len};
+  return s;
+}
+
+size_t kevs_tape_next(KevsTape self, size_t i) {
+  assert(i < self.len);
+  const uint64_t entry = self.ptr[i];
+  switch (tape_type(entry)) {
+  case '{':
+  case '[':
+    return tape_payload(entry);
+  case 'i':
+    return i + 2;
+  default:
+    return i + 1;
+  }
+}
+
+typedef struct {
+  Parser p;
+  KevsTape tape;
+  size_t strings_len;
+  // begin entry of the innermost open list or table
+  size_t open;
+} TapeBuilder;
+
+static void tape_append(TapeBuilder *self, uint64_t entry) {
+  self->tape.ptr[self->tape.len] = entry;
+  self->tape.len += 1;
+}
+
+// Start a string at the end of the string buffer, returns its offset.
+static uint64_t tape_reserve_str(TapeBuilder *self, char **out) {
+  const uint64_t offset = self->strings_len;
+  *out = self->tape.strings + offset + sizeof(uint64_t);
+  return offset;
+}
+
+static void tape_commit_str(TapeBuilder *self, uint64_t offset, uint64_t len) {
+  memcpy(self->tape.strings + offset, &len, sizeof(len));
+  self->tape.strings[offset + sizeof(len) + len] = 0;
+  self->strings_len = offset + sizeof(len) + len + 1;
 }
 
-static bool parse_simple_value(Parser *self, KevsValue *out) {
-  if (!parser_expect(self, KevsTokenKindValue)) {
-    parse_errorf(self, "expected value token");
+static bool tape_key(TapeBuilder *self, KevsStr key) {
+  if (!is_identifier(key)) {
+    char *s = kevs_str_dup(key);
+    parse_errorf(&self->p, "key is not a valid identifier: '%s'", s);
+    free(s);
     return false;
   }
 
-  const KevsStr val = parser_get(self).value;
+  // check if key is unique, entries of the open table are key, value pairs
+  for (size_t i = self->open + 1; i < self->tape.len;) {
+    if (str_equals(tape_str(self->tape, tape_payload(self->tape.ptr[i])),
+                   key)) {
+      char *s = kevs_str_dup(key);
+      parse_errorf(&self->p, "key '%s' is not unique for current table", s);
+      free(s);
+      return false;
+    }
+    i = kevs_tape_next(self->tape, i + 1);
+  }
 
-  bool ok = true;
+  char *dst = NULL;
+  const uint64_t offset = tape_reserve_str(self, &dst);
+  memcpy(dst, key.ptr, key.len);
+  tape_commit_str(self, offset, key.len);
+  tape_append(self, tape_entry('k', offset));
+
+  return true;
+}
 
+static bool tape_simple_value(TapeBuilder *self, KevsStr val) {
   if (str_starts_with_char(val, kStringBegin)) {
-    char *data = NULL;
-    KevsError err = str_norm(str_slice(val, 1, val.len - 1), &data);
+    const KevsStr raw = str_slice(val, 1, val.len - 1);
+    String dst = {.cap = raw.len};
+    const uint64_t offset = tape_reserve_str(self, &dst.ptr);
+    dst.ptr[0] = 0;
+    KevsError err = str_norm(raw, &dst);
     if (err != NULL) {
-      parse_errorf(self, "could not normalize string: %s", err);
-      free(data);
+      parse_errorf(&self->p, "could not normalize string: %s", err);
       return false;
     }
-    out->kind = KevsValueKindString;
-    out->data.string = data;
+    tape_commit_str(self, offset, dst.len);
+    tape_append(self, tape_entry('s', offset));
 
   } else if (str_starts_with_char(val, kRawStringBegin)) {
-    out->kind = KevsValueKindString;
-    out->data.string = kevs_str_dup(str_slice(val, 1, val.len - 1));
+    const KevsStr raw = str_slice(val, 1, val.len - 1);
+    char *dst = NULL;
+    const uint64_t offset = tape_reserve_str(self, &dst);
+    memcpy(dst, raw.ptr, raw.len);
+    tape_commit_str(self, offset, raw.len);
+    tape_append(self, tape_entry('s', offset));
 
   } else if (str_equals(val, kevs_str_from_cstr("true"))) {
-    out->kind = KevsValueKindBoolean;
-    out->data.boolean = true;
+    tape_append(self, tape_entry('t', 0));
 
   } else if (str_equals(val, kevs_str_from_cstr("false"))) {
-    out->kind = KevsValueKindBoolean;
-    out->data.boolean = false;
+    tape_append(self, tape_entry('f', 0));
 
   } else {
     int64_t i = 0;
     KevsError err = str_to_int(val, 0, &i);
     if (err != NULL) {
       char *s = kevs_str_dup(val);
-      parse_errorf(self, "value '%s' is not an integer: %s", s, err);
+      parse_errorf(&self->p, "value '%s' is not an integer: %s", s, err);
       free(s);
-      ok = false;
-    } else {
-      out->kind = KevsValueKindInteger;
-      out->data.integer = i;
+      return false;
     }
+    tape_append(self, tape_entry('i', 0));
+    tape_append(self, (uint64_t)i);
   }
 
-  parser_pop(self);
-
-  return ok;
+  return true;
 }
 
-static bool parse_value(Parser *self, KevsValue *out) {
-  bool ok = false;
-  if (parser_expect_delim(self, kListBegin)) {
-    ok = parse_list_value(self, out);
-  } else if (parser_expect_delim(self, kTableBegin)) {
-    ok = parse_table_value(self, out);
-  } else {
-    ok = parse_simple_value(self, out);
-  }
-  if (!ok) {
-    value_free(out);
-    return false;
-  }
-
-  if (!parse_delim(self, kKeyValEnd)) {
-    parse_errorf(self, "missing key value end");
-    value_free(out);
-    return false;
-  }
+static void tape_begin(TapeBuilder *self, char type) {
+  // while open, the payload links to the enclosing list or table
+  const size_t i = self->tape.len;
+  tape_append(self, tape_entry(type, self->open));
+  self->open = i;
+}
 
-  return true;
+static void tape_end(TapeBuilder *self, char type) {
+  const size_t begin = self->open;
+  const uint64_t entry = self->tape.ptr[begin];
+  self->open = tape_payload(entry);
+  tape_append(self, tape_entry(type, begin));
+  self->tape.ptr[begin] = tape_entry(tape_type(entry), self->tape.len);
 }
 
-static bool parse_key(Parser *self, KevsTable parent, KevsStr *key) {
-  if (!parser_expect(self, KevsTokenKindKey)) {
-    parse_errorf(self, "expected key token");
-    return false;
+KevsError kevs_tape_parse(KevsTape *tape, KevsStr content, char *err_buf,
+                          size_t err_buf_len, KevsOpts opts) {
+  assert(err_buf_len != 0);
+  assert(err_buf != NULL);
+  if (opts.include != NULL) {
+    // the tape is built from one buffer, fragments are not spliced in
+    return "includes are not supported by the tape";
   }
 
-  const KevsToken tok = parser_get(self);
-
-  if (!is_identifier(tok.value)) {
-    char *s = kevs_str_dup(tok.value);
-    parse_errorf(self, "key is not a valid identifier: '%s'", s);
-    free(s);
-    return false;
+  KevsTokens tokens = {};
+  KevsError err = scan(&tokens, content, err_buf, err_buf_len, opts);
+  if (err != NULL) {
+    free(tokens.ptr);
+    return err;
   }
 
-  // check if key is unique
-  for (size_t i = 0; i < parent.len; i++) {
-    if (str_equals(parent.ptr[i].key, tok.value)) {
-      char *s = kevs_str_dup(tok.value);
-      parse_errorf(self, "key '%s' is not unique for current table", s);
-      free(s);
-      return false;
+  // size both buffers upfront, strings never grow when normalized
+  size_t entries = 2;
+  size_t strings = 0;
+  for (size_t i = 0; i < tokens.len; i++) {
+    const KevsToken tok = tokens.ptr[i];
+    if (tok.kind == KevsTokenKindKey) {
+      entries += 1;
+      strings += sizeof(uint64_t) + tok.value.len + 1;
+    } else if (tok.kind == KevsTokenKindValue) {
+      entries += 2;
+      strings += sizeof(uint64_t) + tok.value.len + 1;
+    } else if (!str_equals_char(tok.value, kKeyValSep) &&
+               !str_equals_char(tok.value, kKeyValEnd)) {
+      entries += 1;
     }
   }
 
-  *key = tok.value;
-
-  parser_pop(self);
+  TapeBuilder b = {
+      .p =
+          {
+              .opts = opts,
+              .tokens = tokens,
+              .err_buf = err_buf,
+              .err_buf_len = err_buf_len,
+              .content = content,
+          },
+  };
+  b.tape.ptr = malloc(entries * sizeof(uint64_t));
+  b.tape.strings = malloc(strings + 1);
+  assert(b.tape.ptr != NULL);
+  assert(b.tape.strings != NULL);
 
-  return true;
-}
+  tape_begin(&b, '{');
 
-static bool parse_key_value(Parser *self, KevsTable parent, KevsKeyValue *out) {
-  KevsStr key = {};
-  if (!parse_key(self, parent, &key)) {
-    return false;
+  bool ok = true;
+  for (; ok && b.p.i < tokens.len; b.p.i++) {
+    const KevsToken tok = tokens.ptr[b.p.i];
+    if (tok.kind == KevsTokenKindKey) {
+      ok = tape_key(&b, tok.value);
+    } else if (tok.kind == KevsTokenKindValue) {
+      ok = tape_simple_value(&b, tok.value);
+    } else if (str_equals_char(tok.value, kListBegin)) {
+      tape_begin(&b, '[');
+    } else if (str_equals_char(tok.value, kListEnd)) {
+      tape_end(&b, ']');
+    } else if (str_equals_char(tok.value, kTableBegin)) {
+      tape_begin(&b, '{');
+    } else if (str_equals_char(tok.value, kTableEnd)) {
+      tape_end(&b, '}');
+    }
   }
 
-  if (!parse_delim(self, kKeyValSep)) {
-    parse_errorf(self, "missing key value separator");
-    return false;
-  }
+  free(tokens.ptr);
 
-  KevsValue val = {};
-  if (!parse_value(self, &val)) {
-    return false;
+  if (!ok) {
+    kevs_tape_free(&b.tape);
+    return err_buf;
   }
 
-  out->key = key;
-  out->val = val;
+  tape_end(&b, '}');
+  assert(b.tape.len <= entries);
+  b.tape.strings_len = b.strings_len;
 
-  return true;
+  *tape = b.tape;
+
+  return NULL;
 }
 
-KevsError parse(KevsTable *table, KevsStr content, char *err_buf,
-                size_t err_buf_len, KevsOpts opts, KevsTokens tokens) {
-  Parser p = {
-      .opts = opts,
-      .tokens = tokens,
-      .table = table,
-      .i = 0,
-      .err_buf = err_buf,
-      .err_buf_len = err_buf_len,
-      .content = content,
-  };
+void kevs_tape_free(KevsTape *self) {
+  free(self->ptr);
+  free(self->strings);
+  *self = (KevsTape){};
+}
 
-  while (p.i < tokens.len) {
-    KevsKeyValue kv = {};
-    if (!parse_key_value(&p, *table, &kv)) {
-      return err_buf;
-    }
-    table_append(p.table, kv);
+KevsValueKind kevs_tape_kind(KevsTape self, size_t i) {
+  if (i >= self.len) {
+    return KevsValueKindUndefined;
+  }
+  switch (tape_type(self.ptr[i])) {
+  case 's':
+    return KevsValueKindString;
+  case 'i':
+    return KevsValueKindInteger;
+  case 't':
+  case 'f':
+    return KevsValueKindBoolean;
+  case '[':
+    return KevsValueKindList;
+  case '{':
+    return KevsValueKindTable;
+  default:
+    return KevsValueKindUndefined;
   }
+}
 
+KevsError kevs_tape_string(KevsTape self, size_t i, KevsStr *out) {
+  if (kevs_tape_kind(self, i) != KevsValueKindString) {
+    return "value is not string";
+  }
+  *out = tape_str(self, tape_payload(self.ptr[i]));
   return NULL;
 }
 
-KevsError kevs_parse(KevsTable *table, KevsStr content, char *err_buf,
-                     size_t err_buf_len, KevsOpts opts) {
-  assert(err_buf_len != 0);
-  assert(err_buf != NULL);
-
-  KevsTokens tokens = {};
-
-  KevsError err = scan(&tokens, content, err_buf, err_buf_len, opts);
-  if (err == NULL) {
-    err = parse(table, content, err_buf, err_buf_len, opts, tokens);
+KevsError kevs_tape_int(KevsTape self, size_t i, int64_t *out) {
+  if (kevs_tape_kind(self, i) != KevsValueKindInteger) {
+    return "value is not integer";
   }
-
-  free(tokens.ptr);
-
-  return err;
+  *out = (int64_t)self.ptr[i + 1];
+  return NULL;
 }
 
-void kevs_free(KevsTable *self) {
-  for (size_t i = 0; i < self->len; i++) {
-    value_free(&self->ptr[i].val);
+KevsError kevs_tape_bool(KevsTape self, size_t i, bool *out) {
+  if (kevs_tape_kind(self, i) != KevsValueKindBoolean) {
+    return "value is not boolean";
   }
-
-  free(self->ptr);
-  *self = (KevsTable){};
+  *out = tape_type(self.ptr[i]) == 't';
+  return NULL;
 }
 
-static bool value_is(KevsValue self, KevsValueKind kind) {
-  return self.kind == kind;
+KevsError kevs_tape_key(KevsTape self, size_t i, KevsStr *out) {
+  if (i >= self.len || tape_type(self.ptr[i]) != 'k') {
+    return "entry is not key";
+  }
+  *out = tape_str(self, tape_payload(self.ptr[i]));
+  return NULL;
 }
 
-static KevsError table_get(KevsTable self, const char *key, KevsValue *val) {
-  KevsStr key_str = kevs_str_from_cstr(key);
-  for (size_t i = 0; i < self.len; i++) {
-    if (str_equals(self.ptr[i].key, key_str)) {
-      *val = self.ptr[i].val;
+KevsError kevs_tape_table_get(KevsTape self, size_t table, const char *key,
+                              size_t *out) {
+  if (kevs_tape_kind(self, table) != KevsValueKindTable) {
+    return "value is not table";
+  }
+  const KevsStr key_str = kevs_str_from_cstr(key);
+  const size_t end = kevs_tape_next(self, table) - 1;
+  for (size_t i = table + 1; i < end; i = kevs_tape_next(self, i + 1)) {
+    if (str_equals(tape_str(self, tape_payload(self.ptr[i])), key_str)) {
+      *out = i + 1;
       return NULL;
     }
   }
   return "key not found";
 }
 
-KevsError kevs_table_string(KevsTable self, const char *key, char **out) {
-  KevsValue val = {};
-  KevsError err = table_get(self, key, &val);
-  if (err != NULL) {
-    return err;
+KevsError kevs_tape_list_get(KevsTape self, size_t list, size_t n,
+                             size_t *out) {
+  if (kevs_tape_kind(self, list) != KevsValueKindList) {
+    return "value is not list";
   }
-  if (!value_is(val, KevsValueKindString)) {
-    return "value is not string";
+  const size_t end = kevs_tape_next(self, list) - 1;
+  size_t i = list + 1;
+  for (; i < end && n != 0; n--) {
+    i = kevs_tape_next(self, i);
   }
-  *out = val.data.string;
+  if (i >= end) {
+    return "index out of bounds";
+  }
+  *out = i;
   return NULL;
 }
 
-KevsError kevs_table_int(KevsTable self, const char *key, int64_t *out) {
-  KevsValue val = {};
-  KevsError err = table_get(self, key, &val);
-  if (err != NULL) {
-    return err;
-  }
-  if (!value_is(val, KevsValueKindInteger)) {
-    return "value is not integer";
-  }
-  *out = val.data.integer;
-  return NULL;
+static bool token_is_begin(KevsToken t) {
+  return t.kind == KevsTokenKindDelim &&
+         (t.value.ptr[0] == kListBegin || t.value.ptr[0] == kTableBegin);
 }
 
-KevsError kevs_table_bool(KevsTable self, const char *key, bool *out) {
-  KevsValue val = {};
-  KevsError err = table_get(self, key, &val);
-  if (err != NULL) {
-    return err;
+static size_t cursor_end(const KevsCursor *self) {
+  if (self->stack_len == 0) {
+    return self->tokens.len;
   }
-  if (!value_is(val, KevsValueKindBoolean)) {
-    return "value is not boolean";
-  }
-  *out = val.data.boolean;
-  return NULL;
+  return self->tokens.ptr[self->stack[self->stack_len - 1]].match;
 }
 
-KevsError kevs_table_list(KevsTable self, const char *key, KevsList *out) {
-  KevsValue val = {};
-  KevsError err = table_get(self, key, &val);
-  if (err != NULL) {
-    return err;
+KevsError kevs_cursor_init(KevsCursor *self, KevsStr content, char *err_buf,
+                           size_t err_buf_len, KevsOpts opts) {
+  assert(err_buf_len != 0);
+  assert(err_buf != NULL);
+
+  *self = (KevsCursor){};
+  self->cur = SIZE_MAX;
+  if (opts.include != NULL) {
+    // the cursor walks the tokens of content only
+    return "includes are not supported by the cursor";
   }
-  if (!value_is(val, KevsValueKindList)) {
-    return "value is not list";
+  KevsError err = scan(&self->tokens, content, err_buf, err_buf_len, opts);
+  if (err != NULL) {
+    kevs_cursor_free(self);
   }
-  *out = val.data.list;
-  return NULL;
+  return err;
 }
 
-KevsError kevs_table_table(KevsTable self, const char *key, KevsTable *out) {
-  KevsValue val = {};
-  KevsError err = table_get(self, key, &val);
-  if (err != NULL) {
-    return err;
-  }
-  if (!value_is(val, KevsValueKindTable)) {
-    return "value is not table";
-  }
-  *out = val.data.table;
-  return NULL;
+void kevs_cursor_free(KevsCursor *self) {
+  free(self->tokens.ptr);
+  free(self->stack);
+  *self = (KevsCursor){};
 }
 
-bool kevs_table_has(KevsTable self, const char *key) {
-  KevsStr key_str = kevs_str_from_cstr(key);
-  for (size_t i = 0; i < self.len; i++) {
-    if (str_equals(self.ptr[i].key, key_str)) {
-      return true;
-    }
+bool kevs_cursor_next(KevsCursor *self) {
+  const size_t end = cursor_end(self);
+  if (self->next >= end) {
+    kevs_cursor_skip(self);
+    return false;
   }
-  return false;
-}
 
-static KevsError list_get(KevsList self, size_t i, KevsValue *val) {
-  if (i >= self.len) {
-    return "index out of bounds";
+  size_t i = self->next;
+  if (self->tokens.ptr[i].kind == KevsTokenKindKey) {
+    // key and separator
+    i += 2;
   }
-  *val = self.ptr[i];
-  return NULL;
+  self->cur = i;
+
+  const KevsToken t = self->tokens.ptr[i];
+  const size_t last = token_is_begin(t) ? t.match : i;
+  // +2 for the value end delim
+  self->next = last + 2;
+  return true;
 }
 
-KevsError kevs_list_string(KevsList self, size_t i, char **out) {
-  KevsValue val = {};
-  KevsError err = list_get(self, i, &val);
-  if (err != NULL) {
-    return err;
-  }
-  if (!value_is(val, KevsValueKindString)) {
-    return "value is not string";
+void kevs_cursor_skip(KevsCursor *self) {
+  if (self->stack_len == 0) {
+    self->next = self->tokens.len;
+    self->cur = SIZE_MAX;
+    return;
   }
-  *out = val.data.string;
-  return NULL;
+  self->stack_len--;
+  const size_t begin = self->stack[self->stack_len];
+  self->cur = begin;
+  self->next = self->tokens.ptr[begin].match + 2;
 }
 
-KevsError kevs_list_int(KevsList self, size_t i, int64_t *out) {
-  KevsValue val = {};
-  KevsError err = list_get(self, i, &val);
-  if (err != NULL) {
-    return err;
+KevsError kevs_cursor_enter(KevsCursor *self) {
+  if (self->cur >= self->tokens.len ||
+      !token_is_begin(self->tokens.ptr[self->cur])) {
+    return "cursor value is not list or table";
   }
-  if (!value_is(val, KevsValueKindInteger)) {
-    return "value is not integer";
+  if (self->stack_len == self->stack_cap) {
+    self->stack_cap = self->stack_cap == 0 ? 8 : self->stack_cap * 2;
+    self->stack = realloc(self->stack, self->stack_cap * sizeof(size_t));
+    assert(self->stack != NULL);
   }
-  *out = val.data.integer;
+  self->stack[self->stack_len++] = self->cur;
+  self->next = self->cur + 1;
   return NULL;
 }
 
-KevsError kevs_list_bool(KevsList self, size_t i, bool *out) {
-  KevsValue val = {};
-  KevsError err = list_get(self, i, &val);
-  if (err != NULL) {
-    return err;
+KevsValueKind kevs_cursor_kind(const KevsCursor *self) {
+  if (self->cur >= self->tokens.len) {
+    return KevsValueKindUndefined;
   }
-  if (!value_is(val, KevsValueKindBoolean)) {
-    return "value is not boolean";
+  const KevsToken t = self->tokens.ptr[self->cur];
+  if (t.kind == KevsTokenKindValue) {
+    return scalar_kind(t.value);
   }
-  *out = val.data.boolean;
-  return NULL;
+  return t.value.ptr[0] == kListBegin ? KevsValueKindList
+                                      : KevsValueKindTable;
 }
 
-KevsError kevs_list_list(KevsList self, size_t i, KevsList *out) {
-  KevsValue val = {};
-  KevsError err = list_get(self, i, &val);
-  if (err != NULL) {
-    return err;
+KevsStr kevs_cursor_key(const KevsCursor *self) {
+  if (self->cur < 2 || self->cur >= self->tokens.len) {
+    return (KevsStr){};
   }
-  if (!value_is(val, KevsValueKindList)) {
-    return "value is not list";
+  const KevsToken t = self->tokens.ptr[self->cur - 2];
+  if (t.kind != KevsTokenKindKey) {
+    return (KevsStr){};
   }
-  *out = val.data.list;
-  return NULL;
+  return t.value;
 }
 
-KevsError kevs_list_table(KevsList self, size_t i, KevsTable *out) {
-  KevsValue val = {};
-  KevsError err = list_get(self, i, &val);
-  if (err != NULL) {
-    return err;
-  }
-  if (!value_is(val, KevsValueKindTable)) {
-    return "value is not table";
+KevsStr kevs_cursor_raw(const KevsCursor *self) {
+  if (self->cur >= self->tokens.len ||
+      self->tokens.ptr[self->cur].kind != KevsTokenKindValue) {
+    return (KevsStr){};
   }
-  *out = val.data.table;
-  return NULL;
+  return self->tokens.ptr[self->cur].value;
 }
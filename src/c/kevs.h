@@ -19,12 +19,17 @@ typedef enum {
   KevsTokenKindKey,
   KevsTokenKindDelim,
   KevsTokenKindValue,
+  // path of an include directive, see KevsOpts.include
+  KevsTokenKindInclude,
 } KevsTokenKind;
 
+// Token: value points into the scanned content, its offset there gives the
+// position, errors count the lines up to it.
 typedef struct {
   KevsStr value;
   KevsTokenKind kind;
-  int line;
+  // for list and table begin delims: index of the matching end delim
+  size_t match;
 } KevsToken;
 
 typedef struct {
@@ -42,11 +47,28 @@ typedef enum {
   KevsValueKindTable,
 } KevsValueKind;
 
+// Flags for lists and tables, set by the library
+typedef enum {
+  // storage is owned by an arena, kevs_free doesn't release it
+  KevsFlagArena = 1 << 0,
+  // root table of an arena document, kevs_free releases the whole arena
+  KevsFlagArenaRoot = 1 << 1,
+  // keys point into the document symbol table, see KevsOpts.intern_keys
+  KevsFlagInterned = 1 << 2,
+  // list elements are stored as int64_t[], see KevsOpts.pack_lists
+  KevsFlagPackedInts = 1 << 3,
+  // list elements are stored as bits in uint64_t[], see KevsOpts.pack_lists
+  KevsFlagPackedBools = 1 << 4,
+  // root table of a heap document, as returned by kevs_parse
+  KevsFlagHeapRoot = 1 << 5,
+} KevsFlag;
+
 struct KevsValue;
 
 typedef struct {
   struct KevsValue *ptr;
-  size_t cap;
+  uint32_t cap;
+  uint32_t flags;
   size_t len;
 } KevsList;
 
@@ -54,7 +76,8 @@ struct KevsKeyValue;
 
 typedef struct {
   struct KevsKeyValue *ptr;
-  size_t cap;
+  uint32_t cap;
+  uint32_t flags;
   size_t len;
 } KevsTable;
 
@@ -74,10 +97,71 @@ typedef struct KevsKeyValue {
   KevsValue val;
 } KevsKeyValue;
 
+struct KevsHashEntry;
+
+// Hashes: cache of the hashes of lists and tables, see kevs_hash.
+//
+// Only lists and tables with at least a few elements are cached, smaller
+// ones are walked.
+// Entries are keyed by storage, they are valid until the document is
+// changed, compacted or freed, reset or free the cache along with it.
+// A zero initialized cache is ready to use.
+typedef struct {
+  struct KevsHashEntry *ptr;
+  size_t cap;
+  size_t len;
+} KevsHashes;
+
 typedef struct {
   KevsStr file;
   bool abort_on_error;
   bool errors_with_file_and_line;
+  // Store each distinct key once in a per-document symbol table.
+  // The document is allocated from an arena and doesn't reference content,
+  // keys of its tables can be compared by pointer or by 32-bit id.
+  bool intern_keys;
+  // Store lists which contain only integers or only booleans as packed
+  // arrays instead of KevsValue[]. Use the accessors for such lists,
+  // their ptr doesn't point to KevsValue.
+  bool pack_lists;
+  // Check that string values are valid UTF-8 while scanning, errors name the
+  // byte offset of the first invalid sequence in content.
+  bool validate_utf8;
+  // Add the hash of the document and of each list and table in it to
+  // hashes while parsing. Ignored by kevs_parse_batch.
+  KevsHashes *hashes;
+
+  // Limits for untrusted input, checked while scanning, 0 means no limit.
+  size_t max_input_bytes;
+  size_t max_tokens;
+  // lists and tables inside the root table
+  size_t max_depth;
+  // total length of string values, as written
+  size_t max_string_bytes;
+  size_t max_table_keys;
+  // values of all kinds, including lists and tables
+  size_t max_nodes;
+
+  // Called every progress_interval tokens (4096 if 0) while scanning and
+  // again while parsing, with the number of tokens done in that phase.
+  // Return false to cancel.
+  bool (*progress)(void *ctx, size_t tokens);
+  void *progress_ctx;
+  size_t progress_interval;
+
+  // Threads used by kevs_parse_batch, 0 or 1 parses on the calling thread.
+  // Ignored on Windows and when compiled with KEVS_NO_THREADS.
+  size_t threads;
+
+  // Resolves `include "path";` entries of tables, which are recognized only
+  // if set. The entries of the returned fragment are copied into the
+  // including table, but documents without intern_keys share its keys.
+  // On error, the message may be written to err_buf.
+  // Includes are resolved by kevs_parse and the APIs built on it,
+  // kevs_tape_parse and kevs_cursor_init fail if include is set.
+  KevsError (*include)(void *ctx, const char *path, KevsTable *out,
+                       char *err_buf, size_t err_buf_len);
+  void *include_ctx;
 } KevsOpts;
 
 KevsStr kevs_str_from_cstr(const char *s);
@@ -89,6 +173,217 @@ KevsError kevs_parse(KevsTable *table, KevsStr content, char *err_buf,
                      size_t err_buf_len, KevsOpts opts);
 void kevs_free(KevsTable *self);
 
+struct KevsArenaBlock;
+struct KevsSymbols;
+struct KevsScanFrame;
+struct KevsParseFrame;
+
+// Parser: reusable context for parsing many documents.
+//
+// Tokens, stacks, the symbol table and the arena are kept between calls,
+// so once they have grown parsing similar documents doesn't allocate.
+// Documents are parsed as with KevsOpts.intern_keys, but borrow the arena
+// of the parser: they are valid until the next kevs_parser_parse,
+// kevs_parser_reset or kevs_parser_free, kevs_free does nothing on them.
+// A zero initialized parser is ready to use.
+typedef struct {
+  KevsTokens tokens;
+  struct KevsArenaBlock *arena;
+  struct KevsSymbols *symbols;
+  struct KevsScanFrame *scan_stack;
+  size_t scan_stack_cap;
+  struct KevsParseFrame *parse_stack;
+  size_t parse_stack_cap;
+} KevsParser;
+
+KevsError kevs_parser_parse(KevsParser *self, KevsTable *table,
+                            KevsStr content, char *err_buf,
+                            size_t err_buf_len, KevsOpts opts);
+// Drop the last document, keeping the memory.
+void kevs_parser_reset(KevsParser *self);
+void kevs_parser_free(KevsParser *self);
+
+// Batch: memory of documents parsed by kevs_parse_batch.
+//
+// Documents are parsed as with KevsOpts.intern_keys and borrow the arena of
+// the batch, they are valid until kevs_batch_free, kevs_free does nothing
+// on them. A zero initialized batch is ready to use, more batches can be
+// parsed into it.
+typedef struct {
+  struct KevsArenaBlock *arena;
+} KevsBatch;
+
+// Parse n independent inputs into outputs, see KevsOpts.threads.
+// errors[i] is NULL or the error of inputs[i], errors don't stop the batch,
+// their messages live in the batch too. Returns an error if any failed.
+KevsError kevs_parse_batch(KevsBatch *self, const KevsStr *inputs, size_t n,
+                           KevsTable *outputs, KevsError *errors,
+                           KevsOpts opts);
+void kevs_batch_free(KevsBatch *self);
+
+struct KevsIncludeEntry;
+
+// Includer: loads, parses and caches fragments for KevsOpts.include.
+//
+// Set include to kevs_include and include_ctx to the includer. Fragments
+// are cached by path, and by content hash so equal files under different
+// paths are parsed once. Paths are passed to read as written.
+// Include cycles and nesting deeper than max_depth (16 if 0) are errors.
+// Free the includer after the documents which include its fragments.
+typedef struct {
+  // read a whole file, out is allocated with malloc
+  KevsError (*read)(void *ctx, const char *path, char **out, size_t *out_len);
+  void *read_ctx;
+  // for parsing fragments, file and include are set by the includer
+  KevsOpts opts;
+  size_t max_depth;
+
+  struct KevsIncludeEntry *entries;
+  size_t entries_cap;
+  size_t entries_len;
+  size_t depth;
+} KevsIncluder;
+
+KevsError kevs_include(void *ctx, const char *path, KevsTable *out,
+                       char *err_buf, size_t err_buf_len);
+void kevs_includer_free(KevsIncluder *self);
+
+// MemoryUsage: bytes held by a document, see kevs_memory_usage.
+typedef struct {
+  // string values, with null terminators
+  size_t strings;
+  // list elements, as KevsValue or packed
+  size_t lists;
+  // table entries
+  size_t tables;
+  // interned keys and their symbol table, or key strings of built documents,
+  // keys of other documents point into the input
+  size_t keys;
+  // allocated but unused: spare capacity of lists and tables, for arena
+  // documents also free block space and storage left behind by growth
+  size_t slack;
+  size_t total;
+} KevsMemoryUsage;
+
+// Bytes held by the table and everything in it, without allocator overhead.
+KevsMemoryUsage kevs_memory_usage(KevsTable self);
+// Trim every allocation of the document to its exact size, arena documents
+// are copied into a single block. Only root tables can be compacted, nested
+// tables share storage with their parent, and documents borrowing an arena
+// can't be compacted.
+KevsError kevs_compact(KevsTable *self);
+
+typedef enum {
+  // lists of the overlay replace lists of the base
+  KevsMergeReplaceLists = 0,
+  // lists of the overlay are appended to lists of the base
+  KevsMergeAppendLists,
+} KevsMergePolicy;
+
+// Merge overlay onto base: tables are merged by key, other values of the
+// overlay replace those of the base, lists depending on policy.
+// The result is an arena document which shares unchanged values with base
+// and overlay, it's valid as long as they are. kevs_free releases only
+// what the merge allocated, kevs_compact turns it into a standalone copy.
+// Stack more layers by merging the result again.
+KevsError kevs_merge(KevsTable base, KevsTable overlay, KevsMergePolicy policy,
+                     KevsTable *out);
+
+// Hash: stable 64-bit structural hash of a value.
+//
+// Equal values hash equal whatever their formatting, comments, order of
+// table keys and storage, like interned keys or packed lists. The hash
+// doesn't depend on the platform or the process, so hashes of documents
+// on different hosts can be compared. Lists and tables found in hashes,
+// which may be NULL, are not walked again.
+uint64_t kevs_hash(KevsValue v, const KevsHashes *hashes);
+uint64_t kevs_table_hash(KevsTable self, const KevsHashes *hashes);
+// Cache the hashes of table and of each list and table in it.
+void kevs_hashes_add(KevsHashes *self, KevsTable table);
+// Drop the entries, keeping the memory.
+void kevs_hashes_reset(KevsHashes *self);
+void kevs_hashes_free(KevsHashes *self);
+
+// Deep comparison with the same notion of equality as kevs_hash.
+// Lists and tables whose cached hashes differ are unequal without being
+// walked, the caches may be NULL.
+bool kevs_equal(KevsValue a, const KevsHashes *hashes_a, KevsValue b,
+                const KevsHashes *hashes_b);
+bool kevs_table_equal(KevsTable a, const KevsHashes *hashes_a, KevsTable b,
+                      const KevsHashes *hashes_b);
+
+// Schema: a KEVS document describing another one, compiled once into flat
+// rules which validate parsed tables or the event stream of kevs_parse_events.
+//
+// A rule is a table with the fields:
+//   type      "string", "integer", "boolean", "list", "table" or "any",
+//             defaults to "table" for the root rule
+//   optional  the key may be missing
+//   min, max  integer range
+//   min_len, max_len
+//             length of strings in bytes and of lists in elements
+//   pattern   glob for strings: * ? [a-z] [!a-z], \ escapes
+//   items     rule of list elements
+//   keys      table of key = rule
+//   strict    keys which are not in keys are errors
+//
+// For example:
+//   keys = {
+//     name = { type = "string"; pattern = "[a-z]*"; };
+//     port = { type = "integer"; min = 1; max = 65535; };
+//     tags = { type = "list"; optional = true; items = { type = "string"; }; };
+//   };
+struct KevsSchemaRule;
+struct KevsSchemaKey;
+typedef struct {
+  struct KevsSchemaRule *rules;
+  size_t rules_len;
+  struct KevsSchemaKey *keys;
+  size_t keys_len;
+  char *strings;
+  size_t strings_len;
+} KevsSchema;
+
+// The schema table is not referenced after compiling.
+KevsError kevs_schema_compile(KevsSchema *self, KevsTable schema,
+                              char *err_buf, size_t err_buf_len);
+// Errors name the path of the value, like "schema: hosts[2].port: ...".
+KevsError kevs_schema_validate(const KevsSchema *self, KevsTable table,
+                               char *err_buf, size_t err_buf_len);
+// Validate while scanning, without building tables.
+// Values are checked as far as the schema needs them, scan errors are
+// returned as well.
+KevsError kevs_schema_validate_events(const KevsSchema *self, KevsStr content,
+                                      char *err_buf, size_t err_buf_len,
+                                      KevsOpts opts);
+void kevs_schema_free(KevsSchema *self);
+
+// Events: callbacks for kevs_parse_events, NULL callbacks are skipped.
+//
+// Return false from a callback to stop parsing.
+// Keys are checked to be valid identifiers, but not to be unique.
+// Scalars are passed as scanned, strings with their quotes and without
+// interpreting escape sequences, use kevs_scalar_* to convert them.
+typedef struct {
+  bool (*key)(void *ctx, KevsStr key);
+  bool (*scalar)(void *ctx, KevsValueKind kind, KevsStr raw);
+  bool (*begin_table)(void *ctx);
+  bool (*end_table)(void *ctx);
+  bool (*begin_list)(void *ctx);
+  bool (*end_list)(void *ctx);
+  void (*error)(void *ctx, KevsError err);
+} KevsEvents;
+
+// Parse content straight from the scanner, without building tokens or tables.
+KevsError kevs_parse_events(KevsStr content, const KevsEvents *events,
+                            void *ctx, char *err_buf, size_t err_buf_len,
+                            KevsOpts opts);
+
+KevsError kevs_scalar_int(KevsStr raw, int64_t *out);
+KevsError kevs_scalar_bool(KevsStr raw, bool *out);
+// out is allocated with malloc
+KevsError kevs_scalar_string(KevsStr raw, char **out);
+
 KevsError kevs_table_string(KevsTable self, const char *key, char **out);
 KevsError kevs_table_int(KevsTable self, const char *key, int64_t *out);
 KevsError kevs_table_bool(KevsTable self, const char *key, bool *out);
@@ -96,10 +391,167 @@ KevsError kevs_table_list(KevsTable self, const char *key, KevsList *out);
 KevsError kevs_table_table(KevsTable self, const char *key, KevsTable *out);
 bool kevs_table_has(KevsTable self, const char *key);
 
+// Symbols: only for documents parsed with KevsOpts.intern_keys
+size_t kevs_symbol_count(KevsTable doc);
+KevsError kevs_symbol_id(KevsTable doc, const char *key, uint32_t *out);
+KevsError kevs_symbol_key(KevsTable doc, uint32_t id, KevsStr *out);
+KevsError kevs_table_key_id(KevsTable self, size_t i, uint32_t *out);
+KevsError kevs_table_get_id(KevsTable self, uint32_t id, KevsValue *out);
+
 KevsError kevs_list_string(KevsList self, size_t i, char **out);
 KevsError kevs_list_int(KevsList self, size_t i, int64_t *out);
 KevsError kevs_list_bool(KevsList self, size_t i, bool *out);
 KevsError kevs_list_list(KevsList self, size_t i, KevsList *out);
 KevsError kevs_list_table(KevsList self, size_t i, KevsTable *out);
+KevsError kevs_list_value(KevsList self, size_t i, KevsValue *out);
+
+// Packed lists: bit i of bools is bools[i / 64] >> (i % 64) & 1
+KevsError kevs_list_ints(KevsList self, const int64_t **out);
+KevsError kevs_list_bools(KevsList self, const uint64_t **out);
+
+// Builder: constructs a document in memory.
+//
+// All lists, tables, keys and strings are allocated from one arena which is
+// handed over to the document by kevs_builder_finish, kevs_free releases it.
+// A zero initialized builder is ready to use and can be reused after finish.
+//
+// Keys must be NULL when adding to a list.
+typedef struct {
+  struct KevsArenaBlock *arena;
+  KevsTable root;
+  struct KevsValue **stack;
+  size_t stack_cap;
+  size_t stack_len;
+} KevsBuilder;
+
+KevsError kevs_builder_reserve(KevsBuilder *self, size_t cap);
+KevsError kevs_builder_table_begin(KevsBuilder *self, const char *key,
+                                   size_t cap);
+KevsError kevs_builder_table_end(KevsBuilder *self);
+KevsError kevs_builder_list_begin(KevsBuilder *self, const char *key,
+                                  size_t cap);
+KevsError kevs_builder_list_end(KevsBuilder *self);
+KevsError kevs_builder_add_string(KevsBuilder *self, const char *key,
+                                  const char *val);
+KevsError kevs_builder_add_int(KevsBuilder *self, const char *key,
+                               int64_t val);
+KevsError kevs_builder_add_bool(KevsBuilder *self, const char *key, bool val);
+KevsError kevs_builder_finish(KevsBuilder *self, KevsTable *out);
+void kevs_builder_free(KevsBuilder *self);
+
+// Cell: compact 16 byte value, alternative to the 32 byte KevsValue.
+//
+// The kind is kept in the tag bits of the first byte, strings of up to 14
+// bytes are stored inline, lists and tables are stored out of line.
+// Table keys are 32-bit ids into the symbol table of the document.
+// Inline strings point into the cell, so pass cells by pointer to get them.
+typedef union {
+  uint8_t bytes[16];
+  uint64_t words[2];
+} KevsCell;
+
+// CellDoc: all cells, keys and strings come from one arena.
+typedef struct {
+  struct KevsArenaBlock *arena;
+  struct KevsSymbols *symbols;
+  KevsCell root;
+} KevsCellDoc;
+
+KevsError kevs_cell_parse(KevsCellDoc *doc, KevsStr content, char *err_buf,
+                          size_t err_buf_len, KevsOpts opts);
+KevsError kevs_cell_from_table(KevsCellDoc *doc, KevsTable table);
+void kevs_cell_free(KevsCellDoc *self);
+
+KevsValueKind kevs_cell_kind(KevsCell self);
+KevsError kevs_cell_int(KevsCell self, int64_t *out);
+KevsError kevs_cell_bool(KevsCell self, bool *out);
+KevsError kevs_cell_string(const KevsCell *self, KevsStr *out);
+size_t kevs_cell_len(KevsCell self);
+KevsError kevs_cell_list_get(KevsCell self, size_t i, const KevsCell **out);
+KevsError kevs_cell_table_entry(KevsCell self, size_t i, uint32_t *key_id,
+                                const KevsCell **out);
+KevsError kevs_cell_table_get(const KevsCellDoc *doc, KevsCell self,
+                              const char *key, const KevsCell **out);
+KevsError kevs_cell_key(const KevsCellDoc *doc, uint32_t id, KevsStr *out);
+
+// Tape: flat document, one array of 64-bit entries plus one string buffer.
+//
+// Entries have a type char in the top 8 bits and a payload in the rest:
+//   'k'      key, payload is the offset of the key in strings
+//   's'      string, payload is the offset of the string in strings
+//   'i'      integer, the next entry holds the value
+//   't' 'f'  boolean
+//   '{' '['  begin, payload is the index after the matching end
+//   '}' ']'  end, payload is the index of the matching begin
+// Strings are stored as a uint64_t length, the bytes and a null terminator.
+//
+// Entry 0 is the root table, table entries are key, value pairs.
+// The tape holds no pointers, it can be copied or written to disk as is.
+typedef struct {
+  uint64_t *ptr;
+  size_t len;
+  char *strings;
+  size_t strings_len;
+} KevsTape;
+
+KevsError kevs_tape_parse(KevsTape *tape, KevsStr content, char *err_buf,
+                          size_t err_buf_len, KevsOpts opts);
+void kevs_tape_free(KevsTape *self);
+
+// Index of the entry after the value at i, skips lists and tables in O(1).
+size_t kevs_tape_next(KevsTape self, size_t i);
+KevsValueKind kevs_tape_kind(KevsTape self, size_t i);
+KevsError kevs_tape_string(KevsTape self, size_t i, KevsStr *out);
+KevsError kevs_tape_int(KevsTape self, size_t i, int64_t *out);
+KevsError kevs_tape_bool(KevsTape self, size_t i, bool *out);
+KevsError kevs_tape_key(KevsTape self, size_t i, KevsStr *out);
+KevsError kevs_tape_table_get(KevsTape self, size_t table, const char *key,
+                              size_t *out);
+KevsError kevs_tape_list_get(KevsTape self, size_t list, size_t n,
+                             size_t *out);
+
+// Cursor: pull iterator over scanned tokens, without building values.
+//
+// Entries of the current table or list are visited with kevs_cursor_next.
+// Nested tables and lists are skipped in O(1) unless entered, it returns
+// false at the end of an entered container and goes back to its parent.
+// Keys are not checked to be valid or unique, that is done by kevs_parse.
+typedef struct {
+  KevsTokens tokens;
+  // index of the current value token
+  size_t cur;
+  // index of the token where the next entry begins
+  size_t next;
+  // indices of entered list and table begin delims
+  size_t *stack;
+  size_t stack_cap;
+  size_t stack_len;
+} KevsCursor;
+
+KevsError kevs_cursor_init(KevsCursor *self, KevsStr content, char *err_buf,
+                           size_t err_buf_len, KevsOpts opts);
+void kevs_cursor_free(KevsCursor *self);
+bool kevs_cursor_next(KevsCursor *self);
+// Skip the rest of the entered list or table and go back to its parent.
+void kevs_cursor_skip(KevsCursor *self);
+KevsError kevs_cursor_enter(KevsCursor *self);
+KevsValueKind kevs_cursor_kind(const KevsCursor *self);
+// Empty for list entries.
+KevsStr kevs_cursor_key(const KevsCursor *self);
+// Scalar as scanned, see kevs_scalar_*.
+KevsStr kevs_cursor_raw(const KevsCursor *self);
+
+#ifdef KEVS_STATS
+// Stats: work counters for performance testing, see src/c/perf_fuzzer.c.
+typedef struct {
+  uint64_t tokens;
+  // key comparisons in uniqueness checks and symbol lookups
+  uint64_t key_compares;
+  // characters inspected while searching for delimiters
+  uint64_t index_steps;
+} KevsStats;
+
+extern KevsStats kevs_stats;
+#endif
 
 #endif
@@ -0,0 +1,723 @@
+// Bulk loading: read many files with the parsing of finished ones overlapping
+// the I/O of the others, and kevs load on top of it.
+//
+// On Linux the files go through io_uring, set up with raw system calls: the
+// opens, stats, reads and closes of a window of files are submitted in
+// batches, which keeps cold starts over many small files from paying a
+// blocking system call per step. Without io_uring, or if the kernel lacks an
+// operation, a pool of threads calls read_file.
+
+#define _DEFAULT_SOURCE
+#define _XOPEN_SOURCE 700
+
+#include <assert.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "kevs.h"
+#include "util.h"
+
+#if !defined(_WIN32) && !defined(KEVS_NO_THREADS)
+#define LOAD_THREADS
+#include <pthread.h>
+#endif
+
+#if defined(__linux__) && !defined(KEVS_NO_URING) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <linux/stat.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#if defined(__NR_io_uring_setup) && defined(IO_URING_OP_SUPPORTED)
+#define LOAD_URING
+#endif
+#endif
+#endif
+
+static const size_t kLoadWindow = 64;
+
+#if defined(LOAD_URING) || defined(LOAD_THREADS)
+
+typedef struct {
+  size_t index;
+  char *data;
+  size_t len;
+  KevsError err;
+} LoadResult;
+
+typedef struct {
+  LoadResult *ptr;
+  size_t cap;
+  size_t len;
+} LoadResults;
+
+static void load_results_push(LoadResults *self, LoadResult v) {
+  if (self->len == self->cap) {
+    self->cap = self->cap < 16 ? 16 : self->cap * 2;
+    self->ptr = realloc(self->ptr, self->cap * sizeof(LoadResult));
+    assert(self->ptr != NULL);
+  }
+  self->ptr[self->len++] = v;
+}
+
+#endif
+
+#ifdef LOAD_URING
+
+// a single read is limited to 32 bits
+static const size_t kUringMaxRead = (size_t)1 << 30;
+
+typedef struct {
+  int fd;
+  unsigned entries;
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned *sq_mask;
+  unsigned *sq_array;
+  struct io_uring_sqe *sqes;
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned *cq_mask;
+  struct io_uring_cqe *cqes;
+  // tail of the submission ring as written, and entries not yet submitted
+  unsigned tail;
+  unsigned queued;
+  void *sq_ptr;
+  size_t sq_size;
+  void *cq_ptr;
+  size_t cq_size;
+  size_t sqes_size;
+} Ring;
+
+static void ring_free(Ring *self) {
+  if (self->sqes != NULL) {
+    munmap(self->sqes, self->sqes_size);
+  }
+  if (self->cq_ptr != NULL && self->cq_ptr != self->sq_ptr) {
+    munmap(self->cq_ptr, self->cq_size);
+  }
+  if (self->sq_ptr != NULL) {
+    munmap(self->sq_ptr, self->sq_size);
+  }
+  if (self->fd >= 0) {
+    close(self->fd);
+  }
+  *self = (Ring){.fd = -1};
+}
+
+static bool ring_supports(int fd) {
+  const uint8_t ops[] = {IORING_OP_OPENAT, IORING_OP_STATX, IORING_OP_READ,
+                         IORING_OP_CLOSE};
+  const size_t probe_ops = 256;
+  struct io_uring_probe *probe = calloc(
+      1, sizeof(*probe) + probe_ops * sizeof(struct io_uring_probe_op));
+  assert(probe != NULL);
+  bool ok = syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe,
+                    probe_ops) == 0;
+  for (size_t i = 0; ok && i < sizeof(ops); i++) {
+    ok = ops[i] <= probe->last_op &&
+         (probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED) != 0;
+  }
+  free(probe);
+  return ok;
+}
+
+// false if io_uring or one of the operations is not available
+static bool ring_init(Ring *self, unsigned entries) {
+  *self = (Ring){.fd = -1};
+  struct io_uring_params p = {};
+  self->fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+  if (self->fd < 0 || !ring_supports(self->fd)) {
+    ring_free(self);
+    return false;
+  }
+  self->entries = p.sq_entries;
+
+  self->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  self->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  const bool single = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+  if (single && self->cq_size > self->sq_size) {
+    self->sq_size = self->cq_size;
+  }
+  self->sq_ptr = mmap(NULL, self->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                      self->fd, IORING_OFF_SQ_RING);
+  if (self->sq_ptr == MAP_FAILED) {
+    self->sq_ptr = NULL;
+    ring_free(self);
+    return false;
+  }
+  if (single) {
+    self->cq_ptr = self->sq_ptr;
+  } else {
+    self->cq_ptr = mmap(NULL, self->cq_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED, self->fd, IORING_OFF_CQ_RING);
+    if (self->cq_ptr == MAP_FAILED) {
+      self->cq_ptr = NULL;
+      ring_free(self);
+      return false;
+    }
+  }
+  self->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+  self->sqes = mmap(NULL, self->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                    self->fd, IORING_OFF_SQES);
+  if (self->sqes == MAP_FAILED) {
+    self->sqes = NULL;
+    ring_free(self);
+    return false;
+  }
+
+  char *sq = self->sq_ptr;
+  self->sq_head = (unsigned *)(sq + p.sq_off.head);
+  self->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+  self->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+  self->sq_array = (unsigned *)(sq + p.sq_off.array);
+  char *cq = self->cq_ptr;
+  self->cq_head = (unsigned *)(cq + p.cq_off.head);
+  self->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+  self->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+  self->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+  self->tail = *self->sq_tail;
+  return true;
+}
+
+// Queue an operation, submitted by the next ring_enter.
+static struct io_uring_sqe *ring_sqe(Ring *self, uint64_t user_data) {
+  const unsigned head = __atomic_load_n(self->sq_head, __ATOMIC_ACQUIRE);
+  // slots have at most two operations queued, the ring is big enough
+  assert(self->tail - head < self->entries);
+  const unsigned i = self->tail & *self->sq_mask;
+  struct io_uring_sqe *sqe = &self->sqes[i];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->user_data = user_data;
+  self->sq_array[i] = i;
+  self->tail++;
+  self->queued++;
+  __atomic_store_n(self->sq_tail, self->tail, __ATOMIC_RELEASE);
+  return sqe;
+}
+
+// Submit the queued operations, with wait until at least one completed.
+static KevsError ring_enter(Ring *self, bool wait) {
+  while (self->queued > 0 || wait) {
+    const long n =
+        syscall(__NR_io_uring_enter, self->fd, self->queued, wait ? 1 : 0,
+                wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if ((errno == EAGAIN || errno == EBUSY) && self->queued > 0 && !wait) {
+        // out of resources for now, completions free them
+        wait = true;
+        continue;
+      }
+      return strerror(errno);
+    }
+    self->queued -= (unsigned)n;
+    wait = false;
+  }
+  return NULL;
+}
+
+enum {
+  kLoadOpOpen,
+  kLoadOpStat,
+  kLoadOpRead,
+  kLoadOpClose,
+};
+
+typedef struct {
+  bool busy;
+  // operation the slot waits for
+  uint8_t stage;
+  uint8_t pending;
+  size_t index;
+  int fd;
+  struct statx stx;
+  char *data;
+  size_t len;
+  size_t done;
+  KevsError err;
+} LoadSlot;
+
+typedef struct {
+  Ring ring;
+  const char *const *paths;
+  LoadSlot *slots;
+  size_t window;
+  size_t active;
+  LoadResults results;
+} Uring;
+
+static void uring_submit(Uring *self, size_t id, uint8_t op) {
+  LoadSlot *slot = &self->slots[id];
+  struct io_uring_sqe *sqe = ring_sqe(&self->ring, (uint64_t)id << 2 | op);
+  // the stat goes with the open
+  slot->stage = op == kLoadOpStat ? kLoadOpOpen : op;
+  slot->pending++;
+  switch (op) {
+  case kLoadOpOpen:
+    sqe->opcode = IORING_OP_OPENAT;
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (uint64_t)(uintptr_t)self->paths[slot->index];
+    sqe->open_flags = O_RDONLY | O_CLOEXEC;
+    break;
+  case kLoadOpStat:
+    sqe->opcode = IORING_OP_STATX;
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (uint64_t)(uintptr_t)self->paths[slot->index];
+    sqe->len = STATX_SIZE;
+    sqe->off = (uint64_t)(uintptr_t)&slot->stx;
+    break;
+  case kLoadOpRead: {
+    size_t len = slot->len - slot->done;
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = slot->fd;
+    sqe->addr = (uint64_t)(uintptr_t)(slot->data + slot->done);
+    sqe->len = (uint32_t)(len < kUringMaxRead ? len : kUringMaxRead);
+    sqe->off = slot->done;
+    break;
+  }
+  case kLoadOpClose:
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->fd = slot->fd;
+    break;
+  }
+}
+
+static void uring_start(Uring *self, size_t index) {
+  size_t id = 0;
+  while (self->slots[id].busy) {
+    id++;
+  }
+  self->slots[id] = (LoadSlot){.busy = true, .index = index, .fd = -1};
+  uring_submit(self, id, kLoadOpOpen);
+  uring_submit(self, id, kLoadOpStat);
+  self->active++;
+}
+
+// Move slot id on once its operations completed.
+static void uring_step(Uring *self, size_t id) {
+  LoadSlot *slot = &self->slots[id];
+  if (slot->stage == kLoadOpClose) {
+    slot->busy = false;
+    self->active--;
+    return;
+  }
+  if (slot->stage == kLoadOpOpen && slot->err == NULL) {
+    slot->len = slot->stx.stx_size;
+    slot->data = malloc(slot->len + 1);
+    if (slot->data == NULL) {
+      slot->err = "out of memory";
+    } else {
+      slot->data[slot->len] = 0;
+    }
+  }
+  if (slot->err == NULL && slot->done < slot->len) {
+    uring_submit(self, id, kLoadOpRead);
+    return;
+  }
+
+  // read or failed: hand the file over, then close it
+  if (slot->err != NULL) {
+    free(slot->data);
+    slot->data = NULL;
+  }
+  load_results_push(&self->results,
+                    (LoadResult){.index = slot->index,
+                                 .data = slot->data,
+                                 .len = slot->len,
+                                 .err = slot->err});
+  if (slot->fd >= 0) {
+    uring_submit(self, id, kLoadOpClose);
+  } else {
+    slot->busy = false;
+    self->active--;
+  }
+}
+
+static void uring_complete(Uring *self, uint64_t user_data, int res) {
+  const size_t id = user_data >> 2;
+  LoadSlot *slot = &self->slots[id];
+  slot->pending--;
+  switch (user_data & 3) {
+  case kLoadOpOpen:
+    if (res >= 0) {
+      slot->fd = res;
+    } else if (slot->err == NULL) {
+      slot->err = strerror(-res);
+    }
+    break;
+  case kLoadOpStat:
+    if (res < 0 && slot->err == NULL) {
+      slot->err = strerror(-res);
+    }
+    break;
+  case kLoadOpRead:
+    if (res > 0) {
+      slot->done += (size_t)res;
+    } else if (res == 0) {
+      slot->err = "short read";
+    } else if (res != -EINTR && res != -EAGAIN) {
+      slot->err = strerror(-res);
+    }
+    break;
+  }
+  if (slot->pending == 0) {
+    uring_step(self, id);
+  }
+}
+
+static void uring_reap(Uring *self) {
+  Ring *ring = &self->ring;
+  unsigned head = *ring->cq_head;
+  const unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+  while (head != tail) {
+    const struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+    uring_complete(self, cqe->user_data, cqe->res);
+    head++;
+  }
+  __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+}
+
+static bool uring_cq_empty(Uring *self) {
+  return *self->ring.cq_head ==
+         __atomic_load_n(self->ring.cq_tail, __ATOMIC_ACQUIRE);
+}
+
+// false if io_uring is not available, nothing was loaded then
+static bool load_uring(const char *const *paths, size_t n, size_t window,
+                       LoadDone done, void *ctx) {
+  Uring self = {.paths = paths, .window = window};
+  if (!ring_init(&self.ring, (unsigned)window * 2)) {
+    return false;
+  }
+  self.slots = calloc(window, sizeof(LoadSlot));
+  assert(self.slots != NULL);
+
+  KevsError err = NULL;
+  size_t next = 0;
+  while (err == NULL && (next < n || self.active > 0)) {
+    while (next < n && self.active < window) {
+      uring_start(&self, next++);
+    }
+    // wait only if there is nothing to hand over
+    err = ring_enter(&self.ring, uring_cq_empty(&self));
+    if (err != NULL) {
+      break;
+    }
+    uring_reap(&self);
+    while (next < n && self.active < window) {
+      uring_start(&self, next++);
+    }
+    // the kernel works on the next files while these are parsed
+    err = ring_enter(&self.ring, false);
+
+    for (size_t i = 0; i < self.results.len; i++) {
+      LoadResult r = self.results.ptr[i];
+      done(ctx, r.index, r.data, r.len, r.err);
+    }
+    self.results.len = 0;
+  }
+
+  if (err != NULL) {
+    // the files not handed over fail, buffers of reads in flight are left
+    // alone as the kernel may still write to them
+    for (size_t i = 0; i < window; i++) {
+      LoadSlot *slot = &self.slots[i];
+      if (slot->busy && slot->stage != kLoadOpClose) {
+        done(ctx, slot->index, NULL, 0, err);
+      }
+    }
+    while (next < n) {
+      done(ctx, next++, NULL, 0, err);
+    }
+  }
+
+  ring_free(&self.ring);
+  free(self.slots);
+  free(self.results.ptr);
+  return true;
+}
+
+#endif
+
+#ifdef LOAD_THREADS
+
+static const size_t kLoadThreads = 16;
+
+typedef struct {
+  const char *const *paths;
+  size_t n;
+  size_t window;
+  pthread_mutex_t mu;
+  // a file was read, a result was taken
+  pthread_cond_t ready;
+  pthread_cond_t space;
+  // next file to be claimed by a worker
+  size_t next;
+  // results taken by the calling thread
+  size_t taken;
+  LoadResults results;
+  size_t head;
+} LoadPool;
+
+static void *load_pool_run(void *arg) {
+  LoadPool *self = arg;
+  pthread_mutex_lock(&self->mu);
+  for (;;) {
+    // stay a window ahead of the parsing, not the whole list
+    while (self->next < self->n && self->next - self->taken >= self->window) {
+      pthread_cond_wait(&self->space, &self->mu);
+    }
+    if (self->next >= self->n) {
+      break;
+    }
+    LoadResult r = {.index = self->next++};
+    pthread_mutex_unlock(&self->mu);
+    r.err = read_file(kevs_str_from_cstr(self->paths[r.index]), &r.data,
+                      &r.len);
+    pthread_mutex_lock(&self->mu);
+    load_results_push(&self->results, r);
+    pthread_cond_signal(&self->ready);
+  }
+  pthread_mutex_unlock(&self->mu);
+  return NULL;
+}
+
+static void load_pool(const char *const *paths, size_t n, size_t window,
+                      size_t threads, LoadDone done, void *ctx) {
+  LoadPool self = {.paths = paths, .n = n, .window = window};
+  if (self.window < threads) {
+    self.window = threads;
+  }
+  if (threads > n) {
+    threads = n;
+  }
+  pthread_mutex_init(&self.mu, NULL);
+  pthread_cond_init(&self.ready, NULL);
+  pthread_cond_init(&self.space, NULL);
+
+  pthread_t *ids = calloc(threads, sizeof(pthread_t));
+  assert(ids != NULL);
+  size_t started = 0;
+  while (started < threads && pthread_create(&ids[started], NULL,
+                                             load_pool_run, &self) == 0) {
+    started++;
+  }
+
+  pthread_mutex_lock(&self.mu);
+  while (self.taken < n) {
+    if (started == 0) {
+      // no thread could be started, read here
+      LoadResult r = {.index = self.next++};
+      r.err = read_file(kevs_str_from_cstr(paths[r.index]), &r.data, &r.len);
+      load_results_push(&self.results, r);
+    }
+    while (self.head == self.results.len) {
+      pthread_cond_wait(&self.ready, &self.mu);
+    }
+    LoadResult r = self.results.ptr[self.head++];
+    if (self.head == self.results.len) {
+      self.head = 0;
+      self.results.len = 0;
+    }
+    self.taken++;
+    pthread_cond_signal(&self.space);
+    pthread_mutex_unlock(&self.mu);
+    done(ctx, r.index, r.data, r.len, r.err);
+    pthread_mutex_lock(&self.mu);
+  }
+  pthread_mutex_unlock(&self.mu);
+
+  for (size_t i = 0; i < started; i++) {
+    pthread_join(ids[i], NULL);
+  }
+  free(ids);
+  free(self.results.ptr);
+  pthread_cond_destroy(&self.space);
+  pthread_cond_destroy(&self.ready);
+  pthread_mutex_destroy(&self.mu);
+}
+
+#endif
+
+const char *load_files(const char *const *paths, size_t n, LoadOpts opts,
+                       LoadDone done, void *ctx) {
+  const size_t window = opts.window == 0 ? kLoadWindow : opts.window;
+#ifdef LOAD_URING
+  if (!opts.no_uring && load_uring(paths, n, window, done, ctx)) {
+    return "io_uring";
+  }
+#endif
+#ifdef LOAD_THREADS
+  load_pool(paths, n, window, opts.threads == 0 ? kLoadThreads : opts.threads,
+            done, ctx);
+  return "threads";
+#else
+  (void)window;
+  for (size_t i = 0; i < n; i++) {
+    char *data = NULL;
+    size_t len = 0;
+    KevsError err = read_file(kevs_str_from_cstr(paths[i]), &data, &len);
+    done(ctx, i, data, len, err);
+  }
+  return "sequential";
+#endif
+}
+
+typedef struct {
+  const char *const *paths;
+  KevsParser parser;
+  KevsOpts opts;
+  size_t bytes;
+  size_t failed;
+  char err_buf[8193];
+} LoadCli;
+
+static void load_cli_done(void *ctx, size_t index, char *data, size_t len,
+                          KevsError err) {
+  LoadCli *self = ctx;
+  if (err != NULL) {
+    fprintf(stderr, "error: failed to read file '%s': %s\n",
+            self->paths[index], err);
+    self->failed++;
+    return;
+  }
+
+  KevsTable table = {};
+  self->opts.file = kevs_str_from_cstr(self->paths[index]);
+  err = kevs_parser_parse(&self->parser, &table,
+                          (KevsStr){.ptr = data, .len = len}, self->err_buf,
+                          sizeof(self->err_buf) - 1, self->opts);
+  if (err != NULL) {
+    fprintf(stderr, "error: %s\n", err);
+    self->failed++;
+  }
+  self->bytes += len;
+  free(data);
+}
+
+typedef struct {
+  char **ptr;
+  size_t cap;
+  size_t len;
+} LoadPaths;
+
+static void load_paths_push(LoadPaths *self, char *path) {
+  if (self->len == self->cap) {
+    self->cap = self->cap < 16 ? 16 : self->cap * 2;
+    self->ptr = realloc(self->ptr, self->cap * sizeof(char *));
+    assert(self->ptr != NULL);
+  }
+  self->ptr[self->len++] = path;
+}
+
+// A path per line, empty lines are skipped.
+static void load_paths_read(LoadPaths *self, FILE *f) {
+  char line[4097];
+  while (fgets(line, sizeof(line), f) != NULL) {
+    size_t len = strlen(line);
+    while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) {
+      len--;
+    }
+    if (len > 0) {
+      line[len] = 0;
+      char *path = strdup(line);
+      assert(path != NULL);
+      load_paths_push(self, path);
+    }
+  }
+}
+
+static bool load_size_arg(int argc, char **argv, int i, size_t *out) {
+  char *end = NULL;
+  if (i + 1 >= argc) {
+    fprintf(stderr, "error: %s needs a number\n", argv[i]);
+    return false;
+  }
+  const unsigned long long v = strtoull(argv[i + 1], &end, 10);
+  if (*argv[i + 1] == 0 || *end != 0 || v == 0) {
+    fprintf(stderr, "error: %s needs a positive number, have '%s'\n", argv[i],
+            argv[i + 1]);
+    return false;
+  }
+  *out = (size_t)v;
+  return true;
+}
+
+int load_main(int argc, char **argv) {
+  LoadOpts load_opts = {};
+  KevsOpts opts = {.errors_with_file_and_line = true};
+  int i = 0;
+  while (i < argc) {
+    if (strcmp(argv[i], "--pack") == 0 || strcmp(argv[i], "-pack") == 0) {
+      opts.pack_lists = true;
+      i++;
+    } else if (strcmp(argv[i], "--utf8") == 0 ||
+               strcmp(argv[i], "-utf8") == 0) {
+      opts.validate_utf8 = true;
+      i++;
+    } else if (strcmp(argv[i], "--no-uring") == 0 ||
+               strcmp(argv[i], "-no-uring") == 0) {
+      load_opts.no_uring = true;
+      i++;
+    } else if (strcmp(argv[i], "--threads") == 0 ||
+               strcmp(argv[i], "-threads") == 0) {
+      if (!load_size_arg(argc, argv, i, &load_opts.threads)) {
+        return 1;
+      }
+      i += 2;
+    } else if (strcmp(argv[i], "--window") == 0 ||
+               strcmp(argv[i], "-window") == 0) {
+      if (!load_size_arg(argc, argv, i, &load_opts.window)) {
+        return 1;
+      }
+      i += 2;
+    } else if (strlen(argv[i]) > 1 && argv[i][0] == '-') {
+      fprintf(stderr, "error: unknown option '%s'\n", argv[i]);
+      return 1;
+    } else {
+      break;
+    }
+  }
+  if (i >= argc) {
+    fprintf(stderr, "usage: kevs load [-pack] [-utf8] [-threads N] "
+                    "[-window N] [-no-uring] file... | -\n");
+    return 1;
+  }
+
+  LoadPaths paths = {};
+  for (; i < argc; i++) {
+    if (strcmp(argv[i], "-") == 0) {
+      load_paths_read(&paths, stdin);
+    } else {
+      char *path = strdup(argv[i]);
+      assert(path != NULL);
+      load_paths_push(&paths, path);
+    }
+  }
+
+  LoadCli *cli = calloc(1, sizeof(LoadCli));
+  assert(cli != NULL);
+  cli->paths = (const char *const *)paths.ptr;
+  cli->opts = opts;
+  const char *method =
+      load_files(cli->paths, paths.len, load_opts, load_cli_done, cli);
+  printf("%zu files, %zu bytes, %zu failed, %s\n", paths.len, cli->bytes,
+         cli->failed, method);
+
+  const int rc = cli->failed == 0 ? 0 : 1;
+  kevs_parser_free(&cli->parser);
+  free(cli);
+  for (size_t j = 0; j < paths.len; j++) {
+    free(paths.ptr[j]);
+  }
+  free(paths.ptr);
+  return rc;
+}
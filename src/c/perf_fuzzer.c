@@ -0,0 +1,231 @@
+// Performance fuzzer: reports inputs whose parsing cost grows faster than
+// their size. Needs kevs.c built with KEVS_STATS, see CMakeLists.txt.
+
+#include "kevs.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+size_t LLVMFuzzerMutate(uint8_t *data, size_t size, size_t max_size);
+
+// provided by the sanitizer runtime, if linked
+__attribute__((weak)) int __sanitizer_install_malloc_and_free_hooks(
+    void (*malloc_hook)(const volatile void *, size_t),
+    void (*free_hook)(const volatile void *));
+
+static char err_buf[8193] = {};
+
+// cost allowed per input byte, KEVS_PERF_MAX_COST overrides it
+static uint64_t max_cost = 64;
+
+// smaller inputs are dominated by constant costs
+static const size_t kMinSize = 256;
+
+static bool counting = false;
+static uint64_t allocations = 0;
+
+static void malloc_hook(const volatile void *ptr, size_t size) {
+  (void)ptr;
+  (void)size;
+  if (counting) {
+    allocations++;
+  }
+}
+
+static void free_hook(const volatile void *ptr) { (void)ptr; }
+
+int LLVMFuzzerInitialize(int *argc, char ***argv) {
+  (void)argc;
+  (void)argv;
+
+  if (__sanitizer_install_malloc_and_free_hooks != NULL) {
+    __sanitizer_install_malloc_and_free_hooks(malloc_hook, free_hook);
+  }
+
+  const char *env = getenv("KEVS_PERF_MAX_COST");
+  if (env != NULL) {
+    max_cost = strtoull(env, NULL, 10);
+  }
+
+  return 0;
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+  KevsTable t = {};
+
+  const KevsStr content = {.ptr = (char *)data, .len = size};
+  const KevsOpts opts = {
+      .file = kevs_str_from_cstr("perf_fuzzer"),
+      .errors_with_file_and_line = true,
+  };
+
+  kevs_stats = (KevsStats){};
+  allocations = 0;
+  counting = true;
+
+  kevs_parse(&t, content, err_buf, sizeof(err_buf) - 1, opts);
+  kevs_free(&t);
+
+  counting = false;
+
+  const KevsStats s = kevs_stats;
+  const uint64_t cost =
+      s.tokens + s.key_compares + s.index_steps + allocations;
+  if (size >= kMinSize && cost > max_cost * size) {
+    fprintf(stderr,
+            "super-linear input: %zu bytes, cost %llu: tokens %llu, "
+            "key compares %llu, index steps %llu, allocations %llu\n",
+            size, (unsigned long long)cost, (unsigned long long)s.tokens,
+            (unsigned long long)s.key_compares,
+            (unsigned long long)s.index_steps,
+            (unsigned long long)allocations);
+    // let libFuzzer save the input
+    abort();
+  }
+
+  return 0;
+}
+
+// Mutator: besides the default mutations, generate deep and wide documents
+// which a byte level mutator is unlikely to reach.
+
+typedef struct {
+  uint8_t *ptr;
+  size_t cap;
+  size_t len;
+} Out;
+
+static uint32_t rand_next(uint32_t *state) {
+  // xorshift32
+  uint32_t x = *state;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  *state = x;
+  return x;
+}
+
+static bool out_fits(const Out *self, size_t n) {
+  return self->len + n <= self->cap;
+}
+
+static void out_str(Out *self, const char *s) {
+  const size_t n = strlen(s);
+  if (out_fits(self, n)) {
+    memcpy(self->ptr + self->len, s, n);
+    self->len += n;
+  }
+}
+
+static void gen_wide_table(Out *self, uint32_t *rng) {
+  char buf[64];
+  const bool nested = rand_next(rng) % 2 == 0;
+  out_str(self, nested ? "t = {\n" : "");
+  for (uint32_t i = 0; out_fits(self, sizeof(buf) + 4); i++) {
+    snprintf(buf, sizeof(buf), "k%u = %u;\n", i, rand_next(rng) % 1000);
+    out_str(self, buf);
+  }
+  out_str(self, nested ? "};\n" : "");
+}
+
+static void gen_deep(Out *self, uint32_t *rng) {
+  const bool tables = rand_next(rng) % 2 == 0;
+  const char *begin = tables ? "{a = " : "[";
+  const char *end = tables ? "};" : "];";
+  const size_t free_len = self->cap - self->len;
+  // key, innermost value and newline
+  if (free_len < 16) {
+    return;
+  }
+  const size_t depth = (free_len - 7) / (strlen(begin) + strlen(end));
+  out_str(self, "a = ");
+  for (size_t i = 0; i < depth; i++) {
+    out_str(self, begin);
+  }
+  out_str(self, "1;");
+  for (size_t i = 0; i < depth; i++) {
+    out_str(self, end);
+  }
+  out_str(self, "\n");
+}
+
+static void gen_long_string(Out *self, uint32_t *rng) {
+  static const char *parts[] = {"x", "\\t", "\\\"", "\\u00e9", "\\n", " "};
+  const size_t n = sizeof(parts) / sizeof(parts[0]);
+  out_str(self, "s = \"");
+  while (out_fits(self, 16)) {
+    out_str(self, parts[rand_next(rng) % n]);
+  }
+  out_str(self, "\";\n");
+}
+
+static void gen_wide_list(Out *self, uint32_t *rng) {
+  static const char *items[] = {"1;", "true;", "0x1f;", "`r`;", "{};", "[];"};
+  const size_t n = sizeof(items) / sizeof(items[0]);
+  const bool mixed = rand_next(rng) % 2 == 0;
+  out_str(self, "l = [");
+  while (out_fits(self, 16)) {
+    out_str(self, items[mixed ? rand_next(rng) % n : 0]);
+  }
+  out_str(self, "];\n");
+}
+
+static void gen_document(Out *self, uint32_t *rng) {
+  switch (rand_next(rng) % 4) {
+  case 0:
+    gen_wide_table(self, rng);
+    break;
+  case 1:
+    gen_deep(self, rng);
+    break;
+  case 2:
+    gen_long_string(self, rng);
+    break;
+  default:
+    gen_wide_list(self, rng);
+    break;
+  }
+}
+
+size_t LLVMFuzzerCustomMutator(uint8_t *data, size_t size, size_t max_size,
+                               unsigned int seed) {
+  uint32_t rng = seed == 0 ? 1 : seed;
+
+  switch (rand_next(&rng) % 4) {
+  case 0: {
+    // fresh document
+    Out out = {.ptr = data, .cap = max_size};
+    gen_document(&out, &rng);
+    return out.len;
+  }
+
+  case 1: {
+    // fragment spliced in at a line start
+    if (size >= max_size) {
+      break;
+    }
+    size_t at = size == 0 ? 0 : rand_next(&rng) % size;
+    while (at != 0 && data[at - 1] != '\n') {
+      at--;
+    }
+
+    // up to a quarter of the free space
+    Out out = {.cap = (max_size - size) / 4 + 1};
+    out.ptr = malloc(out.cap);
+    if (out.ptr == NULL) {
+      break;
+    }
+    gen_document(&out, &rng);
+    memmove(data + at + out.len, data + at, size - at);
+    memcpy(data + at, out.ptr, out.len);
+    free(out.ptr);
+    return size + out.len;
+  }
+
+  default:
+    break;
+  }
+
+  return LLVMFuzzerMutate(data, size, max_size);
+}
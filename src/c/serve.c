@@ -0,0 +1,541 @@
+// kevs serve and kevs get: a daemon which keeps parsed documents in memory
+// and answers path queries over a Unix domain socket, and its client.
+//
+// One request per connection, integers in host byte order:
+//   request   u32 file length, u32 path length, file, path
+//   response  u8 status (0 ok, 1 error), u32 length, text
+// The text is what kevs get prints, the value or the error message.
+
+#define _XOPEN_SOURCE 700
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <limits.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+#include "kevs.h"
+#include "util.h"
+
+typedef struct {
+  const char *socket;
+  KevsOpts opts;
+  // first argument after the flags
+  int index;
+} ServeFlags;
+
+static bool serve_flags(int argc, char **argv, ServeFlags *out) {
+  int i = 0;
+  while (i < argc) {
+    if (strcmp(argv[i], "--socket") == 0 || strcmp(argv[i], "-socket") == 0) {
+      if (i + 1 >= argc) {
+        fprintf(stderr, "error: -socket needs a path\n");
+        return false;
+      }
+      out->socket = argv[i + 1];
+      i += 2;
+    } else if (strcmp(argv[i], "--intern") == 0 ||
+               strcmp(argv[i], "-intern") == 0) {
+      out->opts.intern_keys = true;
+      i++;
+    } else if (strcmp(argv[i], "--pack") == 0 ||
+               strcmp(argv[i], "-pack") == 0) {
+      out->opts.pack_lists = true;
+      i++;
+    } else if (strlen(argv[i]) > 0 && argv[i][0] == '-') {
+      fprintf(stderr, "error: unknown option '%s'\n", argv[i]);
+      return false;
+    } else {
+      break;
+    }
+  }
+  out->index = i;
+  return true;
+}
+
+// Look up path in a parsed document and print the value to f.
+static KevsError query(KevsTable table, const char *path, FILE *f) {
+  KevsValue v = {};
+  KevsError err = table_lookup(table, kevs_str_from_cstr(path), &v);
+  if (err == NULL) {
+    value_fprint(f, v);
+  }
+  return err;
+}
+
+// Without a daemon: read, parse and look up in this process.
+static int get_direct(const char *file, const char *path, KevsOpts opts) {
+  char *data = NULL;
+  size_t data_len = 0;
+  KevsError err = read_file(kevs_str_from_cstr(file), &data, &data_len);
+  if (err != NULL) {
+    fprintf(stderr, "error: failed to read file: %s\n", err);
+    return 1;
+  }
+
+  KevsTable table = {};
+  char err_buf[8193] = {};
+  opts.file = kevs_str_from_cstr(file);
+  opts.errors_with_file_and_line = true;
+  err = kevs_parse(&table, (KevsStr){.ptr = data, .len = data_len}, err_buf,
+                   sizeof(err_buf) - 1, opts);
+  if (err == NULL) {
+    err = query(table, path, stdout);
+  }
+  if (err != NULL) {
+    fprintf(stderr, "error: %s\n", err);
+  }
+
+  kevs_free(&table);
+  free(data);
+  return err == NULL ? 0 : 1;
+}
+
+#ifdef _WIN32
+
+int serve_main(int argc, char **argv) {
+  (void)argc;
+  (void)argv;
+  fprintf(stderr, "error: serve needs Unix domain sockets\n");
+  return 1;
+}
+
+int get_main(int argc, char **argv) {
+  ServeFlags flags = {};
+  if (!serve_flags(argc, argv, &flags) || argc - flags.index != 2) {
+    fprintf(stderr, "usage: kevs get [-intern] [-pack] file path\n");
+    return 1;
+  }
+  return get_direct(argv[flags.index], argv[flags.index + 1], flags.opts);
+}
+
+#else
+
+#if defined(__APPLE__)
+#define STAT_MTIME_NSEC(st) ((st).st_mtimespec.tv_nsec)
+#else
+#define STAT_MTIME_NSEC(st) ((st).st_mtim.tv_nsec)
+#endif
+
+// documents kept, the least recently used one is dropped for a new one
+static const size_t kServeMaxDocs = 64;
+static const uint32_t kServeMaxPath = 4096;
+
+typedef struct {
+  // absolute path
+  char *file;
+  // the version which was parsed
+  dev_t dev;
+  ino_t ino;
+  off_t size;
+  time_t mtime;
+  long mtime_nsec;
+  char *data;
+  KevsTable table;
+  // parse error, kept until the file changes
+  char *err;
+  uint64_t used;
+} ServeDoc;
+
+typedef struct {
+  ServeDoc *ptr;
+  size_t len;
+  KevsOpts opts;
+  uint64_t clock;
+} ServeCache;
+
+static void serve_doc_clear(ServeDoc *self) {
+  kevs_free(&self->table);
+  free(self->data);
+  free(self->err);
+  self->data = NULL;
+  self->err = NULL;
+}
+
+static void serve_doc_load(ServeDoc *self, struct stat st, KevsOpts opts) {
+  self->dev = st.st_dev;
+  self->ino = st.st_ino;
+  self->size = st.st_size;
+  self->mtime = st.st_mtime;
+  self->mtime_nsec = STAT_MTIME_NSEC(st);
+
+  char err_buf[8193] = {};
+  size_t data_len = 0;
+  KevsError err =
+      read_file(kevs_str_from_cstr(self->file), &self->data, &data_len);
+  if (err != NULL) {
+    snprintf(err_buf, sizeof(err_buf), "failed to read file: %s", err);
+    self->err = strdup(err_buf);
+    return;
+  }
+
+  opts.file = kevs_str_from_cstr(self->file);
+  opts.errors_with_file_and_line = true;
+  err = kevs_parse(&self->table,
+                   (KevsStr){.ptr = self->data, .len = data_len}, err_buf,
+                   sizeof(err_buf) - 1, opts);
+  if (err != NULL) {
+    self->err = strdup(err);
+  }
+}
+
+// Find the document of file, parsing it if it's new or has changed.
+static KevsError serve_doc(ServeCache *self, const char *file,
+                           ServeDoc **out) {
+  // stat before reading, a change while reading is seen by the next query
+  struct stat st = {};
+  if (stat(file, &st) == -1) {
+    return strerror(errno);
+  }
+
+  ServeDoc *doc = NULL;
+  for (size_t i = 0; i < self->len && doc == NULL; i++) {
+    if (strcmp(self->ptr[i].file, file) == 0) {
+      doc = &self->ptr[i];
+    }
+  }
+
+  if (doc != NULL && doc->dev == st.st_dev && doc->ino == st.st_ino &&
+      doc->size == st.st_size && doc->mtime == st.st_mtime &&
+      doc->mtime_nsec == STAT_MTIME_NSEC(st)) {
+    doc->used = ++self->clock;
+    *out = doc;
+    return NULL;
+  }
+
+  if (doc == NULL && self->len < kServeMaxDocs) {
+    doc = &self->ptr[self->len++];
+    *doc = (ServeDoc){.file = strdup(file)};
+  } else if (doc == NULL) {
+    doc = &self->ptr[0];
+    for (size_t i = 1; i < self->len; i++) {
+      if (self->ptr[i].used < doc->used) {
+        doc = &self->ptr[i];
+      }
+    }
+    serve_doc_clear(doc);
+    free(doc->file);
+    *doc = (ServeDoc){.file = strdup(file)};
+  } else {
+    serve_doc_clear(doc);
+  }
+
+  serve_doc_load(doc, st, self->opts);
+  doc->used = ++self->clock;
+  *out = doc;
+  return NULL;
+}
+
+static void serve_cache_free(ServeCache *self) {
+  for (size_t i = 0; i < self->len; i++) {
+    serve_doc_clear(&self->ptr[i]);
+    free(self->ptr[i].file);
+  }
+  free(self->ptr);
+}
+
+static bool read_full(int fd, void *buf, size_t len) {
+  char *p = buf;
+  while (len > 0) {
+    const ssize_t n = read(fd, p, len);
+    if (n == -1 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    p += n;
+    len -= (size_t)n;
+  }
+  return true;
+}
+
+static bool write_full(int fd, const void *buf, size_t len) {
+  const char *p = buf;
+  while (len > 0) {
+    const ssize_t n = write(fd, p, len);
+    if (n == -1 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    p += n;
+    len -= (size_t)n;
+  }
+  return true;
+}
+
+static void serve_respond(int fd, uint8_t status, const char *text,
+                          size_t len) {
+  if (len > UINT32_MAX) {
+    text = "value too large";
+    len = strlen(text);
+    status = 1;
+  }
+  const uint32_t n = (uint32_t)len;
+  char header[5] = {(char)status};
+  memcpy(header + 1, &n, sizeof(n));
+  if (write_full(fd, header, sizeof(header))) {
+    write_full(fd, text, len);
+  }
+}
+
+static void serve_conn(ServeCache *cache, int fd) {
+  uint32_t lens[2] = {};
+  if (!read_full(fd, lens, sizeof(lens))) {
+    return;
+  }
+  if (lens[0] == 0 || lens[0] >= PATH_MAX || lens[1] > kServeMaxPath) {
+    const char *err = "request too large";
+    serve_respond(fd, 1, err, strlen(err));
+    return;
+  }
+
+  char *req = malloc((size_t)lens[0] + lens[1] + 2);
+  if (req == NULL) {
+    return;
+  }
+  char *file = req;
+  char *path = req + lens[0] + 1;
+  if (!read_full(fd, file, lens[0]) || !read_full(fd, path, lens[1])) {
+    free(req);
+    return;
+  }
+  file[lens[0]] = 0;
+  path[lens[1]] = 0;
+
+  char *text = NULL;
+  size_t text_len = 0;
+  FILE *f = open_memstream(&text, &text_len);
+  KevsError err = NULL;
+  if (f == NULL) {
+    err = strerror(errno);
+  } else if (strlen(file) != lens[0] || file[0] != '/') {
+    err = "file must be an absolute path";
+  } else {
+    ServeDoc *doc = NULL;
+    err = serve_doc(cache, file, &doc);
+    if (err == NULL) {
+      err = doc->err != NULL ? doc->err : query(doc->table, path, f);
+    }
+  }
+  if (f != NULL) {
+    fclose(f);
+  }
+
+  if (err != NULL) {
+    serve_respond(fd, 1, err, strlen(err));
+  } else {
+    serve_respond(fd, 0, text, text_len);
+  }
+  free(text);
+  free(req);
+}
+
+static void default_socket(char *buf, size_t len) {
+  const char *env = getenv("KEVS_SOCKET");
+  if (env != NULL && env[0] != 0) {
+    snprintf(buf, len, "%s", env);
+  } else {
+    snprintf(buf, len, "/tmp/kevs-%u.sock", (unsigned)getuid());
+  }
+}
+
+static int socket_connect(const char *path) {
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  strcpy(addr.sun_path, path);
+
+  const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd == -1) {
+    return -1;
+  }
+  if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+static volatile sig_atomic_t serve_stop = 0;
+
+static void serve_on_signal(int sig) {
+  (void)sig;
+  serve_stop = 1;
+}
+
+int serve_main(int argc, char **argv) {
+  ServeFlags flags = {};
+  if (!serve_flags(argc, argv, &flags) || flags.index != argc) {
+    fprintf(stderr, "usage: kevs serve [-socket path] [-intern] [-pack]\n");
+    return 1;
+  }
+  char sock[PATH_MAX] = {};
+  if (flags.socket != NULL) {
+    snprintf(sock, sizeof(sock), "%s", flags.socket);
+  } else {
+    default_socket(sock, sizeof(sock));
+  }
+
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  if (strlen(sock) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "error: socket path too long: %s\n", sock);
+    return 1;
+  }
+  strcpy(addr.sun_path, sock);
+
+  const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd == -1) {
+    fprintf(stderr, "error: socket: %s\n", strerror(errno));
+    return 1;
+  }
+
+  // only the owner may connect
+  const mode_t mask = umask(077);
+  int rc = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+  if (rc == -1 && errno == EADDRINUSE) {
+    // left over from a daemon which didn't exit cleanly
+    const int other = socket_connect(sock);
+    if (other != -1) {
+      close(other);
+      umask(mask);
+      fprintf(stderr, "error: already serving on %s\n", sock);
+      close(fd);
+      return 1;
+    }
+    unlink(sock);
+    rc = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+  }
+  umask(mask);
+  if (rc == -1 || listen(fd, 64) == -1) {
+    fprintf(stderr, "error: failed to listen on %s: %s\n", sock,
+            strerror(errno));
+    close(fd);
+    return 1;
+  }
+
+  // without SA_RESTART, so accept returns on a signal
+  struct sigaction sa = {};
+  sa.sa_handler = serve_on_signal;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+  signal(SIGPIPE, SIG_IGN);
+
+  ServeCache cache = {.opts = flags.opts};
+  cache.ptr = calloc(kServeMaxDocs, sizeof(ServeDoc));
+  if (cache.ptr == NULL) {
+    fprintf(stderr, "error: out of memory\n");
+    close(fd);
+    unlink(sock);
+    return 1;
+  }
+
+  fprintf(stderr, "serving on %s\n", sock);
+  while (!serve_stop) {
+    const int conn = accept(fd, NULL, NULL);
+    if (conn == -1) {
+      if (errno != EINTR) {
+        fprintf(stderr, "error: accept: %s\n", strerror(errno));
+      }
+      continue;
+    }
+    // a stuck client must not block the others for long
+    const struct timeval timeout = {.tv_sec = 1};
+    setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(conn, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    serve_conn(&cache, conn);
+    close(conn);
+  }
+
+  close(fd);
+  unlink(sock);
+  serve_cache_free(&cache);
+  return 0;
+}
+
+// Ask the daemon, false if there is none or it failed before answering.
+static bool get_remote(const char *sock, const char *file, const char *path,
+                       int *rc) {
+  const size_t file_len = strlen(file);
+  const size_t path_len = strlen(path);
+  if (path_len > kServeMaxPath) {
+    return false;
+  }
+
+  const int fd = socket_connect(sock);
+  if (fd == -1) {
+    return false;
+  }
+
+  const uint32_t lens[2] = {(uint32_t)file_len, (uint32_t)path_len};
+  char header[5] = {};
+  uint32_t text_len = 0;
+  char *text = NULL;
+  bool ok = write_full(fd, lens, sizeof(lens)) &&
+            write_full(fd, file, file_len) &&
+            write_full(fd, path, path_len) &&
+            read_full(fd, header, sizeof(header));
+  if (ok) {
+    memcpy(&text_len, header + 1, sizeof(text_len));
+    text = malloc((size_t)text_len + 1);
+    ok = text != NULL && read_full(fd, text, text_len);
+  }
+  close(fd);
+  if (!ok) {
+    free(text);
+    return false;
+  }
+
+  text[text_len] = 0;
+  if (header[0] == 0) {
+    fwrite(text, 1, text_len, stdout);
+    *rc = 0;
+  } else {
+    fprintf(stderr, "error: %s\n", text);
+    *rc = 1;
+  }
+  free(text);
+  return true;
+}
+
+int get_main(int argc, char **argv) {
+  ServeFlags flags = {};
+  if (!serve_flags(argc, argv, &flags) || argc - flags.index != 2) {
+    fprintf(stderr, "usage: kevs get [-socket path] [-intern] [-pack] "
+                    "file path\n");
+    return 1;
+  }
+  const char *file = argv[flags.index];
+  const char *path = argv[flags.index + 1];
+
+  char sock[PATH_MAX] = {};
+  if (flags.socket != NULL) {
+    snprintf(sock, sizeof(sock), "%s", flags.socket);
+  } else {
+    default_socket(sock, sizeof(sock));
+  }
+
+  // the daemon has its own working directory
+  char abs[PATH_MAX] = {};
+  int rc = 0;
+  if (realpath(file, abs) != NULL && get_remote(sock, abs, path, &rc)) {
+    return rc;
+  }
+  return get_direct(file, path, flags.opts);
+}
+
+#endif
@@ -1,6 +1,16 @@
+#define _XOPEN_SOURCE 700
+
 #include <assert.h>
+#include <inttypes.h>
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
 
 #include "kevs.h"
 #include "util.h"
@@ -19,25 +29,25 @@ static void print_log(const char *fn, int ln, const char *fmt, ...) {
 static void test_str_index_char() {
   KevsStr s = kevs_str_from_cstr("0123456789");
   {
-    int i = str_index_char(s, '0');
+    int64_t i = str_index_char(s, '0');
     const int expected = 0;
     INFO("want %zu, have %zu", expected, i);
     assert(i == expected);
   }
   {
-    int i = str_index_char(s, '5');
+    int64_t i = str_index_char(s, '5');
     const int expected = 5;
     INFO("want %zu, have %zu", expected, i);
     assert(i == expected);
   }
   {
-    int i = str_index_char(s, '9');
+    int64_t i = str_index_char(s, '9');
     const int expected = 9;
     INFO("want %zu, have %zu", expected, i);
     assert(i == expected);
   }
   {
-    int i = str_index_char(s, 'x');
+    int64_t i = str_index_char(s, 'x');
     const int expected = -1;
     INFO("want %zu, have %zu", expected, i);
     assert(i == expected);
@@ -265,6 +275,1633 @@ static void test_ucs_to_utf8() {
   }
 }
 
+static void test_builder() {
+  KevsBuilder b = {};
+
+  assert(kevs_builder_reserve(&b, (size_t)UINT32_MAX + 1) != NULL);
+  assert(kevs_builder_list_begin(&b, "l", (size_t)UINT32_MAX + 1) != NULL);
+  assert(kevs_builder_reserve(&b, 4) == NULL);
+  assert(kevs_builder_add_string(&b, "name", "host1") == NULL);
+  assert(kevs_builder_add_int(&b, "port", 8080) == NULL);
+  assert(kevs_builder_add_bool(&b, "enabled", true) == NULL);
+  assert(kevs_builder_list_begin(&b, "weights", 0) == NULL);
+  for (int64_t i = 0; i < 100; i++) {
+    assert(kevs_builder_add_int(&b, NULL, i) == NULL);
+  }
+  assert(kevs_builder_table_begin(&b, NULL, 1) == NULL);
+  assert(kevs_builder_add_string(&b, "zone", "eu") == NULL);
+  assert(kevs_builder_table_end(&b) == NULL);
+  assert(kevs_builder_list_end(&b) == NULL);
+
+  // invalid usage
+  assert(kevs_builder_add_int(&b, "port", 1) != NULL);
+  assert(kevs_builder_add_int(&b, "1port", 1) != NULL);
+  assert(kevs_builder_add_int(&b, NULL, 1) != NULL);
+  assert(kevs_builder_list_end(&b) != NULL);
+  assert(kevs_builder_table_end(&b) != NULL);
+
+  KevsTable root = {};
+  assert(kevs_builder_finish(&b, &root) == NULL);
+  INFO("root: len=%zu", root.len);
+  assert(root.len == 4);
+
+  char *name = NULL;
+  assert(kevs_table_string(root, "name", &name) == NULL);
+  assert(strcmp(name, "host1") == 0);
+
+  int64_t port = 0;
+  assert(kevs_table_int(root, "port", &port) == NULL);
+  assert(port == 8080);
+
+  bool enabled = false;
+  assert(kevs_table_bool(root, "enabled", &enabled) == NULL);
+  assert(enabled);
+
+  KevsList weights = {};
+  assert(kevs_table_list(root, "weights", &weights) == NULL);
+  INFO("weights: len=%zu", weights.len);
+  assert(weights.len == 101);
+  for (size_t i = 0; i < 100; i++) {
+    int64_t v = 0;
+    assert(kevs_list_int(weights, i, &v) == NULL);
+    assert(v == (int64_t)i);
+  }
+
+  KevsTable zone = {};
+  assert(kevs_list_table(weights, 100, &zone) == NULL);
+  char *zone_name = NULL;
+  assert(kevs_table_string(zone, "zone", &zone_name) == NULL);
+  assert(strcmp(zone_name, "eu") == 0);
+
+  kevs_free(&root);
+
+  // unfinished document
+  assert(kevs_builder_table_begin(&b, "t", 0) == NULL);
+  assert(kevs_builder_finish(&b, &root) != NULL);
+
+  kevs_builder_free(&b);
+}
+
+static void test_intern_keys() {
+  const char *input = "hosts = [\n"
+                      "  {host = \"a\"; port = 1; weight = 10;};\n"
+                      "  {host = \"b\"; port = 2; weight = 20;};\n"
+                      "];\n"
+                      "port = 3;\n";
+
+  // keys must not reference the input
+  char *data = kevs_str_dup(kevs_str_from_cstr(input));
+  const KevsStr content = kevs_str_from_cstr(data);
+
+  KevsTable root = {};
+  char err_buf[8193] = {};
+  const KevsOpts opts = {.intern_keys = true};
+  KevsError err =
+      kevs_parse(&root, content, err_buf, sizeof(err_buf) - 1, opts);
+  free(data);
+  INFO("err=%s", err);
+  assert(err == NULL);
+
+  INFO("symbols: %zu", kevs_symbol_count(root));
+  assert(kevs_symbol_count(root) == 4);
+
+  uint32_t port_id = 0;
+  assert(kevs_symbol_id(root, "port", &port_id) == NULL);
+  assert(kevs_symbol_id(root, "nope", &port_id) != NULL);
+
+  KevsStr port_key = {};
+  assert(kevs_symbol_key(root, port_id, &port_key) == NULL);
+  assert(port_key.len == 4 && memcmp(port_key.ptr, "port", 4) == 0);
+
+  KevsList hosts = {};
+  assert(kevs_table_list(root, "hosts", &hosts) == NULL);
+  for (size_t i = 0; i < hosts.len; i++) {
+    KevsTable host = {};
+    assert(kevs_list_table(hosts, i, &host) == NULL);
+
+    // same key in different tables is the same symbol
+    uint32_t id = 0;
+    assert(kevs_table_key_id(host, 1, &id) == NULL);
+    assert(id == port_id);
+    assert(host.ptr[1].key.ptr == port_key.ptr);
+
+    KevsValue v = {};
+    assert(kevs_table_get_id(host, port_id, &v) == NULL);
+    assert(v.kind == KevsValueKindInteger);
+    assert(v.data.integer == (int64_t)i + 1);
+  }
+
+  int64_t port = 0;
+  assert(kevs_table_int(root, "port", &port) == NULL);
+  assert(port == 3);
+
+  kevs_free(&root);
+
+  // duplicate keys are still detected
+  const KevsStr dup = kevs_str_from_cstr("a = {x = 1; x = 2;};\n");
+  err = kevs_parse(&root, dup, err_buf, sizeof(err_buf) - 1, opts);
+  INFO("err=%s", err);
+  assert(err != NULL);
+  kevs_free(&root);
+}
+
+static void test_pack_lists() {
+  const KevsStr content = kevs_str_from_cstr(
+      "ints = [1; -2; 0x10; +42; 9223372036854775807;];\n"
+      "bools = [true; false; true;];\n"
+      "mixed = [1; true;];\n"
+      "strings = [\"a\";];\n"
+      "empty = [];\n");
+
+  const KevsOpts opts_list[] = {
+      {.pack_lists = true},
+      {.pack_lists = true, .intern_keys = true},
+  };
+  for (size_t k = 0; k < sizeof(opts_list) / sizeof(opts_list[0]); k++) {
+    KevsTable root = {};
+    char err_buf[8193] = {};
+    KevsError err = kevs_parse(&root, content, err_buf, sizeof(err_buf) - 1,
+                               opts_list[k]);
+    INFO("opts #%zu: err=%s", k, err);
+    assert(err == NULL);
+
+    KevsList ints = {};
+    assert(kevs_table_list(root, "ints", &ints) == NULL);
+    const int64_t *packed = NULL;
+    assert(kevs_list_ints(ints, &packed) == NULL);
+    const int64_t expected[] = {1, -2, 0x10, 42, INT64_MAX};
+    assert(ints.len == sizeof(expected) / sizeof(expected[0]));
+    for (size_t i = 0; i < ints.len; i++) {
+      int64_t v = 0;
+      assert(kevs_list_int(ints, i, &v) == NULL);
+      INFO("ints[%zu]: want %ld, have %ld", i, expected[i], v);
+      assert(v == expected[i]);
+      assert(packed[i] == expected[i]);
+    }
+    bool b = false;
+    assert(kevs_list_bool(ints, 0, &b) != NULL);
+
+    KevsList bools = {};
+    assert(kevs_table_list(root, "bools", &bools) == NULL);
+    const uint64_t *bits = NULL;
+    assert(kevs_list_bools(bools, &bits) == NULL);
+    assert(bools.len == 3);
+    assert(bits[0] == 5);
+    assert(kevs_list_bool(bools, 1, &b) == NULL && !b);
+    assert(kevs_list_bool(bools, 2, &b) == NULL && b);
+
+    KevsList mixed = {};
+    assert(kevs_table_list(root, "mixed", &mixed) == NULL);
+    assert(kevs_list_ints(mixed, &packed) != NULL);
+    assert(kevs_list_bool(mixed, 1, &b) == NULL && b);
+
+    KevsList strings = {};
+    assert(kevs_table_list(root, "strings", &strings) == NULL);
+    assert(kevs_list_ints(strings, &packed) != NULL);
+
+    kevs_free(&root);
+  }
+
+  // invalid integers are reported as without packing
+  KevsTable root = {};
+  char err_buf[8193] = {};
+  const KevsOpts opts = {.pack_lists = true};
+  KevsError err =
+      kevs_parse(&root, kevs_str_from_cstr("x = [1; 0y2;];\n"), err_buf,
+                 sizeof(err_buf) - 1, opts);
+  INFO("err=%s", err);
+  assert(err != NULL && strstr(err, "is not an integer") != NULL);
+  kevs_free(&root);
+}
+
+static void test_cells() {
+  assert(sizeof(KevsCell) == 16);
+
+  const KevsStr content = kevs_str_from_cstr(
+      "short = \"hello\";\n"
+      "long = \"this string does not fit inline\";\n"
+      "int = -42;\n"
+      "bool = true;\n"
+      "list = [1; \"x\"; [false;];];\n"
+      "table = {int = 7; nested = {short = \"hi\";};};\n");
+
+  KevsCellDoc doc = {};
+  char err_buf[8193] = {};
+  const KevsOpts opts = {.pack_lists = true};
+  KevsError err =
+      kevs_cell_parse(&doc, content, err_buf, sizeof(err_buf) - 1, opts);
+  INFO("err=%s", err);
+  assert(err == NULL);
+  assert(kevs_cell_kind(doc.root) == KevsValueKindTable);
+  assert(kevs_cell_len(doc.root) == 6);
+
+  const KevsCell *c = NULL;
+  KevsStr s = {};
+  assert(kevs_cell_table_get(&doc, doc.root, "short", &c) == NULL);
+  assert(kevs_cell_string(c, &s) == NULL);
+  assert(s.len == 5 && memcmp(s.ptr, "hello", 5) == 0);
+
+  assert(kevs_cell_table_get(&doc, doc.root, "long", &c) == NULL);
+  assert(kevs_cell_string(c, &s) == NULL);
+  assert(s.len == 31 && memcmp(s.ptr, "this string", 11) == 0);
+
+  int64_t i = 0;
+  assert(kevs_cell_table_get(&doc, doc.root, "int", &c) == NULL);
+  assert(kevs_cell_int(*c, &i) == NULL && i == -42);
+  assert(kevs_cell_string(c, &s) != NULL);
+
+  bool b = false;
+  assert(kevs_cell_table_get(&doc, doc.root, "bool", &c) == NULL);
+  assert(kevs_cell_bool(*c, &b) == NULL && b);
+
+  const KevsCell *list = NULL;
+  assert(kevs_cell_table_get(&doc, doc.root, "list", &list) == NULL);
+  assert(kevs_cell_len(*list) == 3);
+  assert(kevs_cell_list_get(*list, 0, &c) == NULL);
+  assert(kevs_cell_int(*c, &i) == NULL && i == 1);
+  assert(kevs_cell_list_get(*list, 2, &c) == NULL);
+  assert(kevs_cell_kind(*c) == KevsValueKindList);
+  assert(kevs_cell_list_get(*list, 3, &c) != NULL);
+
+  const KevsCell *table = NULL;
+  assert(kevs_cell_table_get(&doc, doc.root, "table", &table) == NULL);
+  assert(kevs_cell_table_get(&doc, *table, "int", &c) == NULL);
+  assert(kevs_cell_int(*c, &i) == NULL && i == 7);
+  assert(kevs_cell_table_get(&doc, *table, "short", &c) != NULL);
+
+  // same key in different tables has the same id
+  uint32_t root_id = 0;
+  uint32_t table_id = 0;
+  assert(kevs_cell_table_entry(doc.root, 2, &root_id, &c) == NULL);
+  assert(kevs_cell_table_entry(*table, 0, &table_id, &c) == NULL);
+  assert(root_id == table_id);
+  assert(kevs_cell_key(&doc, root_id, &s) == NULL);
+  assert(s.len == 3 && memcmp(s.ptr, "int", 3) == 0);
+
+  kevs_cell_free(&doc);
+}
+
+static void test_tape() {
+  const KevsStr content = kevs_str_from_cstr(
+      "name = \"a\\tb\";\n"
+      "list = [1; {x = true;}; [`raw`;];];\n"
+      "table = {port = 0x10; empty = [];};\n");
+
+  KevsTape tape = {};
+  char err_buf[8193] = {};
+  const KevsOpts opts = {};
+  KevsError err =
+      kevs_tape_parse(&tape, content, err_buf, sizeof(err_buf) - 1, opts);
+  INFO("err=%s", err);
+  assert(err == NULL);
+
+  assert(kevs_tape_kind(tape, 0) == KevsValueKindTable);
+  assert(kevs_tape_next(tape, 0) == tape.len);
+
+  size_t i = 0;
+  KevsStr s = {};
+  assert(kevs_tape_table_get(tape, 0, "name", &i) == NULL);
+  assert(kevs_tape_string(tape, i, &s) == NULL);
+  assert(s.len == 3 && memcmp(s.ptr, "a\tb", 3) == 0);
+  assert(s.ptr[s.len] == 0);
+
+  size_t list = 0;
+  assert(kevs_tape_table_get(tape, 0, "list", &list) == NULL);
+  assert(kevs_tape_kind(tape, list) == KevsValueKindList);
+
+  int64_t n = 0;
+  assert(kevs_tape_list_get(tape, list, 0, &i) == NULL);
+  assert(kevs_tape_int(tape, i, &n) == NULL && n == 1);
+
+  bool b = false;
+  assert(kevs_tape_list_get(tape, list, 1, &i) == NULL);
+  assert(kevs_tape_table_get(tape, i, "x", &i) == NULL);
+  assert(kevs_tape_bool(tape, i, &b) == NULL && b);
+
+  assert(kevs_tape_list_get(tape, list, 2, &i) == NULL);
+  assert(kevs_tape_list_get(tape, i, 0, &i) == NULL);
+  assert(kevs_tape_string(tape, i, &s) == NULL);
+  assert(s.len == 3 && memcmp(s.ptr, "raw", 3) == 0);
+
+  assert(kevs_tape_list_get(tape, list, 3, &i) != NULL);
+
+  size_t table = 0;
+  assert(kevs_tape_table_get(tape, 0, "table", &table) == NULL);
+  assert(kevs_tape_table_get(tape, table, "port", &i) == NULL);
+  assert(kevs_tape_int(tape, i, &n) == NULL && n == 16);
+  assert(kevs_tape_table_get(tape, table, "empty", &i) == NULL);
+  assert(kevs_tape_list_get(tape, i, 0, &i) != NULL);
+  assert(kevs_tape_table_get(tape, table, "name", &i) != NULL);
+
+  kevs_tape_free(&tape);
+
+  const char *not_valid[] = {
+      "x = {a = 1; a = 2;};\n",
+      "x = [1; 0y;];\n",
+      "1x = 1;\n",
+      "x = \"\\q\";\n",
+      "x = 1\n",
+  };
+  for (size_t k = 0; k < sizeof(not_valid) / sizeof(not_valid[0]); k++) {
+    err = kevs_tape_parse(&tape, kevs_str_from_cstr(not_valid[k]), err_buf,
+                          sizeof(err_buf) - 1, opts);
+    INFO("test #%zu: err=%s", k, err);
+    assert(err != NULL);
+  }
+}
+
+typedef struct {
+  int keys;
+  int scalars;
+  int tables;
+  int lists;
+  int errors;
+  int64_t sum;
+  int stop_after;
+} EventCounts;
+
+static bool count_key(void *ctx, KevsStr key) {
+  (void)key;
+  EventCounts *c = ctx;
+  c->keys++;
+  return c->stop_after == 0 || c->keys < c->stop_after;
+}
+
+static bool count_scalar(void *ctx, KevsValueKind kind, KevsStr raw) {
+  EventCounts *c = ctx;
+  c->scalars++;
+  if (kind == KevsValueKindInteger) {
+    int64_t n = 0;
+    assert(kevs_scalar_int(raw, &n) == NULL);
+    c->sum += n;
+  }
+  return true;
+}
+
+static bool count_table(void *ctx) {
+  ((EventCounts *)ctx)->tables++;
+  return true;
+}
+
+static bool count_list(void *ctx) {
+  ((EventCounts *)ctx)->lists++;
+  return true;
+}
+
+static void count_error(void *ctx, KevsError err) {
+  (void)err;
+  ((EventCounts *)ctx)->errors++;
+}
+
+static void test_events() {
+  const KevsEvents events = {
+      .key = count_key,
+      .scalar = count_scalar,
+      .begin_table = count_table,
+      .begin_list = count_list,
+      .error = count_error,
+  };
+  const KevsStr content = kevs_str_from_cstr(
+      "a = 1;\n"
+      "b = [2; {c = 3; d = \"x\\ty\";}; [];];\n"
+      "e = true;\n");
+
+  char err_buf[8193] = {};
+  const KevsOpts opts = {};
+  EventCounts c = {};
+  KevsError err = kevs_parse_events(content, &events, &c, err_buf,
+                                    sizeof(err_buf) - 1, opts);
+  INFO("err=%s", err);
+  assert(err == NULL);
+  assert(c.keys == 5 && c.scalars == 5 && c.tables == 1 && c.lists == 2);
+  assert(c.sum == 6 && c.errors == 0);
+
+  c = (EventCounts){.stop_after = 2};
+  err = kevs_parse_events(content, &events, &c, err_buf, sizeof(err_buf) - 1,
+                          opts);
+  assert(err != NULL && strstr(err, "stopped by event callback") != NULL);
+  assert(c.keys == 2 && c.scalars == 1 && c.errors == 0);
+
+  c = (EventCounts){};
+  err = kevs_parse_events(kevs_str_from_cstr("a = 1"), &events, &c, err_buf,
+                          sizeof(err_buf) - 1, opts);
+  assert(err != NULL && c.errors == 1);
+
+  bool b = false;
+  char *str = NULL;
+  assert(kevs_scalar_bool(kevs_str_from_cstr("true"), &b) == NULL && b);
+  assert(kevs_scalar_string(kevs_str_from_cstr("\"x\\ty\""), &str) == NULL);
+  assert(strcmp(str, "x\ty") == 0);
+  free(str);
+}
+
+static void test_cursor() {
+  const KevsStr content = kevs_str_from_cstr(
+      "skip = {a = [1; 2; {b = 3;};]; c = `x`;};\n"
+      "items = [{id = 1;}; {id = 2; tags = [true;];};];\n"
+      "name = \"n\";\n");
+
+  KevsCursor c = {};
+  char err_buf[8193] = {};
+  const KevsOpts opts = {};
+  KevsError err =
+      kevs_cursor_init(&c, content, err_buf, sizeof(err_buf) - 1, opts);
+  INFO("err=%s", err);
+  assert(err == NULL);
+
+  assert(kevs_cursor_next(&c));
+  assert(kevs_cursor_kind(&c) == KevsValueKindTable);
+  assert(kevs_cursor_raw(&c).len == 0);
+
+  // nested table is skipped
+  assert(kevs_cursor_next(&c));
+  KevsStr key = kevs_cursor_key(&c);
+  assert(key.len == 5 && memcmp(key.ptr, "items", 5) == 0);
+  assert(kevs_cursor_kind(&c) == KevsValueKindList);
+
+  assert(kevs_cursor_enter(&c) == NULL);
+  int64_t sum = 0;
+  while (kevs_cursor_next(&c)) {
+    assert(kevs_cursor_key(&c).len == 0);
+    assert(kevs_cursor_enter(&c) == NULL);
+    assert(kevs_cursor_next(&c));
+    int64_t n = 0;
+    assert(kevs_scalar_int(kevs_cursor_raw(&c), &n) == NULL);
+    sum += n;
+    kevs_cursor_skip(&c);
+  }
+  assert(sum == 3);
+
+  assert(kevs_cursor_next(&c));
+  key = kevs_cursor_key(&c);
+  assert(key.len == 4 && memcmp(key.ptr, "name", 4) == 0);
+  assert(kevs_cursor_kind(&c) == KevsValueKindString);
+  assert(kevs_cursor_enter(&c) != NULL);
+
+  assert(!kevs_cursor_next(&c));
+  assert(!kevs_cursor_next(&c));
+  kevs_cursor_free(&c);
+}
+
+static void test_deep_nesting() {
+  // deeper than the C stack would allow with recursive descent
+  const size_t depth = 200000;
+  const char *pre = "a = ";
+  const size_t len = strlen(pre) + depth * 3 + 2;
+  char *buf = malloc(len + 1);
+  assert(buf != NULL);
+
+  char *p = buf;
+  memcpy(p, pre, strlen(pre));
+  p += strlen(pre);
+  memset(p, '[', depth);
+  p += depth;
+  *p++ = ']';
+  for (size_t i = 1; i < depth; i++) {
+    *p++ = ';';
+    *p++ = ']';
+  }
+  *p++ = ';';
+  *p++ = '\n';
+  *p = 0;
+
+  KevsTable table = {};
+  char err_buf[8193] = {};
+  const KevsOpts opts = {};
+  KevsError err = kevs_parse(&table, kevs_str_from_cstr(buf), err_buf,
+                             sizeof(err_buf) - 1, opts);
+  INFO("err=%s", err);
+  assert(err == NULL);
+
+  size_t n = 0;
+  KevsValue v = table.ptr[0].val;
+  while (v.kind == KevsValueKindList && v.data.list.len == 1) {
+    v = v.data.list.ptr[0];
+    n++;
+  }
+  assert(n == depth - 1);
+
+  KevsCellDoc doc = {};
+  err = kevs_cell_from_table(&doc, table);
+  assert(err == NULL);
+  uint32_t key_id = 0;
+  const KevsCell *cell = NULL;
+  err = kevs_cell_table_entry(doc.root, 0, &key_id, &cell);
+  assert(err == NULL);
+  n = 0;
+  while (kevs_cell_kind(*cell) == KevsValueKindList &&
+         kevs_cell_len(*cell) == 1) {
+    err = kevs_cell_list_get(*cell, 0, &cell);
+    assert(err == NULL);
+    n++;
+  }
+  assert(n == depth - 1);
+  kevs_cell_free(&doc);
+
+  kevs_free(&table);
+  free(buf);
+}
+
+static bool cancel_progress(void *ctx, size_t tokens) {
+  (void)tokens;
+  size_t *calls = ctx;
+  (*calls)++;
+  // 22 tokens, two calls while scanning, cancel on the first while parsing
+  return *calls < 3;
+}
+
+static void expect_limit(const char *content, KevsOpts opts, const char *want) {
+  KevsTable table = {};
+  char err_buf[8193] = {};
+  KevsError err = kevs_parse(&table, kevs_str_from_cstr(content), err_buf,
+                             sizeof(err_buf) - 1, opts);
+  INFO("want=%s err=%s", want, err);
+  assert(err != NULL && strstr(err, want) != NULL);
+  kevs_free(&table);
+}
+
+static void test_limits() {
+  const char *content = "a = [1; {b = \"xy\"; c = `z`;};];\nd = true;\n";
+
+  KevsTable table = {};
+  char err_buf[8193] = {};
+  KevsOpts opts = {
+      .max_input_bytes = strlen(content),
+      .max_tokens = 22,
+      .max_depth = 2,
+      .max_string_bytes = 3,
+      .max_table_keys = 2,
+      .max_nodes = 6,
+  };
+  KevsError err = kevs_parse(&table, kevs_str_from_cstr(content), err_buf,
+                             sizeof(err_buf) - 1, opts);
+  INFO("err=%s", err);
+  assert(err == NULL);
+  kevs_free(&table);
+
+  expect_limit(content, (KevsOpts){.max_input_bytes = 8}, "input is larger");
+  expect_limit(content, (KevsOpts){.max_tokens = 21}, "more than 21 tokens");
+  expect_limit(content, (KevsOpts){.max_depth = 1}, "nesting is deeper");
+  expect_limit(content, (KevsOpts){.max_string_bytes = 2}, "strings longer");
+  expect_limit(content, (KevsOpts){.max_table_keys = 1}, "more than 1 keys");
+  expect_limit(content, (KevsOpts){.max_nodes = 5}, "more than 5 values");
+
+  size_t calls = 0;
+  opts = (KevsOpts){
+      .progress = cancel_progress,
+      .progress_ctx = &calls,
+      .progress_interval = 8,
+  };
+  expect_limit(content, opts, "parse: canceled by progress callback");
+  assert(calls == 3);
+}
+
+static void test_parser_reuse() {
+  const KevsStr content = kevs_str_from_cstr(
+      "id = 7;\nname = \"gw\";\ntags = [{k = 1;}; {k = 2;};];\n");
+
+  KevsParser p = {};
+  char err_buf[8193] = {};
+  const KevsOpts opts = {};
+
+  const KevsToken *tokens = NULL;
+  const struct KevsArenaBlock *arena = NULL;
+  for (int round = 0; round < 3; round++) {
+    KevsTable root = {};
+    KevsError err = kevs_parser_parse(&p, &root, content, err_buf,
+                                      sizeof(err_buf) - 1, opts);
+    INFO("round=%d err=%s", round, err);
+    assert(err == NULL);
+
+    int64_t id = 0;
+    assert(kevs_table_int(root, "id", &id) == NULL);
+    assert(id == 7);
+    assert(kevs_symbol_count(root) == 4);
+
+    uint32_t k_id = 0;
+    assert(kevs_symbol_id(root, "k", &k_id) == NULL);
+    KevsList tags = {};
+    assert(kevs_table_list(root, "tags", &tags) == NULL);
+    KevsTable tag = {};
+    assert(kevs_list_table(tags, 1, &tag) == NULL);
+    KevsValue v = {};
+    assert(kevs_table_get_id(tag, k_id, &v) == NULL);
+    assert(v.data.integer == 2);
+
+    // borrowed from the parser
+    kevs_free(&root);
+
+    // the same buffers serve every round after the first
+    if (round > 0) {
+      assert(p.tokens.ptr == tokens);
+      assert(p.arena == arena);
+    }
+    tokens = p.tokens.ptr;
+    arena = p.arena;
+  }
+
+  // errors leave the parser usable
+  KevsTable root = {};
+  const KevsStr dup = kevs_str_from_cstr("a = 1;\na = 2;\n");
+  KevsError err =
+      kevs_parser_parse(&p, &root, dup, err_buf, sizeof(err_buf) - 1, opts);
+  INFO("err=%s", err);
+  assert(err != NULL);
+  err = kevs_parser_parse(&p, &root, content, err_buf, sizeof(err_buf) - 1,
+                          opts);
+  assert(err == NULL);
+  assert(kevs_table_has(root, "name"));
+
+  kevs_parser_reset(&p);
+  assert(p.tokens.len == 0);
+  kevs_parser_free(&p);
+}
+
+static void test_parse_batch() {
+  const size_t n = 300;
+  KevsStr *inputs = calloc(n, sizeof(KevsStr));
+  char **data = calloc(n, sizeof(char *));
+  for (size_t i = 0; i < n; i++) {
+    data[i] = malloc(64);
+    if (i % 100 == 7) {
+      snprintf(data[i], 64, "id = %zu;\nid = 0;\n", i);
+    } else {
+      snprintf(data[i], 64, "id = %zu;\ntags = [\"a\"; {x = 1;};];\n", i);
+    }
+    inputs[i] = kevs_str_from_cstr(data[i]);
+  }
+
+  const size_t threads[] = {0, 4};
+  for (size_t t = 0; t < sizeof(threads) / sizeof(threads[0]); t++) {
+    KevsTable *outputs = calloc(n, sizeof(KevsTable));
+    KevsError *errors = calloc(n, sizeof(KevsError));
+    KevsBatch batch = {};
+    const KevsOpts opts = {.threads = threads[t]};
+
+    KevsError err = kevs_parse_batch(&batch, inputs, n, outputs, errors, opts);
+    INFO("threads=%zu err=%s", threads[t], err);
+    assert(err != NULL);
+
+    for (size_t i = 0; i < n; i++) {
+      if (i % 100 == 7) {
+        assert(errors[i] != NULL && strstr(errors[i], "not unique") != NULL);
+        continue;
+      }
+      assert(errors[i] == NULL);
+      int64_t id = 0;
+      assert(kevs_table_int(outputs[i], "id", &id) == NULL);
+      assert(id == (int64_t)i);
+      assert(kevs_symbol_count(outputs[i]) == 3);
+    }
+
+    kevs_batch_free(&batch);
+    free(outputs);
+    free(errors);
+  }
+
+  for (size_t i = 0; i < n; i++) {
+    free(data[i]);
+  }
+  free(data);
+  free(inputs);
+}
+
+static void expect_compact(KevsTable *root) {
+  const KevsMemoryUsage before = kevs_memory_usage(*root);
+  INFO("before: strings=%zu lists=%zu tables=%zu keys=%zu slack=%zu "
+       "total=%zu",
+       before.strings, before.lists, before.tables, before.keys, before.slack,
+       before.total);
+  assert(before.slack != 0);
+
+  assert(kevs_compact(root) == NULL);
+
+  const KevsMemoryUsage after = kevs_memory_usage(*root);
+  INFO("after: slack=%zu total=%zu", after.slack, after.total);
+  assert(after.strings == before.strings);
+  assert(after.lists == before.lists);
+  assert(after.keys <= before.keys);
+  assert(after.total < before.total);
+
+  char *s = NULL;
+  assert(kevs_table_string(*root, "name", &s) == NULL);
+  assert(strcmp(s, "a\tb") == 0);
+  KevsList l = {};
+  assert(kevs_table_list(*root, "l", &l) == NULL);
+  assert(l.len == 3 && l.cap == 3);
+  KevsTable t = {};
+  assert(kevs_list_table(l, 2, &t) == NULL);
+  int64_t x = 0;
+  assert(kevs_table_int(t, "x", &x) == NULL);
+  assert(x == 5);
+
+  // compacting again changes nothing
+  assert(kevs_compact(root) == NULL);
+  const KevsMemoryUsage again = kevs_memory_usage(*root);
+  assert(again.total == after.total);
+}
+
+static void test_memory_usage() {
+  const KevsStr content = kevs_str_from_cstr(
+      "name = \"a\\tb\";\nl = [1; \"two\"; {x = 5;};];\nn = 1;\n");
+  char err_buf[8193] = {};
+
+  KevsTable root = {};
+  KevsError err =
+      kevs_parse(&root, content, err_buf, sizeof(err_buf) - 1, (KevsOpts){});
+  INFO("err=%s", err);
+  assert(err == NULL);
+  assert(kevs_memory_usage(root).strings == strlen("a\tb") + 1 + 4);
+  // nested tables share storage with the parent
+  KevsList l = {};
+  KevsTable nested = {};
+  assert(kevs_table_list(root, "l", &l) == NULL);
+  assert(kevs_list_table(l, 2, &nested) == NULL);
+  assert(kevs_compact(&nested) != NULL);
+  expect_compact(&root);
+  assert(kevs_memory_usage(root).slack == 0);
+  kevs_free(&root);
+
+  const KevsOpts opts = {.intern_keys = true};
+  err = kevs_parse(&root, content, err_buf, sizeof(err_buf) - 1, opts);
+  assert(err == NULL);
+  expect_compact(&root);
+  // a single block, padding is all that's left
+  assert(kevs_memory_usage(root).slack < 64);
+  uint32_t id = 0;
+  assert(kevs_symbol_id(root, "x", &id) == NULL);
+  kevs_free(&root);
+
+  // borrowed documents can't be compacted
+  KevsParser p = {};
+  err = kevs_parser_parse(&p, &root, content, err_buf, sizeof(err_buf) - 1,
+                          opts);
+  assert(err == NULL);
+  assert(kevs_compact(&root) != NULL);
+  kevs_parser_free(&p);
+}
+
+typedef struct {
+  const char *path;
+  const char *content;
+} TestFile;
+
+static const TestFile test_files[] = {
+    {"common.kevs", "port = 80;\ntls = {include \"inner.kevs\";};\n"},
+    {"copy.kevs", "port = 80;\ntls = {include \"inner.kevs\";};\n"},
+    {"inner.kevs", "on = true;\nciphers = [\"a\"; \"b\";];\n"},
+    {"cycle_a.kevs", "include \"cycle_b.kevs\";\n"},
+    {"cycle_b.kevs", "include \"cycle_a.kevs\";\n"},
+    {"deep_1.kevs", "include \"deep_2.kevs\";\n"},
+    {"deep_2.kevs", "include \"deep_3.kevs\";\n"},
+    {"deep_3.kevs", "x = 1;\n"},
+};
+
+static KevsError test_read(void *ctx, const char *path, char **out,
+                           size_t *out_len) {
+  size_t *reads = ctx;
+  for (size_t i = 0; i < sizeof(test_files) / sizeof(test_files[0]); i++) {
+    if (strcmp(test_files[i].path, path) == 0) {
+      (*reads)++;
+      *out = kevs_str_dup(kevs_str_from_cstr(test_files[i].content));
+      *out_len = strlen(test_files[i].content);
+      return NULL;
+    }
+  }
+  return "no such file";
+}
+
+static KevsError include_parse(KevsIncluder *includer, const char *content,
+                               KevsTable *out, KevsOpts opts) {
+  static char err_buf[8193] = {};
+  opts.include = kevs_include;
+  opts.include_ctx = includer;
+  return kevs_parse(out, kevs_str_from_cstr(content), err_buf,
+                    sizeof(err_buf) - 1, opts);
+}
+
+static void test_include() {
+  const char *content = "a = {include \"common.kevs\"; name = \"a\";};\n"
+                        "b = {include \"common.kevs\"; name = \"b\";};\n"
+                        "c = {include  \"copy.kevs\";};\n"
+                        "include = 1;\n";
+
+  for (int intern = 0; intern < 2; intern++) {
+    size_t reads = 0;
+    KevsIncluder includer = {.read = test_read, .read_ctx = &reads};
+    const KevsOpts opts = {.intern_keys = intern};
+
+    KevsTable root = {};
+    KevsError err = include_parse(&includer, content, &root, opts);
+    INFO("intern=%d err=%s reads=%zu", intern, err, reads);
+    assert(err == NULL);
+    // common.kevs, inner.kevs and copy.kevs which is equal to common.kevs
+    assert(reads == 3);
+
+    const char *tables[] = {"a", "b", "c"};
+    for (size_t i = 0; i < 3; i++) {
+      KevsTable t = {};
+      assert(kevs_table_table(root, tables[i], &t) == NULL);
+      int64_t port = 0;
+      assert(kevs_table_int(t, "port", &port) == NULL);
+      assert(port == 80);
+      KevsTable tls = {};
+      assert(kevs_table_table(t, "tls", &tls) == NULL);
+      KevsList ciphers = {};
+      assert(kevs_table_list(tls, "ciphers", &ciphers) == NULL);
+      char *cipher = NULL;
+      assert(kevs_list_string(ciphers, 1, &cipher) == NULL);
+      assert(strcmp(cipher, "b") == 0);
+    }
+    int64_t n = 0;
+    assert(kevs_table_int(root, "include", &n) == NULL);
+    assert(n == 1);
+
+    kevs_free(&root);
+    kevs_includer_free(&includer);
+  }
+
+  struct {
+    const char *content;
+    size_t max_depth;
+    const char *want;
+  } errors[] = {
+      {"port = 1;\ninclude \"common.kevs\";\n", 0,
+       "key 'port' from include 'common.kevs' is not unique"},
+      {"include \"cycle_a.kevs\";\n", 0, "include cycle"},
+      {"include \"deep_1.kevs\";\n", 2, "nested deeper than 2"},
+      {"include \"deep_1.kevs\";\n", 3, NULL},
+      {"include \"nope.kevs\";\n", 0, "include 'nope.kevs': no such file"},
+      {"l = [include \"common.kevs\";];\n", 0, "not an integer"},
+  };
+  for (size_t i = 0; i < sizeof(errors) / sizeof(errors[0]); i++) {
+    size_t reads = 0;
+    KevsIncluder includer = {
+        .read = test_read,
+        .read_ctx = &reads,
+        .max_depth = errors[i].max_depth,
+    };
+    KevsTable root = {};
+    KevsError err =
+        include_parse(&includer, errors[i].content, &root, (KevsOpts){});
+    INFO("#%zu want=%s err=%s", i, errors[i].want, err);
+    if (errors[i].want == NULL) {
+      assert(err == NULL);
+    } else {
+      assert(err != NULL && strstr(err, errors[i].want) != NULL);
+    }
+    kevs_free(&root);
+    kevs_includer_free(&includer);
+  }
+
+  // the tape and the cursor don't resolve includes, they must not drop them
+  KevsIncluder includer = {.read = test_read};
+  const KevsOpts opts = {.include = kevs_include, .include_ctx = &includer};
+  const KevsStr doc = kevs_str_from_cstr("include \"common.kevs\";\na = 1;\n");
+  char err_buf[8193] = {};
+  KevsTape tape = {};
+  KevsError err = kevs_tape_parse(&tape, doc, err_buf, sizeof(err_buf) - 1,
+                                  opts);
+  INFO("tape err=%s", err);
+  assert(err != NULL && strstr(err, "includes are not supported") != NULL);
+  KevsCursor cursor = {};
+  err = kevs_cursor_init(&cursor, doc, err_buf, sizeof(err_buf) - 1, opts);
+  INFO("cursor err=%s", err);
+  assert(err != NULL && strstr(err, "includes are not supported") != NULL);
+  kevs_cursor_free(&cursor);
+  kevs_includer_free(&includer);
+}
+
+static KevsTable merge_parse(const char *content, KevsOpts opts) {
+  KevsTable out = {};
+  char err_buf[8193] = {};
+  KevsError err = kevs_parse(&out, kevs_str_from_cstr(content), err_buf,
+                             sizeof(err_buf) - 1, opts);
+  INFO("err=%s", err);
+  assert(err == NULL);
+  return out;
+}
+
+static void test_merge() {
+  KevsTable base =
+      merge_parse("name = \"svc\";\n"
+                  "limits = {cpu = 1; mem = 512;};\n"
+                  "log = {level = \"info\"; sinks = [\"file\";];};\n"
+                  "ports = [80;];\n"
+                  "flags = [true;];\n",
+                  (KevsOpts){.pack_lists = true});
+
+  // more than kMergeLinearMax keys, so the hashed lookup is used
+  KevsTable region = merge_parse(
+      "k0 = 0; k1 = 1; k2 = 2; k3 = 3; k4 = 4; k5 = 5; k6 = 6; k7 = 7;\n"
+      "limits = {mem = 1024; disk = 10;};\n"
+      "ports = [443;];\n"
+      "flags = [false; true;];\n",
+      (KevsOpts){.intern_keys = true, .pack_lists = true});
+
+  KevsTable host = merge_parse(
+      "log = {sinks = [\"syslog\"; 1;];};\nname = 7;\n", (KevsOpts){});
+
+  KevsTable merged = {};
+  assert(kevs_merge(base, region, KevsMergeAppendLists, &merged) == NULL);
+  KevsTable layered = {};
+  assert(kevs_merge(merged, host, KevsMergeAppendLists, &layered) == NULL);
+
+  int64_t n = 0;
+  KevsTable limits = {};
+  assert(kevs_table_table(layered, "limits", &limits) == NULL);
+  assert(kevs_table_int(limits, "cpu", &n) == NULL && n == 1);
+  assert(kevs_table_int(limits, "mem", &n) == NULL && n == 1024);
+  assert(kevs_table_int(limits, "disk", &n) == NULL && n == 10);
+  assert(kevs_table_int(layered, "k7", &n) == NULL && n == 7);
+  assert(kevs_table_int(layered, "name", &n) == NULL && n == 7);
+
+  // packed lists of the same kind stay packed
+  KevsList ports = {};
+  const int64_t *ints = NULL;
+  assert(kevs_table_list(layered, "ports", &ports) == NULL);
+  assert(kevs_list_ints(ports, &ints) == NULL);
+  assert(ports.len == 2 && ints[0] == 80 && ints[1] == 443);
+  KevsList flags = {};
+  bool b = false;
+  assert(kevs_table_list(layered, "flags", &flags) == NULL);
+  assert(flags.len == 3);
+  assert(kevs_list_bool(flags, 0, &b) == NULL && b);
+  assert(kevs_list_bool(flags, 1, &b) == NULL && !b);
+  assert(kevs_list_bool(flags, 2, &b) == NULL && b);
+
+  KevsTable log = {};
+  KevsList sinks = {};
+  char *str = NULL;
+  assert(kevs_table_table(layered, "log", &log) == NULL);
+  assert(kevs_table_string(log, "level", &str) == NULL);
+  assert(strcmp(str, "info") == 0);
+  assert(kevs_table_list(log, "sinks", &sinks) == NULL);
+  assert(sinks.len == 3);
+  assert(kevs_list_string(sinks, 1, &str) == NULL);
+  assert(strcmp(str, "syslog") == 0);
+  assert(kevs_list_int(sinks, 2, &n) == NULL && n == 1);
+
+  // unchanged subtrees are shared
+  KevsTable base_log = {};
+  assert(kevs_table_table(base, "log", &base_log) == NULL);
+  KevsTable merged_log = {};
+  assert(kevs_table_table(merged, "log", &merged_log) == NULL);
+  assert(merged_log.ptr == base_log.ptr);
+
+  // lists are replaced by default
+  KevsTable replaced = {};
+  assert(kevs_merge(base, region, KevsMergeReplaceLists, &replaced) == NULL);
+  assert(kevs_table_list(replaced, "ports", &ports) == NULL);
+  assert(ports.len == 1);
+  kevs_free(&replaced);
+
+  // compacted results don't depend on their inputs
+  assert(kevs_compact(&layered) == NULL);
+  kevs_free(&merged);
+  kevs_free(&host);
+  kevs_free(&region);
+  kevs_free(&base);
+  assert(kevs_table_table(layered, "limits", &limits) == NULL);
+  assert(kevs_table_int(limits, "mem", &n) == NULL && n == 1024);
+  assert(kevs_table_list(layered, "flags", &flags) == NULL);
+  assert(kevs_list_bool(flags, 2, &b) == NULL && b);
+  kevs_free(&layered);
+}
+
+static const char *kTestSchema =
+    "keys = {\n"
+    "  name = {type = \"string\"; pattern = \"[a-z]*-[0-9]\";};\n"
+    "  port = {type = \"integer\"; min = 1; max = 65535;};\n"
+    "  debug = {type = \"boolean\"; optional = true;};\n"
+    "  extra = {type = \"any\"; optional = true;};\n"
+    "  hosts = {\n"
+    "    type = \"list\"; min_len = 1;\n"
+    "    items = {\n"
+    "      type = \"table\"; strict = true;\n"
+    "      keys = {\n"
+    "        addr = {type = \"string\"; min_len = 3; max_len = 8;};\n"
+    "        tags = {type = \"list\"; optional = true;\n"
+    "                items = {type = \"string\";};};\n"
+    "      };\n"
+    "    };\n"
+    "  };\n"
+    "};\n";
+
+// Validate content as a table and as events, both have to agree.
+static void expect_schema(const KevsSchema *schema, const char *content,
+                          const char *want) {
+  INFO("content=%s", content);
+  KevsTable table = {};
+  char err_buf[8193] = {};
+  const KevsStr s = kevs_str_from_cstr(content);
+  assert(kevs_parse(&table, s, err_buf, sizeof(err_buf) - 1, (KevsOpts){}) ==
+         NULL);
+
+  KevsError err =
+      kevs_schema_validate(schema, table, err_buf, sizeof(err_buf) - 1);
+  INFO("err=%s", err);
+  assert(want == NULL ? err == NULL : err != NULL && strcmp(err, want) == 0);
+
+  err = kevs_schema_validate_events(schema, s, err_buf, sizeof(err_buf) - 1,
+                                    (KevsOpts){});
+  INFO("events err=%s", err);
+  assert(want == NULL ? err == NULL : err != NULL && strcmp(err, want) == 0);
+
+  kevs_free(&table);
+}
+
+static void expect_schema_compile(const char *content, const char *want) {
+  KevsTable table = {};
+  char err_buf[8193] = {};
+  assert(kevs_parse(&table, kevs_str_from_cstr(content), err_buf,
+                    sizeof(err_buf) - 1, (KevsOpts){}) == NULL);
+  KevsSchema schema = {};
+  KevsError err =
+      kevs_schema_compile(&schema, table, err_buf, sizeof(err_buf) - 1);
+  INFO("err=%s", err);
+  assert(err != NULL && strcmp(err, want) == 0);
+  assert(schema.rules == NULL);
+  kevs_free(&table);
+}
+
+static void test_schema() {
+  KevsTable table = {};
+  char err_buf[8193] = {};
+  assert(kevs_parse(&table, kevs_str_from_cstr(kTestSchema), err_buf,
+                    sizeof(err_buf) - 1, (KevsOpts){}) == NULL);
+  KevsSchema schema = {};
+  KevsError err =
+      kevs_schema_compile(&schema, table, err_buf, sizeof(err_buf) - 1);
+  INFO("err=%s", err);
+  assert(err == NULL);
+  // the schema table is not needed anymore
+  kevs_free(&table);
+
+  expect_schema(&schema,
+                "name = \"web-1\"; port = 80; other = 1;\n"
+                "extra = [1; {x = \"y\";};];\n"
+                "hosts = [{addr = \"a.b\"; tags = [\"x\";];};\n"
+                "  {addr = `c.d`;};];",
+                NULL);
+  expect_schema(&schema, "name = \"web-2\"; port = 80; hosts = [];",
+                "schema: hosts: length 0 is less than 1");
+  expect_schema(&schema, "name = \"Web-1\"; port = 80; hosts = [];",
+                "schema: name: does not match '[a-z]*-[0-9]'");
+  expect_schema(&schema, "name = \"web-1\"; port = 0x10000; hosts = [];",
+                "schema: port: 65536 is more than 65535");
+  expect_schema(&schema, "name = \"web-1\"; port = true; hosts = [];",
+                "schema: port: is boolean, want integer");
+  expect_schema(&schema, "name = \"web-1\"; hosts = [{addr = \"abc\";};];",
+                "schema: missing key 'port'");
+  expect_schema(&schema,
+                "name = \"a-1\"; port = 1;\n"
+                "hosts = [{addr = \"abc\";}; {addr = \"abc\"; tags = [1;];};];",
+                "schema: hosts[1].tags[0]: is integer, want string");
+  expect_schema(&schema,
+                "name = \"a-1\"; port = 1;\n"
+                "hosts = [{addr = \"abc\";}; {addr = \"abc\"; port = 1;};];",
+                "schema: hosts[1].port: unknown key");
+  expect_schema(&schema,
+                "name = \"a-1\"; port = 1; hosts = [{tags = [];};];",
+                "schema: hosts[0]: missing key 'addr'");
+  expect_schema(&schema,
+                "name = \"a-1\"; port = 1;\n"
+                "hosts = [{addr = \"toolong.example\";};];",
+                "schema: hosts[0].addr: length 15 is more than 8");
+
+  // scan errors with a file name longer than any fixed scratch buffer
+  char file[4096] = {};
+  memset(file, 'f', sizeof(file) - 1);
+  const KevsOpts opts = {
+      .file = kevs_str_from_cstr(file),
+      .errors_with_file_and_line = true,
+  };
+  err = kevs_schema_validate_events(&schema, kevs_str_from_cstr("name = \"a;"),
+                                    err_buf, sizeof(err_buf) - 1, opts);
+  assert(err != NULL && strncmp(err, file, sizeof(file) - 1) == 0);
+  INFO("events err=%s", err + sizeof(file) - 1);
+  assert(strstr(err + sizeof(file) - 1, ":1: scan: ") != NULL);
+  kevs_schema_free(&schema);
+
+  expect_schema_compile("type = \"list\";",
+                        "schema: rule '(root)': root is not a table");
+  expect_schema_compile("keys = {a = {min = 1;};};",
+                        "schema: rule 'a': missing field 'type'");
+  expect_schema_compile("keys = {a = {type = \"str\";};};",
+                        "schema: rule 'a': unknown type 'str'");
+  expect_schema_compile("keys = {a = {type = \"string\"; min = 1;};};",
+                        "schema: rule 'a': min and max are for integers");
+  expect_schema_compile("keys = {a = {type = \"string\"; pattern = \"[a\";};};",
+                        "schema: rule 'a': invalid pattern '[a'");
+  expect_schema_compile("keys = {a = 1;};",
+                        "schema: rule 'a': rule is not a table");
+  expect_schema_compile("kyes = {};",
+                        "schema: rule '(root)': unknown field 'kyes'");
+  expect_schema_compile("strict = 1;",
+                        "schema: rule '(root)': field 'strict' is not boolean");
+}
+
+static void test_utf8() {
+  const struct {
+    const char *s;
+    // offset of the invalid sequence, -1 if valid
+    int invalid;
+  } cases[] = {
+      {"", -1},
+      {"abc", -1},
+      {"\xc3\xa9", -1},
+      {"\xe2\x82\xac", -1},
+      {"\xf0\x9f\x96\x96", -1},
+      {"\xed\x9f\xbf", -1},
+      {"\xee\x80\x80", -1},
+      {"\xf4\x8f\xbf\xbf", -1},
+      {"\x80", 0},
+      {"a\xbf", 1},
+      {"\xc0\x80", 0},
+      {"\xc1\xbf", 0},
+      {"\xe0\x9f\xbf", 0},
+      {"\xed\xa0\x80", 0},
+      {"\xf0\x8f\xbf\xbf", 0},
+      {"\xf4\x90\x80\x80", 0},
+      {"\xf5\x80\x80\x80", 0},
+      {"\xff", 0},
+      {"ab\xe2\x82", 2},
+      {"\xe2\x82" "a", 0},
+      {"\xc3\xa9\xc3", 2},
+      {"\xf0\x9f\x96" "a", 0},
+  };
+
+  // at every position around the 16 byte blocks
+  char buf[64] = {};
+  for (size_t c = 0; c < sizeof(cases) / sizeof(cases[0]); c++) {
+    const size_t n = strlen(cases[c].s);
+    for (size_t pos = 0; pos + n <= 40; pos++) {
+      memset(buf, 'x', sizeof(buf));
+      memcpy(buf + pos, cases[c].s, n);
+      for (size_t len = pos + n; len <= 48; len += 7) {
+        const KevsStr s = {.ptr = buf, .len = len};
+        const size_t want =
+            (cases[c].invalid < 0 ? len : pos + cases[c].invalid);
+        const size_t have = utf8_check(s);
+        if (have != want || utf8_check_scalar(s) != want) {
+          INFO("case %zu pos %zu len %zu: want %zu, have %zu", c, pos, len,
+               want, have);
+        }
+        assert(have == want);
+        assert(utf8_check_scalar(s) == want);
+      }
+    }
+  }
+
+  // random bytes, mostly valid sequences
+  uint64_t seed = 42;
+  char rnd[256] = {};
+  for (int round = 0; round < 20000; round++) {
+    size_t len = 0;
+    while (len + 4 <= sizeof(rnd)) {
+      seed = seed * 6364136223846793005u + 1442695040888963407u;
+      const uint32_t r = (uint32_t)(seed >> 33);
+      char seq[4] = {};
+      uint8_t n = ucs_to_utf8(r % 8 == 0 ? r % 0x110000 : r % 0x80, seq);
+      if (r % 997 == 0) {
+        seq[0] = (char)(r >> 8);
+        n = 1;
+      }
+      memcpy(rnd + len, seq, n);
+      len += n;
+    }
+    const KevsStr s = {.ptr = rnd, .len = len};
+    assert(utf8_check(s) == utf8_check_scalar(s));
+  }
+
+  KevsTable table = {};
+  char err_buf[8193] = {};
+  const KevsOpts opts = {.validate_utf8 = true};
+  const KevsStr content =
+      kevs_str_from_cstr("a = \"ok\";\nb = `x\ny\xc3\x28`;\n");
+  KevsError err =
+      kevs_parse(&table, content, err_buf, sizeof(err_buf) - 1, opts);
+  INFO("err=%s", err);
+  assert(err != NULL);
+  assert(strcmp(err, "scan: invalid UTF-8 at offset 18") == 0);
+
+  // without the option, strings are taken as they are
+  err = kevs_parse(&table, content, err_buf, sizeof(err_buf) - 1,
+                   (KevsOpts){});
+  assert(err == NULL);
+  kevs_free(&table);
+
+  err = kevs_parse(&table, kevs_str_from_cstr("s = \"\xc3\xa9\\t\";\n"),
+                   err_buf, sizeof(err_buf) - 1, opts);
+  assert(err == NULL);
+  kevs_free(&table);
+}
+
+static void test_table_lookup() {
+  KevsTable table = {};
+  char err_buf[8193] = {};
+  const KevsStr content =
+      kevs_str_from_cstr("name = \"svc\";\n"
+                         "hosts = [{addr = \"a\"; ports = [80; 443;];};];\n"
+                         "grid = [[1; 2;]; [3; 4;];];\n");
+  assert(kevs_parse(&table, content, err_buf, sizeof(err_buf) - 1,
+                    (KevsOpts){.pack_lists = true}) == NULL);
+
+  KevsValue v = {};
+  assert(table_lookup(table, kevs_str_from_cstr("name"), &v) == NULL);
+  assert(v.kind == KevsValueKindString && strcmp(v.data.string, "svc") == 0);
+  assert(table_lookup(table, kevs_str_from_cstr("hosts[0].ports[1]"), &v) ==
+         NULL);
+  assert(v.kind == KevsValueKindInteger && v.data.integer == 443);
+  assert(table_lookup(table, kevs_str_from_cstr("grid[1][0]"), &v) == NULL);
+  assert(v.kind == KevsValueKindInteger && v.data.integer == 3);
+  assert(table_lookup(table, kevs_str_from_cstr(""), &v) == NULL);
+  assert(v.kind == KevsValueKindTable);
+
+  const char *bad[] = {
+      "nope", "hosts[1]", "hosts[x]", "hosts[0", "name[0]",
+      "name.x", "hosts..a", ".name", "hosts[0]addr",
+  };
+  for (size_t i = 0; i < sizeof(bad) / sizeof(bad[0]); i++) {
+    KevsError err = table_lookup(table, kevs_str_from_cstr(bad[i]), &v);
+    INFO("path=%s err=%s", bad[i], err);
+    assert(err != NULL);
+  }
+  kevs_free(&table);
+}
+
+// Everything written to f so far, the caller frees it.
+static char *tmpfile_read(FILE *f) {
+  const long len = ftell(f);
+  assert(len >= 0);
+  char *out = malloc((size_t)len + 1);
+  assert(out != NULL);
+  rewind(f);
+  assert(fread(out, 1, (size_t)len, f) == (size_t)len);
+  out[len] = '\0';
+  rewind(f);
+  return out;
+}
+
+static void test_json() {
+  const char *cases[][2] = {
+      {"", "{}\n"},
+      {"a = 1; b = -9223372036854775808; c = true; d = false;\n",
+       "{\"a\":1,\"b\":-9223372036854775808,\"c\":true,\"d\":false}\n"},
+      {"s = \"\\a \\t \\\" \\\\ \\u00e9 \\U0001f596 \\u001f\";\n",
+       "{\"s\":\"\\u0007 \\t \\\" \\\\ \xc3\xa9 \xf0\x9f\x96\x96 \\u001f\"}\n"},
+      {"r = `a\"b\\c`;\n", "{\"r\":\"a\\\"b\\\\c\"}\n"},
+      {"l = [[]; {}; [1; {x = [2;];};];];\n",
+       "{\"l\":[[],{},[1,{\"x\":[2]}]]}\n"},
+      {"t = {u = {v = \"w\";}; e = {};};\n",
+       "{\"t\":{\"u\":{\"v\":\"w\"},\"e\":{}}}\n"},
+      {"long = \"0123456789abcdef0123456789\\\"abcdef0123456789abc\\\"\";\n",
+       "{\"long\":\"0123456789abcdef0123456789\\\"abcdef0123456789abc\\\"\"}"
+       "\n"},
+  };
+
+  char err_buf[8193] = {};
+  FILE *f = tmpfile();
+  assert(f != NULL);
+  for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+    INFO("content=%s", cases[i][0]);
+    const KevsStr content = kevs_str_from_cstr(cases[i][0]);
+    KevsTable table = {};
+    assert(kevs_parse(&table, content, err_buf, sizeof(err_buf) - 1,
+                      (KevsOpts){}) == NULL);
+
+    assert(json_write_table(f, table, false) == NULL);
+    char *out = tmpfile_read(f);
+    INFO("table=%s", out);
+    assert(strcmp(out, cases[i][1]) == 0);
+    free(out);
+
+    assert(json_write_events(f, content, false, err_buf, sizeof(err_buf) - 1,
+                             (KevsOpts){}) == NULL);
+    out = tmpfile_read(f);
+    INFO("events=%s", out);
+    assert(strcmp(out, cases[i][1]) == 0);
+    free(out);
+    kevs_free(&table);
+  }
+
+  // ndjson: a line per root key
+  const KevsStr content =
+      kevs_str_from_cstr("a = 1;\nb = [\"x\"; {y = true;};];\n");
+  const char *want = "{\"a\":1}\n{\"b\":[\"x\",{\"y\":true}]}\n";
+  KevsTable table = {};
+  assert(kevs_parse(&table, content, err_buf, sizeof(err_buf) - 1,
+                    (KevsOpts){}) == NULL);
+  assert(json_write_table(f, table, true) == NULL);
+  char *out = tmpfile_read(f);
+  assert(strcmp(out, want) == 0);
+  free(out);
+  assert(json_write_events(f, content, true, err_buf, sizeof(err_buf) - 1,
+                           (KevsOpts){}) == NULL);
+  out = tmpfile_read(f);
+  assert(strcmp(out, want) == 0);
+  free(out);
+  kevs_free(&table);
+
+  // errors of the scanner are reported
+  assert(json_write_events(f, kevs_str_from_cstr("a = ;\n"), false, err_buf,
+                           sizeof(err_buf) - 1, (KevsOpts){}) != NULL);
+  assert(ftell(f) == 0);
+
+  // and scalars which don't convert, like the parser words them, with
+  // nothing written
+  const KevsOpts opts = {.file = kevs_str_from_cstr("t.kevs"),
+                         .errors_with_file_and_line = true};
+  assert(json_write_events(f, kevs_str_from_cstr("a = 1;\nc = 9e99;\n"),
+                           false, err_buf, sizeof(err_buf) - 1,
+                           opts) != NULL);
+  INFO("err=%s", err_buf);
+  assert(strcmp(err_buf, "t.kevs:2: parse: value '9e99' is not an integer: "
+                         "invalid digit, bigger than base") == 0);
+  assert(ftell(f) == 0);
+  fclose(f);
+}
+
+static void test_hash() {
+  const char *doc =
+      "name = \"svc\"; port = 8080; on = true;\n"
+      "k0 = 0; k1 = 1; k2 = 2; k3 = 3; k4 = 4; k5 = 5; k6 = 6; k7 = 7;\n"
+      "tags = [\"a\"; \"b\";]; ids = [1; 2; 3;]; bits = [true; false;];\n"
+      "hosts = [{addr = \"a\"; ports = [80; 443;];}; {addr = \"b\";};];\n"
+      "empty = {}; none = [];\n";
+  // reordered keys, comments, layout
+  const char *same =
+      "# comment\n"
+      "none = [ ];\nempty = { };\n"
+      "hosts = [\n  {ports = [80; 443;]; addr = \"a\";};\n"
+      "  {addr = \"b\";};\n];\n"
+      "bits = [true; false;]; ids = [1; 2; 3;]; tags = [\"a\"; \"b\";];\n"
+      "k7 = 7; k6 = 6; k5 = 5; k4 = 4; k3 = 3; k2 = 2; k1 = 1; k0 = 0;\n"
+      "on = true; port = 8080; name = \"svc\";\n";
+  const char *other[] = {
+      "a = 1;\n",      "a = \"1\";\n",     "a = true;\n",
+      "a = [];\n",     "a = {};\n",        "a = [1; 2;];\n",
+      "a = [2; 1;];\n", "b = 1;\n",        "a = 1; b = 2;\n",
+      "a = [[1;];];\n", "a = [[]; 1;];\n", "a = {b = {};};\n",
+  };
+
+  const KevsOpts opts[] = {
+      {},
+      {.pack_lists = true},
+      {.intern_keys = true},
+      {.intern_keys = true, .pack_lists = true},
+  };
+  const size_t n_opts = sizeof(opts) / sizeof(opts[0]);
+
+  KevsTable base = merge_parse(doc, (KevsOpts){});
+  const uint64_t want = kevs_table_hash(base, NULL);
+  // pinned, hashes must not change between builds
+  INFO("hash=%" PRIx64, want);
+  assert(want == 0xd6e3749b4ad5831e);
+
+  for (size_t i = 0; i < n_opts; i++) {
+    for (size_t j = 0; j < 2; j++) {
+      KevsHashes hashes = {};
+      KevsOpts o = opts[i];
+      o.hashes = &hashes;
+      KevsTable t = merge_parse(j == 0 ? doc : same, o);
+      assert(hashes.len != 0);
+      assert(kevs_table_hash(t, &hashes) == want);
+      assert(kevs_table_hash(t, NULL) == want);
+
+      // the cache of the parser matches a walk of the document
+      KevsHashes added = {};
+      kevs_hashes_add(&added, t);
+      assert(added.len == hashes.len);
+      KevsList l = {};
+      assert(kevs_table_list(t, "hosts", &l) == NULL);
+      const KevsValue v = {.kind = KevsValueKindList, .data.list = l};
+      assert(kevs_hash(v, &hashes) == kevs_hash(v, NULL));
+      assert(kevs_hash(v, &added) == kevs_hash(v, NULL));
+
+      assert(kevs_table_equal(base, NULL, t, &hashes));
+      assert(kevs_table_equal(t, &added, base, NULL));
+      kevs_hashes_free(&added);
+      kevs_hashes_free(&hashes);
+      kevs_free(&t);
+    }
+  }
+
+  for (size_t i = 0; i < sizeof(other) / sizeof(other[0]); i++) {
+    for (size_t j = 0; j < sizeof(other) / sizeof(other[0]); j++) {
+      KevsHashes ha = {};
+      KevsHashes hb = {};
+      KevsTable a = merge_parse(other[i], (KevsOpts){.hashes = &ha});
+      KevsTable b = merge_parse(
+          other[j], (KevsOpts){.pack_lists = true, .hashes = &hb});
+      INFO("a=%s b=%s", other[i], other[j]);
+      assert((kevs_table_hash(a, NULL) == kevs_table_hash(b, NULL)) ==
+             (i == j));
+      assert(kevs_table_equal(a, &ha, b, &hb) == (i == j));
+      assert(kevs_table_equal(a, NULL, b, NULL) == (i == j));
+      kevs_hashes_free(&ha);
+      kevs_hashes_free(&hb);
+      kevs_free(&a);
+      kevs_free(&b);
+    }
+  }
+
+  // differing cached hashes stop the comparison: after changing a in place
+  // its cache is stale, so a no longer compares equal to what it holds
+  KevsHashes stale = {};
+  const char *cached = "a = {b = %d; c = 0; d = 0; e = 0; f = 0; g = 0; "
+                       "h = 0; i = 0;};\n";
+  char buf[256] = {};
+  snprintf(buf, sizeof(buf), cached, 1);
+  KevsTable a = merge_parse(buf, (KevsOpts){.hashes = &stale});
+  KevsHashes real = {};
+  snprintf(buf, sizeof(buf), cached, 2);
+  KevsTable b = merge_parse(buf, (KevsOpts){.hashes = &real});
+  a.ptr[0].val.data.table.ptr[0].val.data.integer = 2;
+  assert(kevs_table_equal(a, NULL, b, NULL));
+  assert(!kevs_table_equal(a, &stale, b, &real));
+  kevs_hashes_reset(&stale);
+  assert(stale.len == 0);
+  assert(kevs_table_equal(a, &stale, b, &real));
+  kevs_hashes_free(&stale);
+  kevs_hashes_free(&real);
+  kevs_free(&a);
+  kevs_free(&b);
+
+  // failed parses leave the cache as it was
+  KevsHashes hashes = {};
+  KevsTable t = merge_parse(doc, (KevsOpts){.hashes = &hashes});
+  const size_t len = hashes.len;
+  KevsTable bad = {};
+  char err_buf[8193] = {};
+  assert(kevs_parse(&bad, kevs_str_from_cstr("a = [1; {b = 2;}; c;];\n"),
+                    err_buf, sizeof(err_buf) - 1,
+                    (KevsOpts){.hashes = &hashes}) != NULL);
+  assert(hashes.len == len);
+  kevs_hashes_free(&hashes);
+  kevs_free(&t);
+  kevs_free(&base);
+}
+
+typedef struct {
+  const char *const *paths;
+  size_t *sizes;
+  size_t *seen;
+  size_t failed;
+} LoadCheck;
+
+static void load_check(void *ctx, size_t index, char *data, size_t len,
+                       KevsError err) {
+  LoadCheck *self = ctx;
+  self->seen[index]++;
+  if (err != NULL) {
+    INFO("%s err=%s", self->paths[index], err);
+    assert(data == NULL);
+    self->failed++;
+    return;
+  }
+  assert(len == self->sizes[index]);
+  assert(data[len] == 0);
+  // file i is i % 26 + 'a' repeated
+  for (size_t i = 0; i < len; i++) {
+    assert(data[i] == (char)('a' + index % 26));
+  }
+  free(data);
+}
+
+static void test_load_files() {
+#ifndef _WIN32
+  char dir[] = "/tmp/kevs-load-XXXXXX";
+  assert(mkdtemp(dir) != NULL);
+
+  // empty, small and one file bigger than the reads of small files
+  enum { n = 300 };
+  char *paths[n + 2] = {};
+  size_t sizes[n + 2] = {};
+  for (size_t i = 0; i < n; i++) {
+    paths[i] = malloc(sizeof(dir) + 32);
+    assert(paths[i] != NULL);
+    snprintf(paths[i], sizeof(dir) + 32, "%s/%zu.kevs", dir, i);
+    sizes[i] = i == 7 ? (size_t)3 << 20 : i % 50;
+    FILE *f = fopen(paths[i], "wb");
+    assert(f != NULL);
+    for (size_t j = 0; j < sizes[i]; j++) {
+      assert(fputc('a' + (int)(i % 26), f) != EOF);
+    }
+    assert(fclose(f) == 0);
+  }
+  paths[n] = "/tmp/kevs-load-missing/0.kevs";
+  paths[n + 1] = dir;
+
+  const LoadOpts cases[] = {
+      {},
+      {.window = 3},
+      {.no_uring = true},
+      {.no_uring = true, .threads = 1, .window = 1},
+  };
+  for (size_t c = 0; c < sizeof(cases) / sizeof(cases[0]); c++) {
+    size_t seen[n + 2] = {};
+    LoadCheck check = {
+        .paths = (const char *const *)paths, .sizes = sizes, .seen = seen};
+    const char *method = load_files(check.paths, n + 2, cases[c], load_check,
+                                    &check);
+    INFO("#%zu method=%s", c, method);
+    assert(check.failed == 2);
+    for (size_t i = 0; i < n + 2; i++) {
+      assert(seen[i] == 1);
+    }
+  }
+
+  for (size_t i = 0; i < n; i++) {
+    assert(unlink(paths[i]) == 0);
+    free(paths[i]);
+  }
+  assert(rmdir(dir) == 0);
+#endif
+}
+
+// More than 4GB and INT_MAX lines, built from one chunk of "#\n" lines
+// mapped over and over, so it takes little memory but a while to scan.
+// Runs only with KEVS_TEST_BIG set.
+static void test_big_input() {
+#ifndef _WIN32
+  if (getenv("KEVS_TEST_BIG") == NULL) {
+    return;
+  }
+
+  const size_t chunk = (size_t)16 << 20;
+  const size_t chunks = ((size_t)4 << 30) / chunk + 1;
+  const char tail[] = "a = 1;\nb = 2;\na = 3;\n";
+  const size_t page = (size_t)sysconf(_SC_PAGESIZE);
+
+  // the chunk, followed by the tail in a page of its own
+  FILE *f = tmpfile();
+  assert(f != NULL);
+  for (size_t i = 0; i < chunk / 2; i++) {
+    assert(fputs("#\n", f) >= 0);
+  }
+  assert(fwrite(tail, 1, sizeof(tail) - 1, f) == sizeof(tail) - 1);
+  assert(fflush(f) == 0);
+  const int fd = fileno(f);
+  assert(ftruncate(fd, (off_t)(chunk + page)) == 0);
+
+  // reserve the whole range, then map the pieces over it
+  const size_t total = chunks * chunk + page;
+  char *base = mmap(NULL, total, PROT_READ, MAP_SHARED, fd, 0);
+  assert(base != MAP_FAILED);
+  for (size_t i = 0; i < chunks; i++) {
+    assert(mmap(base + i * chunk, chunk, PROT_READ, MAP_SHARED | MAP_FIXED,
+                fd, 0) != MAP_FAILED);
+  }
+  assert(mmap(base + chunks * chunk, page, PROT_READ, MAP_SHARED | MAP_FIXED,
+              fd, (off_t)chunk) != MAP_FAILED);
+
+  const KevsStr content = {.ptr = base,
+                           .len = chunks * chunk + sizeof(tail) - 1};
+  const size_t line = chunks * chunk / 2 + 1;
+  INFO("bytes=%zu lines=%zu", content.len, line + 2);
+
+  char err_buf[8193] = {};
+  const KevsOpts opts = {
+      .file = kevs_str_from_cstr("big"),
+      .errors_with_file_and_line = true,
+  };
+  KevsTokens tokens = {};
+  assert(scan(&tokens, content, err_buf, sizeof(err_buf) - 1, opts) == NULL);
+  assert(tokens.len == 12);
+  // a key per line of the tail
+  for (size_t i = 0; i < tokens.len; i += 4) {
+    const size_t offset = (size_t)(tokens.ptr[i].value.ptr - base);
+    assert(offset == chunks * chunk + i / 4 * 7);
+  }
+
+  // without the duplicate key
+  KevsTable table = {};
+  tokens.len -= 4;
+  assert(parse(&table, content, err_buf, sizeof(err_buf) - 1, opts, tokens) ==
+         NULL);
+  int64_t b = 0;
+  assert(kevs_table_int(table, "b", &b) == NULL && b == 2);
+  kevs_free(&table);
+
+  tokens.len += 4;
+  KevsError err =
+      parse(&table, content, err_buf, sizeof(err_buf) - 1, opts, tokens);
+  INFO("err=%s", err);
+  char want[128] = {};
+  snprintf(want, sizeof(want),
+           "big:%zu: parse: key 'a' is not unique for current table", line + 2);
+  assert(err != NULL && strcmp(err, want) == 0);
+  // entries before the error are kept
+  kevs_free(&table);
+  free(tokens.ptr);
+
+  assert(munmap(base, total) == 0);
+  fclose(f);
+#endif
+}
+
 int main() {
   test_str_index_char();
   test_str_slice_low();
@@ -274,5 +1911,26 @@ int main() {
   test_str_to_int_negative();
   test_str_to_int_positive();
   test_ucs_to_utf8();
+  test_builder();
+  test_intern_keys();
+  test_pack_lists();
+  test_cells();
+  test_tape();
+  test_events();
+  test_cursor();
+  test_deep_nesting();
+  test_limits();
+  test_parser_reuse();
+  test_parse_batch();
+  test_memory_usage();
+  test_include();
+  test_merge();
+  test_schema();
+  test_utf8();
+  test_table_lookup();
+  test_json();
+  test_hash();
+  test_load_files();
+  test_big_input();
   return 0;
 }
@@ -2,8 +2,6 @@
 
 #include <errno.h>
 #include <fcntl.h>
-#include <inttypes.h>
-#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
@@ -27,18 +25,27 @@ KevsError read_file(KevsStr path, char **out, size_t *out_len) {
   const size_t len = stbuf.st_size;
   ptr = malloc(len + 1);
   if (ptr == NULL) {
-    return "out of memory";
+    err = "out of memory";
+    goto cleanup;
   }
   ptr[len] = 0;
 
-  ssize_t nread = read(fd, ptr, len);
-  if (nread == -1) {
-    err = strerror(errno);
-    goto cleanup;
-  }
-  if ((size_t)nread != len) {
-    err = "short read";
-    goto cleanup;
+  // a single read returns at most about 2GB on Linux
+  size_t done = 0;
+  while (done < len) {
+    const ssize_t nread = read(fd, ptr + done, len - done);
+    if (nread == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      err = strerror(errno);
+      goto cleanup;
+    }
+    if (nread == 0) {
+      err = "short read";
+      goto cleanup;
+    }
+    done += (size_t)nread;
   }
 
   *out = ptr;
@@ -53,78 +60,63 @@ cleanup:
   return err;
 }
 
-void list_dump(KevsList self) {
-  for (size_t i = 0; i < self.len; i++) {
-    const KevsValue v = self.ptr[i];
-
-    switch (v.kind) {
-    case KevsValueKindTable: {
-      printf("%s\n", kevs_valuekind_str(v.kind));
-      table_dump(v.data.table);
-    } break;
-
-    case KevsValueKindList: {
-      printf("%s\n", kevs_valuekind_str(v.kind));
-      list_dump(v.data.list);
-    } break;
-
-    case KevsValueKindString: {
-      printf("%s '%s'\n", kevs_valuekind_str(v.kind), v.data.string);
-    } break;
-
-    case KevsValueKindBoolean: {
-      printf("%s %s\n", kevs_valuekind_str(v.kind),
-             (v.data.boolean ? "true" : "false"));
-    } break;
-
-    case KevsValueKindInteger: {
-      printf("%s %" PRId64 "\n", kevs_valuekind_str(v.kind), v.data.integer);
-    } break;
-
-    default: {
-      printf("%s\n", kevs_valuekind_str(v.kind));
-    } break;
+KevsError table_lookup(KevsTable self, KevsStr path, KevsValue *out) {
+  KevsValue v = {.kind = KevsValueKindTable, .data.table = self};
+  size_t i = 0;
+  while (i < path.len) {
+    if (path.ptr[i] == '[') {
+      if (v.kind != KevsValueKindList) {
+        return "path: index of a value which is not a list";
+      }
+      size_t j = i + 1;
+      uint64_t index = 0;
+      while (j < path.len && path.ptr[j] >= '0' && path.ptr[j] <= '9' &&
+             index <= UINT32_MAX) {
+        index = index * 10 + (uint64_t)(path.ptr[j] - '0');
+        j++;
+      }
+      if (j == i + 1 || j == path.len || path.ptr[j] != ']') {
+        return "path: invalid index";
+      }
+      if (index >= v.data.list.len) {
+        return "path: index out of range";
+      }
+      kevs_list_value(v.data.list, index, &v);
+      i = j + 1;
+      continue;
     }
-  }
-}
 
-void table_dump(KevsTable self) {
-  for (size_t i = 0; i < self.len; i++) {
-    const KevsKeyValue kv = self.ptr[i];
-
-    char *k = kevs_str_dup(kv.key);
-
-    switch (kv.val.kind) {
-    case KevsValueKindTable: {
-      printf("%s %s\n", k, kevs_valuekind_str(kv.val.kind));
-      table_dump(kv.val.data.table);
-    } break;
-
-    case KevsValueKindList: {
-      printf("%s %s\n", k, kevs_valuekind_str(kv.val.kind));
-      list_dump(kv.val.data.list);
-    } break;
-
-    case KevsValueKindString: {
-      printf("%s %s '%s'\n", k, kevs_valuekind_str(kv.val.kind),
-             kv.val.data.string);
-    } break;
-
-    case KevsValueKindBoolean: {
-      printf("%s %s %s\n", k, kevs_valuekind_str(kv.val.kind),
-             (kv.val.data.boolean ? "true" : "false"));
-    } break;
-
-    case KevsValueKindInteger: {
-      printf("%s %s %" PRId64 "\n", k, kevs_valuekind_str(kv.val.kind),
-             kv.val.data.integer);
-    } break;
-
-    default: {
-      printf("%s %s\n", k, kevs_valuekind_str(kv.val.kind));
-    } break;
+    // keys follow a dot, except for the first one
+    if (i != 0) {
+      if (path.ptr[i] != '.') {
+        return "path: expected '.' or '['";
+      }
+      i++;
     }
-
-    free(k);
+    size_t j = i;
+    while (j < path.len && path.ptr[j] != '.' && path.ptr[j] != '[') {
+      j++;
+    }
+    if (j == i) {
+      return "path: empty key";
+    }
+    if (v.kind != KevsValueKindTable) {
+      return "path: key of a value which is not a table";
+    }
+    const KevsStr key = {.ptr = path.ptr + i, .len = j - i};
+    const KevsTable t = v.data.table;
+    size_t k = 0;
+    while (k < t.len && !(t.ptr[k].key.len == key.len &&
+                          memcmp(t.ptr[k].key.ptr, key.ptr, key.len) == 0)) {
+      k++;
+    }
+    if (k == t.len) {
+      return "path: key not found";
+    }
+    v = t.ptr[k].val;
+    i = j;
   }
+  *out = v;
+  return NULL;
 }
+
@@ -1,11 +1,13 @@
 #ifndef KEVS_UTIL_H
 #define KEVS_UTIL_H
 
+#include <stdio.h>
+
 #include "kevs.h"
 
 // kevs.c
 
-int str_index_char(KevsStr self, char c);
+int64_t str_index_char(KevsStr self, char c);
 KevsStr str_slice_low(KevsStr self, size_t low);
 KevsStr str_slice(KevsStr self, size_t low, size_t high);
 KevsStr str_trim_left(KevsStr self, KevsStr cutset);
@@ -13,6 +15,8 @@ KevsStr str_trim_right(KevsStr self, KevsStr cutset);
 KevsError str_to_int(KevsStr self, uint64_t base, int64_t *out);
 
 uint8_t ucs_to_utf8(uint64_t code, char buf[4]);
+size_t utf8_check(KevsStr s);
+size_t utf8_check_scalar(KevsStr s);
 
 KevsError scan(KevsTokens *tokens, KevsStr content, char *err_buf,
                size_t err_buf_len, KevsOpts opts);
@@ -23,8 +27,52 @@ const char *tokenkind_str(KevsTokenKind v);
 
 // util.c
 
+KevsError read_file(KevsStr path, char **out, size_t *out_len);
+// Find the value at a path like "hosts[2].port".
+KevsError table_lookup(KevsTable self, KevsStr path, KevsValue *out);
+
+// export.c
+
 void table_dump(KevsTable self);
 void list_dump(KevsList self);
-KevsError read_file(KevsStr path, char **out, size_t *out_len);
+KevsError table_fdump(FILE *f, KevsTable self);
+KevsError list_fdump(FILE *f, KevsList self);
+// Print a scalar as text, lists and tables like table_dump.
+void value_fprint(FILE *f, KevsValue v);
+
+// JSON of a parsed table. With ndjson, each key of the root table is a line
+// {"key": value}.
+KevsError json_write_table(FILE *f, KevsTable table, bool ndjson);
+// Like json_write_table, converting the events of kevs_parse_events.
+// Keys are not checked to be unique.
+KevsError json_write_events(FILE *f, KevsStr content, bool ndjson,
+                            char *err_buf, size_t err_buf_len, KevsOpts opts);
+
+// serve.c
+
+int serve_main(int argc, char **argv);
+int get_main(int argc, char **argv);
+
+// load.c
+
+// Called on the thread of load_files as files are read, in completion order.
+// data is NUL terminated and owned by the callee, NULL if err is set.
+typedef void (*LoadDone)(void *ctx, size_t index, char *data, size_t len,
+                         KevsError err);
+
+typedef struct {
+  // files read at once, 0 for a default
+  size_t window;
+  // reader threads without io_uring, 0 for a default
+  size_t threads;
+  // use the reader threads even if io_uring is available
+  bool no_uring;
+} LoadOpts;
+
+// Read the files at paths, done runs while the next files are read.
+// Returns how: "io_uring", "threads" or "sequential".
+const char *load_files(const char *const *paths, size_t n, LoadOpts opts,
+                       LoadDone done, void *ctx);
+int load_main(int argc, char **argv);
 
 #endif
@@ -0,0 +1,432 @@
+// CPython extension: parse with the C implementation.
+// Used by kevs.loads/kevs.load when built, see setup.py.
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#include "kevs.h"
+
+#include <stdbool.h>
+
+static PyObject *Error = NULL;
+
+// Doc: parsed document, shared by all proxies created from it
+typedef struct {
+  PyObject_HEAD
+  KevsTable table;
+  // keys point into the UTF-8 buffer of content
+  PyObject *content;
+} Doc;
+
+typedef struct {
+  PyObject_HEAD
+  Doc *doc;
+  KevsTable table;
+} Table;
+
+typedef struct {
+  PyObject_HEAD
+  Doc *doc;
+  KevsList list;
+} List;
+
+static PyTypeObject DocType;
+static PyTypeObject TableType;
+static PyTypeObject ListType;
+
+static PyObject *table_to_dict(KevsTable table);
+static PyObject *list_to_list(KevsList list);
+
+static PyObject *table_new(Doc *doc, KevsTable table) {
+  Table *self = PyObject_New(Table, &TableType);
+  if (self == NULL) {
+    return NULL;
+  }
+  Py_INCREF(doc);
+  self->doc = doc;
+  self->table = table;
+  return (PyObject *)self;
+}
+
+static PyObject *list_new(Doc *doc, KevsList list) {
+  List *self = PyObject_New(List, &ListType);
+  if (self == NULL) {
+    return NULL;
+  }
+  Py_INCREF(doc);
+  self->doc = doc;
+  self->list = list;
+  return (PyObject *)self;
+}
+
+// Convert a value, lists and tables become proxies if doc is set.
+static PyObject *value_to_py(Doc *doc, KevsValue v) {
+  switch (v.kind) {
+  case KevsValueKindString:
+    // kevs.c rejects NUL, the C string is the whole value
+    return PyUnicode_FromString(v.data.string);
+  case KevsValueKindInteger:
+    return PyLong_FromLongLong(v.data.integer);
+  case KevsValueKindBoolean:
+    return PyBool_FromLong(v.data.boolean);
+  case KevsValueKindList:
+    return doc != NULL ? list_new(doc, v.data.list)
+                       : list_to_list(v.data.list);
+  case KevsValueKindTable:
+    return doc != NULL ? table_new(doc, v.data.table)
+                       : table_to_dict(v.data.table);
+  default:
+    PyErr_SetString(PyExc_SystemError, "unexpected value kind");
+    return NULL;
+  }
+}
+
+static PyObject *list_to_list(KevsList list) {
+  if (Py_EnterRecursiveCall(" while converting a KEVS list")) {
+    return NULL;
+  }
+
+  PyObject *out = PyList_New((Py_ssize_t)list.len);
+  for (size_t i = 0; out != NULL && i < list.len; i++) {
+    KevsValue v = {};
+    kevs_list_value(list, i, &v);
+    PyObject *item = value_to_py(NULL, v);
+    if (item == NULL) {
+      Py_CLEAR(out);
+      break;
+    }
+    PyList_SET_ITEM(out, (Py_ssize_t)i, item);
+  }
+
+  Py_LeaveRecursiveCall();
+  return out;
+}
+
+static PyObject *table_to_dict(KevsTable table) {
+  if (Py_EnterRecursiveCall(" while converting a KEVS table")) {
+    return NULL;
+  }
+
+  PyObject *out = PyDict_New();
+  for (size_t i = 0; out != NULL && i < table.len; i++) {
+    const KevsKeyValue kv = table.ptr[i];
+    PyObject *key =
+        PyUnicode_FromStringAndSize(kv.key.ptr, (Py_ssize_t)kv.key.len);
+    PyObject *val = key == NULL ? NULL : value_to_py(NULL, kv.val);
+    if (val == NULL || PyDict_SetItem(out, key, val) != 0) {
+      Py_CLEAR(out);
+    }
+    Py_XDECREF(key);
+    Py_XDECREF(val);
+  }
+
+  Py_LeaveRecursiveCall();
+  return out;
+}
+
+static void doc_dealloc(Doc *self) {
+  kevs_free(&self->table);
+  Py_XDECREF(self->content);
+  Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+static PyTypeObject DocType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "_kevs.Doc",
+    .tp_basicsize = sizeof(Doc),
+    .tp_dealloc = (destructor)doc_dealloc,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_doc = "Parsed document, owned by its proxies",
+};
+
+static void table_dealloc(Table *self) {
+  Py_DECREF(self->doc);
+  PyObject_Free(self);
+}
+
+static bool table_find(const Table *self, PyObject *key, KevsValue *out) {
+  Py_ssize_t len = 0;
+  const char *s = PyUnicode_AsUTF8AndSize(key, &len);
+  if (s == NULL) {
+    PyErr_Clear();
+    return false;
+  }
+  for (size_t i = 0; i < self->table.len; i++) {
+    const KevsStr k = self->table.ptr[i].key;
+    if (k.len == (size_t)len && memcmp(k.ptr, s, k.len) == 0) {
+      *out = self->table.ptr[i].val;
+      return true;
+    }
+  }
+  return false;
+}
+
+static Py_ssize_t table_len(Table *self) {
+  return (Py_ssize_t)self->table.len;
+}
+
+static PyObject *table_getitem(Table *self, PyObject *key) {
+  KevsValue v = {};
+  if (!table_find(self, key, &v)) {
+    PyErr_SetObject(PyExc_KeyError, key);
+    return NULL;
+  }
+  return value_to_py(self->doc, v);
+}
+
+static int table_contains(Table *self, PyObject *key) {
+  KevsValue v = {};
+  return table_find(self, key, &v);
+}
+
+static PyObject *table_keys(Table *self, PyObject *unused) {
+  (void)unused;
+  PyObject *out = PyList_New((Py_ssize_t)self->table.len);
+  for (size_t i = 0; out != NULL && i < self->table.len; i++) {
+    const KevsStr k = self->table.ptr[i].key;
+    PyObject *key = PyUnicode_FromStringAndSize(k.ptr, (Py_ssize_t)k.len);
+    if (key == NULL) {
+      Py_CLEAR(out);
+      break;
+    }
+    PyList_SET_ITEM(out, (Py_ssize_t)i, key);
+  }
+  return out;
+}
+
+static PyObject *table_values(Table *self, PyObject *unused) {
+  (void)unused;
+  PyObject *out = PyList_New((Py_ssize_t)self->table.len);
+  for (size_t i = 0; out != NULL && i < self->table.len; i++) {
+    PyObject *val = value_to_py(self->doc, self->table.ptr[i].val);
+    if (val == NULL) {
+      Py_CLEAR(out);
+      break;
+    }
+    PyList_SET_ITEM(out, (Py_ssize_t)i, val);
+  }
+  return out;
+}
+
+static PyObject *table_items(Table *self, PyObject *unused) {
+  (void)unused;
+  PyObject *out = PyList_New((Py_ssize_t)self->table.len);
+  for (size_t i = 0; out != NULL && i < self->table.len; i++) {
+    const KevsKeyValue kv = self->table.ptr[i];
+    PyObject *item = Py_BuildValue(
+        "(s#N)", kv.key.ptr, (Py_ssize_t)kv.key.len,
+        value_to_py(self->doc, kv.val));
+    if (item == NULL) {
+      Py_CLEAR(out);
+      break;
+    }
+    PyList_SET_ITEM(out, (Py_ssize_t)i, item);
+  }
+  return out;
+}
+
+static PyObject *table_get(Table *self, PyObject *args) {
+  PyObject *key = NULL;
+  PyObject *def = Py_None;
+  if (!PyArg_ParseTuple(args, "O|O:get", &key, &def)) {
+    return NULL;
+  }
+  KevsValue v = {};
+  if (!table_find(self, key, &v)) {
+    Py_INCREF(def);
+    return def;
+  }
+  return value_to_py(self->doc, v);
+}
+
+static PyObject *table_iter(Table *self) {
+  PyObject *keys = table_keys(self, NULL);
+  if (keys == NULL) {
+    return NULL;
+  }
+  PyObject *it = PyObject_GetIter(keys);
+  Py_DECREF(keys);
+  return it;
+}
+
+static PyObject *table_to_dict_method(Table *self, PyObject *unused) {
+  (void)unused;
+  return table_to_dict(self->table);
+}
+
+static PyMappingMethods table_as_mapping = {
+    .mp_length = (lenfunc)table_len,
+    .mp_subscript = (binaryfunc)table_getitem,
+};
+
+static PySequenceMethods table_as_sequence = {
+    .sq_contains = (objobjproc)table_contains,
+};
+
+static PyMethodDef table_methods[] = {
+    {"keys", (PyCFunction)table_keys, METH_NOARGS, NULL},
+    {"values", (PyCFunction)table_values, METH_NOARGS, NULL},
+    {"items", (PyCFunction)table_items, METH_NOARGS, NULL},
+    {"get", (PyCFunction)table_get, METH_VARARGS, NULL},
+    {"to_dict", (PyCFunction)table_to_dict_method, METH_NOARGS,
+     "Convert the whole table to a dict"},
+    {NULL, NULL, 0, NULL},
+};
+
+static PyTypeObject TableType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "_kevs.Table",
+    .tp_basicsize = sizeof(Table),
+    .tp_dealloc = (destructor)table_dealloc,
+    .tp_as_mapping = &table_as_mapping,
+    .tp_as_sequence = &table_as_sequence,
+    .tp_iter = (getiterfunc)table_iter,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_doc = "Read-only view of a table, values are converted on access",
+    .tp_methods = table_methods,
+};
+
+static void list_dealloc(List *self) {
+  Py_DECREF(self->doc);
+  PyObject_Free(self);
+}
+
+static Py_ssize_t list_len(List *self) { return (Py_ssize_t)self->list.len; }
+
+static PyObject *list_item(List *self, Py_ssize_t i) {
+  if (i < 0 || (size_t)i >= self->list.len) {
+    PyErr_SetString(PyExc_IndexError, "list index out of range");
+    return NULL;
+  }
+  KevsValue v = {};
+  kevs_list_value(self->list, (size_t)i, &v);
+  return value_to_py(self->doc, v);
+}
+
+static PyObject *list_to_list_method(List *self, PyObject *unused) {
+  (void)unused;
+  return list_to_list(self->list);
+}
+
+static PySequenceMethods list_as_sequence = {
+    .sq_length = (lenfunc)list_len,
+    .sq_item = (ssizeargfunc)list_item,
+};
+
+static PyMethodDef list_methods[] = {
+    {"to_list", (PyCFunction)list_to_list_method, METH_NOARGS,
+     "Convert the whole list to a list"},
+    {NULL, NULL, 0, NULL},
+};
+
+static PyTypeObject ListType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "_kevs.List",
+    .tp_basicsize = sizeof(List),
+    .tp_dealloc = (destructor)list_dealloc,
+    .tp_as_sequence = &list_as_sequence,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_doc = "Read-only view of a list, values are converted on access",
+    .tp_methods = list_methods,
+};
+
+static PyObject *loads(PyObject *module, PyObject *args, PyObject *kwargs) {
+  (void)module;
+
+  static char *kwlist[] = {"content", "file", "lazy", NULL};
+  PyObject *content = NULL;
+  const char *file = "<string>";
+  int lazy = 0;
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "U|sp:loads", kwlist,
+                                   &content, &file, &lazy)) {
+    return NULL;
+  }
+
+  Py_ssize_t len = 0;
+  const char *data = PyUnicode_AsUTF8AndSize(content, &len);
+  if (data == NULL) {
+    return NULL;
+  }
+
+  KevsTable table = {};
+  char err_buf[8193] = {};
+  const KevsOpts opts = {
+      .file = kevs_str_from_cstr(file),
+      .errors_with_file_and_line = true,
+      .pack_lists = true,
+  };
+  KevsError err = NULL;
+
+  // content is kept alive by the caller, or by doc below
+  Py_BEGIN_ALLOW_THREADS;
+  err = kevs_parse(&table, (KevsStr){.ptr = data, .len = (size_t)len},
+                   err_buf, sizeof(err_buf) - 1, opts);
+  Py_END_ALLOW_THREADS;
+
+  if (err != NULL) {
+    kevs_free(&table);
+    PyErr_SetString(Error, err);
+    return NULL;
+  }
+
+  if (!lazy) {
+    PyObject *out = table_to_dict(table);
+    kevs_free(&table);
+    return out;
+  }
+
+  Doc *doc = PyObject_New(Doc, &DocType);
+  if (doc == NULL) {
+    kevs_free(&table);
+    return NULL;
+  }
+  doc->table = table;
+  Py_INCREF(content);
+  doc->content = content;
+
+  PyObject *out = table_new(doc, table);
+  Py_DECREF(doc);
+  return out;
+}
+
+static PyMethodDef module_methods[] = {
+    {"loads", (PyCFunction)(void (*)(void))loads,
+     METH_VARARGS | METH_KEYWORDS,
+     "loads(content, file='<string>', lazy=False)\n\n"
+     "Parse content into dicts, lists, ints, bools and strs.\n"
+     "With lazy, return a Table whose values are converted on access."},
+    {NULL, NULL, 0, NULL},
+};
+
+static struct PyModuleDef module_def = {
+    PyModuleDef_HEAD_INIT,
+    .m_name = "_kevs",
+    .m_doc = "KEVS parser implemented in C",
+    .m_size = -1,
+    .m_methods = module_methods,
+};
+
+PyMODINIT_FUNC PyInit__kevs(void) {
+  if (PyType_Ready(&DocType) < 0 || PyType_Ready(&TableType) < 0 ||
+      PyType_Ready(&ListType) < 0) {
+    return NULL;
+  }
+
+  PyObject *m = PyModule_Create(&module_def);
+  if (m == NULL) {
+    return NULL;
+  }
+
+  Error = PyErr_NewException("_kevs.Error", PyExc_ValueError, NULL);
+  Py_INCREF(Error);
+  Py_INCREF(&TableType);
+  Py_INCREF(&ListType);
+  if (PyModule_AddObject(m, "Error", Error) < 0 ||
+      PyModule_AddObject(m, "Table", (PyObject *)&TableType) < 0 ||
+      PyModule_AddObject(m, "List", (PyObject *)&ListType) < 0) {
+    Py_DECREF(m);
+    return NULL;
+  }
+
+  return m;
+}
@@ -0,0 +1,82 @@
+#!/usr/bin/env python3
+
+# Benchmark the Python implementation, and the C extension if it's built.
+#
+# Usage: bench.py [--size N] [--repeat N] [file ...]
+# Without files, a document of about --size bytes is generated.
+
+import argparse
+import time
+
+import kevs
+
+
+def generate(size: int) -> str:
+    parts = []
+    n = 0
+    i = 0
+    while n < size:
+        part = (
+            f"k{i} = {{\n"
+            f'  name = "item {i}\\t\\u00e9";\n'
+            f"  raw = `raw {i}`;\n"
+            f"  id = {i};\n"
+            f"  mask = 0x{i:x};\n"
+            f"  on = {'true' if i % 2 else 'false'};\n"
+            f"  tags = [1; 2; 3; {{x = {i};}};];\n"
+            f"}};\n"
+            f"# comment {i}\n"
+        )
+        parts.append(part)
+        n += len(part)
+        i += 1
+    return "".join(parts)
+
+
+def scan_parse(content: str, dicts: bool):
+    s = kevs.Scanner("bench", content, abort=False)
+    tokens = s.scan()
+    assert tokens is not None, s.error
+    p = kevs.Parser("bench", content, tokens, abort=False, dicts=dicts)
+    table = p.parse()
+    assert table is not None, p.error
+    return table
+
+
+def run(name: str, content: str, repeat: int, fn):
+    best = None
+    for _ in range(repeat):
+        start = time.perf_counter()
+        fn(content)
+        dur = time.perf_counter() - start
+        best = dur if best is None else min(best, dur)
+    mbps = len(content) / best / 1e6
+    print(f"  {name:<12} {best * 1e3:10.2f} ms {mbps:8.2f} MB/s")
+
+
+def main():
+    parser = argparse.ArgumentParser(prog="bench.py")
+    parser.add_argument("files", nargs="*")
+    parser.add_argument("--size", type=int, default=1 << 20, help="Size of the generated document")
+    parser.add_argument("--repeat", type=int, default=5, help="Runs per case, the best one is reported")
+    args = parser.parse_args()
+
+    inputs = []
+    for file in args.files:
+        with open(file, "r") as f:
+            inputs.append((file, f.read()))
+    if len(inputs) == 0:
+        inputs.append((f"generated({args.size})", generate(args.size)))
+
+    for name, content in inputs:
+        print(f"{name}: {len(content)} bytes")
+        run("scan", content, args.repeat, lambda c: kevs.Scanner("bench", c, abort=False).scan())
+        run("values", content, args.repeat, lambda c: scan_parse(c, dicts=False))
+        run("dicts", content, args.repeat, lambda c: scan_parse(c, dicts=True))
+        if kevs._kevs is not None:
+            run("ext", content, args.repeat, lambda c: kevs.loads(c))
+            run("ext lazy", content, args.repeat, lambda c: kevs.loads(c, lazy=True))
+
+
+if __name__ == "__main__":
+    main()
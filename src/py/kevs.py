@@ -1,7 +1,14 @@
+import collections.abc
+import re
 from dataclasses import dataclass
 from enum import Enum
 from typing import Any
 
+try:
+    import _kevs
+except ImportError:
+    _kevs = None
+
 
 class TokenKind(Enum):
     undefined = 0
@@ -12,18 +19,12 @@ class TokenKind(Enum):
 
 @dataclass
 class Token:
+    __slots__ = ("kind", "value", "line")
     kind: TokenKind
     value: str
     line: int
 
 
-def index_any(s, chars):
-    for i, c in enumerate(s):
-        if chars.find(c) != -1:
-            return i, c
-    return -1, None
-
-
 kSpaces = " \t"
 kNewline = "\n"
 kKeyValSep = "="
@@ -36,18 +37,47 @@ kListEnd = "]"
 kTableBegin = "{"
 kTableEnd = "}"
 
+# compiled once, the scanner searches from its position instead of slicing
+kSpacesRe = re.compile(r"[ \t]*")
+kKeyEndRe = re.compile(r"[=;\n]")
+kIntOrBoolEndRe = re.compile(r"[;\]}\n]")
+kIdentifierRe = re.compile(r"[A-Za-z_][A-Za-z0-9_]*\Z")
+kHexRe = re.compile(r"[0-9A-Fa-f]*\Z")
+
+# escape sequences of strings, like kevs.c every other one is an error
+kEscapes = {
+    "a": "\a",
+    "b": "\b",
+    "f": "\f",
+    "n": "\n",
+    "r": "\r",
+    "t": "\t",
+    "v": "\v",
+    '"': '"',
+    "\\": "\\",
+}
+
 
 class Scanner:
     def __init__(self, file: str, content: str, abort: bool):
         self.file = file
         self.content = content
+        self.pos = 0
         self.tokens = []
         self.line = 1
         self.error = ""
         self.abort = abort
 
     def scan(self):
-        while len(self.content) != 0:
+        content = self.content
+        n = len(content)
+        # like kevs.c, where values are C strings
+        nul = content.find("\0")
+        if nul != -1:
+            self.line += content.count(kNewline, 0, nul)
+            self.errorf("input contains a NUL byte")
+            return None
+        while self.pos < n:
             self.trim_space()
             ok = False
             if self.expect(kNewline):
@@ -62,15 +92,15 @@ class Scanner:
 
     def scan_newline(self) -> bool:
         self.line += 1
-        self.advance(1)
+        self.pos += 1
         return True
 
     def scan_comment(self) -> bool:
-        end = self.content.find(kNewline)
+        end = self.content.find(kNewline, self.pos)
         if end == -1:
             self.errorf("comment does not end with newline")
             return False
-        self.advance(end)
+        self.pos = end
         return True
 
     def scan_key_value(self) -> bool:
@@ -82,11 +112,11 @@ class Scanner:
         return True
 
     def scan_key(self) -> bool:
-        i, c = index_any(self.content, "=;\n")
-        if c != kKeyValSep:
+        m = kKeyEndRe.search(self.content, self.pos)
+        if m is None or m.group() != kKeyValSep:
             self.errorf("key-value pair is missing separator")
             return False
-        self.append(TokenKind.key, i)
+        self.append(TokenKind.key, m.start())
         if len(self.tokens[-1].value) == 0:
             self.errorf("empty key")
             return False
@@ -94,14 +124,15 @@ class Scanner:
 
     def scan_value(self) -> bool:
         self.trim_space()
+        c = self.content[self.pos : self.pos + 1]
         ok = False
-        if self.expect(kListBegin):
+        if c == kListBegin:
             ok = self.scan_list_value()
-        elif self.expect(kTableBegin):
+        elif c == kTableBegin:
             ok = self.scan_table_value()
-        elif self.expect(kStringBegin):
+        elif c == kStringBegin:
             ok = self.scan_string_value()
-        elif self.expect(kRawStringBegin):
+        elif c == kRawStringBegin:
             ok = self.scan_raw_string()
         else:
             ok = self.scan_int_or_bool_value()
@@ -113,106 +144,83 @@ class Scanner:
         return True
 
     def scan_list_value(self) -> bool:
+        return self.scan_container(kListEnd, "list", self.scan_value)
+
+    def scan_table_value(self) -> bool:
+        return self.scan_container(kTableEnd, "table", self.scan_key_value)
+
+    def scan_container(self, end: str, name: str, scan_entry) -> bool:
         self.append_delim()
+        content = self.content
+        n = len(content)
         while True:
             self.trim_space()
-            if len(self.content) == 0:
-                self.errorf("end of input without list end")
+            if self.pos >= n:
+                self.errorf(f"end of input without {name} end")
                 return False
-            if self.expect(kNewline):
-                if not self.scan_newline():
-                    return False
+            c = content[self.pos]
+            if c == kNewline:
+                self.scan_newline()
                 continue
-            if self.expect(kCommentBegin):
+            if c == kCommentBegin:
                 if not self.scan_comment():
                     return False
                 continue
-            if self.expect(kListEnd):
+            if c == end:
                 self.append_delim()
                 return True
-            if not self.scan_value():
+            if not scan_entry():
                 return False
-            if self.expect(kListEnd):
+            if self.expect(end):
                 self.append_delim()
                 return True
-        return True
 
     def scan_raw_string(self) -> bool:
-        end = self.content[1:].find(kRawStringBegin)
+        end = self.content.find(kRawStringBegin, self.pos + 1)
         if end == -1:
             self.errorf("raw string value does not end with backtick")
             return False
 
-        # +2 for leading and trailing quotes
-        self.append(TokenKind.value, end + 2)
+        # +1 for trailing quote
+        self.append(TokenKind.value, end + 1)
 
         # count newlines in raw string to keep line count accurate
         self.line += self.tokens[-1].value.count("\n")
 
         return True
 
-    def scan_table_value(self) -> bool:
-        self.append_delim()
-        while True:
-            self.trim_space()
-            if len(self.content) == 0:
-                self.errorf("end of input without table end")
-                return False
-            if self.expect(kNewline):
-                if not self.scan_newline():
-                    return False
-                continue
-            if self.expect(kCommentBegin):
-                if not self.scan_comment():
-                    return False
-                continue
-            if self.expect(kTableEnd):
-                self.append_delim()
-                return True
-            if not self.scan_key_value():
-                return False
-            if self.expect(kTableEnd):
-                self.append_delim()
-                return True
-        return True
-
     def scan_string_value(self) -> bool:
+        content = self.content
+
         # advance past leading quote
-        s = self.content[1:]
+        i = self.pos + 1
 
         while True:
             # search for trailing quote
-            i = s.find(kStringBegin)
+            i = content.find(kStringBegin, i)
             if i == -1:
                 self.errorf("string value does not end with quote")
                 return False
 
-            # get previous char
-            prev = s[i - 1]
-
-            # advance
-            s = s[i + 1 :]
-
             # stop if quote is not escaped
-            if prev != "\\":
+            if content[i - 1] != "\\":
                 break
 
-        # calculate the end, includes trailing quote
-        end = self.content.find(s) - 1
+            i += 1
 
-        # +1 for leading quote
-        self.append(TokenKind.value, end + 1)
+        # +1 for trailing quote
+        self.append(TokenKind.value, i + 1)
 
         return True
 
     def scan_int_or_bool_value(self) -> bool:
         # search for all possible value endings
         # if semicolon(or none of them) is not found => error
-        i, c = index_any(self.content, ";]}\n")
-        if c != kKeyValEnd:
+        m = kIntOrBoolEndRe.search(self.content, self.pos)
+        if m is None or m.group() != kKeyValEnd:
             self.errorf("integer or boolean value does not end with semicolon")
             return False
-        self.append(TokenKind.value, i)
+        self.append(TokenKind.value, m.start())
         return True
 
     def scan_delim(self, c: str) -> bool:
@@ -227,36 +235,21 @@ class Scanner:
             assert False, self.error
 
     def append(self, kind: TokenKind, end: int):
-        val = self.content[:end].rstrip(kSpaces)
-        self.tokens.append(
-            Token(
-                kind=kind,
-                value=val,
-                line=self.line,
-            )
-        )
-        self.advance(end)
+        """Append content from the position up to end, end is absolute."""
+        val = self.content[self.pos : end].rstrip(kSpaces)
+        self.tokens.append(Token(kind, val, self.line))
+        self.pos = end
 
     def append_delim(self):
-        self.tokens.append(
-            Token(
-                kind=TokenKind.delim,
-                value=self.content[:1],
-                line=self.line,
-            )
-        )
-        self.advance(1)
+        pos = self.pos
+        self.tokens.append(Token(TokenKind.delim, self.content[pos : pos + 1], self.line))
+        self.pos = pos + 1
 
     def trim_space(self):
-        self.content = self.content.lstrip(kSpaces)
+        self.pos = kSpacesRe.match(self.content, self.pos).end()
 
     def expect(self, c) -> bool:
-        if len(self.content) == 0:
-            return False
-        return self.content[0] == c
-
-    def advance(self, n: int):
-        self.content = self.content[n:]
+        return self.content.startswith(c, self.pos)
 
 
 class ValueKind(Enum):
@@ -270,57 +263,96 @@ class ValueKind(Enum):
 
 @dataclass
 class Value:
+    __slots__ = ("kind", "data")
     kind: ValueKind
     data: Any
 
 
 @dataclass
 class KeyValue:
+    __slots__ = ("key", "val")
     key: str
     val: Value
 
 
-def is_digit(c: str) -> bool:
-    assert len(c) == 1
-    return c in "0123456789"
-
-
-def is_letter(c: str) -> bool:
-    assert len(c) == 1
-    c = c.lower()
-    return c in "abcdefghijklmnopqrstuvwxyz"
-
-
 def is_identifier(key: str) -> bool:
-    c = key[0]
-    if c != "_" and not is_letter(c):
-        return False
-    for c in key:
-        if not is_digit(c) and not is_letter(c) and c != "_":
-            return False
-    return True
+    return kIdentifierRe.match(key) is not None
+
+
+def normalize_string(s: str) -> str:
+    """Resolve the escape sequences of a string value, raises ValueError."""
+    if "\\" not in s:
+        return s
+    out = []
+    i = 0
+    while True:
+        j = s.find("\\", i)
+        if j == -1:
+            out.append(s[i:])
+            return "".join(out)
+        out.append(s[i:j])
+        c = s[j + 1 : j + 2]
+        if c in kEscapes:
+            out.append(kEscapes[c])
+            i = j + 2
+        elif c == "u" or c == "U":
+            width = 4 if c == "u" else 8
+            digits = s[j + 2 : j + 2 + width]
+            if len(digits) != width:
+                raise ValueError(f"\\{c} must be followed by {width} hex digits")
+            if not kHexRe.match(digits):
+                raise ValueError("invalid char, must be a hex digit")
+            code = int(digits, 16)
+            if code == 0:
+                raise ValueError("NUL is not allowed in strings")
+            # surrogates and code points beyond Unicode have no UTF-8
+            if 0xD800 <= code <= 0xDFFF or code > 0x10FFFF:
+                raise ValueError("could not encode Unicode code point to UTF-8")
+            out.append(chr(code))
+            i = j + 2 + width
+        else:
+            raise ValueError("unknown escape sequence")
 
 
 class Parser:
-    def __init__(self, file: str, content: str, tokens: [], abort: bool):
+    """Parse scanned tokens into a list of KeyValue.
+
+    With dicts, the result is a dict holding plain Python values instead,
+    without building Value objects.
+    """
+
+    def __init__(self, file: str, content: str, tokens: [], abort: bool, dicts: bool = False):
         self.file = file
         self.content = content
         self.tokens = tokens
         self.i = 0
         self.error = ""
         self.abort = abort
+        self.dicts = dicts
 
     def parse(self):
-        table = []
-        while self.i < len(self.tokens):
-            kv, ok = self.parse_key_value(table)
-            if not ok:
+        table = {} if self.dicts else []
+        keys = table if self.dicts else set()
+        n = len(self.tokens)
+        while self.i < n:
+            if not self.parse_entry(table, keys):
                 return None
-            table.append(kv)
         return table
 
-    def parse_key_value(self, parent) -> (KeyValue, bool):
-        key, ok = self.parse_key(parent)
+    def parse_entry(self, table, keys) -> bool:
+        kv, ok = self.parse_key_value(keys)
+        if not ok:
+            return False
+        key, val = kv
+        if self.dicts:
+            table[key] = val
+        else:
+            keys.add(key)
+            table.append(KeyValue(key, val))
+        return True
+
+    def parse_key_value(self, keys) -> ((str, Any), bool):
+        key, ok = self.parse_key(keys)
         if not ok:
             return None, False
 
@@ -332,31 +364,28 @@ class Parser:
         if not ok:
             return None, False
 
-        return KeyValue(key=key, val=val), True
+        return (key, val), True
 
-    def parse_key(self, parent) -> (str, bool):
+    def parse_key(self, keys) -> (str, bool):
         if not self.expect(TokenKind.key):
             self.errorf("expected key token")
             return None, False
 
-        tok = self.get()
-        if not is_identifier(tok.value):
-            self.errorf(f"key is not a valid identifier: '{tok.value}'")
+        key = self.tokens[self.i].value
+        if not is_identifier(key):
+            self.errorf(f"key is not a valid identifier: '{key}'")
             return None, False
 
         # check if key is unique
-        for entry in parent:
-            if entry.key == tok.value:
-                self.errorf(f"key '{tok.value}' is not unique for current table")
-                return None, False
-
-        key = tok.value
+        if key in keys:
+            self.errorf(f"key '{key}' is not unique for current table")
+            return None, False
 
-        self.pop()
+        self.i += 1
 
         return key, True
 
-    def parse_value(self) -> (Value, bool):
+    def parse_value(self) -> (Any, bool):
         ok = False
         val = None
         if self.expect_delim(kListBegin):
@@ -372,114 +401,107 @@ class Parser:
             return None, False
         return val, True
 
-    def parse_simple_value(self) -> (Value, bool):
+    def parse_simple_value(self) -> (Any, bool):
         if not self.expect(TokenKind.value):
             self.errorf("expected value token")
             return None, False
 
-        val = self.get().value
+        val = self.tokens[self.i].value
 
         ok = True
-        out = None
+        kind = ValueKind.undefined
+        data = None
 
-        if val.startswith(kStringBegin):
+        c = val[:1]
+        if c == kStringBegin:
             try:
-                out = Value(
-                    kind=ValueKind.string,
-                    data=bytes(val[1:-1], "utf-8").decode("unicode_escape"),
-                )
-            except UnicodeDecodeError as e:
+                kind = ValueKind.string
+                data = normalize_string(val[1:-1])
+            except ValueError as e:
                 self.errorf(f"could not normalize string: {str(e)}")
                 ok = False
-        elif val.startswith(kRawStringBegin):
-            out = Value(
-                kind=ValueKind.string,
-                data=val[1:-1],
-            )
+        elif c == kRawStringBegin:
+            kind = ValueKind.string
+            data = val[1:-1]
         elif val == "true":
-            out = Value(
-                kind=ValueKind.boolean,
-                data=True,
-            )
+            kind = ValueKind.boolean
+            data = True
         elif val == "false":
-            out = Value(
-                kind=ValueKind.boolean,
-                data=False,
-            )
+            kind = ValueKind.boolean
+            data = False
         else:
             try:
-                out = Value(
-                    kind=ValueKind.integer,
-                    data=int(val, 0),
-                )
+                kind = ValueKind.integer
+                data = int(val, 0)
             except ValueError as e:
                 self.errorf(f"value '{val}' is not an integer: {str(e)}")
                 ok = False
 
-        self.pop()
+        self.i += 1
 
-        return out, ok
+        if not ok:
+            return None, False
+        if self.dicts:
+            return data, True
+        return Value(kind, data), True
 
-    def parse_list_value(self) -> (Value, bool):
-        out = Value(
-            kind=ValueKind.list,
-            data=[],
-        )
+    def parse_list_value(self) -> (Any, bool):
+        out = []
 
-        self.pop()
+        self.i += 1
 
         while True:
             if self.parse_delim(kListEnd):
-                return out, True
+                break
 
             v, ok = self.parse_value()
             if not ok:
                 return None, False
-            out.data.append(v)
+            out.append(v)
 
             if self.parse_delim(kListEnd):
-                return out, True
+                break
 
-        return out, True
+        if self.dicts:
+            return out, True
+        return Value(ValueKind.list, out), True
 
-    def parse_table_value(self) -> (Value, bool):
-        out = Value(
-            kind=ValueKind.table,
-            data=[],
-        )
+    def parse_table_value(self) -> (Any, bool):
+        out = {} if self.dicts else []
+        keys = out if self.dicts else set()
 
-        self.pop()
+        self.i += 1
 
         while True:
             if self.parse_delim(kTableEnd):
-                return out, True
+                break
 
-            v, ok = self.parse_key_value(out.data)
-            if not ok:
+            if not self.parse_entry(out, keys):
                 return None, False
-            out.data.append(v)
 
             if self.parse_delim(kTableEnd):
-                return out, True
+                break
 
-        return out, True
+        if self.dicts:
+            return out, True
+        return Value(ValueKind.table, out), True
 
     def parse_delim(self, c: str) -> bool:
         if not self.expect_delim(c):
             return False
-        self.pop()
+        self.i += 1
         return True
 
     def expect_delim(self, delim: str) -> bool:
         if not self.expect(TokenKind.delim):
             return False
-        return self.get().value == delim
+        return self.tokens[self.i].value == delim
 
     def expect(self, kind: TokenKind) -> bool:
         if self.i >= len(self.tokens):
             self.errorf(f"expected token '{kind.name}', have nothing")
             return False
-        return self.get().kind == kind
+        return self.tokens[self.i].kind == kind
 
     def get(self) -> Token:
         return self.tokens[self.i]
@@ -488,7 +510,8 @@ class Parser:
         self.i += 1
 
     def errorf(self, s: str):
-        self.error = f"{self.file}:{self.tokens[self.i].line}: error: parse: {s}"
+        line = self.tokens[min(self.i, len(self.tokens) - 1)].line
+        self.error = f"{self.file}:{line}: error: parse: {s}"
         if self.abort:
             assert False, self.error
 
@@ -523,3 +546,54 @@ def table_dump(root):
             print(kv.key, kv.val.kind.name, "true" if kv.val.data else "false")
         else:
             print(kv.key, kv.val.kind.name, kv.val.data)
+
+
+if _kevs is not None:
+    KevsError = _kevs.Error
+    collections.abc.Mapping.register(_kevs.Table)
+    collections.abc.Sequence.register(_kevs.List)
+else:
+
+    class KevsError(ValueError):
+        pass
+
+
+def value_to_py(v: Value):
+    if v.kind == ValueKind.table:
+        return table_to_dict(v.data)
+    if v.kind == ValueKind.list:
+        return [value_to_py(e) for e in v.data]
+    return v.data
+
+
+def table_to_dict(root) -> dict:
+    return {kv.key: value_to_py(kv.val) for kv in root}
+
+
+def loads(content: str, file: str = "<string>", lazy: bool = False):
+    """Parse content into dicts, lists, ints, bools and strs.
+
+    Uses the C extension if it's built, see setup.py. With lazy, tables and
+    lists are returned as read-only views converted on access, this needs
+    the C extension and is ignored without it.
+    """
+    if _kevs is not None:
+        return _kevs.loads(content, file, lazy)
+    return loads_py(content, file)
+
+
+def loads_py(content: str, file: str = "<string>"):
+    """Like loads, always with the Python parser."""
+    s = Scanner(file, content, abort=False)
+    tokens = s.scan()
+    if tokens is None:
+        raise KevsError(s.error)
+    p = Parser(file, content, tokens, abort=False, dicts=True)
+    table = p.parse()
+    if table is None:
+        raise KevsError(p.error)
+    return table
+
+
+def load(fp, lazy: bool = False):
+    return loads(fp.read(), getattr(fp, "name", "<file>"), lazy)
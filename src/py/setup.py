@@ -0,0 +1,15 @@
+from setuptools import Extension, setup
+
+# The extension is optional, kevs.py falls back to its own parser.
+setup(
+    name="kevs",
+    py_modules=["kevs"],
+    ext_modules=[
+        Extension(
+            "_kevs",
+            sources=["_kevs.c", "../c/kevs.c"],
+            include_dirs=["../c"],
+            optional=True,
+        )
+    ],
+)